@@ -4,27 +4,27 @@
 #include <tusb.h>
 
 #include <pico/stdlib.h>
+#include <pico/multicore.h>
 #include <pico/usb_reset_interface.h>
 
 #include <pico/bootrom.h>
 #include <boot/picobin.h>
 
+#include <picovd_config.h>
 #include <vd_virtual_disk.h>
+#include <vd_handoff.h>
+#include <vd_usb_vendor.h>
 #include <vd_files_stdout.h>
+#include <vd_files_rp2350.h>
+#include <vd_files_hashes.h>
+#include <vd_files_sram_delta.h>
+#include <vd_files_flash_map.h>
+#include <vd_files_slow.h>
 
-int main()
+// Initialize TinyUSB and the virtual disk files.
+// Runs on the USB core: core 0, or core 1 with PICOVD_USB_ON_CORE1.
+static void usb_service_init(void)
 {
-    // Initialize XIP and flash, necessary when running as a no_flash binary
-    rom_connect_internal_flash(); // Ensure the flash is connected
-    rom_flash_exit_xip();         // ensure we're starting from SPI-command mode
-    rom_flash_enter_cmd_xip();    // send 0xEB + dummy cycles
-    rom_flash_flush_cache();
-
-    // Load the partition table from the BootROM,
-    // also necessary when running as a no_flash binary
-    static uint8_t work_area[4 * 1024]; // XXX FIXME
-    int rc = rom_load_partition_table(work_area, sizeof(work_area), false);
-
     // Initialize TinyUSB stack
     board_init();
     tusb_init();
@@ -40,6 +40,20 @@ int main()
     // Add STDOUT.TXT files to the virtual disk
     vd_files_stdout_init();
 
+    // Add the flash partitions, and HASHES.TXT covering them.
+    // This also loads the partition table, necessary when running as a no_flash binary
+    vd_files_rp2350_init_bootrom_partitions();
+    vd_files_hashes_init();
+
+    // Add FLASH.MAP and FLASH.SPARSE, for copying only the non-erased flash
+    vd_files_flash_map_init();
+
+    // Add SRAM-DELTA.BIN, for repeated SRAM snapshots
+    vd_files_sram_delta_init();
+
+    // Add SLOW.TXT, if enabled, for the CDC latency benchmark
+    vd_files_slow_init();
+
     // Print the PicoVD version, with at least 128 bytes, to get it exposed
     // through the exFAT file system.
     printf("PicoVD:" PICO_PROGRAM_VERSION_STRING " " PICO_PROGRAM_NAME "\n");
@@ -48,10 +62,114 @@ int main()
     printf("Padding padding padding padding padding padding padding padding\n");
     printf("Padding padding padding padding padding padding padding padding\n");
     fflush(stdout);
+}
+
+// One round of the USB service loop
+static void usb_service_task(void)
+{
+    // TinyUSB device task, must be called regurlarly
+    tud_task();
+    // Run the calls handed over from the application core, if any
+    vd_handoff_task();
+    // Replay the change notifications the handoff queue had no room for
+    vd_virtual_disk_notify_task();
+    // Answer the vendor bulk requests, if enabled
+    vd_usb_vendor_task();
+    // Generate the clusters a sequential reader will want next, if any
+    vd_virtual_disk_read_ahead_task();
+    // Rebuild the partition files if the partition table has changed
+    vd_files_rp2350_partitions_task();
+    // Advance the background SHA-256 computation, if any
+    vd_files_hashes_task();
+    // Scan the next stale flash block for FLASH.MAP, if any
+    vd_files_flash_map_task();
+    // Rescan the SRAM for SRAM-DELTA.BIN, when due
+    vd_files_sram_delta_task();
+    // Echo CDC input, if SLOW.TXT is enabled
+    vd_files_slow_task();
+}
+
+// One round of the application loop.  picovd-tool has no application work,
+// but optionally measures how regularly the loop gets to run.
+static void app_task(void)
+{
+#if PICOVD_APP_LOOP_STATS_ENABLED
+    static uint64_t period_start_us = 0;
+    static uint64_t last_us         = 0;
+    static uint32_t iterations      = 0;
+    static uint32_t max_gap_us      = 0;
+
+    const uint64_t now_us = time_us_64();
+    if (last_us != 0 && now_us - last_us > max_gap_us) {
+        max_gap_us = now_us - last_us;
+    }
+    iterations++;
+    if (now_us - period_start_us >= PICOVD_APP_LOOP_STATS_PERIOD_MS * 1000ull) {
+        printf("app loop: core %u, %u iterations, max gap %u us\n",
+               get_core_num(), (unsigned)iterations, (unsigned)max_gap_us);
+        vd_notify_stats_t notify;
+        vd_virtual_disk_get_notify_stats(&notify);
+        printf("notify: %u changes, %u UAs, %u resets; remounts avoided: %u uncached, %u coalesced, %u resets\n",
+               (unsigned)notify.changes, (unsigned)notify.unit_attentions, (unsigned)notify.hard_resets,
+               (unsigned)notify.changes_uncached, (unsigned)notify.changes_coalesced,
+               (unsigned)notify.hard_resets_avoided);
+#if PICOVD_READ_AHEAD_ENABLED
+        vd_read_ahead_stats_t read_ahead;
+        vd_virtual_disk_get_read_ahead_stats(&read_ahead);
+        printf("read-ahead: %u hits, %u misses, %u prefetched, %u wasted\n",
+               (unsigned)read_ahead.hits, (unsigned)read_ahead.misses,
+               (unsigned)read_ahead.prefetched, (unsigned)read_ahead.wasted);
+#endif
+        period_start_us = time_us_64();
+        iterations      = 0;
+        max_gap_us      = 0;
+    }
+    last_us = time_us_64(); // Do not count the printf above as a gap
+#endif
+}
+
+#if PICOVD_USB_ON_CORE1
+#define USB_SERVICE_READY (0x50564431) // "PVD1"
+
+static void usb_service_main(void)
+{
+    vd_handoff_set_usb_core();
+    usb_service_init();
+    // Let core 0 go on only once TinyUSB and the files are set up
+    multicore_fifo_push_blocking(USB_SERVICE_READY);
+
+    while (true) {
+        usb_service_task();
+    }
+}
+#endif
+
+int main()
+{
+    // Initialize XIP and flash, necessary when running as a no_flash binary
+    rom_connect_internal_flash(); // Ensure the flash is connected
+    rom_flash_exit_xip();         // ensure we're starting from SPI-command mode
+    rom_flash_enter_cmd_xip();    // send 0xEB + dummy cycles
+    rom_flash_flush_cache();
+
+#if PICOVD_USB_ON_CORE1
+    // TinyUSB, and its IRQ, on core 1; core 0 is left to the application
+    multicore_launch_core1(usb_service_main);
+    while (multicore_fifo_pop_blocking() != USB_SERVICE_READY) {
+        tight_loop_contents();
+    }
+
+    // main run loop
+    while (true) {
+        app_task();
+    }
+#else
+    usb_service_init();
 
     // main run loop
     while (true) {
-        // TinyUSB device task, must be called regurlarly
-        tud_task();
+        usb_service_task();
+        app_task();
     }
+#endif
 }
@@ -10,12 +10,81 @@
 
 #define PICOVD_VOLUME_LABEL_UTF16       u"PicoVD"
 
+// Serve two exFAT volumes, on two LUNs: the memory images (FLASH.BIN, SRAM.BIN, ...)
+// and other rarely changing files on LUN 0, and the frequently changing files
+// (STDOUT.TXT, SRAM-DELTA.BIN, ...) on LUN 1, labelled PICOVD_VOLATILE_VOLUME_LABEL_UTF16.
+// A change then raises a Unit Attention only on the LUN of the changed file,
+// and the host keeps its cache of the other volume.
+#define PICOVD_MULTI_LUN_ENABLED        (0)
+#define PICOVD_VOLATILE_VOLUME_LABEL_UTF16 u"PicoVD-LOG" // At most 11 characters
+
 // SCSI INQUIRY vendor identification (8 bytes, SCSI standard)
 #define PICOVD_MSC_VENDOR_ID            "PicoVD  "
 
-// Maximum number of dynamic files to support
+// Maximum number of dynamic files to support, subdirectories included
 #define PICOVD_PARAM_MAX_DYNAMIC_FILES  (12)
 
+// Subdirectories for dynamic files, see PICOVD_DEFINE_DIRECTORY_RUNTIME.
+// Each one takes PICOVD_PARAM_SUBDIRECTORY_SIZE_BYTES of the dynamic area,
+// a multiple of the 4 KB cluster: 128 entries per cluster.
+#define PICOVD_PARAM_MAX_SUBDIRECTORIES     (2)
+#define PICOVD_PARAM_SUBDIRECTORY_SIZE_BYTES (4096)
+
+// Present the disk with 4096-byte logical sectors (4Kn) instead of 512-byte ones.
+// One LBA is then one cluster and one flash page, and the host needs 8x fewer
+// READ10 commands for the same data.  The volume layout, in bytes, stays the same.
+// Not all hosts mount 4Kn USB disks, see README.md.
+#define PICOVD_4KN_ENABLED              (0)
+
+// Size of the virtual disk, a multiple of 1 MiB, up to 64 GiB (16 M clusters, see §3.1.9).
+// The memory region files below are placed at their directly mapped clusters, which
+// need at least 1 GiB; with a smaller disk, place them lower, after the dynamic area.
+// Can be given on the CMake command line, e.g. -DPICOVD_VIRTUAL_DISK_SIZE_BYTES=0x800000000
+#ifndef PICOVD_VIRTUAL_DISK_SIZE_BYTES
+#define PICOVD_VIRTUAL_DISK_SIZE_BYTES  (0x40000000ULL) // 1 GiB
+#endif
+
+// Compact layout: start the cluster heap right after the FAT, instead of at cluster 0x1000,
+// and size the disk to the metadata, the dynamic area and the memory regions, which then
+// follow each other; PICOVD_VIRTUAL_DISK_SIZE_BYTES and the *_START_CLUSTERs are ignored.
+// The host then reads a FAT and an allocation bitmap of a few KiB at mount, instead of
+// 1 MiB and 32 KiB.  The memory regions are no longer directly mapped, but read with
+// a constant address offset each.  Up to 128 MiB, one cluster of allocation bitmap.
+#define PICOVD_COMPACT_LAYOUT_ENABLED       (0)
+#define PICOVD_COMPACT_DYNAMIC_AREA_BYTES   (32 * 1024 * 1024) // STDOUT.TXT and STDOUT-TAIL.TXT take 20 MiB
+
+// Run TinyUSB and all PicoVD files on core 1, leaving core 0 to the application.
+// Calls from the application core, such as vd_update_file(), are handed to core 1
+// through a lock-free queue of PICOVD_HANDOFF_QUEUE_LENGTH entries, see vd_handoff.h.
+#define PICOVD_USB_ON_CORE1             (0)
+#define PICOVD_HANDOFF_QUEUE_LENGTH     (16) // Must be a power of two
+
+// Add a vendor-specific USB interface with a bulk IN/OUT endpoint pair, for reading
+// memory ranges and dynamic files without going through SCSI, exFAT and the host page cache.
+// Meant for automated test rigs; see vd_usb_vendor.h for the protocol and tools/picovd_bulk.py.
+#define PICOVD_VENDOR_BULK_ENABLED      (0)
+
+// Generate the next clusters of a dynamic file in the background while the host reads
+// it sequentially, for files with slow content callbacks.  Opt in per file with
+// .read_ahead, the number of clusters to keep ahead of the reader, before vd_add_file().
+// The cache holds PICOVD_READ_AHEAD_CACHE_CLUSTERS clusters of 4 KB; data generated more
+// than PICOVD_READ_AHEAD_MAX_AGE_MS ago is discarded rather than served.
+#define PICOVD_READ_AHEAD_ENABLED        (0)
+#define PICOVD_READ_AHEAD_CACHE_CLUSTERS (4)
+#define PICOVD_READ_AHEAD_MAX_AGE_MS     (500)
+
+// A deferred read, see VD_READ_PENDING, not completed within this time fails,
+// and frees the way for the other reads.  Also for a completed read whose
+// caller, the MSC or the vendor interface, has not come back for the data.
+#define PICOVD_READ_PENDING_TIMEOUT_MS   (5000)
+
+// Print application loop statistics to stdout every PICOVD_APP_LOOP_STATS_PERIOD_MS:
+// the iteration count and the longest gap between iterations.  For comparing
+// the application loop jitter with and without PICOVD_USB_ON_CORE1.
+// Also prints the change notification and read-ahead counters.
+#define PICOVD_APP_LOOP_STATS_ENABLED   (0)
+#define PICOVD_APP_LOOP_STATS_PERIOD_MS (5000)
+
 // The exFAT file creation time for compile-time defined files.
 #ifdef PICOVD_BUILD_EPOCH
 #define PICOVD_PARAM_STATIC_FILE_CREATION_TIME PICOVD_BUILD_EPOCH
@@ -23,6 +92,11 @@
 #define PICOVD_PARAM_STATIC_FILE_CREATION_TIME 1753177630 // 2025-07-22 12:27:10 UTC
 #endif
 
+// Take the wall-clock time of the dynamic file timestamps from the AON timer, once the
+// application has started it, e.g. with aon_timer_start().  Without it, or until then,
+// the time runs from the static file creation time, or from vd_time_set(), see vd_time.h.
+#define PICOVD_TIME_AON_TIMER_ENABLED (1)
+
 #define PICOVD_UTF16_STRING_LEN(str) (sizeof(str)/sizeof(char16_t)-1) // Exclude NUL
 #define PICOVD_UTF8_STRING_LEN(str)  (sizeof(str)/sizeof(char)    -1) // Exclude NUL
 
@@ -31,18 +105,40 @@
 #define PICOVD_SRAM_ENABLED             (1)
 #define PICOVD_SRAM_FILE_NAME           "SRAM.BIN"
 #define PICOVD_SRAM_FILE_NAME_LEN       PICOVD_UTF16_STRING_LEN(PICOVD_SRAM_FILE_NAME)
+#define PICOVD_SRAM_BASE_ADDRESS        SRAM0_BASE
 #define PICOVD_SRAM_SIZE_BYTES          (0x42000) // 264 KiB
+#define PICOVD_SRAM_ACCESS              VD_MEMORY_ACCESS_MEMCPY
+#if PICOVD_COMPACT_LAYOUT_ENABLED
+#define PICOVD_SRAM_START_CLUSTER       (PICOVD_PSRAM_START_CLUSTER + PICOVD_COMPACT_REGION_CLUSTERS(PSRAM))
+#else
 #define PICOVD_SRAM_START_CLUSTER       (0x1F000) // See ExFAT-design.md
+#endif
 #define PICOVD_SRAM_START_LBA           EXFAT_CLUSTER_TO_LBA(PICOVD_SRAM_START_CLUSTER)
 
+// Add support for SRAM-DELTA file
+// This will enable the generation of a file named "SRAM-DELTA.BIN" in the exFAT filesystem.
+// The file contains only the SRAM pages changed since the host last read the whole file,
+// each as an (address, CRC-32) header followed by the page. See vd_files_sram_delta.c.
+#define PICOVD_SRAM_DELTA_ENABLED           (1)
+#define PICOVD_SRAM_DELTA_FILE_NAME         "SRAM-DELTA.BIN"
+#define PICOVD_SRAM_DELTA_FILE_NAME_LEN     PICOVD_UTF16_STRING_LEN(PICOVD_SRAM_DELTA_FILE_NAME)
+#define PICOVD_SRAM_DELTA_PAGE_SIZE_BYTES   (4096) // Granularity of the change detection
+#define PICOVD_SRAM_DELTA_RESCAN_MS         (1000) // Minimum time between scans, and after a read
+
 // Add support for ROM file
 // This will enable the generation of a file named "BOOTROM.BIN" in the exFAT filesystem.
 // The file will be generated from the contents of the Boot ROM segment on the RP2530.
 #define PICOVD_BOOTROM_ENABLED          (1)
 #define PICOVD_BOOTROM_FILE_NAME        "BOOTROM.BIN"
 #define PICOVD_BOOTROM_FILE_NAME_LEN    PICOVD_UTF16_STRING_LEN(PICOVD_BOOTROM_FILE_NAME)
+#define PICOVD_BOOTROM_BASE_ADDRESS     (0x0) // Bootrom is mapped at address 0x0
 #define PICOVD_BOOTROM_SIZE_BYTES       (0x8000) // 32 KiB
+#define PICOVD_BOOTROM_ACCESS           VD_MEMORY_ACCESS_MEMCPY
+#if PICOVD_COMPACT_LAYOUT_ENABLED
+#define PICOVD_BOOTROM_START_CLUSTER    PICOVD_DYNAMIC_AREA_END_CLUSTER
+#else
 #define PICOVD_BOOTROM_START_CLUSTER    (0xE000) // Within the free cluster range
+#endif
 #define PICOVD_BOOTROM_START_LBA        EXFAT_CLUSTER_TO_LBA(PICOVD_BOOTROM_START_CLUSTER)
 
 // Add support for FLASH file
@@ -51,14 +147,92 @@
 #define PICOVD_FLASH_ENABLED            (1)
 #define PICOVD_FLASH_FILE_NAME          "FLASH.BIN"
 #define PICOVD_FLASH_FILE_NAME_LEN      PICOVD_UTF16_STRING_LEN(PICOVD_FLASH_FILE_NAME)
+#define PICOVD_FLASH_BASE_ADDRESS       XIP_BASE
 #define PICOVD_FLASH_SIZE_BYTES         (0x200000) // 2 Mb
+#define PICOVD_FLASH_ACCESS             VD_MEMORY_ACCESS_MEMCPY
+#if PICOVD_COMPACT_LAYOUT_ENABLED
+#define PICOVD_FLASH_START_CLUSTER      (PICOVD_BOOTROM_START_CLUSTER + PICOVD_COMPACT_REGION_CLUSTERS(BOOTROM))
+#else
 #define PICOVD_FLASH_START_CLUSTER      (0xF000) // See ExFAT-design.md
+#endif
 #define PICOVD_FLASH_START_LBA          EXFAT_CLUSTER_TO_LBA(PICOVD_FLASH_START_CLUSTER)
 
+// Add support for the FLASH.MAP and FLASH.SPARSE files
+// FLASH.MAP lists the non-erased extents of the flash, one "0x<offset> 0x<length>" line each.
+// FLASH.SPARSE contains only those extents, after a small index header.
+// See vd_files_flash_map.h for the format.  The flash is scanned in the background,
+// one block per vd_files_flash_map_task() call, and the result is cached per block.
+#define PICOVD_FLASH_MAP_ENABLED            (1)
+#define PICOVD_FLASH_MAP_FILE_NAME          "FLASH.MAP"
+#define PICOVD_FLASH_MAP_FILE_NAME_LEN      PICOVD_UTF16_STRING_LEN(PICOVD_FLASH_MAP_FILE_NAME)
+#define PICOVD_FLASH_SPARSE_FILE_NAME       "FLASH.SPARSE"
+#define PICOVD_FLASH_SPARSE_FILE_NAME_LEN   PICOVD_UTF16_STRING_LEN(PICOVD_FLASH_SPARSE_FILE_NAME)
+#define PICOVD_FLASH_MAP_PAGE_SIZE_BYTES    (0x1000)  // Flash erase sector, granularity of the extents
+#define PICOVD_FLASH_MAP_BLOCK_SIZE_BYTES   (0x10000) // Flash erase block, granularity of the scans
+
+// Add support for PSRAM file
+// This will enable the generation of a file named "PSRAM.BIN" in the exFAT filesystem.
+// The file will be generated from the contents of the QMI chip select 1 window on the RP2350.
+// The board code must configure the QMI for the PSRAM before the file is read.
+// Read through the uncached alias by default, not to evict the flash from the XIP cache.
+#define PICOVD_PSRAM_ENABLED            (0)
+#define PICOVD_PSRAM_FILE_NAME          "PSRAM.BIN"
+#define PICOVD_PSRAM_FILE_NAME_LEN      PICOVD_UTF16_STRING_LEN(PICOVD_PSRAM_FILE_NAME)
+#define PICOVD_PSRAM_BASE_ADDRESS       (XIP_BASE + 0x01000000) // QMI chip select 1
+#define PICOVD_PSRAM_SIZE_BYTES         (0x800000) // 8 MiB
+#define PICOVD_PSRAM_ACCESS             VD_MEMORY_ACCESS_UNCACHED
+#if PICOVD_COMPACT_LAYOUT_ENABLED
+#define PICOVD_PSRAM_START_CLUSTER      (PICOVD_FLASH_START_CLUSTER + PICOVD_COMPACT_REGION_CLUSTERS(FLASH))
+#else
+#define PICOVD_PSRAM_START_CLUSTER      (0x10000) // Directly mapped, see ExFAT-design.md
+#endif
+#define PICOVD_PSRAM_START_LBA          EXFAT_CLUSTER_TO_LBA(PICOVD_PSRAM_START_CLUSTER)
+
+// Memory regions exposed as files, in ascending cluster order.
+// Each region is declared once, with its PICOVD_<NAME>_* parameters above;
+// the directory entries and the LBA regions are generated from this list.
+// The access method is one of VD_MEMORY_ACCESS_MEMCPY, _DMA or _UNCACHED.
+#if PICOVD_BOOTROM_ENABLED
+#define PICOVD_MEMORY_REGION_BOOTROM(X) X(bootrom, BOOTROM)
+#else
+#define PICOVD_MEMORY_REGION_BOOTROM(X)
+#endif
+#if PICOVD_FLASH_ENABLED
+#define PICOVD_MEMORY_REGION_FLASH(X)   X(flash, FLASH)
+#else
+#define PICOVD_MEMORY_REGION_FLASH(X)
+#endif
+#if PICOVD_PSRAM_ENABLED
+#define PICOVD_MEMORY_REGION_PSRAM(X)   X(psram, PSRAM)
+#else
+#define PICOVD_MEMORY_REGION_PSRAM(X)
+#endif
+#if PICOVD_SRAM_ENABLED
+#define PICOVD_MEMORY_REGION_SRAM(X)    X(sram, SRAM)
+#else
+#define PICOVD_MEMORY_REGION_SRAM(X)
+#endif
+
+#define PICOVD_MEMORY_REGIONS(X)  \
+    PICOVD_MEMORY_REGION_BOOTROM(X) \
+    PICOVD_MEMORY_REGION_FLASH(X)   \
+    PICOVD_MEMORY_REGION_PSRAM(X)   \
+    PICOVD_MEMORY_REGION_SRAM(X)
+
+// With PICOVD_COMPACT_LAYOUT_ENABLED, each memory region starts where the previous one
+// ends, and a disabled region takes no clusters
+#define PICOVD_COMPACT_REGION_CLUSTERS(CFG) \
+    (PICOVD_ ## CFG ## _ENABLED ? (PICOVD_ ## CFG ## _SIZE_BYTES + 4095) / 4096 : 0)
+#define PICOVD_COMPACT_END_CLUSTER      (PICOVD_SRAM_START_CLUSTER + PICOVD_COMPACT_REGION_CLUSTERS(SRAM))
+
 // Add support for the RP2350 BootROM flash partitions
 #define PICOVD_BOOTROM_PARTITIONS_ENABLED            (1)
 #define PICOVD_BOOTROM_PARTITIONS_MAX_FILES          (8)
-#define PICOVD_BOOTROM_PARTITIONS_NAMES_STORAGE_SIZE (256)
+#define PICOVD_BOOTROM_PARTITIONS_POLL_MS            (1000) // Partition table change check interval, 0 to disable
+// Place the partition files in a subdirectory of their own, instead of the root directory.
+// A partition table change then notifies the host only if it has listed the subdirectory.
+#define PICOVD_BOOTROM_PARTITIONS_DIR_ENABLED        (0)
+#define PICOVD_BOOTROM_PARTITIONS_DIR_NAME           "PARTS"
 // The 'x' in the string will be replaced with the partition index (0-7).
 // PICOVD_BOOTROM_PARTITIONS_FILE_NAME_N_IDX must match the position of 'x' in the string.
 #define PICOVD_BOOTROM_PARTITIONS_FILE_NAME_BASE     "PARTx.BIN" // UTF-8
@@ -67,6 +241,16 @@
 _Static_assert(PICOVD_BOOTROM_PARTITIONS_FILE_NAME_N_IDX < PICOVD_BOOTROM_PARTITIONS_FILE_NAME_LEN,
     "PICOVD_BOOTROM_PARTITIONS_FILE_NAME_N_IDX must be within the name");
 
+// Add support for the HASHES file
+// This will enable the generation of a file named "HASHES.TXT" in the exFAT filesystem,
+// listing the SHA-256 digests of FLASH.BIN and of the partitions, in `sha256sum` format.
+// The digests are computed in the background with the SHA-256 accelerator, one chunk
+// per vd_files_hashes_task() call, and recomputed only after the flash has changed.
+#define PICOVD_HASHES_FILE_ENABLED        (1)
+#define PICOVD_HASHES_FILE_NAME           "HASHES.TXT"
+#define PICOVD_HASHES_FILE_NAME_LEN       PICOVD_UTF16_STRING_LEN(PICOVD_HASHES_FILE_NAME)
+#define PICOVD_HASHES_CHUNK_SIZE_BYTES    (4096) // Bytes hashed per task call
+
 // Add support for a constantly changing file, to test the host's ability to re-read the disk contents
 // This will enable the generation of a file named "CHANGING.TXT" in the exFAT filesystem.
 #define PICOVD_CHANGING_FILE_ENABLED    (1)
@@ -74,9 +258,27 @@ _Static_assert(PICOVD_BOOTROM_PARTITIONS_FILE_NAME_N_IDX < PICOVD_BOOTROM_PARTIT
 #define PICOVD_CHANGING_FILE_NAME_LEN   PICOVD_UTF16_STRING_LEN(PICOVD_CHANGING_FILE_NAME)
 #define PICOVD_CHANGING_FILE_SIZE_BYTES (512) // XXX FIXME
 
+// Add support for a slow file, to demonstrate deferred reads (VD_READ_PENDING)
+// This will enable the generation of a file named "SLOW.TXT" in the exFAT filesystem.
+// Every read of the file takes PICOVD_SLOW_FILE_DELAY_MS.  With PICOVD_SLOW_FILE_ASYNC,
+// the delay runs in a timer alarm, which completes the read with vd_read_complete();
+// otherwise the content callback busy-waits inside tud_task().
+// Also echoes CDC input back to the host, for tools/cdc_latency_bench.py.
+#define PICOVD_SLOW_FILE_ENABLED        (0)
+#define PICOVD_SLOW_FILE_NAME           "SLOW.TXT"
+#define PICOVD_SLOW_FILE_NAME_LEN       PICOVD_UTF16_STRING_LEN(PICOVD_SLOW_FILE_NAME)
+#define PICOVD_SLOW_FILE_SIZE_BYTES     (64 * 1024)
+#define PICOVD_SLOW_FILE_DELAY_MS       (20)  // Time to produce each read
+#define PICOVD_SLOW_FILE_ASYNC          (1)   // 0 for the blocking baseline, read ahead if enabled
+
 // Dynamic file cluster allocation region
 #define PICOVD_DYNAMIC_AREA_START_CLUSTER   (EXFAT_ROOT_DIR_START_CLUSTER + EXFAT_ROOT_DIR_LENGTH_CLUSTERS)
+#if PICOVD_COMPACT_LAYOUT_ENABLED
+#define PICOVD_DYNAMIC_AREA_END_CLUSTER     \
+    (PICOVD_DYNAMIC_AREA_START_CLUSTER + PICOVD_COMPACT_DYNAMIC_AREA_BYTES / 4096)
+#else
 #define PICOVD_DYNAMIC_AREA_END_CLUSTER     (PICOVD_BOOTROM_START_CLUSTER) // 264 KiB
+#endif
 #define PICOVD_DYNAMIC_AREA_START_LBA       EXFAT_CLUSTER_TO_LBA(PICOVD_DYNAMIC_AREA_START_CLUSTER)
 #define PICOVD_DYNAMIC_AREA_END_LBA         EXFAT_CLUSTER_TO_LBA(PICOVD_DYNAMIC_AREA_END_CLUSTER)
 
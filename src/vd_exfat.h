@@ -16,19 +16,20 @@ extern const size_t exfat_boot_sector_data_length;
 /**
  * Compile-time VBR checksum for the exFAT boot sector.
  * This is the checksum for sectors 0-10, as per Microsoft spec §3.1.2,
- * ignoring VolumeSerialNumber, which is added at runtime.
+ * ignoring VolumeSerialNumber, which is added at runtime: the checksum of
+ * the bytes before it, and the steps of the bytes after it.
  * For the math involved, see the C++ source file.
  */
-// Net rotate amount for suffix (modulo 32)
-extern const int      EXFAT_VBR_SUFFIX_ROT;
-extern const uint32_t EXFAT_VBR_CHECKSUM_PREFIX;
-extern const uint32_t EXFAT_VBR_CHECKSUM_SUFFIX;
+typedef struct {
+    uint8_t rotate; ///< Rotate the sum right by this, modulo 32,
+    uint8_t byte;   ///< and add this non-zero byte
+} exfat_vbr_checksum_step_t;
 
-// ---------------------------------------------------------------
-// First FAT sector partial data (initial cluster chains)
-// ---------------------------------------------------------------
-extern const uint32_t * const exfat_fat0_sector_data; ///< First FAT sector data
-extern const size_t   exfat_fat0_sector_data_len; // (128 bytes)
+extern const uint32_t                         EXFAT_VBR_CHECKSUM_PREFIX;
+extern const exfat_vbr_checksum_step_t *const EXFAT_VBR_CHECKSUM_SUFFIX_STEPS;
+extern const size_t                           EXFAT_VBR_CHECKSUM_SUFFIX_STEPS_LEN;
+// Net rotate amount after the last suffix step (modulo 32)
+extern const int                              EXFAT_VBR_SUFFIX_ROT;
 
 // ---------------------------------------------------------------
 // Minimal up-case table
@@ -39,11 +40,21 @@ extern const size_t   exfat_upcase_table_len; /// Length of the up-case table in
 extern const uint32_t exfat_upcase_table_checksum; ///< Checksum of the up-case table
 
 // ---------------------------------------------------------------
-// Functions to generate the root directory sectors
+// Function to generate the root directory sectors
+// ---------------------------------------------------------------
+// This function generates the root directory sector data for exFAT,
+// for any slice of the root directory region.
+extern  int32_t exfat_generate_root_dir_sector(uint32_t lba, uint32_t offset, void* buf, uint32_t bufsize);
+
+// ---------------------------------------------------------------
+// Functions to generate the allocation bitmap and the FAT sectors
 // ---------------------------------------------------------------
-// This function generates the root directory sector data for exFAT.
-extern  int32_t exfat_generate_root_dir_fixed_sector(uint32_t lba, uint32_t offset, void* buf, uint32_t bufsize);
-extern  int32_t exfat_generate_root_dir_dynamic_sector(uint32_t lba, uint32_t offset, void* buf, uint32_t bufsize);
+// These functions generate the allocation bitmap and the FAT of the
+// current volume, for any slice of their regions, from the extents of its files.
+extern  int32_t exfat_generate_bitmap_sector(uint32_t lba, uint32_t offset, void* buf, uint32_t bufsize);
+extern  int32_t exfat_generate_fat_sector(uint32_t lba, uint32_t offset, void* buf, uint32_t bufsize);
+// Note a change to the clusters of the files, to rebuild the extent index
+extern  void    vd_exfat_extents_changed(void);
 
 // ---------------------------------------------------------------
 // Macro to compute an LBA from a cluster number
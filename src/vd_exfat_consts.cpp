@@ -1,12 +1,11 @@
 
-#include <pico/bootrom.h>
-
 #include "picovd_config.h"
 
 #include "vd_virtual_disk.h"
 #include "vd_exfat_params.h"
 #include "vd_exfat.h"
 #include "vd_exfat_dirs.h"
+#include "vd_exfat_layout.h"
 
 // Rotate right 32-bit by one bit
 static constexpr uint32_t ror32(uint32_t x) {
@@ -111,19 +110,66 @@ extern "C" constexpr uint32_t exfat_upcase_table_checksum = compute_upcase_check
 #endif
 
 // ---------------------------------------------------------------------------
-// exFAT boot sector
+// Volume layout
 // ---------------------------------------------------------------------------
 
-uint32_t exfat_get_volume_serial_number(void) {
-    // We want BOOT_RANDOM (0x0010) only
-    constexpr uint32_t FLAGS = 0x0010; // XXX TBD, replace with the proper #define from the Pico headers
-    // Buffer: [supported_flags, rand0, rand1, rand2, rand3]
-    uint32_t buf[1 + 4] = {};
-    rom_get_sys_info(buf, sizeof(buf)/sizeof(buf[0]), FLAGS);
-    // Ignore errors. On an error, just use what happens to be in the buf[].
-    // Combine the four 32-bit words into one 32-bit serial.
-    return buf[1] ^ buf[2] ^ buf[3] ^ buf[4];
-}
+static constexpr vd_exfat_layout exfat_layout = vd_exfat_make_layout({
+    .disk_size_bytes           = VIRTUAL_DISK_SIZE,
+    .bytes_per_sector_shift    = EXFAT_BYTES_PER_SECTOR_SHIFT,
+    .sectors_per_cluster_shift = EXFAT_SECTORS_PER_CLUSTER_SHIFT,
+    .heap_alignment_clusters   = EXFAT_CLUSTER_HEAP_ALIGNMENT_CLUSTERS,
+    .upcase_table_clusters     = EXFAT_UPCASE_TABLE_LENGTH_CLUSTERS,
+    .root_dir_clusters         = EXFAT_ROOT_DIR_LENGTH_CLUSTERS,
+    .heap_end_cluster          = PICOVD_COMPACT_LAYOUT_ENABLED ? PICOVD_COMPACT_END_CLUSTER : 0,
+});
+
+static_assert(exfat_layout.bytes_per_cluster == 4096,
+    "The cluster must be one 4 KB flash page");
+static_assert(vd_exfat_layout_addressable(exfat_layout),
+    "PICOVD_VIRTUAL_DISK_SIZE_BYTES is too large or too small");
+static_assert(vd_exfat_layout_fat_fits(exfat_layout),
+    "The FAT must cover all clusters and end before the cluster heap");
+static_assert(vd_exfat_layout_metadata_fits(exfat_layout),
+    "The allocation bitmap, up-case table and root directory must fit in the volume");
+
+// The C sources use the macros of vd_exfat_params.h
+static_assert(exfat_layout.volume_length          == EXFAT_VOLUME_LENGTH
+           && exfat_layout.fat_offset             == EXFAT_FAT_REGION_START_LBA
+           && exfat_layout.fat_length             == EXFAT_FAT_REGION_LENGTH
+           && exfat_layout.heap_gap_clusters      == EXFAT_CLUSTER_HEAP_GAP_CLUSTERS
+           && exfat_layout.cluster_heap_offset    == EXFAT_CLUSTER_HEAP_START_LBA
+           && exfat_layout.cluster_count          == EXFAT_CLUSTER_COUNT,
+    "vd_exfat_params.h disagrees with vd_exfat_make_layout() on the volume geometry");
+static_assert(exfat_layout.bitmap_first_cluster   == EXFAT_ALLOCATION_BITMAP_START_CLUSTER
+           && exfat_layout.bitmap_clusters        == EXFAT_ALLOCATION_BITMAP_LENGTH_CLUSTERS
+           && exfat_layout.upcase_first_cluster   == EXFAT_UPCASE_TABLE_START_CLUSTER
+           && exfat_layout.root_dir_first_cluster == EXFAT_ROOT_DIR_START_CLUSTER
+           && exfat_layout.cluster_to_lba(EXFAT_UPCASE_TABLE_START_CLUSTER) == EXFAT_UPCASE_TABLE_START_LBA
+           && exfat_layout.cluster_to_lba(EXFAT_ROOT_DIR_START_CLUSTER)     == EXFAT_ROOT_DIR_START_LBA
+           && exfat_layout.files_first_cluster()  == PICOVD_DYNAMIC_AREA_START_CLUSTER,
+    "vd_exfat_params.h disagrees with vd_exfat_make_layout() on the metadata clusters");
+
+// The dynamic area and the memory regions (BOOTROM.BIN, FLASH.BIN, ...) follow the
+// metadata.  The LBA regions are searched in order, so the memory regions must be
+// listed in ascending cluster order, must not overlap each other, and must end
+// within the volume.
+#define VD_MEMORY_REGION_CLUSTERS(id, CFG) { \
+        PICOVD_ ## CFG ## _START_CLUSTER, \
+        PICOVD_ ## CFG ## _START_CLUSTER + \
+            ((PICOVD_ ## CFG ## _SIZE_BYTES - 1) >> (EXFAT_BYTES_PER_SECTOR_SHIFT + EXFAT_SECTORS_PER_CLUSTER_SHIFT)) + 1 },
+static constexpr vd_exfat_layout_region exfat_layout_regions[] = {
+    { PICOVD_DYNAMIC_AREA_START_CLUSTER, PICOVD_DYNAMIC_AREA_END_CLUSTER },
+    PICOVD_MEMORY_REGIONS(VD_MEMORY_REGION_CLUSTERS)
+};
+#undef VD_MEMORY_REGION_CLUSTERS
+
+static_assert(vd_exfat_layout_regions_fit(exfat_layout, exfat_layout_regions,
+                                          sizeof(exfat_layout_regions) / sizeof(exfat_layout_regions[0])),
+    "PICOVD_MEMORY_REGIONS must be in ascending cluster order, non-overlapping and within the volume");
+
+// ---------------------------------------------------------------------------
+// exFAT boot sector
+// ---------------------------------------------------------------------------
 
 #define U16_LE(x) (uint8_t)((x) & 0xFF), (uint8_t)(((x) >> 8) & 0xFF)
 #define U32_LE(x) U16_LE((x) & 0xFFFF), U16_LE(((x) >> 16) & 0xFFFF)
@@ -137,20 +183,20 @@ extern "C"  constexpr uint8_t exfat_boot_sector_data[120] = {
     0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,      // must_zero[43-58] (16 bytes)
     0,0,0,0,0,                            // must_zero[59-63] (5 bytes)
     U64_LE(0),                            // PartitionOffset
-    U64_LE(EXFAT_VOLUME_LENGTH),          // VolumeLength
-    U32_LE(EXFAT_FAT_REGION_START_LBA),   // FATOffset
-    U32_LE(EXFAT_FAT_REGION_LENGTH),      // FATLength
-    U32_LE(EXFAT_CLUSTER_HEAP_START_LBA), // ClusterHeapOffset
-    U32_LE(EXFAT_CLUSTER_COUNT),          // ClusterCount
-    U32_LE(EXFAT_ROOT_DIR_START_CLUSTER), // RootDirectoryCluster
-    U32_LE(0),                            // VolumeSerialNumber, filled at runtime
-    U16_LE(EXFAT_FILE_SYSTEM_VERSION),    // FileSystemRevision (1.00)
-    U16_LE(0),                            // VolumeFlags
-    EXFAT_BYTES_PER_SECTOR_SHIFT,         // BytesPerSectorShift (log2 of 512)
-    EXFAT_SECTORS_PER_CLUSTER_SHIFT,      // SectorsPerClusterShift (log2 of 8)
-    1,                                    // NumberOfFats
-    0,                                    // DriveSelect, not in use
-    0xFF,                                 // PercentInUse, not in use
+    U64_LE(exfat_layout.volume_length),          // VolumeLength
+    U32_LE(exfat_layout.fat_offset),             // FATOffset
+    U32_LE(exfat_layout.fat_length),             // FATLength
+    U32_LE(exfat_layout.cluster_heap_offset),    // ClusterHeapOffset
+    U32_LE(exfat_layout.cluster_count),          // ClusterCount
+    U32_LE(exfat_layout.root_dir_first_cluster), // RootDirectoryCluster
+    U32_LE(0),                                   // VolumeSerialNumber, from the board ID at runtime
+    U16_LE(EXFAT_FILE_SYSTEM_VERSION),           // FileSystemRevision (1.00)
+    U16_LE(0),                                   // VolumeFlags
+    EXFAT_BYTES_PER_SECTOR_SHIFT,                // BytesPerSectorShift (log2 of 512 or 4096)
+    EXFAT_SECTORS_PER_CLUSTER_SHIFT,             // SectorsPerClusterShift (log2 of 8 or 1)
+    1,                                           // NumberOfFats
+    0,                                           // DriveSelect, not in use
+    0xFF,                                        // PercentInUse, not in use
 };
 
 constexpr size_t exfat_boot_sector_data_length = sizeof(exfat_boot_sector_data);
@@ -163,7 +209,7 @@ _Static_assert(sizeof(exfat_boot_sector_data) == 120, "Boot sector header must b
 
 // Return the byte at (lba, offset) matching the on-disk generator behavior
 static constexpr uint8_t sector_byte(uint32_t lba, uint32_t off) {
-    // Sector 0: boot sector, bytes from exfat_boot_sector_data, rest zero
+    // Sector 0: boot sector, bytes from exfat_boot_sector_data, the signature, rest zero
     if (lba == 0) {
         // Zero VolumeFlags (bytes 106-107) and PercentInUse (byte 112) per spec
         if (off == 106 || off == 107 || off == 112) {
@@ -172,12 +218,15 @@ static constexpr uint8_t sector_byte(uint32_t lba, uint32_t off) {
         if (off < exfat_boot_sector_data_length) {
             return exfat_boot_sector_data[off];
         }
+        // BootSignature at bytes 510-511 whatever the sector size, §3.1.22
+        if (off == 510) return 0x55;
+        if (off == 511) return 0xAA;
         return 0;
     }
-    // Sectors 1-8: extended boot sectors: zeros except bytes 510=0x55, 511=0xAA
+    // Sectors 1-8: extended boot sectors: zeros except the last two bytes, 0x55 0xAA
     if (lba >= 1 && lba <= 8) {
-        if (off == 510) return 0x55;
-        if (off == 511) return 0xAA;
+        if (off == EXFAT_BYTES_PER_SECTOR - 2) return 0x55;
+        if (off == EXFAT_BYTES_PER_SECTOR - 1) return 0xAA;
         return 0;
     }
     // Sectors 9-10: all zeros
@@ -192,9 +241,9 @@ static constexpr uint8_t sector_byte(uint32_t lba, uint32_t off) {
  * Compute a VBR checksum over a range of sectors.
  *
  * @param start_lba      First LBA in the range.
- * @param start_offset   Byte offset within the first sector to begin (0-511).
+ * @param start_offset   Byte offset within the first sector to begin (0 to sector size - 1).
  * @param lba_count      Number of consecutive sectors to include.
- * @param next_offset    Byte offset within the last sector to end (exclusive, 1-512).
+ * @param next_offset    Byte offset within the last sector to end (exclusive, 1 to sector size).
  */
 static constexpr uint32_t compute_vbr_checksum(uint32_t start_lba,
                                                uint32_t start_offset,
@@ -204,7 +253,7 @@ static constexpr uint32_t compute_vbr_checksum(uint32_t start_lba,
     for (uint32_t i = 0; i < lba_count; ++i) {
         uint32_t lba = start_lba + i;
         uint32_t off_begin = (i == 0 ? start_offset : 0);
-        uint32_t off_end   = (i == lba_count - 1 ? next_offset : 512);
+        uint32_t off_end   = (i == lba_count - 1 ? next_offset : EXFAT_BYTES_PER_SECTOR);
         for (uint32_t off = off_begin; off < off_end; ++off) {
             // Skip VolumeFlags (106-107) and PercentInUse (112) in the boot sector
             if (lba == 0 && (off == 106 || off == 107 || off == 112)) {
@@ -220,95 +269,89 @@ static constexpr uint32_t compute_vbr_checksum(uint32_t start_lba,
 /* -------------------------------------------------------------------------
  * Constants for runtime VBR checksum computation
  *
- * In the realm of 32-bit affine transforms:
+ * Each byte b_i of sectors 0-10 takes the sum through
  * sum_i+1 = ROR32(sum_i) + b_i
- * Unrolling that over any contiguous slice of bytes, gives
- * sum_final = ROR^n(sum_start) + C
- * where
- *	n = number of bytes in the slice (mod 32), and
- *	C = sum_0-1^n ( ROR^(n-1-i)(b_i)  (mod 2^32), a constant to be precomputed.
+ * Only the four bytes of VolumeSerialNumber, at offsets 100-103 of sector 0,
+ * are not known at compile time.  The checksum of the bytes before them is
+ * a constant, EXFAT_VBR_CHECKSUM_PREFIX.  After them, a zero byte only rotates
+ * the sum, and the rotations of a run of zero bytes add up, so the rest of
+ * the sub-region reduces to one step sum = ROR32^n(sum) + b for each non-zero
+ * byte, a few dozen in all, and a final rotation.
  *
- * This implementation, as it currently stands, does not work.
- * Hence, it is not used in the code.
- * Instead, we use a simple runtime version of the VBR checksum computation.
- * That uses the same algorithm as the compile-time version, but
- * iterates over the sectors and bytes, rather than using a precomputed
- * constant.
+ * A single affine constant for the whole suffix, ROR^n(sum) + C, does not
+ * work: the carries of the additions do not commute with the rotations.
  * ------------------------------------------------------------------------- */
 
-// Total bytes covered by sectors 0-10 (11 sectors x 512 bytes)
-static constexpr int EXFAT_VBR_TOTAL_BYTES = 11 * 512; // 5632
-
-// Byte-offset in sector 0 immediately after the VolumeSerialNumber field
-static constexpr int EXFAT_VBR_SUFFIX_START_OFFSET = 104;
-
-// Number of bytes in the suffix region (from offset 104 to end of sector 10)
-static constexpr int EXFAT_VBR_SUFFIX_LEN = EXFAT_VBR_TOTAL_BYTES - EXFAT_VBR_SUFFIX_START_OFFSET; // 5632 - 104 = 5528
-
-// Net rotate amount for suffix (modulo 32)
-extern "C" constexpr int EXFAT_VBR_SUFFIX_ROT = EXFAT_VBR_SUFFIX_LEN % 32; // 5528 mod 32 = 24
+// Byte-offset in sector 0 of the VolumeSerialNumber field, and immediately after it
+static constexpr uint32_t EXFAT_VBR_SERIAL_OFFSET       = 100;
+static constexpr uint32_t EXFAT_VBR_SUFFIX_START_OFFSET = 104;
 
-// Materialize compile-time checksums around the VolumeSerialNumber field
-extern "C" constexpr uint32_t EXFAT_VBR_CHECKSUM_PREFIX
-  = compute_vbr_checksum(0, 0, 1, 100);
+// Call f with each checksummed byte after the VolumeSerialNumber, in order
+template<typename F>
+static constexpr void for_each_vbr_suffix_byte(F &&f) {
+    for (uint32_t lba = 0; lba < 11; ++lba) {
+        for (uint32_t off = (lba == 0 ? EXFAT_VBR_SUFFIX_START_OFFSET : 0); off < EXFAT_BYTES_PER_SECTOR; ++off) {
+            // Skip VolumeFlags (106-107) and PercentInUse (112) in the boot sector
+            if (lba == 0 && (off == 106 || off == 107 || off == 112)) {
+                continue;
+            }
+            f(sector_byte(lba, off));
+        }
+    }
+}
 
-// Compile-time checksum of the suffix region
-// (sectors 0 bytes 104-511, then sectors 1-10 full)
-extern "C" constexpr uint32_t EXFAT_VBR_CHECKSUM_SUFFIX
-   = compute_vbr_checksum(0, EXFAT_VBR_SUFFIX_START_OFFSET, 11, 512
-);
+static constexpr size_t count_vbr_suffix_steps(void) {
+    size_t count = 0;
+    for_each_vbr_suffix_byte([&count](uint8_t b) { count += (b != 0); });
+    return count;
+}
 
-// -----------------------------------------------------------------------------
-// Compile-time first FAT sector beginning with initial cluster chains
-// -----------------------------------------------------------------------------
+static constexpr size_t EXFAT_VBR_SUFFIX_STEP_COUNT = count_vbr_suffix_steps(); // 22 with 512 B sectors
 
-#include <array>
-#include <algorithm>
-
-constexpr size_t exfat_fat0_entries =
-    2 /* reserved */ +
-    EXFAT_ALLOCATION_BITMAP_LENGTH_CLUSTERS +
-    EXFAT_UPCASE_TABLE_LENGTH_CLUSTERS +
-    EXFAT_ROOT_DIR_LENGTH_CLUSTERS;
-
-// Max cluster index we'll need to fill
-constexpr uint32_t exfat_fat0_required_size =
-    std::max({
-        EXFAT_ALLOCATION_BITMAP_START_CLUSTER + EXFAT_ALLOCATION_BITMAP_LENGTH_CLUSTERS,
-        EXFAT_UPCASE_TABLE_START_CLUSTER      + EXFAT_UPCASE_TABLE_LENGTH_CLUSTERS,
-        EXFAT_ROOT_DIR_START_CLUSTER          + EXFAT_ROOT_DIR_LENGTH_CLUSTERS
-    });
+struct vbr_suffix {
+    exfat_vbr_checksum_step_t steps[EXFAT_VBR_SUFFIX_STEP_COUNT];
+    uint8_t                   rotate; // After the last step
+};
 
-// The FAT sector will contain entries for clusters 0 to N
-constexpr std::array<uint32_t, exfat_fat0_required_size> generate_fat0_chains() {
-    std::array<uint32_t, exfat_fat0_required_size> fat{};
-    fat[0] = 0xFFFFFFF8u; // cluster 0
-    fat[1] = 0xFFFFFFFFu; // cluster 1
-
-    auto continuous_chain = [&](uint32_t start, uint32_t length) {
-        for (uint32_t i = 0; i < length; ++i) {
-            uint32_t cluster = start + i;
-            if (i == length - 1) {
-                fat[cluster] = 0xFFFFFFFFu; // end of chain
-            } else {
-                fat[cluster] = cluster + 1;
-            }
+static constexpr vbr_suffix make_vbr_suffix(void) {
+    vbr_suffix suffix = {};
+    size_t   i      = 0;
+    uint32_t rotate = 0;
+    for_each_vbr_suffix_byte([&](uint8_t b) {
+        rotate++;
+        if (b != 0) {
+            suffix.steps[i++] = { static_cast<uint8_t>(rotate % 32), b };
+            rotate = 0;
         }
-    };
+    });
+    suffix.rotate = static_cast<uint8_t>(rotate % 32);
+    return suffix;
+}
 
-    continuous_chain(EXFAT_ALLOCATION_BITMAP_START_CLUSTER, EXFAT_ALLOCATION_BITMAP_LENGTH_CLUSTERS);
-    continuous_chain(EXFAT_UPCASE_TABLE_START_CLUSTER,      EXFAT_UPCASE_TABLE_LENGTH_CLUSTERS);
-    continuous_chain(EXFAT_ROOT_DIR_START_CLUSTER,          EXFAT_ROOT_DIR_LENGTH_CLUSTERS);
+static constexpr vbr_suffix exfat_vbr_suffix = make_vbr_suffix();
 
-    return fat;
+static constexpr uint32_t ror32_n(uint32_t x, uint32_t n) {
+    return n % 32 ? (x >> (n % 32)) | (x << (32 - n % 32)) : x;
 }
 
-static constexpr auto exfat_fat0_sector = generate_fat0_chains();
-extern "C" const uint32_t * const exfat_fat0_sector_data = exfat_fat0_sector.data();
-extern "C" const size_t           exfat_fat0_sector_data_len = exfat_fat0_sector.size() * sizeof(uint32_t);
+// Materialize compile-time checksums around the VolumeSerialNumber field
+extern "C" constexpr uint32_t EXFAT_VBR_CHECKSUM_PREFIX
+  = compute_vbr_checksum(0, 0, 1, EXFAT_VBR_SERIAL_OFFSET);
+
+// The steps of the suffix region (sector 0 bytes 104 to the end, then sectors 1-10 full)
+extern "C" constexpr const exfat_vbr_checksum_step_t *EXFAT_VBR_CHECKSUM_SUFFIX_STEPS = exfat_vbr_suffix.steps;
+extern "C" constexpr size_t   EXFAT_VBR_CHECKSUM_SUFFIX_STEPS_LEN = EXFAT_VBR_SUFFIX_STEP_COUNT;
+extern "C" constexpr int      EXFAT_VBR_SUFFIX_ROT                = exfat_vbr_suffix.rotate;
 
-_Static_assert(exfat_fat0_sector_data_len <= 512,
-    "First FAT sector fixed data must less than or equal to 512 bytes");
+// With a zero VolumeSerialNumber, the steps must give the checksum of the whole sub-region
+static constexpr uint32_t apply_vbr_suffix(uint32_t sum) {
+    for (size_t i = 0; i < EXFAT_VBR_SUFFIX_STEP_COUNT; i++) {
+        sum = ror32_n(sum, exfat_vbr_suffix.steps[i].rotate) + exfat_vbr_suffix.steps[i].byte;
+    }
+    return ror32_n(sum, exfat_vbr_suffix.rotate);
+}
+static_assert(apply_vbr_suffix(ror32_n(EXFAT_VBR_CHECKSUM_PREFIX, 4)) == compute_vbr_checksum(0, 0, 11, EXFAT_BYTES_PER_SECTOR),
+    "The VBR checksum suffix steps disagree with the checksum of sectors 0-10");
 
 // ---------------------------------------------------------------------------
 // Pre-constructed first directory-entry structs for the root directory
@@ -343,3 +386,15 @@ static constexpr exfat_upcase_table_dir_entry_t upcase_table_entry
     .data_length    = EXFAT_UPCASE_TABLE_LENGTH_CLUSTERS * EXFAT_BYTES_PER_SECTOR * EXFAT_SECTORS_PER_CLUSTER,
 #endif
 };
+
+// Placeholder: the GUID and the SetChecksum are derived from the board ID at runtime,
+// see vd_virtual_disk_volume_guid()
+static constexpr exfat_volume_guid_dir_entry_t volume_guid_entry
+    __attribute__((section("flashdata_picovd_static_directory_entries"), used, aligned(4))) = {
+    .entry_type            = exfat_entry_type_volume_guid,
+    .secondary_count       = 0,
+    .set_checksum          = 0,
+    .general_primary_flags = 0,
+    .volume_guid           = {},
+    .reserved              = {},
+};
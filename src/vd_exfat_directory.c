@@ -9,7 +9,6 @@
 #include <string.h>
 
 #include <tusb.h>
-#include "tusb_config.h"     // for CFG_TUD_MSC_EP_BUFSIZE
 
 #include "picovd_config.h"
 
@@ -18,6 +17,7 @@
 #include "vd_exfat.h"
 #include "vd_exfat_dirs.h"
 #include "vd_files_rp2350.h"
+#include "vd_time.h"
 
 
 // ---------------------------------------------------------------------------
@@ -36,30 +36,25 @@ uint16_t exfat_dirs_compute_setchecksum(const uint8_t *entries, size_t len) {
 
 // ---------------------------------------------------------------------------
 // Directory entry sets for the root directory.
-
-// XXX FIXME: Outdated below.
-//
-// The SetChecksums computed lazily the first time an entry set
 //
-// To minimise runtime SRAM use, we don't store the root directory as a single
-// runtime buffer but as a series of entry sets, pointed by this table.
-// This allows us to compute the assemble the directory sector contents
-// relatively quicly at runtime.  An alternative would be to use a separate
-// linker segment for the entry sets, thereby making them continuous.
-// However, that would not be easy.  Firstly, computing the SetChecksums at
-// compile time turned out to be quite complicated, requiring C++20.
-// Secondly, for we have both compile-time generated and run-time generated
-// entry sets.  The current code allows them to be both handled by this
-// same code.
+// The root directory is never stored, but generated on each read as a
+// packed stream of 32-byte entries: first the compile-time entry sets of
+// the volume, from the linker section below, then the entry set of each
+// dynamic file of the volume, 3 to 19 entries depending on the name length,
+// back to back, and end-of-directory entries up to the end of the directory.
 //
-// As long as the number of entry sets is relatively low, in the order
-// of a few tens at most, having this whole table in SRAM takes at most
-// a few hundred bytes.
+// A per-volume index keeps the start of each dynamic entry set.  A slice
+// of any sector is answered by a binary search for the first entry set
+// overlapping it; only the entry sets in the slice are then generated.
+// A sector thus holds up to 5 entry sets with short names, and the host
+// reads only the sectors in use when it scans the directory at mount.
 // ---------------------------------------------------------------------------
 
-// Provided by the linker.
-extern const vd_static_file_t __start_flashdata_picovd_static_directory_entries[];
-extern const vd_static_file_t __stop_flashdata_picovd_static_directory_entries[];
+// Provided by the linker.  The section holds the metadata entries and the
+// entry sets of PICOVD_DEFINE_FILE_STATIC, each of its own length, back to
+// back and complete with their SetChecksums.
+extern const uint8_t __start_flashdata_picovd_static_directory_entries[];
+extern const uint8_t __stop_flashdata_picovd_static_directory_entries[];
 
 #if 0
 static struct {
@@ -90,80 +85,97 @@ static_assert(sizeof(exfat_root_dir_first_entries_data)
 #endif
 
 
+#if VD_LUN_VOLATILE != VD_LUN_STATIC
+// The volatile volume has the same metadata entries as the static one,
+// the first entries of the section, but its own label.
+// The compile-time files are on the static volume only.
+static exfat_root_dir_entries_first_t volatile_volume_first_entries;
+
+static const uint8_t *volatile_volume_entries(void) {
+    static bool inited = false;
+    if (!inited) {
+        static const char16_t label[] = PICOVD_VOLATILE_VOLUME_LABEL_UTF16;
+        static_assert(PICOVD_UTF16_STRING_LEN(label) <= EXFAT_VOLUME_LABEL_MAX_LENGTH,
+                      "Volatile volume label must fit in the maximum length");
+
+        memcpy(&volatile_volume_first_entries, __start_flashdata_picovd_static_directory_entries,
+               sizeof(volatile_volume_first_entries));
+        exfat_volume_label_dir_entry_t *entries = (exfat_volume_label_dir_entry_t *)&volatile_volume_first_entries;
+        for (size_t i = 0; i < sizeof(volatile_volume_first_entries) / sizeof(*entries); i++) {
+            if (entries[i].entry_type == exfat_entry_type_volume_label) {
+                entries[i].char_count = PICOVD_UTF16_STRING_LEN(label);
+                memset(entries[i].volume_label, 0, sizeof(entries[i].volume_label));
+                memcpy(entries[i].volume_label, label, PICOVD_UTF16_STRING_LEN(label) * sizeof(char16_t));
+            }
+        }
+        inited = true;
+    }
+    return (const uint8_t *)&volatile_volume_first_entries;
+}
+#endif
+
 // ---------------------------------------------------------------------------
-// Generate a slice of a root directory sector, as requested by the MSC layer.
+// The Volume GUID entry of a volume, §7.5, generated once.  The compile-time
+// entries hold a placeholder for it.
 // ---------------------------------------------------------------------------
-int32_t exfat_generate_root_dir_fixed_sector(uint32_t __unused lba, uint32_t offset, void* buffer, uint32_t bufsize) {
-
-    assert(lba == EXFAT_ROOT_DIR_START_LBA);
-
-    uint8_t *buf = (uint8_t *)buffer; // Current place to copy
-    size_t   len = bufsize;           // Remaining bytes to copy
-    size_t   idx = 0;                 // Current index within the sector
-
-    const vd_static_file_t *begin = __start_flashdata_picovd_static_directory_entries;
-    const vd_static_file_t *end   = __stop_flashdata_picovd_static_directory_entries;
-
-    for (const vd_static_file_t *f = begin; f < end; ++f) {
-        // Each vd_static_file_t contains a file_dir_entry, stream_extension_entry, and file_name_entry
-        // We treat the struct as a contiguous entry set
-        const uint8_t *entries_data = (const uint8_t *)f;
-        const size_t   entries_len  = sizeof(vd_static_file_t);
-
-        // Step 2: If the requested slice is after the current entries, skip to next ones
-        if (offset >= idx + entries_len) {
-            idx += entries_len;
-            continue;
-        }
+static const exfat_volume_guid_dir_entry_t *volume_guid_entry(uint8_t lun) {
+    static exfat_volume_guid_dir_entry_t entries[VD_LUN_COUNT];
+    exfat_volume_guid_dir_entry_t *entry = &entries[lun];
+    if (entry->entry_type != exfat_entry_type_volume_guid) {
+        entry->entry_type = exfat_entry_type_volume_guid;
+        vd_virtual_disk_volume_guid(lun, entry->volume_guid);
+        entry->set_checksum = exfat_dirs_compute_setchecksum((const uint8_t *)entry, sizeof(*entry));
+    }
+    return entry;
+}
 
-        // Copy data from the current entries to the buffer
-        // If some part of the entries falls before the requested slice,
-        // start copying only at within the entries as needed.
-        // We have copied idx bytes so far. Hence, the offset within the entries
-        // is offset - idx, or the number of bytes to skip in the beginning
-        // of this entry set. If this is negative, we start copying from the beginning.
-        const size_t   entries_offset = (offset > idx? offset - idx: 0);
-        assert(entries_offset < entries_len);
-        const uint8_t *copy_from      = entries_data + entries_offset;
-        size_t         copy_len       = entries_len  - entries_offset;
-
-        if (copy_len > len)
-            copy_len = len;
+// ---------------------------------------------------------------------------
+// The compile-time entries of a volume
+// ---------------------------------------------------------------------------
+static void root_dir_fixed_sets(uint8_t lun, const uint8_t **begin, const uint8_t **end) {
+    *begin = __start_flashdata_picovd_static_directory_entries;
+    *end   = __stop_flashdata_picovd_static_directory_entries;
+#if VD_LUN_VOLATILE != VD_LUN_STATIC
+    if (lun == VD_LUN_VOLATILE) {
+        *begin = volatile_volume_entries();
+        *end   = *begin + sizeof(volatile_volume_first_entries);
+    }
+#endif
+}
 
-        memcpy(buf, copy_from, copy_len);
+static uint32_t root_dir_fixed_size(uint8_t lun) {
+    const uint8_t *begin, *end;
+    root_dir_fixed_sets(lun, &begin, &end);
+    return end - begin;
+}
 
-        // Place the SetChecksum, if needed and if it is part of the copied data,
-        // at indices 2 and 3 as measured from the beginning of the entries
-        if (entries_data[0] == exfat_entry_type_file_directory ||
-            entries_data[0] == exfat_entry_type_volume_guid) {
-            // Compute checksum for the current entry set
-            const uint16_t checksum = exfat_dirs_compute_setchecksum(entries_data, entries_len);
-            // TODO: Precompute and store checksum at build time in the future
+// ---------------------------------------------------------------------------
+// Generate a slice of the compile-time entries, at the start of the root directory.
+// ---------------------------------------------------------------------------
+static int32_t root_dir_fixed_entries(uint8_t lun, uint32_t offset, void* buffer, uint32_t bufsize) {
 
-            if (entries_offset <= 2 && copy_len > 2 - entries_offset) {
-                buf[2 - entries_offset] =  checksum       & 0xFF;
-            }
-            if (entries_offset <= 3 && copy_len > 3 - entries_offset) {
-                buf[3 - entries_offset] = (checksum >> 8) & 0xFF;
-            }
-        }
+    assert(offset + bufsize <= root_dir_fixed_size(lun));
 
-        // Advance for the next entry (if any)
-        buf += copy_len;
-        len -= copy_len;
-        idx += entries_offset + copy_len;
+    const uint8_t *begin, *end;
+    root_dir_fixed_sets(lun, &begin, &end);
 
-        assert(buf >= ((uint8_t *)buffer) && buf <= ((uint8_t *)buffer) + bufsize);
-        assert(len <= bufsize);
-        assert(idx <= EXFAT_BYTES_PER_SECTOR);
+    // The SetChecksums were computed at compile time, see vd_exfat_dirs_make_static_file()
+    memcpy(buffer, begin + offset, bufsize);
 
-        // If the buffer is full, stop
-        if (len == 0)
-            break;
+    // Except the one of the Volume GUID, filled from the board ID.  Found by its
+    // type, as the compiler may place the entries in the section in any order.
+    const uint8_t *entry = begin;
+    while (entry < end && entry[0] != exfat_entry_type_volume_guid) {
+        entry += 32;
+    }
+    const uint32_t guid_pos = entry - begin;
+    if (entry < end && offset < guid_pos + sizeof(exfat_volume_guid_dir_entry_t) && offset + bufsize > guid_pos) {
+        const exfat_volume_guid_dir_entry_t *guid = volume_guid_entry(lun);
+        const uint32_t guid_end = guid_pos + sizeof(*guid);
+        const uint32_t first    = offset > guid_pos ? offset : guid_pos;
+        const uint32_t last     = offset + bufsize < guid_end ? offset + bufsize : guid_end;
+        memcpy((uint8_t *)buffer + (first - offset), (const uint8_t *)guid + (first - guid_pos), last - first);
     }
-
-    // Mark the rest of the buffer as unused
-    memset(buf, exfat_entry_type_unused, len);
     return bufsize;
 }
 
@@ -183,53 +195,212 @@ typedef struct {
 static dynamic_file_entry_t dynamic_files[PICOVD_PARAM_MAX_DYNAMIC_FILES];
 static size_t dynamic_file_count = 0;
 
+#ifndef PICOVD_PARAM_MAX_SUBDIRECTORIES
+#define PICOVD_PARAM_MAX_SUBDIRECTORIES 2
+#endif
+
+// A generated directory: the root directory of a volume, or a subdirectory.
+// The index keeps where each of its dynamic entry sets starts, in bytes from
+// the start of the directory, in directory order.  It is rebuilt lazily when
+// the generation of the directory has changed, i.e. after files have been
+// added to or removed from it; other directories keep their index.
+typedef struct {
+    const vd_dynamic_file_t *dir; ///< The subdirectory; NULL for a root directory, or a free slot
+    uint32_t generation;          ///< Changes to the listing of the directory
+    uint32_t index_generation;    ///< Generation the index was built at
+    uint16_t start[PICOVD_PARAM_MAX_DYNAMIC_FILES + 1]; ///< The last one is the end of the entry sets
+    const vd_dynamic_file_t *file[PICOVD_PARAM_MAX_DYNAMIC_FILES];
+    uint16_t count;               ///< Entry sets in the directory
+} directory_t;
+
+#define DIRECTORY_COUNT (VD_LUN_COUNT + PICOVD_PARAM_MAX_SUBDIRECTORIES)
+
+// The root directories first, at their LUN, then the subdirectory slots
+static directory_t directories[DIRECTORY_COUNT] = {
+    [0 ... VD_LUN_COUNT - 1] = { .generation = 1 },
+};
+
+_Static_assert(EXFAT_ROOT_DIR_LENGTH_BYTES <= UINT16_MAX,
+               "Root directory offsets must fit in the index");
+_Static_assert(PICOVD_PARAM_SUBDIRECTORY_SIZE_BYTES % EXFAT_BYTES_PER_CLUSTER == 0
+               && PICOVD_PARAM_SUBDIRECTORY_SIZE_BYTES <= UINT16_MAX,
+               "Subdirectories must be whole clusters, with offsets that fit in the index");
+
+static inline bool is_root_directory(const directory_t *d) {
+    return d < &directories[VD_LUN_COUNT];
+}
+
+static inline uint8_t directory_lun(const directory_t *d) {
+    return is_root_directory(d) ? (uint8_t)(d - directories) : d->dir->lun;
+}
+
+// Return the subdirectory dir of a volume, its root directory for NULL,
+// or NULL if dir is not registered
+static directory_t *directory_find(uint8_t lun, const vd_dynamic_file_t *dir) {
+    if (dir == NULL) {
+        return &directories[lun];
+    }
+    for (size_t i = VD_LUN_COUNT; i < DIRECTORY_COUNT; i++) {
+        if (directories[i].dir == dir) {
+            return &directories[i];
+        }
+    }
+    return NULL;
+}
+
+static inline directory_t *directory_of_file(const vd_dynamic_file_t *file) {
+    return directory_find(file->lun, file->parent);
+}
+
+// Each file name entry holds 15 UTF-16 code units; longer names are truncated
+static size_t file_name_length(const vd_dynamic_file_t *file) {
+    return file->name_length < EXFAT_FILE_NAME_MAX_ENTRIES * 15
+         ? file->name_length : EXFAT_FILE_NAME_MAX_ENTRIES * 15;
+}
+
+// Size of the entry set of a file: File, Stream Extension and File Name entries
+static uint32_t file_entry_set_size(const vd_dynamic_file_t *file) {
+    return (2 + (file_name_length(file) + 14) / 15) * 32;
+}
+
+static uint32_t directory_size(const directory_t *d) {
+    return is_root_directory(d) ? EXFAT_ROOT_DIR_LENGTH_BYTES : d->dir->size_bytes;
+}
+
+static const directory_t *directory_index_get(directory_t *d) {
+    if (d->index_generation != d->generation) {
+        const uint8_t lun = directory_lun(d);
+        d->count    = 0;
+        d->start[0] = is_root_directory(d) ? root_dir_fixed_size(lun) : 0;
+        for (size_t i = 0; i < dynamic_file_count; i++) {
+            const vd_dynamic_file_t *file = dynamic_files[i].file;
+            if (file->lun == lun && file->parent == d->dir) {
+                d->file[d->count] = file;
+                d->start[d->count + 1] = d->start[d->count] + file_entry_set_size(file);
+                d->count++;
+            }
+        }
+        d->index_generation = d->generation;
+    }
+    return d;
+}
+
 // Add a dynamic file, returns index or -1 if full
 int vd_exfat_dir_add_file(vd_dynamic_file_t* file) {
     if (dynamic_file_count >= PICOVD_PARAM_MAX_DYNAMIC_FILES) return -1;
+    // The files of a subdirectory are on its volume
+    if (file->parent != NULL) {
+        file->lun = file->parent->lun;
+    }
+    // The entry set must fit in its directory
+    directory_t *d = directory_of_file(file);
+    if (d == NULL) return -1;
+    const directory_t *index = directory_index_get(d);
+    if (index->start[index->count] + file_entry_set_size(file) > directory_size(d)) return -1;
+    // A subdirectory takes a free slot
+    if (file->file_attributes & FAT_FILE_ATTR_DIRECTORY) {
+        directory_t *sub = directory_find(file->lun, file);
+        for (size_t i = VD_LUN_COUNT; sub == NULL && i < DIRECTORY_COUNT; i++) {
+            if (directories[i].dir == NULL) {
+                sub = &directories[i];
+            }
+        }
+        if (sub == NULL) return -1;
+        sub->dir = file;
+        sub->generation++;
+    }
     dynamic_files[dynamic_file_count].file      = file;
     dynamic_files[dynamic_file_count].name_hash = vd_exfat_dirs_compute_name_hash(file->name, file->name_length);
+    if (file->creat_time_sec == 0) {
+        file->creat_time_sec = vd_time_now(&file->creat_time_10ms);
+    }
     vd_exfat_dir_update_file(file);
+    d->generation++;
+    vd_exfat_extents_changed();
     return (int)dynamic_file_count++;
 }
 
-int vd_exfat_dir_update_file(vd_dynamic_file_t* file) {
-    absolute_time_t now = get_absolute_time();
-    uint64_t us = to_us_since_boot(now);
-    uint32_t secs = us / 1000000;
+// Remove a dynamic file; the entry sets after it move up
+int vd_exfat_dir_remove_file(const vd_dynamic_file_t* file) {
+    for (size_t i = 0; i < dynamic_file_count; i++) {
+        if (dynamic_files[i].file == file) {
+            memmove(&dynamic_files[i], &dynamic_files[i + 1],
+                    (dynamic_file_count - i - 1) * sizeof(dynamic_files[0]));
+            dynamic_file_count--;
+            vd_exfat_extents_changed();
+            directory_t *d = directory_of_file(file);
+            if (d != NULL) {
+                d->generation++;
+            }
+            if (file->file_attributes & FAT_FILE_ATTR_DIRECTORY) {
+                directory_t *sub = directory_find(file->lun, file);
+                if (sub != NULL) {
+                    sub->dir = NULL;
+                }
+            }
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+// Note a change to the entry set of a file, e.g. its size.  Returns the
+// first LBA of the directory that lists the file, and its length in sectors.
+uint32_t vd_exfat_dir_file_changed(const vd_dynamic_file_t *file, uint32_t *sectors) {
+    vd_exfat_extents_changed(); // Its size may have changed
+    directory_t *d = directory_of_file(file);
+    if (d == NULL || is_root_directory(d)) {
+        if (d != NULL) {
+            d->generation++;
+        }
+        *sectors = EXFAT_ROOT_DIR_LENGTH_SECTORS;
+        return EXFAT_ROOT_DIR_START_LBA;
+    }
+    d->generation++;
+    *sectors = d->dir->size_bytes / EXFAT_BYTES_PER_SECTOR;
+    return EXFAT_CLUSTER_TO_LBA(d->dir->first_cluster);
+}
 
-    file->mod_time_sec = secs;
+// Return the nth dynamic file, in directory order, or NULL
+const vd_dynamic_file_t *vd_exfat_dir_get_file(size_t idx) {
+    return idx < dynamic_file_count ? dynamic_files[idx].file : NULL;
+}
+
+int vd_exfat_dir_update_file(vd_dynamic_file_t* file) {
+    file->mod_time_sec = vd_time_now(&file->mod_time_10ms);
     return 0;
 }
 
 
 // ---------------------------------------------------------------------------
-// Generate a slice of a root directory sector, as requested by the MSC layer.
-// This function is used for dynamically generated entries, mainly partitions.
+// Entry sets of the dynamic files and subdirectories, shared by the root
+// directory and the subdirectories.
 // ---------------------------------------------------------------------------
 
 // Buffer for a dynamically generated entry set. Cleared on each call.
 static exfat_root_dir_entries_dynamic_file_t directory_entry_set_buffer;
 
-#ifndef __INTELLISENSE__
-_Static_assert(sizeof(exfat_root_dir_entries_dynamic_file_t) % CFG_TUD_MSC_EP_BUFSIZE == 0,
-              "Dynamic entry-set must be a multiple of MSC EP buffer size");
-#endif
-
 static bool build_file_entry_set(const vd_dynamic_file_t *file, exfat_root_dir_entries_dynamic_file_t *des) {
     assert(file != NULL);
     memset(des, 0x00, sizeof(*des));
 
     // (1) Prepare the file directory entry
+    const size_t name_length  = file_name_length(file);
+    const size_t name_entries = (name_length + 14) / 15;
+
     des->file_directory.entry_type = exfat_entry_type_file_directory;
-    des->file_directory.secondary_count = 2; // 1 stream + 1 name entry, to be adjusted if needed)
+    des->file_directory.secondary_count = 1 + name_entries; // 1 stream + name entries
     des->file_directory.file_attributes = file->file_attributes;
 
     // Set timestamps (convert from time_t to exFAT format)
-    // For now, use fixed date/time if not set
-    des->file_directory.creat_time = vd_exfat_dirs_make_timestamp(file->creat_time_sec);
+    des->file_directory.creat_time = vd_time_exfat_timestamp(file->creat_time_sec);
     // Use the file's modification time for last_mod_time, not creation time
-    des->file_directory.last_mod_time = vd_exfat_dirs_make_timestamp(file->mod_time_sec);
-    des->file_directory.last_acc_time = vd_exfat_dirs_make_timestamp(file->mod_time_sec);
+    des->file_directory.last_mod_time = vd_time_exfat_timestamp(file->mod_time_sec);
+    des->file_directory.last_acc_time = des->file_directory.last_mod_time;
+    des->file_directory.creat_time_ms =
+        vd_exfat_dirs_make_10ms_increment(file->creat_time_sec, file->creat_time_10ms);
+    des->file_directory.last_mod_time_ms =
+        vd_exfat_dirs_make_10ms_increment(file->mod_time_sec, file->mod_time_10ms);
     des->file_directory.creat_time_off    = exfat_utc_offset_UTC;
     des->file_directory.last_mod_time_off = exfat_utc_offset_UTC;
     des->file_directory.last_acc_time_off = exfat_utc_offset_UTC;
@@ -237,59 +408,103 @@ static bool build_file_entry_set(const vd_dynamic_file_t *file, exfat_root_dir_e
     // (2) Prepare the stream extension entry
     des->stream_extension.entry_type = exfat_entry_type_stream_extension;
     des->stream_extension.secondary_flags = 0x03;   // always 'valid data length' + 'no FAT' XXX FIXME
-    des->stream_extension.name_length = file->name_length;
+    des->stream_extension.name_length = name_length;
     des->stream_extension.valid_data_length = file->size_bytes;
     des->stream_extension.data_length = file->size_bytes;
     des->stream_extension.first_cluster = file->first_cluster;
-    des->stream_extension.name_hash = vd_exfat_dirs_compute_name_hash(file->name, file->name_length);
-
-    // (3) Prepare the file name entries (only one for now)
-    des->file_name[0].entry_type = exfat_entry_type_file_name;
-    memcpy(des->file_name[0].file_name, file->name, file->name_length * sizeof(char16_t));
-    // Mark extra entries as unused
-    for (size_t i = 1; i < sizeof(des->file_name) / sizeof(des->file_name[0]); ++i) {
-        des->file_name[i].entry_type = exfat_entry_type_unused;
+    des->stream_extension.name_hash = vd_exfat_dirs_compute_name_hash(file->name, name_length);
+
+    // (3) Prepare the file name entries, 15 code units each
+    for (size_t i = 0; i < name_entries; ++i) {
+        const size_t chars = (name_length - i * 15 < 15) ? name_length - i * 15 : 15;
+        des->file_name[i].entry_type = exfat_entry_type_file_name;
+        memcpy(des->file_name[i].file_name, file->name + i * 15, chars * sizeof(char16_t));
     }
+
+    des->file_directory.set_checksum = exfat_dirs_compute_setchecksum(
+        (const uint8_t *)des, (size_t)((1 + des->file_directory.secondary_count) * 32));
     return true;
 }
 
-static int32_t  current_slot_idx = -1;  ///< partition index currently in slot_buf
+// ---------------------------------------------------------------------------
+// Generate a slice of the packed dynamic entry sets of a directory, at byte
+// pos from its start, past the compile-time entries of a root directory.
+// ---------------------------------------------------------------------------
+static void directory_dynamic_entries(directory_t *d, uint32_t pos, uint8_t *buf, uint32_t len) {
+    const directory_t *index = directory_index_get(d);
+
+    assert(pos >= index->start[0]);
+
+    // Binary search for the first entry set that ends after pos
+    uint32_t lo = 0, hi = index->count;
+    while (lo < hi) {
+        const uint32_t mid = (lo + hi) / 2;
+        if (index->start[mid + 1] <= pos) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    // Copy the entry sets overlapping the slice
+    for (uint32_t i = lo; i < index->count && len > 0; i++) {
+        build_file_entry_set(index->file[i], &directory_entry_set_buffer);
+        uint32_t copy_len = index->start[i + 1] - pos;
+        if (copy_len > len) {
+            copy_len = len;
+        }
+        memcpy(buf, (const uint8_t *)&directory_entry_set_buffer + (pos - index->start[i]), copy_len);
+        buf += copy_len;
+        pos += copy_len;
+        len -= copy_len;
+    }
+
+    // End-of-directory entries from the high-water mark on, so that the
+    // host stops its scan there instead of reading the whole directory.
+    // Added files move the mark; the host sees them after the next remount.
+    memset(buf, exfat_entry_type_end_of_directory, len);
+}
 
 // ---------------------------------------------------------------------------
-// Generate a slice of a *dynamic* root-directory sector
+// Generate a slice of the root directory, as requested by the MSC layer.
 // ---------------------------------------------------------------------------
-int32_t exfat_generate_root_dir_dynamic_sector(uint32_t lba, uint32_t offset, void* buf, uint32_t bufsize) {
+int32_t exfat_generate_root_dir_sector(uint32_t lba, uint32_t offset, void* buffer, uint32_t bufsize) {
+
+    assert(lba >= EXFAT_ROOT_DIR_START_LBA);
 
-    assert(lba > EXFAT_ROOT_DIR_START_LBA &&
-           lba < EXFAT_ROOT_DIR_START_LBA + EXFAT_ROOT_DIR_LENGTH_SECTORS);
-    assert(bufsize <= EXFAT_BYTES_PER_SECTOR);
-    assert(offset   < EXFAT_BYTES_PER_SECTOR);
+    const uint8_t lun = vd_virtual_disk_current_lun();
+    uint8_t *buf = (uint8_t *)buffer;
+    uint32_t pos = (lba - EXFAT_ROOT_DIR_START_LBA) * EXFAT_BYTES_PER_SECTOR + offset;
+    uint32_t end = pos + bufsize;
 
-    // slot 0 starts at (EXFAT_ROOT_DIR_START_LBA + 1)
-    uint32_t slot_idx = lba - EXFAT_ROOT_DIR_START_LBA - 1u;
+    assert(end <= EXFAT_ROOT_DIR_LENGTH_BYTES);
 
-    bool ok = false;
-    if (slot_idx < dynamic_file_count) {
-        ok = build_file_entry_set(dynamic_files[slot_idx].file, &directory_entry_set_buffer);
-    } else {
-        ok = false;
+    const uint32_t fixed_size = root_dir_fixed_size(lun);
+    if (pos < fixed_size) {
+        const uint32_t len = (end < fixed_size ? end : fixed_size) - pos;
+        root_dir_fixed_entries(lun, pos, buf, len);
+        buf += len;
+        pos += len;
     }
-    if (ok) {
-        const uint16_t checksum = exfat_dirs_compute_setchecksum(
-            (const uint8_t *)&directory_entry_set_buffer,
-            (size_t)((1 + directory_entry_set_buffer.file_directory.secondary_count) * 32));
-        directory_entry_set_buffer.file_directory.set_checksum = checksum;
-        current_slot_idx = slot_idx;
-    } else {
-        current_slot_idx = -1;
+    if (pos < end) {
+        directory_dynamic_entries(directory_find(lun, NULL), pos, buf, end - pos);
     }
+    return bufsize;
+}
 
-    // Copy the requested slice. XXX HACK: We assume maybe too much,
-    // but we do static_assert that the entry set is a multiple of CFG_TUD_MSC_EP_BUFSIZE bytes.
-    if (current_slot_idx >= 0 && offset < sizeof(directory_entry_set_buffer)) {
-        memcpy(buf, ((uint8_t *)&directory_entry_set_buffer) + offset, bufsize);
-    } else {
-        memset(buf, exfat_entry_type_unused, bufsize); // Fill with unused entries
+// ---------------------------------------------------------------------------
+// Generate a slice of a subdirectory, at byte offset from its start, as
+// requested by the dynamic area handler for the clusters of the directory.
+// ---------------------------------------------------------------------------
+int32_t exfat_generate_subdir(const vd_dynamic_file_t *dir, uint32_t offset, void* buffer, uint32_t bufsize) {
+    assert(offset + bufsize <= dir->size_bytes);
+
+    directory_t *d = directory_find(dir->lun, dir);
+    if (d == NULL) {
+        // Removed: an empty directory, until the host notices
+        memset(buffer, exfat_entry_type_end_of_directory, bufsize);
+        return bufsize;
     }
+    directory_dynamic_entries(d, offset, (uint8_t *)buffer, bufsize);
     return bufsize;
 }
@@ -8,33 +8,12 @@
 #include "vd_exfat.h"
 #include "vd_exfat_dirs.h"
 
-// Compile-time directory entries for SRAM.BIN
-#if PICOVD_SRAM_ENABLED
-PICOVD_DEFINE_FILE_STATIC(
-    exfat_root_dir_sram_file_data,
-    PICOVD_SRAM_FILE_NAME,
-    PICOVD_SRAM_START_CLUSTER,
-    PICOVD_SRAM_SIZE_BYTES
-);
-#endif // PICOVD_SRAM_ENABLED
-
-// Compile-time directory entries for BOOTROM.BIN
-#if PICOVD_BOOTROM_ENABLED
-
-PICOVD_DEFINE_FILE_STATIC(
-    exfat_root_dir_bootrom_file_data,
-    PICOVD_BOOTROM_FILE_NAME,
-    PICOVD_BOOTROM_START_CLUSTER,
-    PICOVD_BOOTROM_SIZE_BYTES
-);
-#endif // PICOVD_BOOTROM_ENABLED
-
-// Compile-time directory entries for FLASH.BIN
-#if PICOVD_FLASH_ENABLED
-PICOVD_DEFINE_FILE_STATIC(
-    exfat_root_dir_flash_file_data,
-    PICOVD_FLASH_FILE_NAME,
-    PICOVD_FLASH_START_CLUSTER,
-    PICOVD_FLASH_SIZE_BYTES
-);
-#endif // PICOVD_FLASH_ENABLED
+// Compile-time directory entries for the memory region files (BOOTROM.BIN, FLASH.BIN, ...)
+#define VD_MEMORY_REGION_FILE(id, CFG)          \
+    PICOVD_DEFINE_FILE_STATIC(                  \
+        exfat_root_dir_ ## id ## _file_data,    \
+        PICOVD_ ## CFG ## _FILE_NAME,           \
+        PICOVD_ ## CFG ## _START_CLUSTER,       \
+        PICOVD_ ## CFG ## _SIZE_BYTES           \
+    );
+PICOVD_MEMORY_REGIONS(VD_MEMORY_REGION_FILE)
@@ -88,15 +88,16 @@ typedef struct __packed exfat_root_dir_entries_first {
     exfat_volume_label_dir_entry_t      volume_label;
     exfat_allocation_bitmap_dir_entry_t allocation_bitmap;
     exfat_upcase_table_dir_entry_t      upcase_table;
+    exfat_volume_guid_dir_entry_t       volume_guid;
 } exfat_root_dir_entries_first_t;
 
-STATIC_ASSERT_PACKED(sizeof(exfat_root_dir_entries_first_t) == 3 * 32, "must be 3 * 32 bytes");
+STATIC_ASSERT_PACKED(sizeof(exfat_root_dir_entries_first_t) == 4 * 32, "must be 4 * 32 bytes");
 
 /// exFAT timestamp field (32 bits; see Table 29 §7.4.8)
 typedef uint32_t exfat_timestamp_t;
 
 /// §7.4.9 “10msIncrement Fields"
-/// These fields are not used in this read-only volume (always zero).
+/// Filled for the dynamic files, see vd_exfat_dirs_make_10ms_increment(); zero for the static ones.
 
 /// §7.4.10 “UtcOffset Fields" (signed 15-minute increments, Table 31)
 /// We only support UTC (offset = 0 minutes).
@@ -153,25 +154,17 @@ typedef struct __packed {
 STATIC_ASSERT_PACKED(sizeof(exfat_file_name_dir_entry_t) == 32,
     "File Name exFAT directory entry must be 32 bytes");
 
-/// Compile time generated exFAT root directory entry sets
-typedef struct __packed vd_static_file_s {
-    exfat_file_directory_dir_entry_t      file_dir_entry;
-    exfat_stream_extension_dir_entry_t    stream_extension_entry;
-    exfat_file_name_dir_entry_t           file_name_entry;
-} vd_static_file_t;
-STATIC_ASSERT_PACKED(sizeof(vd_static_file_t) == 3 * 32,
-    "Fixed exFAT file/directory entry set length must be == 3 * 32 bytes");
+/// File Name entries for the longest exFAT name, 255 characters
+#define EXFAT_FILE_NAME_MAX_ENTRIES 17
 
 /// Dynamically generated exFAT root directory entry sets
 typedef struct __packed exfat_root_dir_entries_dynamic_file {
     exfat_file_directory_dir_entry_t      file_directory;    // 32 bytes
     exfat_stream_extension_dir_entry_t    stream_extension;  // 32 bytes
-    exfat_file_name_dir_entry_t           file_name[10];      // 10 * 32 bytes, 9 * 15 chars > 127 chars
+    exfat_file_name_dir_entry_t           file_name[EXFAT_FILE_NAME_MAX_ENTRIES]; // 17 * 15 = 255 chars
 } exfat_root_dir_entries_dynamic_file_t;
-STATIC_ASSERT_PACKED(sizeof(exfat_root_dir_entries_dynamic_file_t) == 12 * 32,
-    "Dynamic exFAT file/directory entry set length must be == 12 * 32 bytes");
-STATIC_ASSERT_PACKED(sizeof(exfat_root_dir_entries_dynamic_file_t) % CFG_TUD_MSC_EP_BUFSIZE == 0,
-    "Dynamic exFAT file/directory entry set length must be a multiple of MSC EP buffer size");
+STATIC_ASSERT_PACKED(sizeof(exfat_root_dir_entries_dynamic_file_t) == 19 * 32,
+    "Dynamic exFAT file/directory entry set length must be == 19 * 32 bytes");
 
 #ifdef __cplusplus
 #define static_cast(type) static_cast<type>
@@ -182,10 +175,11 @@ STATIC_ASSERT_PACKED(sizeof(exfat_root_dir_entries_dynamic_file_t) % CFG_TUD_MSC
 
 
 /// Compute the name hash for an exFAT file name.
+/// The hash is over the up-cased name, see §7.6.4; our up-case table maps a-z only.
 static constexpr inline uint16_t vd_exfat_dirs_compute_name_hash(const char16_t *name, size_t len) {
     uint16_t hash = 0;
     for (size_t i = 0; i < len; ++i) {
-        char16_t wc = name[i];
+        char16_t wc = (name[i] >= u'a' && name[i] <= u'z') ? static_cast(char16_t)(name[i] - u'a' + u'A') : name[i];
         uint8_t lo = static_cast(uint8_t)(wc & 0xFF);
         uint8_t hi = static_cast(uint8_t)((wc >> 8) & 0xFF);
         hash = static_cast(uint16_t)(((hash & 1) ? 0x8000 : 0) + (hash >> 1) + lo);
@@ -194,77 +188,114 @@ static constexpr inline uint16_t vd_exfat_dirs_compute_name_hash(const char16_t
     return hash;
 }
 
-// Helper functions for exFAT timestamp computation
-static constexpr inline bool vd_exfat_dirs_is_leap_year(int year) {
-    return ((year % 4 == 0) && (year % 100 != 0)) || (year % 400 == 0);
+// Helper functions for exFAT timestamp computation, in constant time
+
+/// The first second an exFAT timestamp can express, 1980-01-01 00:00:00 UTC
+#define VD_EXFAT_DIRS_EPOCH_1980 (315532800)
+
+/// Date bits of an exFAT timestamp (Table 29 §7.4.8), from days since 1970-01-01,
+/// from 1980 on.  The civil_from_days() algorithm of H. Hinnant: the year starts
+/// on March 1, so that the leap day is the last day of the year, and the days
+/// are split into 400-year eras of 146097 days.
+static constexpr inline exfat_timestamp_t vd_exfat_dirs_make_date(uint32_t days) {
+    const uint32_t z     = days + 719468;  // Days since 0000-03-01
+    const uint32_t era   = z / 146097;
+    const uint32_t doe   = z - era * 146097;                                    // [0, 146096]
+    const uint32_t yoe   = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365; // [0, 399]
+    const uint32_t doy   = doe - (365 * yoe + yoe / 4 - yoe / 100);             // [0, 365]
+    const uint32_t mp    = (5 * doy + 2) / 153;                                 // 0 = March
+    const uint32_t day   = doy - (153 * mp + 2) / 5 + 1;
+    const uint32_t month = mp < 10 ? mp + 3 : mp - 9;
+    const uint32_t year  = era * 400 + yoe + (month <= 2);
+    return ((year - 1980)   & 0x7F) << 25
+         | (month           & 0x0F) << 21
+         | (day             & 0x1F) << 16;
 }
 
-static constexpr inline int vd_exfat_dirs_days_in_year(int year) {
-    return 365 + vd_exfat_dirs_is_leap_year(year);
+/// Time bits of an exFAT timestamp, from seconds since midnight, rounded down to even
+static constexpr inline exfat_timestamp_t vd_exfat_dirs_make_time(uint32_t seconds) {
+    return ((seconds / 3600)      & 0x1F) << 11
+         | ((seconds / 60 % 60)   & 0x3F) <<  5
+         | ((seconds % 60 / 2)    & 0x1F) <<  0;
 }
 
-static constexpr inline int vd_exfat_dirs_days_in_month(int year, int month) {
-    // month: 0=Jan, ..., 11=Dec
-    if (month == 1) { // February
-        return vd_exfat_dirs_is_leap_year(year) ? 29 : 28;
-    }
-    // April, June, September, November have 30 days
-    if (month == 3 || month == 5 || month == 8 || month == 10) {
-        return 30;
-    }
-    // All others have 31 days
-    return 31;
+/// Create an exFAT 32-bit timestamp from Unix epoch seconds (Table 29 §7.4.8).
+/// Times before 1980 are clamped to 1980-01-01 00:00:00.
+static constexpr inline exfat_timestamp_t vd_exfat_dirs_make_timestamp(time_t epoch_seconds) {
+    const time_t t = epoch_seconds < VD_EXFAT_DIRS_EPOCH_1980 ? VD_EXFAT_DIRS_EPOCH_1980 : epoch_seconds;
+    return vd_exfat_dirs_make_date(static_cast(uint32_t)(t / 86400))
+         | vd_exfat_dirs_make_time(static_cast(uint32_t)(t % 86400));
 }
 
-static constexpr inline struct tm vd_exfat_dirs_make_tm(time_t epoch_seconds) {
-    struct tm tm = {0};
-    int days = epoch_seconds / 86400;
-    int rem  = epoch_seconds % 86400;
-
-    tm.tm_hour = rem / 3600;
-    rem = rem % 3600;
-    tm.tm_min = rem / 60;
-    tm.tm_sec = rem % 60;
-
-    // Start from 1970
-    int year = 1970;
-    for (int ydays = vd_exfat_dirs_days_in_year(year); days >= ydays; ydays = vd_exfat_dirs_days_in_year(year)) {
-        days -= ydays;
-        year++;
-    }
-    tm.tm_year = year - 1900;
+/// 10msIncrement field (§7.4.9) of Unix epoch seconds and the hundredths past them:
+/// the odd second the timestamp rounds down, and the hundredths, 0 to 199
+static constexpr inline uint8_t vd_exfat_dirs_make_10ms_increment(time_t epoch_seconds, uint8_t hundredths) {
+    return epoch_seconds < VD_EXFAT_DIRS_EPOCH_1980 ? 0
+         : static_cast(uint8_t)((epoch_seconds & 1) * 100 + hundredths % 100);
+}
 
-    // Now find the month
-    int month = 0;
-    for (int mdays = vd_exfat_dirs_days_in_month(year, month); days >= mdays; mdays = vd_exfat_dirs_days_in_month(year, month)) {
-        days -= mdays;
-        month++;
-    }
-    tm.tm_mon = month;
-    tm.tm_mday = days + 1;
 
-    return tm;
+#ifdef __cplusplus
+/// Compile time generated exFAT entry set of a static file, with a name of L characters,
+/// see PICOVD_DEFINE_FILE_STATIC.  The sets are packed back to back in the root directory.
+template<size_t L>
+struct __packed vd_static_file_entries {
+    static_assert(L >= 1 && L <= 255, "exFAT file names must be 1 to 255 characters");
+    exfat_file_directory_dir_entry_t      file_dir_entry;
+    exfat_stream_extension_dir_entry_t    stream_extension_entry;
+    exfat_file_name_dir_entry_t           file_name_entries[(L + 14) / 15];
+};
+
+/// SetChecksum of an entry set at compile time, as exfat_dirs_compute_setchecksum()
+template<typename T>
+static constexpr inline uint16_t vd_exfat_dirs_compute_setchecksum(const T &set) {
+    struct bytes { uint8_t b[sizeof(T)]; };
+    const bytes entries = __builtin_bit_cast(bytes, set);
+    uint16_t sum = 0;
+    for (size_t i = 0; i < sizeof(T); i++) {
+        if (i == 2 || i == 3)
+            continue;
+        sum = static_cast<uint16_t>(((sum & 0x0001) ? 0x8000 : 0) + (sum >> 1) + entries.b[i]);
+    }
+    return sum;
 }
 
-/// Create an exFAT 32-bit timestamp from Unix epoch seconds (Table 29 §7.4.8)
-static constexpr inline exfat_timestamp_t vd_exfat_dirs_make_timestamp(time_t epoch_seconds) {
-    // exFAT timestamp fields: year (>=1980), month: 1-12, day:1-31, hour:0-23, minute:0-59, second:0-59 (rounded down to even)
-    const struct tm tm = vd_exfat_dirs_make_tm(epoch_seconds);
-
-    const unsigned year   = (tm.tm_year + 1900) < 1980 ? 1980 : (tm.tm_year + 1900);
-    const unsigned month  = tm.tm_mon + 1;
-    const unsigned day    = tm.tm_mday;
-    const unsigned hour   = tm.tm_hour;
-    const unsigned minute = tm.tm_min;
-    const unsigned second = tm.tm_sec;
-    return ((year - 1980)   & 0x7F) << 25
-         | (month           & 0x0F) << 21
-         | (day             & 0x1F) << 16
-         | (hour            & 0x1F) << 11
-         | (minute          & 0x3F) <<  5
-         | ((second / 2)    & 0x1F) <<  0;
-}
+/// Build the entry set of a static file, including its name hash and SetChecksum
+template<size_t N>
+static constexpr inline vd_static_file_entries<N - 1> vd_exfat_dirs_make_static_file(
+        const char16_t (&name)[N], uint32_t first_cluster, uint64_t size_bytes, exfat_timestamp_t time) {
+    constexpr size_t name_length = N - 1; // Without the terminating NUL
+    vd_static_file_entries<name_length> set{};
+
+    set.file_dir_entry.entry_type        = exfat_entry_type_file_directory;
+    set.file_dir_entry.secondary_count   = 1 + (name_length + 14) / 15; // 1 stream + name entries
+    set.file_dir_entry.file_attributes   = FAT_FILE_ATTR_READ_ONLY;
+    set.file_dir_entry.creat_time        = time;
+    set.file_dir_entry.last_mod_time     = time;
+    set.file_dir_entry.last_acc_time     = time;
+    set.file_dir_entry.creat_time_off    = exfat_utc_offset_UTC;
+    set.file_dir_entry.last_mod_time_off = exfat_utc_offset_UTC;
+    set.file_dir_entry.last_acc_time_off = exfat_utc_offset_UTC;
+
+    set.stream_extension_entry.entry_type        = exfat_entry_type_stream_extension;
+    set.stream_extension_entry.secondary_flags   = 0x03; // AllocationPossible | NoFatChain
+    set.stream_extension_entry.name_length       = name_length;
+    set.stream_extension_entry.name_hash         = vd_exfat_dirs_compute_name_hash(name, name_length);
+    set.stream_extension_entry.valid_data_length = size_bytes;
+    set.stream_extension_entry.first_cluster     = first_cluster;
+    set.stream_extension_entry.data_length       = size_bytes;
+
+    for (size_t i = 0; i < (name_length + 14) / 15; i++) {
+        set.file_name_entries[i].entry_type = exfat_entry_type_file_name;
+    }
+    for (size_t i = 0; i < name_length; i++) {
+        set.file_name_entries[i / 15].file_name[i % 15] = name[i];
+    }
 
+    set.file_dir_entry.set_checksum = vd_exfat_dirs_compute_setchecksum(set);
+    return set;
+}
+#endif
 
 
 #ifdef __cplusplus
@@ -275,6 +306,10 @@ extern "C" {
 
 int vd_exfat_dir_add_file(vd_dynamic_file_t* file); // >= 0 if success, -1 if error
 int vd_exfat_dir_update_file(vd_dynamic_file_t* file);    // >= 0 if success, -1 if error
+int vd_exfat_dir_remove_file(const vd_dynamic_file_t* file); // >= 0 if success, -1 if not found
+const vd_dynamic_file_t *vd_exfat_dir_get_file(size_t idx); // NULL if no such file
+uint32_t vd_exfat_dir_file_changed(const vd_dynamic_file_t *file, uint32_t *sectors); // LBA of its directory
+int32_t exfat_generate_subdir(const vd_dynamic_file_t *dir, uint32_t offset, void* buf, uint32_t bufsize);
 
 #ifdef __cplusplus
 }
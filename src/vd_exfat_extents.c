@@ -0,0 +1,256 @@
+/**
+ * @file src/vd_exfat_extents.c
+ * @brief exFAT Allocation Bitmap and FAT for PicoVD, generated from the file extents.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <assert.h>
+#include <string.h>
+
+#include <tusb.h>
+
+#include "picovd_config.h"
+
+#include "vd_virtual_disk.h"
+#include "vd_exfat_params.h"
+#include "vd_exfat.h"
+#include "vd_exfat_dirs.h"
+
+// ---------------------------------------------------------------------------
+// Extents of the allocated clusters.
+//
+// The Allocation Bitmap and the FAT are never stored, but generated on each
+// read from a per-volume index of the allocated clusters: a sorted list of
+// disjoint extents, rebuilt lazily after the files have changed, from
+//   - the metadata: the bitmap itself, the up-case table and the root directory,
+//   - the compile-time files, from their entry sets in the linker section,
+//   - the dynamic files and subdirectories, DataLength rounded up to clusters.
+// Clusters reserved for a dynamic file beyond its current size are free.
+//
+// Files may share clusters, e.g. the partitions within FLASH.BIN; their
+// overlapping extents are merged.  Adjacent extents are kept apart, as
+// each one is a cluster chain of its own in the FAT.
+//
+// A slice of a bitmap or FAT sector is answered by a binary search for the
+// first extent overlapping it; only the extents in the slice are then filled in.
+// ---------------------------------------------------------------------------
+
+#ifndef PICOVD_PARAM_MAX_DYNAMIC_FILES
+#define PICOVD_PARAM_MAX_DYNAMIC_FILES 12
+#endif
+
+// Compile-time files, PICOVD_DEFINE_FILE_STATIC, including the memory region files
+#ifndef PICOVD_PARAM_MAX_STATIC_FILES
+#define PICOVD_PARAM_MAX_STATIC_FILES 8
+#endif
+
+#define EXTENTS_MAX (3 + PICOVD_PARAM_MAX_STATIC_FILES + PICOVD_PARAM_MAX_DYNAMIC_FILES)
+
+// First cluster after the cluster heap
+#define EXTENTS_END_CLUSTER (EXFAT_CLUSTER_HEAP_START_CLUSTER + EXFAT_CLUSTER_COUNT)
+
+typedef struct {
+    uint32_t first_cluster;
+    uint32_t end_cluster;   ///< Exclusive
+} extent_t;
+
+typedef struct {
+    uint32_t index_generation; ///< extents_generation the index was built at
+    uint16_t count;
+    extent_t extents[EXTENTS_MAX];
+} extent_index_t;
+
+static uint32_t       extents_generation = 1; ///< Changes to the extents of the files
+static extent_index_t extent_indices[VD_LUN_COUNT];
+
+// Provided by the linker, see vd_exfat_directory.c
+extern const uint8_t __start_flashdata_picovd_static_directory_entries[];
+extern const uint8_t __stop_flashdata_picovd_static_directory_entries[];
+
+void vd_exfat_extents_changed(void) {
+    extents_generation++;
+}
+
+// Insert an extent of size_bytes from first_cluster, keeping the list sorted by first cluster
+static void extent_index_add(extent_index_t *index, uint32_t first_cluster, uint64_t size_bytes) {
+    if (size_bytes == 0 || first_cluster < EXFAT_CLUSTER_HEAP_START_CLUSTER) {
+        return; // No clusters
+    }
+    const uint64_t end = first_cluster + (size_bytes + EXFAT_BYTES_PER_CLUSTER - 1) / EXFAT_BYTES_PER_CLUSTER;
+    assert(index->count < EXTENTS_MAX);
+    if (index->count >= EXTENTS_MAX) {
+        return;
+    }
+    size_t i = index->count++;
+    for (; i > 0 && index->extents[i - 1].first_cluster > first_cluster; i--) {
+        index->extents[i] = index->extents[i - 1];
+    }
+    index->extents[i] = (extent_t){
+        .first_cluster = first_cluster,
+        .end_cluster   = end < EXTENTS_END_CLUSTER ? (uint32_t)end : EXTENTS_END_CLUSTER,
+    };
+}
+
+static const extent_index_t *extent_index_get(uint8_t lun) {
+    extent_index_t *index = &extent_indices[lun];
+    if (index->index_generation == extents_generation) {
+        return index;
+    }
+    index->count = 0;
+
+    // The metadata, on every volume
+    extent_index_add(index, EXFAT_ALLOCATION_BITMAP_START_CLUSTER,
+        (uint64_t)EXFAT_ALLOCATION_BITMAP_LENGTH_CLUSTERS * EXFAT_BYTES_PER_CLUSTER);
+    extent_index_add(index, EXFAT_UPCASE_TABLE_START_CLUSTER,
+        (uint64_t)EXFAT_UPCASE_TABLE_LENGTH_CLUSTERS * EXFAT_BYTES_PER_CLUSTER);
+    extent_index_add(index, EXFAT_ROOT_DIR_START_CLUSTER, EXFAT_ROOT_DIR_LENGTH_BYTES);
+
+    // The compile-time files, on the static volume only
+    if (lun == VD_LUN_STATIC) {
+        const uint8_t *entry = __start_flashdata_picovd_static_directory_entries;
+        for (; entry < __stop_flashdata_picovd_static_directory_entries; entry += 32) {
+            if (entry[0] == exfat_entry_type_file_directory) {
+                const exfat_stream_extension_dir_entry_t *stream = (const exfat_stream_extension_dir_entry_t *)(entry + 32);
+                extent_index_add(index, stream->first_cluster, stream->data_length);
+            }
+        }
+    }
+
+    // The dynamic files and subdirectories of the volume
+    const vd_dynamic_file_t *file;
+    for (size_t i = 0; (file = vd_exfat_dir_get_file(i)) != NULL; i++) {
+        if (file->lun == lun) {
+            extent_index_add(index, file->first_cluster, file->size_bytes);
+        }
+    }
+
+    // Merge the overlapping extents
+    size_t n = 0;
+    for (size_t i = 0; i < index->count; i++) {
+        if (n > 0 && index->extents[i].first_cluster < index->extents[n - 1].end_cluster) {
+            if (index->extents[i].end_cluster > index->extents[n - 1].end_cluster) {
+                index->extents[n - 1].end_cluster = index->extents[i].end_cluster;
+            }
+        } else {
+            index->extents[n++] = index->extents[i];
+        }
+    }
+    index->count = n;
+    index->index_generation = extents_generation;
+    return index;
+}
+
+// Binary search for the first extent that ends after cluster
+static size_t extent_index_find(const extent_index_t *index, uint32_t cluster) {
+    uint32_t lo = 0, hi = index->count;
+    while (lo < hi) {
+        const uint32_t mid = (lo + hi) / 2;
+        if (index->extents[mid].end_cluster <= cluster) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// ---------------------------------------------------------------------------
+// Allocation Bitmap, see Microsoft spec §7.1.5 “Allocation Bitmap”.
+// Bit N of the bitmap is set iff cluster N + 2 is in an extent.
+// ---------------------------------------------------------------------------
+
+// Set bits [first, end) of a bitmap slice; whole bytes with memset,
+// the partial bytes at both ends with masks
+static void bitmap_set_bits(uint8_t *bits, uint32_t first, uint32_t end) {
+    const uint32_t first_byte = (first + 7) / 8;
+    const uint32_t end_byte   = end / 8;
+    if (first_byte > end_byte) {
+        // Within a single byte
+        bits[end_byte] |= (uint8_t)(((1u << (end - first)) - 1) << (first % 8));
+        return;
+    }
+    if (first % 8) {
+        bits[first_byte - 1] |= (uint8_t)(0xFF << (first % 8));
+    }
+    memset(bits + first_byte, 0xFF, end_byte - first_byte);
+    if (end % 8) {
+        bits[end_byte] |= (uint8_t)((1u << (end % 8)) - 1);
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Generate a slice of the Allocation Bitmap region
+// ---------------------------------------------------------------------------
+int32_t exfat_generate_bitmap_sector(uint32_t lba, uint32_t offset, void* buf, uint32_t bufsize) {
+    assert(lba >= EXFAT_ALLOCATION_BITMAP_START_LBA);
+
+    memset(buf, 0, bufsize);
+
+    // Clusters covered by the slice
+    const uint32_t pos   = (lba - EXFAT_ALLOCATION_BITMAP_START_LBA) * EXFAT_BYTES_PER_SECTOR + offset;
+    const uint32_t first = EXFAT_CLUSTER_HEAP_START_CLUSTER + pos * 8;
+    const uint32_t end   = first + bufsize * 8;
+
+    const extent_index_t *index = extent_index_get(vd_virtual_disk_current_lun());
+
+    for (size_t i = extent_index_find(index, first); i < index->count && index->extents[i].first_cluster < end; i++) {
+        const uint32_t from = index->extents[i].first_cluster > first ? index->extents[i].first_cluster : first;
+        const uint32_t to   = index->extents[i].end_cluster   < end   ? index->extents[i].end_cluster   : end;
+        bitmap_set_bits((uint8_t *)buf, from - first, to - first);
+    }
+    return bufsize;
+}
+
+// ---------------------------------------------------------------------------
+// FAT, see Microsoft spec §4.1 “First and Second FAT Sub-regions”.
+//
+// The files are contiguous, and their entry sets say NoFatChain, but some
+// hosts walk the FAT anyway.  Each extent is a chain: the entry of each of
+// its clusters points to the next one, and that of its last cluster is the
+// end of chain.  The entries of the free clusters are zero.
+// ---------------------------------------------------------------------------
+
+#define FAT_ENTRY_MEDIA       0xFFFFFFF8u // Cluster 0, the media type
+#define FAT_ENTRY_END_OF_CHAIN 0xFFFFFFFFu // Also cluster 1, reserved
+
+// ---------------------------------------------------------------------------
+// Generate a slice of the FAT region, whole entries only
+// ---------------------------------------------------------------------------
+int32_t exfat_generate_fat_sector(uint32_t lba, uint32_t offset, void* buf, uint32_t bufsize) {
+    assert(lba >= EXFAT_FAT_REGION_START_LBA);
+    assert(((uintptr_t)buf & 3) == 0);
+    assert((offset & 3) == 0);
+    assert((bufsize & 3) == 0);
+
+    uint32_t *fat = (uint32_t *)buf;
+    memset(buf, 0, bufsize);
+
+    // Clusters covered by the slice
+    const uint32_t first = ((lba - EXFAT_FAT_REGION_START_LBA) * EXFAT_BYTES_PER_SECTOR + offset) / sizeof(uint32_t);
+    const uint32_t end   = first + bufsize / sizeof(uint32_t);
+
+    if (first == 0) {
+        fat[0] = FAT_ENTRY_MEDIA;
+        if (end > 1) {
+            fat[1] = FAT_ENTRY_END_OF_CHAIN;
+        }
+    }
+
+    const extent_index_t *index = extent_index_get(vd_virtual_disk_current_lun());
+
+    for (size_t i = extent_index_find(index, first); i < index->count && index->extents[i].first_cluster < end; i++) {
+        const extent_t *extent = &index->extents[i];
+        const uint32_t from = extent->first_cluster > first ? extent->first_cluster : first;
+        const uint32_t to   = extent->end_cluster   < end   ? extent->end_cluster   : end;
+        // Each entry points to the next cluster; a plain loop, for the compiler to unroll
+        uint32_t *out = fat + (from - first);
+        for (uint32_t cluster = from + 1; cluster <= to; cluster++) {
+            *out++ = cluster;
+        }
+        if (to == extent->end_cluster) {
+            fat[to - 1 - first] = FAT_ENTRY_END_OF_CHAIN;
+        }
+    }
+    return bufsize;
+}
@@ -0,0 +1,148 @@
+#pragma once
+
+// Compile-time layout of the virtual exFAT volume, for the C++ sources only.
+//
+// vd_exfat_make_layout() computes every LBA and cluster number of the volume
+// from a handful of parameters: the disk size, the sector and cluster sizes,
+// and the lengths of the up-case table and the root directory.  In the
+// compact layout, see PICOVD_COMPACT_LAYOUT_ENABLED, the end of the heap is
+// given instead of the disk size, and the disk is sized to fit it.
+// vd_exfat_consts.cpp builds the boot sector from the result, and checks that
+// the EXFAT_* macros of vd_exfat_params.h, used by the C sources, agree with it,
+// and that the memory regions and the dynamic area fit in the volume.
+//
+// See doc/ExFAT-design.md, Section Cluster mapping.
+
+#ifndef __cplusplus
+#error "vd_exfat_layout.h is C++ only"
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct vd_exfat_layout_params {
+    uint64_t disk_size_bytes;
+    uint8_t  bytes_per_sector_shift;    // 9 or 12, see PICOVD_4KN_ENABLED
+    uint8_t  sectors_per_cluster_shift; // 3 or 0, for 4 KB clusters
+    uint32_t heap_alignment_clusters;   // The gap before the heap is a multiple of this
+    uint32_t upcase_table_clusters;
+    uint32_t root_dir_clusters;
+    uint32_t heap_end_cluster;          // If non-zero, the disk ends here, disk_size_bytes is ignored
+};
+
+struct vd_exfat_layout {
+    uint32_t bytes_per_sector;
+    uint32_t sectors_per_cluster;
+    uint32_t bytes_per_cluster;
+
+    uint64_t volume_length;        // Sectors, VolumeLength
+    uint32_t fat_offset;           // LBA, FATOffset
+    uint32_t fat_length;           // Sectors, FATLength
+    uint32_t heap_gap_clusters;    // Cluster N is at byte (gap + N) * cluster size
+    uint32_t cluster_heap_offset;  // LBA of cluster 2, ClusterHeapOffset
+    uint32_t cluster_count;        // ClusterCount
+
+    uint32_t bitmap_first_cluster;
+    uint32_t bitmap_clusters;
+    uint32_t upcase_first_cluster;
+    uint32_t upcase_clusters;
+    uint32_t root_dir_first_cluster;
+    uint32_t root_dir_clusters;
+
+    // First cluster after the metadata, where the files may start
+    constexpr uint32_t files_first_cluster() const {
+        return root_dir_first_cluster + root_dir_clusters;
+    }
+    // One past the last cluster of the heap
+    constexpr uint32_t end_cluster() const {
+        return 2 + cluster_count;
+    }
+    constexpr uint64_t cluster_to_lba(uint32_t cluster) const {
+        return cluster_heap_offset + (uint64_t)(cluster - 2) * sectors_per_cluster;
+    }
+};
+
+// A range of clusters given to the files, [first_cluster, end_cluster)
+struct vd_exfat_layout_region {
+    uint32_t first_cluster;
+    uint32_t end_cluster;
+};
+
+static constexpr inline uint64_t vd_exfat_layout_div_up(uint64_t n, uint64_t d) {
+    return (n + d - 1) / d;
+}
+
+static constexpr inline vd_exfat_layout vd_exfat_make_layout(const vd_exfat_layout_params &p) {
+    vd_exfat_layout l = {};
+    l.bytes_per_sector    = 1U << p.bytes_per_sector_shift;
+    l.sectors_per_cluster = 1U << p.sectors_per_cluster_shift;
+    l.bytes_per_cluster   = l.bytes_per_sector * l.sectors_per_cluster;
+
+    // §3.1.5: the FAT follows the Main and Backup Boot regions, 12 sectors each.
+    // It has an entry for each cluster of the whole disk, the gap included,
+    // or in the compact layout just for the heap.
+    l.fat_offset    = 2 * 12;
+    if (p.heap_end_cluster) {
+        l.fat_length = (uint32_t)vd_exfat_layout_div_up((uint64_t)p.heap_end_cluster * 4, l.bytes_per_sector);
+    } else {
+        l.volume_length = p.disk_size_bytes / l.bytes_per_sector;
+        l.fat_length    = (uint32_t)(p.disk_size_bytes / l.bytes_per_cluster * 4 / l.bytes_per_sector);
+    }
+
+    // The gap is the smallest multiple of the alignment that holds the boot
+    // regions and the FAT, so that with the default 1 GiB disk cluster N is
+    // at byte (0x1000 + N) * 4 KB and memory addresses map directly to LBAs
+    const uint64_t fat_end_clusters = vd_exfat_layout_div_up(l.fat_offset + l.fat_length, l.sectors_per_cluster);
+    l.heap_gap_clusters   = (uint32_t)(vd_exfat_layout_div_up(fat_end_clusters, p.heap_alignment_clusters)
+                                       * p.heap_alignment_clusters);
+    l.cluster_heap_offset = (l.heap_gap_clusters + 2) * l.sectors_per_cluster;
+    if (p.heap_end_cluster) {
+        l.cluster_count = p.heap_end_cluster - 2;
+        l.volume_length = (uint64_t)(l.heap_gap_clusters + p.heap_end_cluster) * l.sectors_per_cluster;
+    } else {
+        l.cluster_count = (uint32_t)vd_exfat_layout_div_up(l.volume_length - l.cluster_heap_offset,
+                                                           l.sectors_per_cluster);
+    }
+
+    // §7.1: one bit per cluster, in whole clusters, then the up-case table and the root directory
+    l.bitmap_first_cluster   = 2;
+    l.bitmap_clusters        = (uint32_t)vd_exfat_layout_div_up(vd_exfat_layout_div_up(l.cluster_count, 8),
+                                                                l.bytes_per_cluster);
+    l.upcase_first_cluster   = l.bitmap_first_cluster + l.bitmap_clusters;
+    l.upcase_clusters        = p.upcase_table_clusters;
+    l.root_dir_first_cluster = l.upcase_first_cluster + l.upcase_clusters;
+    l.root_dir_clusters      = p.root_dir_clusters;
+    return l;
+}
+
+// The FAT region holds an entry for each cluster, and ends before the cluster heap
+static constexpr inline bool vd_exfat_layout_fat_fits(const vd_exfat_layout &l) {
+    return (uint64_t)l.fat_length * l.bytes_per_sector >= (uint64_t)(l.cluster_count + 2) * 4
+        && l.fat_offset + l.fat_length <= l.cluster_heap_offset;
+}
+
+// The LBAs fit in READ (10), and the cluster count within the 16 M recommended by §3.1.9
+static constexpr inline bool vd_exfat_layout_addressable(const vd_exfat_layout &l) {
+    return l.volume_length <= UINT32_MAX
+        && l.volume_length > l.cluster_heap_offset
+        && l.cluster_count <= (1U << 24);
+}
+
+// The metadata clusters lie within the heap, and leave room for the files
+static constexpr inline bool vd_exfat_layout_metadata_fits(const vd_exfat_layout &l) {
+    return l.files_first_cluster() < l.end_cluster();
+}
+
+// The regions are in ascending cluster order, do not overlap each other or
+// the metadata, and end within the volume
+static constexpr inline bool vd_exfat_layout_regions_fit(const vd_exfat_layout &l,
+                                                         const vd_exfat_layout_region *regions, size_t count) {
+    uint32_t next_cluster = l.files_first_cluster();
+    for (size_t i = 0; i < count; i++) {
+        if (regions[i].first_cluster < next_cluster || regions[i].end_cluster < regions[i].first_cluster) {
+            return false;
+        }
+        next_cluster = regions[i].end_cluster;
+    }
+    return next_cluster <= l.end_cluster();
+}
@@ -4,6 +4,8 @@
 #include <tusb_config.h>
 #include <assert.h>
 
+#include "picovd_config.h"
+
 #ifdef __cplusplus
   // C++11 and later: char16_t is a built-in type
 #else
@@ -15,14 +17,21 @@
 // Virtual disk parameters
 // -----------------------------------------------------------------------------
 
-// In theory, you should be able to change the parameters below
-// to create a larger or smaller virtual disk, with different sizes for the
-// allocation bitmap, up-case table, and root directory. However, the
-// current implementation has been tested only with this specific configuration,
-// so changing these parameters may lead to unexpected behavior or errors.
-
-// 1 GiB virtual disk size
-#define VIRTUAL_DISK_SIZE              (0x40000000)
+// The disk size and the lengths of the up-case table and the root directory
+// are the parameters of the layout; the rest of the macros below follow from them.
+// With PICOVD_COMPACT_LAYOUT_ENABLED, the end of the last memory region is
+// the parameter instead of the disk size, and the disk size follows from it.
+// vd_exfat_consts.cpp computes the same layout with vd_exfat_make_layout(),
+// see vd_exfat_layout.h, and fails the build if the two disagree, or if the
+// memory regions of picovd_config.h do not fit in the volume.
+
+#if PICOVD_COMPACT_LAYOUT_ENABLED
+#define VIRTUAL_DISK_SIZE              \
+  ((uint64_t)(EXFAT_CLUSTER_HEAP_GAP_CLUSTERS + EXFAT_CLUSTER_HEAP_START_CLUSTER + EXFAT_CLUSTER_COUNT) \
+    << EXFAT_BYTES_PER_CLUSTER_SHIFT)
+#else
+#define VIRTUAL_DISK_SIZE              (PICOVD_VIRTUAL_DISK_SIZE_BYTES)
+#endif
 
 #define EXFAT_UPCASE_TABLE_COMPRESSED  (1)
 
@@ -32,18 +41,27 @@
 // -----------------------------------------------------------------------------
 // USB MSC interface parameters
 // -----------------------------------------------------------------------------
-#define MSC_BLOCK_SIZE                  CFG_TUD_MSC_BUFSIZE   // (512)
+#define MSC_BLOCK_SIZE                  EXFAT_BYTES_PER_SECTOR // (512 or 4096), independent of the transfer size
 
-// Total blocks served by the Pico (256 K clusters × 8 sectors per cluster)
+// Total blocks served by the Pico (256 K clusters × 8 or 1 sectors per cluster, with 1 GiB)
 #define MSC_TOTAL_BLOCKS               (VIRTUAL_DISK_SIZE / MSC_BLOCK_SIZE)
 
 // -----------------------------------------------------------------------------
 // exFAT filesystem constants (compile-time parameters)
 // -----------------------------------------------------------------------------
 
+// The cluster is always 4 KB, one flash page.  With PICOVD_4KN_ENABLED
+// the sector is a whole cluster, otherwise a cluster has 8 sectors.
+#if PICOVD_4KN_ENABLED
+#define EXFAT_BYTES_PER_SECTOR_SHIFT    12U  // 2^12 = 4096
+#define EXFAT_SECTORS_PER_CLUSTER_SHIFT 0U   // 2^0 = 1
+#else
 #define EXFAT_BYTES_PER_SECTOR_SHIFT    9U   // 2^9 = 512
-#define EXFAT_BYTES_PER_SECTOR          (1U << EXFAT_BYTES_PER_SECTOR_SHIFT)
 #define EXFAT_SECTORS_PER_CLUSTER_SHIFT 3U   // 2^3 = 8
+#endif
+#define EXFAT_BYTES_PER_SECTOR          (1U << EXFAT_BYTES_PER_SECTOR_SHIFT)
+#define EXFAT_BYTES_PER_CLUSTER_SHIFT   (EXFAT_BYTES_PER_SECTOR_SHIFT + EXFAT_SECTORS_PER_CLUSTER_SHIFT)
+#define EXFAT_BYTES_PER_CLUSTER         (1U << EXFAT_BYTES_PER_CLUSTER_SHIFT)
 #define EXFAT_SECTORS_PER_CLUSTER       (1U << EXFAT_SECTORS_PER_CLUSTER_SHIFT)
 
 #define EXFAT_FILE_SYSTEM_VERSION_MAJOR 1U
@@ -58,31 +76,68 @@
 // Region start LBAs within the virtual disk
 // -----------------------------------------------------------------------------
 
+// The Main and Backup Boot regions are 12 sectors each, whatever the sector size
+#define EXFAT_BOOT_REGION_LENGTH          (12)
+
 // LBA of the first FAT sector (FATOffset in the boot sector)
-#define EXFAT_FAT_REGION_START_LBA        (0x18)
-#define EXFAT_FAT_REGION_LENGTH           (0x800)
+#define EXFAT_FAT_REGION_START_LBA        (2 * EXFAT_BOOT_REGION_LENGTH) // 0x18
+#if PICOVD_COMPACT_LAYOUT_ENABLED
+// One 4-byte entry for each cluster of the heap, and the two reserved ones
+#define EXFAT_FAT_REGION_LENGTH           \
+  (((EXFAT_CLUSTER_HEAP_START_CLUSTER + EXFAT_CLUSTER_COUNT) * 4 + EXFAT_BYTES_PER_SECTOR - 1) \
+    / EXFAT_BYTES_PER_SECTOR)
+#else
+// One 4-byte entry for each cluster of the whole disk: 0x800 or 0x100 sectors with 1 GiB
+#define EXFAT_FAT_REGION_LENGTH           \
+  ((VIRTUAL_DISK_SIZE >> EXFAT_BYTES_PER_CLUSTER_SHIFT) * 4 / EXFAT_BYTES_PER_SECTOR)
+#endif
 
 // LBA of the first data-cluster (ClusterHeapOffset in the boot sector)
-// Note the gap, see docs/ExFAT-design.md Section Cluster Mapping
+// Note the gap, see docs/ExFAT-design.md Section Cluster Mapping:
+// cluster N is at byte offset (0x1000 + N) * 4 KB, i.e. LBA 0x8010 or 0x1002
+// for cluster 2, so that memory addresses map directly to LBAs.
+// The gap is the smallest multiple of 0x1000 clusters (16 MiB) after the FAT;
+// from 16 GiB up the FAT does not fit in the first 16 MiB, and the
+// memory regions are then read with an offset instead.
+// With PICOVD_COMPACT_LAYOUT_ENABLED, the heap starts at the first cluster after the FAT.
 #define EXFAT_CLUSTER_HEAP_START_CLUSTER  (2) // Defined by MicroSoft
-#define EXFAT_CLUSTER_HEAP_START_LBA      (0x8010U)
+#if PICOVD_COMPACT_LAYOUT_ENABLED
+#define EXFAT_CLUSTER_HEAP_ALIGNMENT_CLUSTERS (1U)
+#else
+#define EXFAT_CLUSTER_HEAP_ALIGNMENT_CLUSTERS (0x1000U)
+#endif
+#define EXFAT_FAT_REGION_END_CLUSTERS     \
+  ((EXFAT_FAT_REGION_START_LBA + EXFAT_FAT_REGION_LENGTH + EXFAT_SECTORS_PER_CLUSTER - 1) \
+    >> EXFAT_SECTORS_PER_CLUSTER_SHIFT)
+#define EXFAT_CLUSTER_HEAP_GAP_CLUSTERS   \
+  ((EXFAT_FAT_REGION_END_CLUSTERS + EXFAT_CLUSTER_HEAP_ALIGNMENT_CLUSTERS - 1) \
+    / EXFAT_CLUSTER_HEAP_ALIGNMENT_CLUSTERS * EXFAT_CLUSTER_HEAP_ALIGNMENT_CLUSTERS)
+#define EXFAT_CLUSTER_HEAP_START_LBA      \
+  ((EXFAT_CLUSTER_HEAP_GAP_CLUSTERS + EXFAT_CLUSTER_HEAP_START_CLUSTER) << EXFAT_SECTORS_PER_CLUSTER_SHIFT)
+
+#if PICOVD_COMPACT_LAYOUT_ENABLED
+#define EXFAT_CLUSTER_COUNT               (PICOVD_COMPACT_END_CLUSTER - EXFAT_CLUSTER_HEAP_START_CLUSTER)
+#else
 #define EXFAT_CLUSTER_COUNT               \
   (((MSC_TOTAL_BLOCKS - EXFAT_CLUSTER_HEAP_START_LBA) + (EXFAT_SECTORS_PER_CLUSTER - 1)) \
     / EXFAT_SECTORS_PER_CLUSTER)
+#endif
 
 // Allocation-bitmap is always at cluster 2, so its LBA is the same as
 // EXFAT_CLUSTER_HEAP_START_LBA
 #define EXFAT_ALLOCATION_BITMAP_START_LBA EXFAT_CLUSTER_HEAP_START_LBA
+#if PICOVD_COMPACT_LAYOUT_ENABLED
+// The cluster count depends on where the files start, so the bitmap length is fixed
+#define EXFAT_ALLOCATION_BITMAP_LENGTH_CLUSTERS  (1U)
+#else
 #define EXFAT_ALLOCATION_BITMAP_LENGTH_CLUSTERS                      \
-    (((((EXFAT_CLUSTER_COUNT / 8)                                    \
+    ((((((EXFAT_CLUSTER_COUNT + 7) / 8)                              \
        + (EXFAT_BYTES_PER_SECTOR - 1)) / EXFAT_BYTES_PER_SECTOR)     \
       + (EXFAT_SECTORS_PER_CLUSTER - 1)) / EXFAT_SECTORS_PER_CLUSTER)
+#endif
 #define EXFAT_ALLOCATION_BITMAP_LENGTH_SECTORS   \
     (EXFAT_ALLOCATION_BITMAP_LENGTH_CLUSTERS * EXFAT_SECTORS_PER_CLUSTER)
 
-_Static_assert(EXFAT_ALLOCATION_BITMAP_LENGTH_CLUSTERS == 8,
-               "Allocation Bitmap is tested only with 8 clusters.");
-
 
 // Up-case Table region starts at after Allocation Bitmap, so its LBA is:
 #define EXFAT_UPCASE_TABLE_START_LBA       \
@@ -111,6 +166,10 @@ _Static_assert(EXFAT_ALLOCATION_BITMAP_LENGTH_CLUSTERS == 8,
 #define EXFAT_ROOT_DIR_LENGTH_SECTORS (        \
     EXFAT_ROOT_DIR_LENGTH_CLUSTERS * EXFAT_SECTORS_PER_CLUSTER)
 
+// The root directory is generated as packed entry sets, the same in both geometries
+#define EXFAT_ROOT_DIR_LENGTH_BYTES   \
+    (EXFAT_ROOT_DIR_LENGTH_CLUSTERS * EXFAT_BYTES_PER_CLUSTER)
+
 _Static_assert(EXFAT_ROOT_DIR_START_LBA
                == (EXFAT_ROOT_DIR_START_CLUSTER - 2) * EXFAT_SECTORS_PER_CLUSTER
                    + EXFAT_CLUSTER_HEAP_START_LBA,
@@ -137,9 +196,15 @@ _Static_assert(EXFAT_VOLUME_LABEL_LENGTH <= EXFAT_VOLUME_LABEL_MAX_LENGTH,
 // Compile-time assertions for configuration consistency
 // ---------------------------------------------------------------------
 
-_Static_assert(CFG_TUD_MSC_BUFSIZE == (1U << EXFAT_BYTES_PER_SECTOR_SHIFT),
-               "MSC block size must match with exFAT bytes per sector");
 _Static_assert((MSC_TOTAL_BLOCKS * MSC_BLOCK_SIZE) == VIRTUAL_DISK_SIZE,
                "Total blocks must match the virtual disk size");
 
+_Static_assert(EXFAT_FAT_REGION_START_LBA + EXFAT_FAT_REGION_LENGTH <= EXFAT_CLUSTER_HEAP_START_LBA,
+               "FAT region must end before the cluster heap");
+
+#if PICOVD_COMPACT_LAYOUT_ENABLED
+_Static_assert(EXFAT_CLUSTER_COUNT <= 8 * EXFAT_BYTES_PER_CLUSTER,
+               "A compact layout must fit in one cluster of allocation bitmap, 128 MiB");
+#endif
+
 #endif // VD_EXFAT_PARAMS_H
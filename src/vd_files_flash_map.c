@@ -0,0 +1,361 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+
+#include "picovd_config.h"
+
+#include "vd_virtual_disk.h"
+#include "vd_exfat_params.h"
+#include "vd_files_flash_map.h"
+
+#if PICOVD_FLASH_MAP_ENABLED
+
+// The flash is tracked in pages, one bit per page, set if the page contains
+// anything else than 0xFF.  The pages are scanned in blocks of 64 KiB,
+// one block per vd_files_flash_map_task() call, through the uncached XIP
+// alias, not to evict code from the XIP cache.  A block stays valid until
+// vd_files_flash_map_flash_changed() reports a change within it.
+//
+// FLASH.MAP lists the maximal runs of non-erased pages, the extents, as
+// fixed width text lines "0x<offset> 0x<length>\n".
+// FLASH.SPARSE has a vd_flash_sparse_header_t and the extent table,
+// padded to a sector, followed by the contents of the extents.
+//
+// Neither file stores the extents; they are walked from the page bitmap
+// on demand, with a cursor that makes sequential reads cheap.
+//
+// The blocks are rescanned into a second bitmap, and the files keep being
+// served from the published one until all stale blocks are rescanned; then
+// the bitmap, the counts and the file sizes are published together.
+
+#define PAGE_SIZE        PICOVD_FLASH_MAP_PAGE_SIZE_BYTES
+#define BLOCK_SIZE       PICOVD_FLASH_MAP_BLOCK_SIZE_BYTES
+#define PAGE_COUNT       (PICOVD_FLASH_SIZE_BYTES / PAGE_SIZE)
+#define BLOCK_COUNT      (PICOVD_FLASH_SIZE_BYTES / BLOCK_SIZE)
+#define PAGES_PER_BLOCK  (BLOCK_SIZE / PAGE_SIZE)
+
+#define MAP_LINE_LENGTH  (sizeof("0x00000000 0x00000000\n") - 1)
+
+static_assert(PICOVD_FLASH_SIZE_BYTES % BLOCK_SIZE == 0, "Flash size must be a multiple of the block size");
+static_assert(BLOCK_SIZE % PAGE_SIZE == 0, "Block size must be a multiple of the page size");
+static_assert(PAGES_PER_BLOCK <= 32, "A block must fit into a bitmap word");
+static_assert(32 % PAGES_PER_BLOCK == 0, "Blocks must not straddle bitmap words");
+
+static uint32_t page_bitmap[(PAGE_COUNT  + 31) / 32]; ///< Set for non-erased pages, as published
+static uint32_t scan_bitmap[(PAGE_COUNT  + 31) / 32]; ///< ...as scanned, published once complete
+static uint32_t block_valid[(BLOCK_COUNT + 31) / 32]; ///< Set for scanned blocks
+static uint32_t stale_blocks = BLOCK_COUNT;
+
+static bool flash_map_added    = false;
+static bool flash_sparse_added = false;
+
+// Totals, as published in the file sizes
+static uint32_t extent_count    = 0;
+static uint32_t populated_pages = 0;
+
+static int32_t flash_map_file_content_cb(uint32_t offset, void* buffer, uint32_t bufsize);
+static int32_t flash_sparse_file_content_cb(uint32_t offset, void* buffer, uint32_t bufsize);
+
+PICOVD_DEFINE_FILE_RUNTIME(
+    flash_map_file,
+    PICOVD_FLASH_MAP_FILE_NAME,
+    0, // initial size, set once the whole flash has been scanned
+    flash_map_file_content_cb
+);
+
+PICOVD_DEFINE_FILE_RUNTIME(
+    flash_sparse_file,
+    PICOVD_FLASH_SPARSE_FILE_NAME,
+    0, // initial size, set once the whole flash has been scanned
+    flash_sparse_file_content_cb
+);
+
+// Return true if the page contains anything else than 0xFF
+static bool flash_map_scan_page(uint32_t page) {
+    const uint32_t *words = (const uint32_t *)(XIP_NOCACHE_NOALLOC_BASE + page * PAGE_SIZE);
+    for (uint32_t i = 0; i < PAGE_SIZE / 4; i += 8) {
+        const uint32_t all = words[i + 0] & words[i + 1] & words[i + 2] & words[i + 3]
+                           & words[i + 4] & words[i + 5] & words[i + 6] & words[i + 7];
+        if (all != 0xFFFFFFFFu) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void flash_map_scan_block(uint32_t block) {
+    const uint32_t first_page = block * PAGES_PER_BLOCK;
+    uint32_t mask = 0;
+    for (uint32_t i = 0; i < PAGES_PER_BLOCK; i++) {
+        if (flash_map_scan_page(first_page + i)) {
+            mask |= 1u << i;
+        }
+    }
+    const uint32_t shift = first_page % 32;
+    const uint32_t block_mask = (PAGES_PER_BLOCK == 32) ? 0xFFFFFFFFu : (((1u << PAGES_PER_BLOCK) - 1) << shift);
+    scan_bitmap[first_page / 32] = (scan_bitmap[first_page / 32] & ~block_mask) | (mask << shift);
+    block_valid[block / 32] |= 1u << (block % 32);
+    stale_blocks--;
+}
+
+// Return the first page at or after the given one whose populated state is `populated`,
+// or PAGE_COUNT if none.  Skips whole bitmap words at a time.
+static uint32_t flash_map_find_page(uint32_t page, bool populated) {
+    while (page < PAGE_COUNT) {
+        uint32_t word = page_bitmap[page / 32];
+        if (!populated) {
+            word = ~word;
+        }
+        word &= 0xFFFFFFFFu << (page % 32);
+        if (word) {
+            page = (page & ~31u) + __builtin_ctz(word);
+            return page < PAGE_COUNT ? page : PAGE_COUNT;
+        }
+        page = (page & ~31u) + 32;
+    }
+    return PAGE_COUNT;
+}
+
+// Walk the extents.  The cursor remembers the last extent returned,
+// so that sequential reads do not restart from the beginning.
+static struct {
+    uint32_t index;      ///< Index of the extent, or UINT32_MAX if none yet
+    uint32_t first_page; ///< First page of that extent
+    uint32_t end_page;   ///< Page after that extent
+} extent_cursor = { UINT32_MAX, 0, 0 };
+
+static bool flash_map_get_extent(uint32_t index, uint32_t *first_page, uint32_t *page_count) {
+    if (index >= extent_count) {
+        return false;
+    }
+    if (extent_cursor.index == UINT32_MAX || index < extent_cursor.index) {
+        extent_cursor.index      = UINT32_MAX;
+        extent_cursor.end_page   = 0;
+    }
+    while (extent_cursor.index != index) {
+        extent_cursor.first_page = flash_map_find_page(extent_cursor.end_page, true);
+        extent_cursor.end_page   = flash_map_find_page(extent_cursor.first_page, false);
+        extent_cursor.index++; // Wraps from UINT32_MAX to 0
+    }
+    *first_page = extent_cursor.first_page;
+    *page_count = extent_cursor.end_page - extent_cursor.first_page;
+    return true;
+}
+
+// Return the flash page holding the given populated page, counting from zero
+static struct {
+    uint32_t ordinal;    ///< Ordinal of the populated page, or UINT32_MAX if none yet
+    uint32_t page;       ///< The page itself
+} populated_cursor = { UINT32_MAX, 0 };
+
+static uint32_t flash_map_get_populated_page(uint32_t ordinal) {
+    uint32_t n, page;
+    if (populated_cursor.ordinal != UINT32_MAX && ordinal >= populated_cursor.ordinal) {
+        n    = populated_cursor.ordinal;
+        page = populated_cursor.page;
+    } else {
+        n    = 0;
+        page = flash_map_find_page(0, true);
+    }
+    // Skip whole bitmap words with popcount, then single pages
+    while (n < ordinal) {
+        const uint32_t rest = page_bitmap[page / 32] & (0xFFFFFFFEu << (page % 32));
+        const uint32_t in_word = __builtin_popcount(rest);
+        if (n + in_word < ordinal) {
+            n   += in_word + 1;
+            page = flash_map_find_page((page & ~31u) + 32, true);
+        } else {
+            page = flash_map_find_page(page + 1, true);
+            n++;
+        }
+    }
+    populated_cursor.ordinal = ordinal;
+    populated_cursor.page    = page;
+    return page;
+}
+
+static inline uint32_t sparse_header_size(void) {
+    const uint32_t size = sizeof(vd_flash_sparse_header_t) + extent_count * sizeof(vd_flash_sparse_extent_t);
+    return (size + EXFAT_BYTES_PER_SECTOR - 1) & ~(EXFAT_BYTES_PER_SECTOR - 1);
+}
+
+// Publish the scanned bitmap, recount the extents, and publish the new file
+// sizes, once all blocks are valid.  All in one go, between two reads, so that
+// a read never sees the new bitmap with the old counts or cursors.
+// Called only after a rescan, i.e. after the flash contents have changed.
+static void flash_map_publish(void) {
+    memcpy(page_bitmap, scan_bitmap, sizeof(page_bitmap));
+
+    uint32_t extents = 0;
+    uint32_t pages   = 0;
+    for (uint32_t page = flash_map_find_page(0, true); page < PAGE_COUNT; ) {
+        const uint32_t end = flash_map_find_page(page, false);
+        extents++;
+        pages += end - page;
+        page = flash_map_find_page(end, true);
+    }
+    extent_cursor.index      = UINT32_MAX;
+    populated_cursor.ordinal = UINT32_MAX;
+
+    extent_count    = extents;
+    populated_pages = pages;
+    if (flash_map_added) {
+        vd_update_file(&flash_map_file, extent_count * MAP_LINE_LENGTH);
+    }
+    if (flash_sparse_added) {
+        vd_update_file(&flash_sparse_file, sparse_header_size() + populated_pages * PAGE_SIZE);
+    }
+}
+
+void vd_files_flash_map_task(void) {
+    if (stale_blocks == 0 || !(flash_map_added || flash_sparse_added)) {
+        return;
+    }
+    for (uint32_t w = 0; w < sizeof(block_valid) / sizeof(block_valid[0]); w++) {
+        const uint32_t invalid = ~block_valid[w];
+        if (invalid) {
+            const uint32_t block = w * 32 + __builtin_ctz(invalid);
+            if (block < BLOCK_COUNT) {
+                flash_map_scan_block(block);
+            }
+            break;
+        }
+    }
+    if (stale_blocks == 0) {
+        flash_map_publish();
+    }
+}
+
+void vd_files_flash_map_flash_changed(uint32_t flash_offset, size_t size_bytes) {
+    if (size_bytes == 0 || flash_offset >= PICOVD_FLASH_SIZE_BYTES) {
+        return;
+    }
+    uint32_t last = (flash_offset + size_bytes - 1) / BLOCK_SIZE;
+    if (last >= BLOCK_COUNT) {
+        last = BLOCK_COUNT - 1;
+    }
+    for (uint32_t block = flash_offset / BLOCK_SIZE; block <= last; block++) {
+        if (block_valid[block / 32] & (1u << (block % 32))) {
+            block_valid[block / 32] &= ~(1u << (block % 32));
+            stale_blocks++;
+        }
+    }
+}
+
+static const char hex_digits[16] = "0123456789abcdef";
+
+static void format_hex32(char *out, uint32_t value) {
+    out[0] = '0';
+    out[1] = 'x';
+    for (int i = 0; i < 8; i++) {
+        out[2 + i] = hex_digits[(value >> (28 - 4 * i)) & 0xF];
+    }
+}
+
+static int32_t flash_map_file_content_cb(uint32_t offset, void* buffer, uint32_t bufsize) {
+    char    *out  = (char *)buffer;
+    uint32_t done = 0;
+
+    while (done < bufsize) {
+        const uint32_t index = (offset + done) / MAP_LINE_LENGTH;
+        const uint32_t pos   = (offset + done) % MAP_LINE_LENGTH;
+        uint32_t first_page, page_count;
+        if (!flash_map_get_extent(index, &first_page, &page_count)) {
+            break;
+        }
+        char line[MAP_LINE_LENGTH];
+        format_hex32(&line[0],  first_page * PAGE_SIZE);
+        line[10] = ' ';
+        format_hex32(&line[11], page_count * PAGE_SIZE);
+        line[21] = '\n';
+
+        uint32_t len = MAP_LINE_LENGTH - pos;
+        if (len > bufsize - done) {
+            len = bufsize - done;
+        }
+        memcpy(out + done, line + pos, len);
+        done += len;
+    }
+    return done;
+}
+
+// Fill a slice of the FLASH.SPARSE header, extent table and padding
+static void flash_sparse_header_slice(uint32_t pos, uint8_t *buf, uint32_t len) {
+    const vd_flash_sparse_header_t header = {
+        .magic        = VD_FLASH_SPARSE_MAGIC,
+        .page_size    = PAGE_SIZE,
+        .flash_size   = PICOVD_FLASH_SIZE_BYTES,
+        .extent_count = extent_count,
+        .header_size  = sparse_header_size(),
+    };
+    for (uint32_t i = 0; i < len; i++, pos++) {
+        if (pos < sizeof(header)) {
+            buf[i] = ((const uint8_t *)&header)[pos];
+            continue;
+        }
+        const uint32_t index = (pos - sizeof(header)) / sizeof(vd_flash_sparse_extent_t);
+        uint32_t first_page, page_count;
+        if (!flash_map_get_extent(index, &first_page, &page_count)) {
+            buf[i] = 0; // Padding
+            continue;
+        }
+        const vd_flash_sparse_extent_t extent = {
+            .offset = first_page * PAGE_SIZE,
+            .length = page_count * PAGE_SIZE,
+        };
+        buf[i] = ((const uint8_t *)&extent)[(pos - sizeof(header)) % sizeof(extent)];
+    }
+}
+
+static int32_t flash_sparse_file_content_cb(uint32_t offset, void* buffer, uint32_t bufsize) {
+    uint8_t *buf  = (uint8_t *)buffer;
+    uint32_t done = 0;
+    const uint32_t header_size = sparse_header_size();
+
+    if (offset < header_size) {
+        done = header_size - offset;
+        if (done > bufsize) {
+            done = bufsize;
+        }
+        flash_sparse_header_slice(offset, buf, done);
+    }
+    while (done < bufsize) {
+        const uint32_t rel     = offset + done - header_size;
+        const uint32_t ordinal = rel / PAGE_SIZE;
+        const uint32_t pos     = rel % PAGE_SIZE;
+        if (ordinal >= populated_pages) {
+            break;
+        }
+        const uint32_t page = flash_map_get_populated_page(ordinal);
+        uint32_t len = PAGE_SIZE - pos;
+        if (len > bufsize - done) {
+            len = bufsize - done;
+        }
+        memcpy(buf + done, (const void *)(XIP_BASE + page * PAGE_SIZE + pos), len);
+        done += len;
+    }
+    return done;
+}
+
+void vd_files_flash_map_init(void) {
+    flash_map_added = vd_add_file(&flash_map_file, (PAGE_COUNT / 2 + 1) * MAP_LINE_LENGTH) == 0;
+    if (!flash_map_added) {
+        printf("Cannot add %s, skipping it\n", PICOVD_FLASH_MAP_FILE_NAME);
+    }
+    flash_sparse_added = vd_add_file(&flash_sparse_file, EXFAT_BYTES_PER_SECTOR
+                                     + (PAGE_COUNT / 2 + 1) * sizeof(vd_flash_sparse_extent_t)
+                                     + PICOVD_FLASH_SIZE_BYTES) == 0;
+    if (!flash_sparse_added) {
+        printf("Cannot add %s, skipping it\n", PICOVD_FLASH_SPARSE_FILE_NAME);
+    }
+}
+
+#else
+
+void vd_files_flash_map_init(void) {}
+void vd_files_flash_map_task(void) {}
+void vd_files_flash_map_flash_changed(uint32_t flash_offset __unused, size_t size_bytes __unused) {}
+
+#endif // PICOVD_FLASH_MAP_ENABLED
@@ -0,0 +1,44 @@
+#ifndef VD_FILES_FLASH_MAP_H
+#define VD_FILES_FLASH_MAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// FLASH.SPARSE starts with this header, followed by extent_count extents,
+// zero padded to header_size bytes.  The contents of the extents follow,
+// back to back, in the order of the extents.  All fields are little endian.
+#define VD_FLASH_SPARSE_MAGIC "PVSPARSE"
+
+typedef struct __attribute__((packed)) {
+    char     magic[8];     // VD_FLASH_SPARSE_MAGIC, not NUL terminated
+    uint32_t page_size;    // Granularity of the extents, in bytes
+    uint32_t flash_size;   // Size of FLASH.BIN, in bytes; the rest is erased (0xFF)
+    uint32_t extent_count; // Number of vd_flash_sparse_extent_t entries
+    uint32_t header_size;  // Offset of the first data byte in the file
+} vd_flash_sparse_header_t;
+
+typedef struct __attribute__((packed)) {
+    uint32_t offset;       // Flash offset of the extent
+    uint32_t length;       // Length of the extent, in bytes
+} vd_flash_sparse_extent_t;
+
+// Initialize FLASH.MAP and FLASH.SPARSE, listing the non-erased parts of the flash
+void vd_files_flash_map_init(void);
+
+// Scan the next stale 64 KiB block of the flash, if any.
+// Call regularly from the main loop, e.g. next to tud_task().
+void vd_files_flash_map_task(void);
+
+// Mark the blocks covering the given flash range as stale.
+// Use vd_files_rp2350_flash_changed() instead of calling this directly.
+void vd_files_flash_map_flash_changed(uint32_t flash_offset, size_t size_bytes);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // VD_FILES_FLASH_MAP_H
@@ -0,0 +1,282 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+
+#include <pico/sha256.h>
+
+#include "picovd_config.h"
+
+#include "vd_virtual_disk.h"
+#include "vd_exfat_params.h"
+#include "vd_exfat_dirs.h"
+#include "vd_files_rp2350.h"
+#include "vd_files_hashes.h"
+
+#if PICOVD_HASHES_FILE_ENABLED
+
+// HASHES.TXT lists one digest per line, in the format of `sha256sum`,
+// so that the host can verify copied files with `sha256sum -c HASHES.TXT`:
+//   <64 hex digits><space><space><file name>\n
+#define HASH_LINE_DIGEST_CHARS (2 * SHA256_RESULT_BYTES)
+#define HASH_LINE_LENGTH(name_length) (HASH_LINE_DIGEST_CHARS + 2 + (name_length) + 1)
+#define HASH_ENTRIES_MAX       (1 + PICOVD_BOOTROM_PARTITIONS_MAX_FILES)
+#define HASH_UTF16(str)        STR_UTF16_EXPAND(str) // Expand the macro argument first
+
+typedef struct {
+    const char16_t *name;         // File name, as shown in the root directory
+    uint8_t         name_length;  // Name length, in UTF-16 code units
+    uint32_t        flash_offset; // Start of the hashed range, from the flash base
+    uint32_t        size_bytes;   // Length of the hashed range
+    bool            valid;        // Digest is up to date
+    uint8_t         digest[SHA256_RESULT_BYTES];
+} hash_entry_t;
+
+static hash_entry_t hash_entries[HASH_ENTRIES_MAX];
+static size_t       hash_entry_count = 0;
+
+// The accelerator computes one digest at a time, fed by DMA in chunks
+static pico_sha256_state_t sha256_state;
+static int32_t  hashing_idx = -1;  ///< Entry currently in the accelerator, or -1
+static uint32_t hashing_pos = 0;   ///< Bytes fed so far for that entry
+
+static int32_t hashes_file_content_cb(uint32_t offset, void* buffer, uint32_t bufsize);
+
+PICOVD_DEFINE_FILE_RUNTIME(
+    hashes_file,
+    PICOVD_HASHES_FILE_NAME,
+    0, // initial size, set once the entries are known
+    hashes_file_content_cb
+);
+
+// Advance the digest in progress, or start a new one, by at most one chunk.
+// Returns true if there may be more work to do.
+static bool hashes_step(void) {
+    if (hashing_idx < 0) {
+        // Pick the first stale entry
+        size_t i;
+        for (i = 0; i < hash_entry_count; i++) {
+            if (!hash_entries[i].valid) {
+                break;
+            }
+        }
+        if (i == hash_entry_count) {
+            return false; // All digests are up to date
+        }
+        if (pico_sha256_try_start(&sha256_state, SHA256_BIG_ENDIAN, true) != PICO_OK) {
+            return false; // Accelerator used by someone else, try again later
+        }
+        hashing_idx = (int32_t)i;
+        hashing_pos = 0;
+    }
+
+    hash_entry_t *entry = &hash_entries[hashing_idx];
+    uint32_t chunk = entry->size_bytes - hashing_pos;
+    if (chunk > PICOVD_HASHES_CHUNK_SIZE_BYTES) {
+        chunk = PICOVD_HASHES_CHUNK_SIZE_BYTES;
+    }
+    if (chunk > 0) {
+        // Read through the uncached alias: this does not thrash the XIP cache,
+        // and it sees the flash contents even if the cache holds stale lines.
+        const uint8_t *src = (const uint8_t *)(XIP_NOCACHE_NOALLOC_BASE + entry->flash_offset + hashing_pos);
+        pico_sha256_update(&sha256_state, src, chunk); // Returns once the DMA is started
+        hashing_pos += chunk;
+    }
+    if (hashing_pos == entry->size_bytes) {
+        sha256_result_t result;
+        pico_sha256_finish(&sha256_state, &result); // Also releases the accelerator
+        memcpy(entry->digest, result.bytes, sizeof(entry->digest));
+        entry->valid = true;
+        hashing_idx = -1;
+    }
+    return true;
+}
+
+static uint32_t hashes_rebuild(void);
+static uint32_t hashes_fill(uint32_t offset, char *out, uint32_t bufsize);
+static bool hashes_ready(uint32_t offset, uint32_t bufsize);
+static uint32_t partitions_version = 0; ///< Partition files version the entries were built for
+static bool     hashes_file_added  = false;
+
+// The read waiting for its digests; only one read may be pending at a time
+static struct {
+    bool     active;
+    vd_read_ticket_t ticket;
+    uint32_t offset;
+    char    *buffer;
+    uint32_t bufsize;
+} hashes_read;
+
+void vd_files_hashes_task(void) {
+    if (!hashes_file_added) {
+        return;
+    }
+    if (partitions_version != vd_files_rp2350_partitions_version()) {
+        // The file is in the root directory, whose change the partition
+        // watcher may not have reported, e.g. with the partitions in a subdirectory
+        (void)vd_update_file(&hashes_file, hashes_rebuild());
+    }
+    (void)hashes_step();
+
+    // Serve the pending read once all its digests are computed.  One dropped
+    // meanwhile, after the timeout or an abort, is forgotten: its buffer may
+    // already hold another transfer.
+    if (hashes_read.active && !vd_read_is_current(hashes_read.ticket)) {
+        hashes_read.active = false;
+    }
+    if (hashes_read.active && hashes_ready(hashes_read.offset, hashes_read.bufsize)) {
+        hashes_read.active = false;
+        if (vd_read_claim(hashes_read.ticket)) {
+            vd_read_complete(hashes_read.ticket,
+                             hashes_fill(hashes_read.offset, hashes_read.buffer, hashes_read.bufsize));
+        }
+    }
+}
+
+void vd_files_hashes_flash_changed(uint32_t flash_offset, size_t size_bytes) {
+    bool changed = false;
+    for (size_t i = 0; i < hash_entry_count; i++) {
+        hash_entry_t *entry = &hash_entries[i];
+        if (flash_offset >= entry->flash_offset + entry->size_bytes ||
+            flash_offset + size_bytes <= entry->flash_offset) {
+            continue; // No overlap
+        }
+        if (hashing_idx == (int32_t)i) {
+            // Drop the partial digest; the entry is restarted on the next step
+            pico_sha256_cleanup(&sha256_state);
+            hashing_idx = -1;
+        }
+        entry->valid = false;
+        changed = true;
+    }
+    if (changed && hashes_file_added) {
+        vd_update_file(&hashes_file, hashes_file.size_bytes);
+    }
+}
+
+static const char hex_digits[16] = "0123456789abcdef";
+
+// Return the character at the given position within the line of an entry
+static inline char hash_line_char(const hash_entry_t *entry, uint32_t pos) {
+    if (pos < HASH_LINE_DIGEST_CHARS) {
+        const uint8_t byte = entry->digest[pos / 2];
+        return hex_digits[(pos & 1) ? (byte & 0x0F) : (byte >> 4)];
+    }
+    pos -= HASH_LINE_DIGEST_CHARS;
+    if (pos < 2) {
+        return ' ';
+    }
+    pos -= 2;
+    if (pos < entry->name_length) {
+        return (char)entry->name[pos]; // Names are ASCII
+    }
+    return '\n';
+}
+
+// Return true if the digests of all lines within the slice are computed
+static bool hashes_ready(uint32_t offset, uint32_t bufsize) {
+    uint32_t line_start = 0;
+    for (size_t i = 0; i < hash_entry_count && line_start < offset + bufsize; i++) {
+        const uint32_t line_len = HASH_LINE_LENGTH(hash_entries[i].name_length);
+        if (offset < line_start + line_len && !hash_entries[i].valid) {
+            return false;
+        }
+        line_start += line_len;
+    }
+    return true;
+}
+
+static uint32_t hashes_fill(uint32_t offset, char *out, uint32_t bufsize) {
+    uint32_t done = 0;
+    uint32_t line_start = 0;
+
+    for (size_t i = 0; i < hash_entry_count && done < bufsize; i++) {
+        const hash_entry_t *entry = &hash_entries[i];
+        const uint32_t line_len = HASH_LINE_LENGTH(entry->name_length);
+        const uint32_t pos = offset + done;
+        if (pos >= line_start + line_len) {
+            line_start += line_len;
+            continue; // Requested slice starts after this line
+        }
+        for (uint32_t p = pos - line_start; p < line_len && done < bufsize; p++) {
+            out[done++] = hash_line_char(entry, p);
+        }
+        line_start += line_len;
+    }
+    return done;
+}
+
+// Never serve a digest that is not computed: until the task has computed
+// them, in the background, the read is pending and the USB stack keeps running
+static int32_t hashes_file_content_cb(uint32_t offset, void* buffer, uint32_t bufsize) {
+    if (hashes_ready(offset, bufsize)) {
+        return hashes_fill(offset, (char *)buffer, bufsize);
+    }
+    hashes_read.offset  = offset;
+    hashes_read.buffer  = (char *)buffer;
+    hashes_read.bufsize = bufsize;
+    hashes_read.ticket  = vd_read_ticket();
+    hashes_read.active  = true;
+    return VD_READ_PENDING;
+}
+
+static void hashes_add_entry(const char16_t *name, uint8_t name_length, uint32_t flash_offset, uint32_t size_bytes) {
+    if (hash_entry_count >= HASH_ENTRIES_MAX || size_bytes == 0) {
+        return;
+    }
+    hash_entries[hash_entry_count++] = (hash_entry_t){
+        .name         = name,
+        .name_length  = name_length,
+        .flash_offset = flash_offset,
+        .size_bytes   = size_bytes,
+        .valid        = false,
+    };
+}
+
+// (Re)build the entries from FLASH.BIN and the current partition files.
+// Returns the new size of the file.
+static uint32_t hashes_rebuild(void) {
+    if (hashing_idx >= 0) {
+        pico_sha256_cleanup(&sha256_state);
+        hashing_idx = -1;
+    }
+    hash_entry_count   = 0;
+    partitions_version = vd_files_rp2350_partitions_version();
+
+    static const char16_t flash_name[] = HASH_UTF16(PICOVD_FLASH_FILE_NAME);
+    hashes_add_entry(flash_name, PICOVD_FLASH_FILE_NAME_LEN, 0, PICOVD_FLASH_SIZE_BYTES);
+
+    for (uint32_t i = 0; i < PICOVD_BOOTROM_PARTITIONS_MAX_FILES; i++) {
+        const vd_dynamic_file_t *part = vd_files_rp2350_get_partition_file(i);
+        if (part == NULL || part->first_cluster == 0) {
+            continue;
+        }
+        const uint32_t flash_offset = (part->first_cluster - PICOVD_FLASH_START_CLUSTER)
+                                    * (EXFAT_BYTES_PER_SECTOR * EXFAT_SECTORS_PER_CLUSTER);
+        hashes_add_entry(part->name, part->name_length, flash_offset, part->size_bytes);
+    }
+
+    uint32_t size_bytes = 0;
+    for (size_t i = 0; i < hash_entry_count; i++) {
+        size_bytes += HASH_LINE_LENGTH(hash_entries[i].name_length);
+    }
+    return size_bytes;
+}
+
+void vd_files_hashes_init(void) {
+    hashes_file.size_bytes = hashes_rebuild();
+    if (vd_add_file(&hashes_file, HASH_ENTRIES_MAX * HASH_LINE_LENGTH(255)) < 0) {
+        printf("Cannot add %s, skipping it\n", PICOVD_HASHES_FILE_NAME);
+        return;
+    }
+    hashes_file_added = true;
+}
+
+#else
+
+void vd_files_hashes_init(void) {}
+void vd_files_hashes_task(void) {}
+void vd_files_hashes_flash_changed(uint32_t flash_offset __unused, size_t size_bytes __unused) {}
+
+#endif // PICOVD_HASHES_FILE_ENABLED
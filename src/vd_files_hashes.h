@@ -0,0 +1,27 @@
+#ifndef VD_FILES_HASHES_H
+#define VD_FILES_HASHES_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Initialize HASHES.TXT, listing the SHA-256 digests of the flash and of each
+// BootROM partition. Call after vd_files_rp2350_init_bootrom_partitions().
+void vd_files_hashes_init(void);
+
+// Feed the next chunk of any stale digest to the SHA-256 accelerator.
+// Call regularly from the main loop, e.g. next to tud_task().
+void vd_files_hashes_task(void);
+
+// Mark the digests covering the given flash range as stale.
+// Use vd_files_rp2350_flash_changed() instead of calling this directly.
+void vd_files_hashes_flash_changed(uint32_t flash_offset, size_t size_bytes);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // VD_FILES_HASHES_H
@@ -2,10 +2,12 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <assert.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include <pico/bootrom.h>   // get_partition_table_info()
-#include <pico/aon_timer.h> // aon_timer_get_datetime()
+#include <pico/time.h>
+#include <hardware/dma.h>
 
 #include <tusb.h>
 
@@ -14,39 +16,57 @@
 #include "vd_exfat.h"
 #include "vd_exfat_params.h"
 #include "vd_exfat_dirs.h"
-
-#ifndef PICOVD_BOOTROM_PARTITIONS_NAMES_STORAGE_SIZE
-#define PICOVD_BOOTROM_PARTITIONS_NAMES_STORAGE_SIZE 256
-#endif
-
-// Single contiguous buffer for all partition names (UTF-16)
-static char16_t partition_name_buf[PICOVD_BOOTROM_PARTITIONS_NAMES_STORAGE_SIZE / sizeof(char16_t)];
-static size_t partition_name_buf_used = 0;
+#include "vd_files_rp2350.h"
+#include "vd_files_hashes.h"
+#include "vd_files_flash_map.h"
+#include "vd_handoff.h"
+#include "vd_time.h"
 
 #ifndef PICOVD_BOOTROM_PARTITIONS_MAX_FILES
 #define PICOVD_BOOTROM_PARTITIONS_MAX_FILES 8
 #endif
+
+// BootROM partition table info flags, see §5.4.8.16 of the datasheet
+enum {
+    PT_INFO               = 0x0001,
+    PT_LOCATION_AND_FLAGS = 0x0010,
+    PT_NAME               = 0x0080,
+    PT_SINGLE_PARTITION   = 0x8000,
+};
+
 typedef struct {
     vd_dynamic_file_t file;
-    char16_t *name;
+    char16_t *name;       // Allocated from the heap, owned by this entry
 } partition_file_entry_t;
 
-static partition_file_entry_t partition_file_entries[PICOVD_BOOTROM_PARTITIONS_MAX_FILES];
+// Cached, decoded partition table.  The files are rebuilt only when the
+// hash over the BootROM table info changes, and then the version is bumped.
+static struct {
+    uint32_t hash;        ///< Hash of the PT_INFO and location and flags words
+    uint32_t version;     ///< Incremented on each rebuild; 0 before the first one
+    uint32_t last_poll_ms;
+    bool     contents_changed; ///< Some partition contents changed, see vd_files_rp2350_flash_changed()
+    partition_file_entry_t entries[PICOVD_BOOTROM_PARTITIONS_MAX_FILES];
+    bool     valid[PICOVD_BOOTROM_PARTITIONS_MAX_FILES];
+} partition_table;
+
+#if PICOVD_BOOTROM_PARTITIONS_DIR_ENABLED
+static PICOVD_DEFINE_DIRECTORY_RUNTIME(partitions_dir, PICOVD_BOOTROM_PARTITIONS_DIR_NAME);
+#define PARTITIONS_PARENT (&partitions_dir)
+#else
+#define PARTITIONS_PARENT NULL
+#endif
+
+// Work area for rom_load_partition_table()
+static uint8_t partition_work_area[4 * 1024]; // XXX FIXME
 
 // Helper: Fill a vd_file_t from a BootROM flash partition entry
 bool fill_vd_file_from_rp2350_partition(uint32_t part_idx, partition_file_entry_t *entry) {
-    enum {
-        PT_LOCATION_AND_FLAGS = 0x0010,
-        PT_NAME               = 0x0080,
-        PT_SINGLE_PARTITION   = 0x8000,
-    };
-
-    uint32_t pt_buf[34]; // plenty for location/flags + long name (max 32 words)
+    uint32_t pt_buf[3 + 32]; // Supported flags, location and flags, and the longest name, 1 + 127 bytes
     uint32_t flags = PT_SINGLE_PARTITION |
                      PT_LOCATION_AND_FLAGS |
                      PT_NAME |
                      (part_idx << 24);   // partition# in top 8 bits per spec
-
     int words
     = rom_get_partition_table_info(pt_buf,
         (uint32_t)(sizeof(pt_buf)/sizeof(pt_buf[0])),
@@ -59,9 +79,11 @@ bool fill_vd_file_from_rp2350_partition(uint32_t part_idx, partition_file_entry_
     uint32_t loc  = *p++;                // permissions_and_location
     uint32_t flg  = *p++;                // permissions_and_flags
 
-    // Extract start address and length (see §5.9.4.2 of the datasheet)
-    uint32_t flash_page  =  (loc & 0x0001FFFFu);   // 4-kB units, matching cluster size
-    uint32_t flash_size  = ((loc & 0x03ffe000u) >> 17) * 4096u;
+    // Extract start address and length (see §5.9.4.2 of the datasheet):
+    // first sector in bits 12:0, last sector (inclusive) in bits 25:13, in 4-kB units
+    uint32_t flash_page  =  (loc & 0x00001FFFu);   // 4-kB units, matching cluster size
+    uint32_t last_page   = ((loc & 0x03FFE000u) >> 13);
+    uint32_t flash_size  = (last_page >= flash_page) ? (last_page - flash_page + 1) * 4096u : 0;
 
     // NAME field
     uint8_t  name_len   = (*(uint8_t *)p) & 0x7F;
@@ -77,80 +99,257 @@ bool fill_vd_file_from_rp2350_partition(uint32_t part_idx, partition_file_entry_
         name_bytes = (const uint8_t *)base_name;
     }
 
-    struct timespec ts;
-    aon_timer_get_time(&ts);
+    uint8_t hundredths;
+    const time_t now = vd_time_now(&hundredths);
 
-    // Linear allocation for UTF-16 name
-    if (partition_name_buf_used + name_len > (sizeof(partition_name_buf) / sizeof(char16_t))) {
-        // XXX TODO: Dynamically allocate a buffer for the name from the heap
-        printf("BootROM partition name buffer exhausted, skipping partition %u\n", part_idx);
+    // UTF-16 name, from the heap; freed when the partition table changes
+    char16_t *name_ptr = malloc(name_len * sizeof(char16_t));
+    if (name_ptr == NULL) {
+        printf("Out of memory for BootROM partition name, skipping partition %u\n", part_idx);
         return false;
     }
-    char16_t *name_ptr = &partition_name_buf[partition_name_buf_used];
     for (size_t i = 0; i < name_len; i++) {
         name_ptr[i] = name_bytes[i]; // UTF-8 to UTF-16LE (ASCII only)
     }
-    partition_name_buf_used += name_len;
 
     entry->name = name_ptr;
     entry->file = (vd_dynamic_file_t){
         .name            = name_ptr,
         .name_length     = name_len,
         .file_attributes = FAT_FILE_ATTR_READ_ONLY,
+        .parent          = PARTITIONS_PARENT,
         .first_cluster   = flash_size ? flash_page + PICOVD_FLASH_START_CLUSTER : 0,
         .size_bytes      = flash_size,
-        .creat_time_sec  = ts.tv_sec,
-        .mod_time_sec    = ts.tv_sec,
+        .creat_time_sec  = now,
+        .mod_time_sec    = now,
+        .creat_time_10ms = hundredths,
+        .mod_time_10ms   = hundredths,
         .get_content     = NULL, // No content callback for partitions
     };
 
     return true;
 }
 
-void vd_files_rp2350_init_bootrom_partitions(void) {
-#if PICOVD_BOOTROM_PARTITIONS_ENABLED
-    size_t name_len = 0;
+// FNV-1a over the table info words
+static uint32_t partition_table_hash(const uint32_t *words, int count) {
+    uint32_t hash = 0x811C9DC5u;
+    for (int i = 0; i < count; i++) {
+        for (int b = 0; b < 4; b++) {
+            hash = (hash ^ ((words[i] >> (8 * b)) & 0xFF)) * 0x01000193u;
+        }
+    }
+    return hash;
+}
+
+// Drop all partition files from the directory and free their names
+static void partition_table_clear(void) {
     for (uint32_t i = 0; i < PICOVD_BOOTROM_PARTITIONS_MAX_FILES; ++i) {
-        char16_t *name_ptr = NULL;
-        if (fill_vd_file_from_rp2350_partition(i, &partition_file_entries[i])) {
-            vd_exfat_dir_add_file(&partition_file_entries[i].file);
+        if (partition_table.valid[i]) {
+            vd_exfat_dir_remove_file(&partition_table.entries[i].file);
+            free(partition_table.entries[i].name);
+            partition_table.entries[i].name = NULL;
+            partition_table.valid[i] = false;
         }
     }
+}
+
+// Reload the partition table from the flash and rebuild the partition files,
+// if the table has changed.  Returns true if the files were rebuilt.
+static bool partition_table_refresh(bool force_reload) {
+    // Location and flags for all partitions, up to 16, after the PT_INFO words
+    uint32_t pt_buf[1 + 2 + 2 * 16];
+
+    if (rom_load_partition_table(partition_work_area, sizeof(partition_work_area), force_reload) < 0) {
+        return false;
+    }
+    int words = rom_get_partition_table_info(pt_buf,
+        (uint32_t)(sizeof(pt_buf)/sizeof(pt_buf[0])),
+        PT_INFO | PT_LOCATION_AND_FLAGS);
+    if (words < 3) {
+        return false; // BootROM error
+    }
+
+    const uint32_t hash = partition_table_hash(pt_buf, words);
+    if (partition_table.version != 0 && hash == partition_table.hash) {
+        return false; // Unchanged, keep the cached files
+    }
+    partition_table.hash = hash;
+    partition_table.version++;
+
+    const uint32_t partition_count = pt_buf[1] & 0xFF; // PT_INFO: count in bits 7:0
+    partition_table_clear();
+    for (uint32_t i = 0; i < partition_count && i < PICOVD_BOOTROM_PARTITIONS_MAX_FILES; ++i) {
+        if (!fill_vd_file_from_rp2350_partition(i, &partition_table.entries[i])) {
+            continue;
+        }
+        if (vd_exfat_dir_add_file(&partition_table.entries[i].file) < 0) {
+            // The directory or the dynamic file slots are full
+            printf("Cannot add BootROM partition %u, skipping it\n", i);
+            free(partition_table.entries[i].name);
+            partition_table.entries[i].name = NULL;
+            continue;
+        }
+        partition_table.valid[i] = true;
+    }
+    return true;
+}
+
+void vd_files_rp2350_init_bootrom_partitions(void) {
+#if PICOVD_BOOTROM_PARTITIONS_ENABLED
+#if PICOVD_BOOTROM_PARTITIONS_DIR_ENABLED
+    if (vd_add_directory(&partitions_dir) < 0) {
+        printf("Cannot add the %s directory, skipping the partitions\n", PICOVD_BOOTROM_PARTITIONS_DIR_NAME);
+        return;
+    }
+#endif
+    (void)partition_table_refresh(false); // Already loaded by the BootROM, if booted from flash
+    partition_table.last_poll_ms = to_ms_since_boot(get_absolute_time());
 #endif
 }
 
-int32_t vd_file_sector_get_bootrom(uint32_t lba, uint32_t offset, void* buffer, uint32_t bufsize) {
-    assert(lba >= PICOVD_BOOTROM_START_LBA);
-    assert(lba  < PICOVD_BOOTROM_START_LBA + PICOVD_BOOTROM_SIZE_BYTES / EXFAT_BYTES_PER_SECTOR);
+// A vd_files_rp2350_flash_changed() call the handoff queue had no room for
+static bool flash_changed_missed = false;
 
-    const uint32_t address = ((lba - PICOVD_BOOTROM_START_LBA) << EXFAT_BYTES_PER_SECTOR_SHIFT); // Bootrom is mapped at address 0x0
-    memcpy(buffer, (const void*)address, bufsize);
-    return bufsize;
+void vd_files_rp2350_partitions_task(void) {
+    // Its range is lost with it: the whole flash may have changed
+    if (__atomic_exchange_n(&flash_changed_missed, false, __ATOMIC_ACQUIRE)) {
+        vd_files_rp2350_flash_changed(0, PICOVD_FLASH_SIZE_BYTES);
+    }
+#if PICOVD_BOOTROM_PARTITIONS_ENABLED
+    bool changed = false;
+#if PICOVD_BOOTROM_PARTITIONS_POLL_MS > 0
+    // Until the poll is due, the contents changes are batched, too
+    const uint32_t now_ms = to_ms_since_boot(get_absolute_time());
+    if (now_ms - partition_table.last_poll_ms < PICOVD_BOOTROM_PARTITIONS_POLL_MS) {
+        return;
+    }
+    partition_table.last_poll_ms = now_ms;
+
+    changed = partition_table_refresh(true);
+#if PICOVD_BOOTROM_PARTITIONS_DIR_ENABLED
+    // A new table changes only the listing of the subdirectory
+    if (changed) {
+        (void)vd_virtual_disk_lun_range_changed(VD_LUN_STATIC, EXFAT_CLUSTER_TO_LBA(partitions_dir.first_cluster),
+                                                partitions_dir.size_bytes / MSC_BLOCK_SIZE);
+        changed = false;
+    }
+#endif
+#endif // PICOVD_BOOTROM_PARTITIONS_POLL_MS > 0
+
+    // Partitions whose contents have changed get a new modification time
+    if (partition_table.contents_changed) {
+        partition_table.contents_changed = false;
+        changed = true;
+    }
+
+    // One media change for the whole update, however many files changed
+    if (changed) {
+        vd_virtual_disk_lun_contents_changed(VD_LUN_STATIC, false);
+    }
+#endif
 }
 
-int32_t vd_file_sector_get_sram(uint32_t lba, uint32_t offset, void* buffer, uint32_t bufsize) {
-    assert(lba >= PICOVD_SRAM_START_LBA);
-    assert(lba  < PICOVD_SRAM_START_LBA + PICOVD_SRAM_SIZE_BYTES / EXFAT_BYTES_PER_SECTOR);
+uint32_t vd_files_rp2350_partitions_version(void) {
+    return partition_table.version;
+}
 
-    const uint32_t address = ((lba - PICOVD_SRAM_START_LBA) << EXFAT_BYTES_PER_SECTOR_SHIFT) + SRAM0_BASE;
-    memcpy(buffer, (const void*)address, bufsize);
-    return bufsize;
+const vd_dynamic_file_t *vd_files_rp2350_get_partition_file(uint32_t part_idx) {
+    if (part_idx >= PICOVD_BOOTROM_PARTITIONS_MAX_FILES || !partition_table.valid[part_idx]) {
+        return NULL;
+    }
+    return &partition_table.entries[part_idx].file;
+}
+
+static void vd_files_rp2350_flash_changed_handoff(void *flash_offset, uint32_t size_bytes) {
+    vd_files_rp2350_flash_changed((uintptr_t)flash_offset, size_bytes);
 }
 
-int32_t vd_file_sector_get_flash(uint32_t lba, uint32_t offset, void* buffer, uint32_t bufsize) {
-    assert(lba >= PICOVD_FLASH_START_LBA);
-    assert(lba  < PICOVD_FLASH_START_LBA + PICOVD_FLASH_SIZE_BYTES / EXFAT_BYTES_PER_SECTOR);
+void vd_files_rp2350_flash_changed(uint32_t flash_offset, size_t size_bytes) {
+    if (!vd_handoff_on_usb_core()) {
+        // Called from the application core; the offset travels in the pointer argument
+        if (!vd_handoff_call(vd_files_rp2350_flash_changed_handoff, (void *)(uintptr_t)flash_offset, size_bytes)) {
+            __atomic_store_n(&flash_changed_missed, true, __ATOMIC_RELEASE); // Queue full, replayed by the task
+        }
+        return;
+    }
+    // Update the modification time of the affected partitions; the host is
+    // notified once, by the next vd_files_rp2350_partitions_task(), at its poll if enabled
+    for (uint32_t i = 0; i < PICOVD_BOOTROM_PARTITIONS_MAX_FILES; ++i) {
+        vd_dynamic_file_t *file = &partition_table.entries[i].file;
+        if (!partition_table.valid[i] || file->first_cluster == 0) {
+            continue;
+        }
+        const uint32_t start = (file->first_cluster - PICOVD_FLASH_START_CLUSTER) * 4096u;
+        if (flash_offset < start + file->size_bytes && flash_offset + size_bytes > start) {
+            vd_exfat_dir_update_file(file);
+            partition_table.contents_changed = true;
+        }
+    }
 
-    uint32_t flash_address;
+    vd_files_hashes_flash_changed(flash_offset, size_bytes);
+    vd_files_flash_map_flash_changed(flash_offset, size_bytes);
+}
 
-    if ((PICOVD_FLASH_START_LBA << EXFAT_BYTES_PER_SECTOR_SHIFT) == XIP_BASE) {
-        // Optimized version for the RP2350, with a directly mapped flash pages
-        flash_address = lba << EXFAT_BYTES_PER_SECTOR_SHIFT;
-    } else {
-        // Generic version, with a flash address offset
-        flash_address = ((lba - PICOVD_FLASH_START_LBA) << EXFAT_BYTES_PER_SECTOR_SHIFT) + XIP_BASE;
+// Copy with a DMA channel, claimed at the first use and kept.
+// Falls back to memcpy if there are no free channels.
+static int32_t __attribute__((unused)) vd_memory_region_read_dma(uintptr_t address, void* buffer, uint32_t bufsize) {
+    static int dma_channel = -2; // Not claimed yet
+    if (dma_channel == -2) {
+        dma_channel = dma_claim_unused_channel(false);
+    }
+    if (dma_channel < 0) {
+        memcpy(buffer, (const void*)address, bufsize);
+        return bufsize;
     }
 
-    memcpy(buffer, (const void*)flash_address, bufsize);
+    const bool aligned = ((address | (uintptr_t)buffer | bufsize) & 3) == 0;
+    dma_channel_config c = dma_channel_get_default_config(dma_channel);
+    channel_config_set_transfer_data_size(&c, aligned ? DMA_SIZE_32 : DMA_SIZE_8);
+    channel_config_set_read_increment(&c, true);
+    channel_config_set_write_increment(&c, true);
+    dma_channel_configure(dma_channel, &c, buffer, (const void*)address,
+                          aligned ? bufsize / 4 : bufsize, true);
+    dma_channel_wait_for_finish_blocking(dma_channel);
     return bufsize;
 }
+
+// Read a slice of a memory region file.  Called through the per-region readers
+// below, with compile-time constant region parameters, so that the address
+// computation and the access method switch are folded away.
+static inline __attribute__((always_inline))
+int32_t vd_memory_region_read(uint32_t lba, uint32_t offset, void* buffer, uint32_t bufsize,
+                              uint32_t start_lba, uint32_t size_bytes,
+                              uintptr_t base_address, vd_memory_access_t access) {
+    assert(lba >= start_lba);
+    assert(lba  < start_lba + size_bytes / EXFAT_BYTES_PER_SECTOR);
+    assert(((lba - start_lba) << EXFAT_BYTES_PER_SECTOR_SHIFT) + offset + bufsize <= size_bytes);
+
+    // The translation from disk bytes to memory addresses is a constant per region:
+    // zero for the directly mapped regions, e.g. flash and SRAM with the default
+    // layout, and otherwise a single add, e.g. with PICOVD_COMPACT_LAYOUT_ENABLED
+    const uintptr_t translation = base_address - ((uintptr_t)start_lba << EXFAT_BYTES_PER_SECTOR_SHIFT);
+    uintptr_t address = ((uintptr_t)lba << EXFAT_BYTES_PER_SECTOR_SHIFT) + translation + offset;
+
+    switch (access) {
+    case VD_MEMORY_ACCESS_UNCACHED:
+        // Only meaningful for the XIP window (flash and PSRAM)
+        address += XIP_NOCACHE_NOALLOC_BASE - XIP_BASE;
+        break;
+    case VD_MEMORY_ACCESS_DMA:
+        return vd_memory_region_read_dma(address, buffer, bufsize);
+    case VD_MEMORY_ACCESS_MEMCPY:
+        break;
+    }
+    memcpy(buffer, (const void*)address, bufsize);
+    return bufsize;
+}
+
+#define VD_MEMORY_REGION_DEFINE_READER(id, CFG)                                              \
+int32_t vd_file_sector_get_ ## id(uint32_t lba, uint32_t offset, void* buffer, uint32_t bufsize) { \
+    return vd_memory_region_read(lba, offset, buffer, bufsize,                               \
+        PICOVD_ ## CFG ## _START_LBA,                                                        \
+        PICOVD_ ## CFG ## _SIZE_BYTES,                                                       \
+        PICOVD_ ## CFG ## _BASE_ADDRESS,                                                     \
+        PICOVD_ ## CFG ## _ACCESS);                                                          \
+}
+PICOVD_MEMORY_REGIONS(VD_MEMORY_REGION_DEFINE_READER)
@@ -4,7 +4,40 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include <picovd_config.h>
+#include "vd_virtual_disk.h"
+
+// How the contents of a memory region file are read, see PICOVD_MEMORY_REGIONS
+typedef enum {
+    VD_MEMORY_ACCESS_MEMCPY,   // Plain memcpy, through the cache if any
+    VD_MEMORY_ACCESS_DMA,      // DMA transfer, blocking until done
+    VD_MEMORY_ACCESS_UNCACHED, // memcpy through the XIP uncached, non-allocating alias
+} vd_memory_access_t;
+
+// Sector readers for the memory region files, one per PICOVD_MEMORY_REGIONS entry,
+// e.g. vd_file_sector_get_flash()
+#define VD_MEMORY_REGION_DECLARE_READER(id, CFG) \
+    int32_t vd_file_sector_get_ ## id(uint32_t lba, uint32_t offset, void* buf, uint32_t bufsize);
+PICOVD_MEMORY_REGIONS(VD_MEMORY_REGION_DECLARE_READER)
+
 // Initialization function to scan and register BootROM partitions as dynamic files
 void vd_files_rp2350_init_bootrom_partitions(void);
 
+// Poll the partition table for changes, e.g. after an A/B update, when due.
+// If the table has changed, the partition files are rebuilt, the version is
+// incremented, and the host gets a single media change for the whole update.
+// Also replays a vd_files_rp2350_flash_changed() the handoff queue had no room for.
+// Call regularly from the main loop, e.g. next to tud_task().
+void vd_files_rp2350_partitions_task(void);
+
+// Return the version of the partition files, incremented whenever they are rebuilt
+uint32_t vd_files_rp2350_partitions_version(void);
+
+// Return the file of the given partition, or NULL if there is no such partition
+const vd_dynamic_file_t *vd_files_rp2350_get_partition_file(uint32_t part_idx);
+
+// Notify the files derived from the flash contents that the given range has
+// been erased or programmed, e.g. after flash_range_program().
+void vd_files_rp2350_flash_changed(uint32_t flash_offset, size_t size_bytes);
+
 #endif // VD_FILES_RP2350_H
@@ -0,0 +1,119 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <tusb.h>
+#include <pico/time.h>
+
+#include "picovd_config.h"
+
+#include "vd_virtual_disk.h"
+#include "vd_files_slow.h"
+
+#if PICOVD_SLOW_FILE_ENABLED
+
+// SLOW.TXT emulates a file whose contents take a while to produce, such as
+// the result of a sensor query.  Every read takes PICOVD_SLOW_FILE_DELAY_MS.
+//
+// With PICOVD_SLOW_FILE_ASYNC, the content callback starts a timer alarm and
+// returns VD_READ_PENDING; the alarm fills the buffer and calls
+// vd_read_complete() from the timer IRQ.  Without it, the callback busy-waits,
+// blocking tud_task() and with it all other USB interfaces.
+
+#define SLOW_LINE_LENGTH 64 // Each line: the file offset of the line, in hex, and padding
+
+static int32_t slow_file_content_cb(uint32_t offset, void* buffer, uint32_t bufsize);
+
+PICOVD_DEFINE_FILE_RUNTIME(
+    slow_file,
+    PICOVD_SLOW_FILE_NAME,
+    PICOVD_SLOW_FILE_SIZE_BYTES,
+    slow_file_content_cb
+);
+
+static void slow_file_fill(uint32_t offset, char *buf, uint32_t bufsize) {
+    static const char hex_digits[16] = "0123456789abcdef";
+
+    for (uint32_t i = 0; i < bufsize; i++) {
+        const uint32_t pos  = offset + i;
+        const uint32_t col  = pos % SLOW_LINE_LENGTH;
+        const uint32_t line = pos - col;
+        if (col < 8) {
+            buf[i] = hex_digits[(line >> (28 - 4 * col)) & 0xF];
+        } else if (col == SLOW_LINE_LENGTH - 1) {
+            buf[i] = '\n';
+        } else {
+            buf[i] = '.';
+        }
+    }
+}
+
+#if PICOVD_SLOW_FILE_ASYNC
+
+// The read in progress; only one read may be pending at a time
+static struct {
+    uint32_t offset;
+    char    *buffer;
+    uint32_t bufsize;
+} slow_read;
+
+// The alarm carries the ticket of its read: that of a read dropped meanwhile,
+// after the timeout or an abort, no longer matches, and its buffer is left alone
+static int64_t slow_file_alarm_cb(alarm_id_t id __unused, void *user_data) {
+    const vd_read_ticket_t ticket = (vd_read_ticket_t)(uintptr_t)user_data;
+    if (vd_read_claim(ticket)) {
+        slow_file_fill(slow_read.offset, slow_read.buffer, slow_read.bufsize);
+        vd_read_complete(ticket, slow_read.bufsize);
+    }
+    return 0; // Do not reschedule
+}
+
+static int32_t slow_file_content_cb(uint32_t offset, void* buffer, uint32_t bufsize) {
+    slow_read.offset  = offset;
+    slow_read.buffer  = (char *)buffer;
+    slow_read.bufsize = bufsize;
+    void *const ticket = (void *)(uintptr_t)vd_read_ticket();
+    if (add_alarm_in_ms(PICOVD_SLOW_FILE_DELAY_MS, slow_file_alarm_cb, ticket, true) < 0) {
+        // No alarm slots left: fall back to a synchronous read
+        busy_wait_ms(PICOVD_SLOW_FILE_DELAY_MS);
+        slow_file_fill(offset, buffer, bufsize);
+        return bufsize;
+    }
+    return VD_READ_PENDING;
+}
+
+#else
+
+static int32_t slow_file_content_cb(uint32_t offset, void* buffer, uint32_t bufsize) {
+    busy_wait_ms(PICOVD_SLOW_FILE_DELAY_MS);
+    slow_file_fill(offset, buffer, bufsize);
+    return bufsize;
+}
+
+#endif // PICOVD_SLOW_FILE_ASYNC
+
+void vd_files_slow_task(void) {
+    uint8_t buf[CFG_TUD_CDC_RX_BUFSIZE];
+
+    if (!tud_cdc_connected() || !tud_cdc_available()) {
+        return;
+    }
+    const uint32_t count = tud_cdc_read(buf, sizeof(buf));
+    tud_cdc_write(buf, count);
+    tud_cdc_write_flush();
+}
+
+void vd_files_slow_init(void) {
+#if !PICOVD_SLOW_FILE_ASYNC
+    // Synchronous, so that the next clusters can be generated ahead of the reader
+    slow_file.read_ahead = PICOVD_READ_AHEAD_CACHE_CLUSTERS;
+#endif
+    vd_add_file(&slow_file, PICOVD_SLOW_FILE_SIZE_BYTES);
+}
+
+#else
+
+void vd_files_slow_init(void) {}
+void vd_files_slow_task(void) {}
+
+#endif // PICOVD_SLOW_FILE_ENABLED
@@ -0,0 +1,20 @@
+#ifndef VD_FILES_SLOW_H
+#define VD_FILES_SLOW_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Initialize SLOW.TXT, whose every read takes PICOVD_SLOW_FILE_DELAY_MS,
+// to demonstrate deferred reads with VD_READ_PENDING and vd_read_complete()
+void vd_files_slow_init(void);
+
+// Echo any CDC input back to the host, for tools/cdc_latency_bench.py.
+// Call regularly from the main loop, e.g. next to tud_task().
+void vd_files_slow_task(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // VD_FILES_SLOW_H
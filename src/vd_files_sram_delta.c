@@ -0,0 +1,248 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+
+#include <pico/time.h>
+#include <hardware/dma.h>
+
+#include "picovd_config.h"
+
+#include "vd_virtual_disk.h"
+#include "vd_files_sram_delta.h"
+
+#if PICOVD_SRAM_DELTA_ENABLED
+
+// SRAM-DELTA.BIN is a stream of records, one per SRAM page whose contents
+// have changed since the last time the host read its record:
+//   vd_sram_delta_record_header_t { address, crc32 }
+//   PICOVD_SRAM_DELTA_PAGE_SIZE_BYTES bytes of page contents
+//
+// The first read after boot returns all pages, i.e. a full snapshot.
+// Concatenating the page contents of all reads, in order, at the given
+// addresses reproduces the current SRAM contents on the host.
+//
+// The pages are hashed with the DMA sniffer, which computes a CRC-32 of
+// the data a DMA channel moves, with no CPU load.  To scan, the channel reads
+// the page and writes each word into the same dummy location.
+//
+// The host gets a record from a snapshot of the page, copied by the same
+// DMA channel when the host first reads the record, so that the CRC in the
+// header is that of the page contents it gets.  A page counts as seen once
+// the host has read its whole record, and then with the CRC of the snapshot.
+
+#define PAGE_COUNT   ((PICOVD_SRAM_SIZE_BYTES + PICOVD_SRAM_DELTA_PAGE_SIZE_BYTES - 1) / PICOVD_SRAM_DELTA_PAGE_SIZE_BYTES)
+#define RECORD_SIZE  (sizeof(vd_sram_delta_record_header_t) + PICOVD_SRAM_DELTA_PAGE_SIZE_BYTES)
+
+static_assert(PICOVD_SRAM_SIZE_BYTES % PICOVD_SRAM_DELTA_PAGE_SIZE_BYTES == 0,
+              "SRAM size must be a multiple of the page size");
+static_assert(PICOVD_SRAM_DELTA_PAGE_SIZE_BYTES % 4 == 0,
+              "Page size must be a multiple of the DMA word size");
+
+static uint32_t reported_crc[PAGE_COUNT]; ///< Page CRCs the host has read in full
+static uint32_t scanned_crc[PAGE_COUNT];  ///< Page CRCs at the last scan
+
+static uint16_t published_pages[PAGE_COUNT]; ///< Pages in the file, in address order
+static uint32_t published_count = 0;
+
+// Snapshots of the records being read.  A read of up to a cluster spans at
+// most two records, as a record is longer than a cluster.
+#define SNAPSHOT_COUNT 2
+#define SNAPSHOT_NONE  UINT32_MAX
+
+typedef struct {
+    uint32_t record; ///< Record the snapshot is for, or SNAPSHOT_NONE
+    uint32_t crc;    ///< CRC-32 of data
+    uint32_t served; ///< Bytes of the record the host has read, from its start
+    uint32_t data[PICOVD_SRAM_DELTA_PAGE_SIZE_BYTES / 4];
+} sram_delta_snapshot_t;
+
+static sram_delta_snapshot_t snapshots[SNAPSHOT_COUNT];
+static uint32_t snapshot_last = 0; ///< Most recently used snapshot
+
+static int      sniff_channel = -1;
+static uint32_t last_access_ms = 0; ///< Last time the host read the file
+static uint32_t last_scan_ms   = 0;
+
+static int32_t sram_delta_file_content_cb(uint32_t offset, void* buffer, uint32_t bufsize);
+
+PICOVD_DEFINE_FILE_RUNTIME(
+    sram_delta_file,
+    PICOVD_SRAM_DELTA_FILE_NAME,
+    0, // initial size, set at the first scan
+    sram_delta_file_content_cb
+);
+
+static inline uint32_t page_address(uint32_t page) {
+    return PICOVD_SRAM_BASE_ADDRESS + page * PICOVD_SRAM_DELTA_PAGE_SIZE_BYTES;
+}
+
+static inline void sram_delta_sniffer_enable(void) {
+    dma_sniffer_enable(sniff_channel, DMA_SNIFF_CTRL_CALC_VALUE_CRC32R, true);
+    dma_sniffer_set_output_invert_enabled(true);
+}
+
+// CRC-32 of a page, computed by the DMA sniffer, while copying the page to
+// dst, or with dst NULL, just reading it.  With the bit-reversed variant,
+// an all-ones seed and inverted output this is the zlib crc32().
+static uint32_t sram_delta_page_crc(uint32_t page, uint32_t *dst) {
+    static uint32_t sink;
+
+    dma_channel_config c = dma_channel_get_default_config(sniff_channel);
+    channel_config_set_transfer_data_size(&c, DMA_SIZE_32);
+    channel_config_set_read_increment(&c, true);
+    channel_config_set_write_increment(&c, dst != NULL);
+    channel_config_set_sniff_enable(&c, true);
+
+    dma_sniffer_set_data_accumulator(0xFFFFFFFF);
+    dma_channel_configure(sniff_channel, &c, dst != NULL ? dst : &sink, (const void *)page_address(page),
+                          PICOVD_SRAM_DELTA_PAGE_SIZE_BYTES / 4, true);
+    dma_channel_wait_for_finish_blocking(sniff_channel);
+    return dma_sniffer_get_data_accumulator();
+}
+
+// Return the snapshot of a published record, taking it if needed
+static sram_delta_snapshot_t *sram_delta_snapshot(uint32_t record) {
+    for (uint32_t i = 0; i < SNAPSHOT_COUNT; i++) {
+        if (snapshots[i].record == record) {
+            snapshot_last = i;
+            return &snapshots[i];
+        }
+    }
+    // Replace the least recently used one
+    snapshot_last = (snapshot_last + 1) % SNAPSHOT_COUNT;
+    sram_delta_snapshot_t *snap = &snapshots[snapshot_last];
+    sram_delta_sniffer_enable();
+    snap->crc    = sram_delta_page_crc(published_pages[record], snap->data);
+    dma_sniffer_disable();
+    snap->record = record;
+    snap->served = 0;
+    return snap;
+}
+
+static void sram_delta_snapshots_clear(void) {
+    for (uint32_t i = 0; i < SNAPSHOT_COUNT; i++) {
+        snapshots[i].record = SNAPSHOT_NONE;
+    }
+}
+
+// Hash all pages and publish the ones that differ from what the host has seen.
+// Returns true if the file contents changed.
+static bool sram_delta_scan(void) {
+    uint32_t count = 0;
+    bool changed = false;
+
+    sram_delta_sniffer_enable();
+    for (uint32_t page = 0; page < PAGE_COUNT; page++) {
+        const uint32_t crc = sram_delta_page_crc(page, NULL);
+        if (crc != scanned_crc[page]) {
+            changed = true;
+        }
+        scanned_crc[page] = crc;
+        if (crc != reported_crc[page]) {
+            changed |= (count >= published_count || published_pages[count] != page);
+            published_pages[count++] = page;
+        }
+    }
+    dma_sniffer_disable();
+
+    changed |= (count != published_count);
+    published_count = count;
+    return changed;
+}
+
+void vd_files_sram_delta_task(void) {
+    if (sniff_channel < 0) {
+        return;
+    }
+    const uint32_t now_ms = to_ms_since_boot(get_absolute_time());
+
+    // Do not change the file under a host that is reading it
+    if (now_ms - last_access_ms < PICOVD_SRAM_DELTA_RESCAN_MS ||
+        now_ms - last_scan_ms   < PICOVD_SRAM_DELTA_RESCAN_MS) {
+        return;
+    }
+    last_scan_ms = now_ms;
+    if (sram_delta_scan()) {
+        // The records are renumbered, and their pages may have changed
+        sram_delta_snapshots_clear();
+        vd_update_file(&sram_delta_file, published_count * RECORD_SIZE);
+    }
+}
+
+static int32_t sram_delta_file_content_cb(uint32_t offset, void* buffer, uint32_t bufsize) {
+    uint8_t *buf  = (uint8_t *)buffer;
+    uint32_t done = 0;
+
+    last_access_ms = to_ms_since_boot(get_absolute_time());
+
+    while (done < bufsize) {
+        const uint32_t record = (offset + done) / RECORD_SIZE;
+        uint32_t       pos    = (offset + done) % RECORD_SIZE;
+        if (record >= published_count) {
+            break;
+        }
+        const uint32_t page  = published_pages[record];
+        const uint32_t start = pos;
+        sram_delta_snapshot_t *snap = sram_delta_snapshot(record);
+
+        if (pos < sizeof(vd_sram_delta_record_header_t)) {
+            const vd_sram_delta_record_header_t header = {
+                .address = page_address(page),
+                .crc32   = snap->crc,
+            };
+            uint32_t len = sizeof(header) - pos;
+            if (len > bufsize - done) {
+                len = bufsize - done;
+            }
+            memcpy(buf + done, (const uint8_t *)&header + pos, len);
+            done += len;
+            pos  += len;
+        }
+        if (done < bufsize) {
+            const uint32_t data_pos = pos - sizeof(vd_sram_delta_record_header_t);
+            uint32_t len = PICOVD_SRAM_DELTA_PAGE_SIZE_BYTES - data_pos;
+            if (len > bufsize - done) {
+                len = bufsize - done;
+            }
+            memcpy(buf + done, (const uint8_t *)snap->data + data_pos, len);
+            done += len;
+            pos  += len;
+        }
+
+        // Once the host has read the whole record, it has seen the snapshot
+        if (start <= snap->served && pos > snap->served) {
+            snap->served = pos;
+            if (snap->served == RECORD_SIZE) {
+                reported_crc[page] = snap->crc;
+            }
+        }
+    }
+    return done;
+}
+
+void vd_files_sram_delta_init(void) {
+    sniff_channel = dma_claim_unused_channel(false);
+    if (sniff_channel < 0) {
+        return; // No DMA channel left, no file
+    }
+    // Start from an empty baseline, so that the first read is a full snapshot
+    memset(reported_crc, 0, sizeof(reported_crc));
+    sram_delta_snapshots_clear();
+    (void)sram_delta_scan();
+    sram_delta_file.size_bytes = published_count * RECORD_SIZE;
+    sram_delta_file.lun        = VD_LUN_VOLATILE;
+    if (vd_add_file(&sram_delta_file, PAGE_COUNT * RECORD_SIZE) < 0) {
+        printf("Cannot add %s, skipping it\n", PICOVD_SRAM_DELTA_FILE_NAME);
+        dma_channel_unclaim(sniff_channel);
+        sniff_channel = -1; // No scans either
+    }
+}
+
+#else
+
+void vd_files_sram_delta_init(void) {}
+void vd_files_sram_delta_task(void) {}
+
+#endif // PICOVD_SRAM_DELTA_ENABLED
@@ -0,0 +1,28 @@
+#ifndef VD_FILES_SRAM_DELTA_H
+#define VD_FILES_SRAM_DELTA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Record header in SRAM-DELTA.BIN, followed by the page contents
+typedef struct __attribute__((packed)) {
+    uint32_t address; // Start address of the page
+    uint32_t crc32;   // CRC-32 of the page contents in the record, as zlib crc32()
+} vd_sram_delta_record_header_t;
+
+// Initialize SRAM-DELTA.BIN, listing the SRAM pages changed since the last complete read
+void vd_files_sram_delta_init(void);
+
+// Rescan the SRAM for changed pages, when due.
+// Call regularly from the main loop, e.g. next to tud_task().
+void vd_files_sram_delta_task(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // VD_FILES_SRAM_DELTA_H
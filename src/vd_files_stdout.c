@@ -7,6 +7,7 @@
 #include "stdio_ring_buffer.h"
 #include "tusb_config.h"
 #include "vd_files_stdout.h"
+#include "vd_handoff.h"
 
 // Timer to notify the host every UA_TIMEOUT_SEC seconds if no data has been written and not read
 static alarm_id_t tail_timeout_alarm = 0;
@@ -17,12 +18,13 @@ static int32_t stdout_file_content_cb(uint32_t offset, void* buf, uint32_t bufsi
 }
 
 // --- STDOUT-TAIL.TXT (tail -F semantics) ---
+#define STDOUT_TAIL_WINDOW_GRANULE 64 // Grow the tail file in steps of this many bytes
 static size_t stdout_tail_total_read = 0;
 static time_t stdout_tail_last_read_time = 0;
 static volatile int stdout_tail_ua_pending = 0;
 
 static size_t tail_file_window_start = 0; // Absolute offset in the stream
-static size_t tail_file_window_size = 0;  // Always a multiple of CFG_TUD_MSC_EP_BUFSIZE
+static size_t tail_file_window_size = 0;  // Always a multiple of STDOUT_TAIL_WINDOW_GRANULE
 
 static int32_t stdout_tail_file_content_cb(uint32_t offset, void* buf, uint32_t bufsize) {
     // Only allow reads within the current window
@@ -58,8 +60,8 @@ PICOVD_DEFINE_FILE_RUNTIME(
 // Update file sizes and trigger SCSI UA 0x28 (media change)
 static void notify_files_changed(size_t total_bytes_written) {
     size_t unread = total_bytes_written - stdout_tail_total_read;
-    // Truncate to previous multiple of CFG_TUD_MSC_EP_BUFSIZE
-    size_t rounded_unread = (unread / CFG_TUD_MSC_EP_BUFSIZE) * CFG_TUD_MSC_EP_BUFSIZE;
+    // Truncate to previous multiple of STDOUT_TAIL_WINDOW_GRANULE
+    size_t rounded_unread = (unread / STDOUT_TAIL_WINDOW_GRANULE) * STDOUT_TAIL_WINDOW_GRANULE;
     // The window starts at the oldest unread byte that fits in the rounded size
     tail_file_window_start = stdout_tail_total_read;
     tail_file_window_size = rounded_unread;
@@ -68,14 +70,41 @@ static void notify_files_changed(size_t total_bytes_written) {
     stdout_tail_ua_pending++;
 }
 
-static int64_t ua_timeout_cb(alarm_id_t id, void* user_data) {
+static void ua_timeout_handoff(void *ptr __unused, uint32_t value __unused) {
     notify_files_changed(ring_buffer_total_written(&stdio_ring_buffer_rb));
     tail_timeout_alarm = 0;
+}
+
+static int64_t ua_timeout_cb(alarm_id_t id, void* user_data) {
+    // The alarm IRQ may run on the application core
+    if (!vd_handoff_call(ua_timeout_handoff, NULL, 0)) {
+        tail_timeout_alarm = 0; // Queue full, the next write reschedules
+    }
     return 0;
 }
 
 // --- Notification and UA logic ---
+static void stdout_notify_write_cb(ring_buffer_t *const rb, size_t bytes_written, size_t total_bytes_written);
+
+// Writes from the application core are evaluated on the USB core,
+// once per batch of writes, with the total at that time
+static volatile bool stdout_notify_pending = false;
+
+static void stdout_notify_handoff(void *ptr __unused, uint32_t value __unused) {
+    stdout_notify_pending = false;
+    stdout_notify_write_cb(&stdio_ring_buffer_rb, 0, ring_buffer_total_written(&stdio_ring_buffer_rb));
+}
+
 static void stdout_notify_write_cb(ring_buffer_t *const rb, size_t bytes_written, size_t total_bytes_written) {
+    if (!vd_handoff_on_usb_core()) {
+        if (!stdout_notify_pending) {
+            stdout_notify_pending = true; // Before the call, the USB core may clear it at once
+            if (!vd_handoff_call(stdout_notify_handoff, NULL, 0)) {
+                stdout_notify_pending = false;
+            }
+        }
+        return;
+    }
     size_t unread = total_bytes_written - stdout_tail_total_read;
     // If host hasn't read new data for UA delay, schedule UA
     time_t now = to_ms_since_boot(get_absolute_time())/1000;;
@@ -93,6 +122,8 @@ static void stdout_notify_write_cb(ring_buffer_t *const rb, size_t bytes_written
 
 void vd_files_stdout_init(void) {
     stdio_ring_buffer_init(stdout_notify_write_cb);
+    stdout_dynamic_file.lun      = VD_LUN_VOLATILE;
+    stdout_dynamic_tail_file.lun = VD_LUN_VOLATILE;
     vd_add_file(&stdout_dynamic_file, 10 * 1024 * 1024);
     vd_add_file(&stdout_dynamic_tail_file, 10 * 1024 * 1024);
     // Initialize file sizes
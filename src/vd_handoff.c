@@ -0,0 +1,66 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <assert.h>
+
+#include <hardware/sync.h>
+#include <pico/platform.h>
+
+#include "picovd_config.h"
+
+#include "vd_handoff.h"
+
+// The queue is a ring of PICOVD_HANDOFF_QUEUE_LENGTH slots.  The head is
+// written only by the application core, the tail only by the USB core, so
+// neither needs a lock; the release/acquire pairs order the slot contents.
+
+#define QUEUE_MASK (PICOVD_HANDOFF_QUEUE_LENGTH - 1)
+
+static_assert((PICOVD_HANDOFF_QUEUE_LENGTH & QUEUE_MASK) == 0,
+              "PICOVD_HANDOFF_QUEUE_LENGTH must be a power of two");
+
+typedef struct {
+    vd_handoff_fn_t fn;
+    void           *ptr;
+    uint32_t        value;
+} vd_handoff_msg_t;
+
+static vd_handoff_msg_t queue[PICOVD_HANDOFF_QUEUE_LENGTH];
+static uint32_t queue_head = 0; ///< Next slot to write, by the application core
+static uint32_t queue_tail = 0; ///< Next slot to read, by the USB core
+
+static uint32_t usb_core = 0;
+
+void vd_handoff_set_usb_core(void) {
+    usb_core = get_core_num();
+}
+
+bool vd_handoff_on_usb_core(void) {
+    return get_core_num() == usb_core;
+}
+
+bool vd_handoff_call(vd_handoff_fn_t fn, void *ptr, uint32_t value) {
+    if (vd_handoff_on_usb_core()) {
+        fn(ptr, value);
+        return true;
+    }
+
+    const uint32_t irq_state = save_and_disable_interrupts();
+    const uint32_t head = queue_head;
+    const bool full = head - __atomic_load_n(&queue_tail, __ATOMIC_ACQUIRE) == PICOVD_HANDOFF_QUEUE_LENGTH;
+    if (!full) {
+        queue[head & QUEUE_MASK] = (vd_handoff_msg_t){ .fn = fn, .ptr = ptr, .value = value };
+        __atomic_store_n(&queue_head, head + 1, __ATOMIC_RELEASE);
+    }
+    restore_interrupts(irq_state);
+    return !full;
+}
+
+void vd_handoff_task(void) {
+    uint32_t tail = queue_tail;
+
+    while (tail != __atomic_load_n(&queue_head, __ATOMIC_ACQUIRE)) {
+        const vd_handoff_msg_t msg = queue[tail & QUEUE_MASK];
+        __atomic_store_n(&queue_tail, ++tail, __ATOMIC_RELEASE);
+        msg.fn(msg.ptr, msg.value);
+    }
+}
@@ -0,0 +1,51 @@
+#ifndef VD_HANDOFF_H
+#define VD_HANDOFF_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Function run on the USB core on behalf of the application core.
+ */
+typedef void (*vd_handoff_fn_t)(void *ptr, uint32_t value);
+
+/**
+ * @brief Make the calling core the one that runs TinyUSB and the PicoVD files.
+ *
+ * By default that is core 0.  Call this first thing on core 1
+ * when running the USB service there (PICOVD_USB_ON_CORE1).
+ */
+void vd_handoff_set_usb_core(void);
+
+/**
+ * @brief Return true if the caller runs on the USB core.
+ */
+bool vd_handoff_on_usb_core(void);
+
+/**
+ * @brief Run fn(ptr, value) on the USB core.
+ *
+ * On the USB core, fn is called directly.  On the other core, the call is
+ * placed in a lock-free single-producer, single-consumer queue, and run by
+ * vd_handoff_task().  Producers on the application core, the main loop and
+ * its IRQ handlers, are serialised by briefly masking interrupts.
+ *
+ * @return true if fn was called or queued, false if the queue was full.
+ */
+bool vd_handoff_call(vd_handoff_fn_t fn, void *ptr, uint32_t value);
+
+/**
+ * @brief Run the calls queued by the application core.
+ * Call regularly from the USB service loop, e.g. next to tud_task().
+ */
+void vd_handoff_task(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // VD_HANDOFF_H
@@ -0,0 +1,106 @@
+/**
+ * @file src/vd_time.c
+ * @brief Time base of the dynamic file timestamps.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <hardware/sync.h>
+#include <pico/time.h>
+#include <pico/aon_timer.h>
+
+#include "picovd_config.h"
+
+#include "vd_virtual_disk.h"
+#include "vd_exfat_dirs.h"
+#include "vd_time.h"
+
+// The wall-clock time at boot, in Unix epoch microseconds; the time since boot is
+// added to it.  Until the AON timer or vd_time_set() gives it, the build time.
+typedef enum {
+    TIME_BASE_BUILD,
+    TIME_BASE_AON_TIMER,
+    TIME_BASE_SET,
+} time_base_source_t;
+
+// Written and read on both cores: a 64-bit value is not written at once, so
+// it is guarded by a sequence counter, odd while a write is in progress.
+// Readers retry if it changed under them; writers take it by making it odd,
+// with the interrupts masked, so that no reader or writer on the same core
+// waits for them.
+static uint32_t           time_base_seq    = 0;
+static int64_t            time_base_us     = (int64_t)PICOVD_PARAM_STATIC_FILE_CREATION_TIME * 1000000;
+static time_base_source_t time_base_source = TIME_BASE_BUILD;
+
+static int64_t time_base_read(time_base_source_t *source) {
+    for (;;) {
+        const uint32_t seq = __atomic_load_n(&time_base_seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            continue; // Being written on the other core
+        }
+        const int64_t base_us = time_base_us;
+        *source = time_base_source;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&time_base_seq, __ATOMIC_RELAXED) == seq) {
+            return base_us;
+        }
+    }
+}
+
+// Set the time base from the given source.  The AON timer only replaces the build time.
+static void time_base_write(int64_t base_us, time_base_source_t source) {
+    const uint32_t irq_state = save_and_disable_interrupts();
+    uint32_t seq = __atomic_load_n(&time_base_seq, __ATOMIC_RELAXED);
+    while ((seq & 1) || !__atomic_compare_exchange_n(&time_base_seq, &seq, seq + 1,
+                                                     false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        seq = __atomic_load_n(&time_base_seq, __ATOMIC_RELAXED);
+    }
+    if (source != TIME_BASE_AON_TIMER || time_base_source == TIME_BASE_BUILD) {
+        time_base_us     = base_us;
+        time_base_source = source;
+    }
+    __atomic_store_n(&time_base_seq, seq + 2, __ATOMIC_RELEASE);
+    restore_interrupts(irq_state);
+}
+
+time_t vd_time_now(uint8_t *hundredths) {
+    const uint64_t now_us = to_us_since_boot(get_absolute_time());
+    time_base_source_t source;
+    int64_t base_us = time_base_read(&source);
+#if PICOVD_TIME_AON_TIMER_ENABLED
+    // The application may start the AON timer at any time; take it once it runs
+    struct timespec ts;
+    if (source == TIME_BASE_BUILD && aon_timer_is_running() && aon_timer_get_time(&ts)) {
+        time_base_write((int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000 - (int64_t)now_us, TIME_BASE_AON_TIMER);
+        base_us = time_base_read(&source);
+    }
+#endif
+    const int64_t us = base_us + (int64_t)now_us;
+    if (hundredths) {
+        *hundredths = (uint8_t)(us % 1000000 / 10000);
+    }
+    return (time_t)(us / 1000000);
+}
+
+void vd_time_set(time_t epoch_seconds) {
+    time_base_write((int64_t)epoch_seconds * 1000000 - (int64_t)to_us_since_boot(get_absolute_time()),
+                    TIME_BASE_SET);
+}
+
+// The exFAT date bits of today, the day most timestamps fall on
+static uint32_t today_days = 0;
+static uint32_t today_date = 0;
+
+uint32_t vd_time_exfat_timestamp(time_t epoch_seconds) {
+    if (epoch_seconds < VD_EXFAT_DIRS_EPOCH_1980) {
+        return vd_exfat_dirs_make_timestamp(epoch_seconds);
+    }
+    const uint32_t days = (uint32_t)(epoch_seconds / 86400);
+    if (days != today_days) {
+        today_date = vd_exfat_dirs_make_date(days);
+        today_days = days;
+    }
+    return today_date | vd_exfat_dirs_make_time((uint32_t)(epoch_seconds % 86400));
+}
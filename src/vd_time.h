@@ -0,0 +1,30 @@
+#ifndef VD_TIME_H
+#define VD_TIME_H
+
+#include <stdint.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Wall-clock time of the dynamic files, as Unix epoch seconds, and the hundredths
+// of a second past them in *hundredths, if not NULL.  The time runs from the boot
+// time base: the AON timer, if PICOVD_TIME_AON_TIMER_ENABLED and it is running,
+// else the last vd_time_set(), else PICOVD_PARAM_STATIC_FILE_CREATION_TIME.
+time_t vd_time_now(uint8_t *hundredths);
+
+// Set the wall-clock time, e.g. from the host or a network time source.
+// Takes precedence over the AON timer from then on.
+void vd_time_set(time_t epoch_seconds);
+
+// exFAT timestamp of Unix epoch seconds, see vd_exfat_dirs_make_timestamp().
+// The date of the last day converted is cached, so that the conversion of
+// the entry sets of the same day is a few divisions and adds.  USB core only.
+uint32_t vd_time_exfat_timestamp(time_t epoch_seconds);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // VD_TIME_H
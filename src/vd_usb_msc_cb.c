@@ -14,11 +14,17 @@
 #include <picovd_config.h>
 #include "vd_exfat_params.h"
 #include "vd_virtual_disk.h"
+#include "vd_handoff.h"
 
 #ifndef PICOVD_PARAM_USB_MSC_UA_MINIMUM_DELAY_MS
 #define PICOVD_PARAM_USB_MSC_UA_MINIMUM_DELAY_MS 5000
 #endif
 
+// LBA extents of the host reads tracked per LUN, see vd_virtual_disk_lun_range_changed()
+#ifndef PICOVD_PARAM_USB_MSC_READ_EXTENTS
+#define PICOVD_PARAM_USB_MSC_READ_EXTENTS 16
+#endif
+
 // Additional Sense Code and Qualifier for Write Protected (per SPC-4 §6.7)
 
 #ifndef SCSI_ASC_WRITE_PROTECTED
@@ -46,6 +52,47 @@
 #ifndef SCSI_CMD_WRITE16
 #define SCSI_CMD_WRITE16          0x8A
 #endif
+#ifndef SCSI_CMD_PREFETCH_10
+#define SCSI_CMD_PREFETCH_10      0x34
+#endif
+#ifndef SCSI_CMD_SYNCHRONIZE_CACHE_10
+#define SCSI_CMD_SYNCHRONIZE_CACHE_10 0x35
+#endif
+#ifndef SCSI_CMD_READ_16
+#define SCSI_CMD_READ_16          0x88
+#endif
+#ifndef SCSI_CMD_PREFETCH_16
+#define SCSI_CMD_PREFETCH_16      0x90
+#endif
+#ifndef SCSI_CMD_SYNCHRONIZE_CACHE_16
+#define SCSI_CMD_SYNCHRONIZE_CACHE_16 0x91
+#endif
+#ifndef SCSI_CMD_SERVICE_ACTION_IN_16
+#define SCSI_CMD_SERVICE_ACTION_IN_16 0x9E
+#endif
+#ifndef SCSI_CMD_REPORT_LUNS
+#define SCSI_CMD_REPORT_LUNS      0xA0
+#endif
+#define SCSI_SA_READ_CAPACITY_16  0x10 // SERVICE ACTION IN (16) service action
+
+// Additional Sense Codes for the commands answered here (SPC-4 §4.5.6)
+#define SCSI_ASC_NOT_READY              0x04 // With ASCQ 0x01: becoming ready
+#define SCSI_ASC_UNRECOVERED_READ_ERROR 0x11
+#define SCSI_ASC_INVALID_COMMAND        0x20
+#define SCSI_ASC_LBA_OUT_OF_RANGE       0x21
+#define SCSI_ASC_INVALID_FIELD_IN_CDB   0x24
+
+// READ CAPACITY (16) parameter data – SBC-3 §5.16.2
+typedef struct TU_ATTR_PACKED {
+  uint32_t last_lba_hi;     // Returned Logical Block Address (big-endian, 64 bits)
+  uint32_t last_lba_lo;
+  uint32_t block_size;      // Logical Block Length in Bytes (big-endian)
+  uint8_t  prot;            // No protection information
+  uint8_t  exponent;        // Logical blocks per physical block exponent
+  uint16_t lowest_aligned;  // Lowest Aligned Logical Block Address (big-endian)
+  uint8_t  reserved[16];
+} scsi_read_capacity16_resp_t;
+_Static_assert(sizeof(scsi_read_capacity16_resp_t) == 32, "SCSI Read Capacity (16) response size mismatch");
 
 #ifndef SCSI_CMD_MODE_SENSE_10
 #define SCSI_CMD_MODE_SENSE_10    0x5A
@@ -74,16 +121,192 @@ _Static_assert(sizeof(scsi_mode_sense10_resp_t) == 8, "SCSI Mode Sense (10) resp
  * re-read the entire disk, so it should be used sparingly.
  */
 
-static enum {
+typedef enum {
     VD_CHANGED_NOT_CHANGED                          = 0x00,
     // Need to fail on media non-removal request
     VD_CHANGED_NEED_MEDIUM_REQUEST_DISALLOW_FAILURE = 0x01,
     VD_CHANGED_NEED_UA_28H                          = 0x02,
     VD_CHANGED_NEED_ALL                             = 0x03,
-} vd_virtual_disk_contents_status = VD_CHANGED_NEED_MEDIUM_REQUEST_DISALLOW_FAILURE;
+} vd_contents_status_t;
+
+// Change state of each volume, so that a change raises a UA only on its own LUN
+static vd_contents_status_t vd_virtual_disk_contents_status[VD_LUN_COUNT] = {
+    [0 ... VD_LUN_COUNT - 1] = VD_CHANGED_NEED_MEDIUM_REQUEST_DISALLOW_FAILURE,
+};
+
+/*
+ * Change notification engine
+ *
+ * A Unit Attention makes the host drop its cache and remount the volume,
+ * so it is raised only when the host may hold stale data.  For each LUN we
+ * keep the LBA extents the host has read since its last Unit Attention or
+ * reconnect; a change outside of them needs no notification at all.
+ * The mount itself reads the boot region, the FAT, the allocation bitmap,
+ * the up-case table and the root directory, so a directory change always
+ * raises a Unit Attention, while a change to the data of a file not read
+ * yet raises none.  A hard reset (USB reconnect) only if asked for, and
+ * only if the host has read something.
+ *
+ * The extents are kept sorted and merged.  When there are more than
+ * PICOVD_PARAM_USB_MSC_READ_EXTENTS of them, the two closest ones are
+ * merged, so that the set errs on the side of notifying.
+ */
+
+typedef struct {
+    uint32_t start; // First LBA
+    uint32_t end;   // LBA after the last one
+} vd_lba_extent_t;
+
+typedef struct {
+    vd_lba_extent_t extents[PICOVD_PARAM_USB_MSC_READ_EXTENTS + 1]; // One spare for an insertion
+    uint32_t        count;
+} vd_lba_extent_set_t;
+
+static vd_lba_extent_set_t vd_read_extents[VD_LUN_COUNT];
+static vd_notify_stats_t   vd_notify_stats;
+
+// Add [start, end) to the set
+static void extent_set_add(vd_lba_extent_set_t *set, uint32_t start, uint32_t end) {
+    vd_lba_extent_t *e = set->extents;
+    uint32_t i = 0;
+
+    while (i < set->count && e[i].end < start) {
+        i++;
+    }
+    if (i < set->count && e[i].start <= end) {
+        // Overlaps or touches extent i: the common case of a sequential read
+        if (start < e[i].start) {
+            e[i].start = start;
+        }
+        if (end <= e[i].end) {
+            return;
+        }
+        e[i].end = end;
+        // Absorb the following extents now covered
+        uint32_t j = i + 1;
+        while (j < set->count && e[j].start <= end) {
+            if (e[j].end > e[i].end) {
+                e[i].end = e[j].end;
+            }
+            j++;
+        }
+        memmove(&e[i + 1], &e[j], (set->count - j) * sizeof(e[0]));
+        set->count -= j - (i + 1);
+        return;
+    }
+
+    memmove(&e[i + 1], &e[i], (set->count - i) * sizeof(e[0]));
+    e[i] = (vd_lba_extent_t){ start, end };
+    set->count++;
+
+    if (set->count > PICOVD_PARAM_USB_MSC_READ_EXTENTS) {
+        // Full: merge the two extents with the smallest gap between them
+        uint32_t best = 0;
+        for (uint32_t k = 1; k + 1 < set->count; k++) {
+            if (e[k + 1].start - e[k].end < e[best + 1].start - e[best].end) {
+                best = k;
+            }
+        }
+        e[best].end = e[best + 1].end;
+        memmove(&e[best + 1], &e[best + 2], (set->count - best - 2) * sizeof(e[0]));
+        set->count--;
+    }
+}
+
+// Does [start, end) overlap the set?
+static bool extent_set_overlaps(const vd_lba_extent_set_t *set, uint32_t start, uint32_t end) {
+    for (uint32_t i = 0; i < set->count && set->extents[i].start < end; i++) {
+        if (start < set->extents[i].end) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// The host has read [lba, end), and may now have it cached
+static void vd_read_extents_mark(uint8_t lun, uint32_t lba, uint32_t end) {
+    vd_lba_extent_set_t *const set = &vd_read_extents[lun];
+    // Fast path: within the last extent, e.g. a re-read after a retry
+    if (set->count == 0 || lba < set->extents[set->count - 1].start || end > set->extents[set->count - 1].end) {
+        extent_set_add(set, lba, end);
+    }
+}
+
+// The host drops its cache of the LUN: at a Unit Attention, or a reconnect
+static void vd_read_extents_clear(uint8_t lun) {
+    vd_read_extents[lun].count = 0;
+}
+
+bool vd_virtual_disk_lun_range_changed(uint8_t lun, uint32_t lba, uint32_t count) {
+    assert(lun < VD_LUN_COUNT);
+
+    vd_notify_stats.changes++;
+    if (vd_virtual_disk_contents_status[lun] & VD_CHANGED_NEED_UA_28H) {
+        vd_notify_stats.changes_coalesced++;
+        return true;
+    }
+    if (!extent_set_overlaps(&vd_read_extents[lun], lba, lba + count)) {
+        vd_notify_stats.changes_uncached++;
+        return false;
+    }
+    vd_virtual_disk_contents_status[lun] = VD_CHANGED_NEED_ALL;
+    return true;
+}
+
+void vd_virtual_disk_get_notify_stats(vd_notify_stats_t *stats) {
+    *stats = vd_notify_stats;
+}
+
+// Notifications the handoff queue had no room for, replayed by vd_virtual_disk_notify_task():
+// one bit per LUN, and CONTENTS_CHANGED_HARD_RESET
+static uint32_t contents_changed_missed = 0;
+
+#define CONTENTS_CHANGED_ALL_LUNS   ((1u << VD_LUN_COUNT) - 1)
+#define CONTENTS_CHANGED_HARD_RESET (1u << 31)
+
+void vd_virtual_disk_notify_task(void) {
+    const uint32_t missed = __atomic_exchange_n(&contents_changed_missed, 0, __ATOMIC_ACQUIRE);
+    if (missed == 0) {
+        return;
+    }
+    const bool hard_reset = (missed & CONTENTS_CHANGED_HARD_RESET) != 0;
+    if ((missed & CONTENTS_CHANGED_ALL_LUNS) == CONTENTS_CHANGED_ALL_LUNS) {
+        vd_virtual_disk_lun_contents_changed(VD_LUN_ALL, hard_reset);
+        return;
+    }
+    for (uint8_t i = 0; i < VD_LUN_COUNT; i++) {
+        if (missed & (1u << i)) {
+            vd_virtual_disk_lun_contents_changed(i, hard_reset);
+        }
+    }
+}
+
+static void vd_virtual_disk_contents_changed_handoff(void *lun, uint32_t hard_reset) {
+    vd_virtual_disk_lun_contents_changed((uintptr_t)lun, hard_reset);
+}
 
 void vd_virtual_disk_contents_changed(bool hard_reset) {
-    vd_virtual_disk_contents_status = VD_CHANGED_NEED_ALL;
+    vd_virtual_disk_lun_contents_changed(VD_LUN_ALL, hard_reset);
+}
+
+void vd_virtual_disk_lun_contents_changed(uint8_t lun, bool hard_reset) {
+    if (!vd_handoff_on_usb_core()) {
+        // Called from the application core: only the USB core may touch TinyUSB
+        if (!vd_handoff_call(vd_virtual_disk_contents_changed_handoff, (void *)(uintptr_t)lun, hard_reset)) {
+            // Queue full: remember it for vd_virtual_disk_notify_task()
+            const uint32_t luns = lun == VD_LUN_ALL ? CONTENTS_CHANGED_ALL_LUNS : 1u << lun;
+            (void)__atomic_fetch_or(&contents_changed_missed,
+                                    luns | (hard_reset ? CONTENTS_CHANGED_HARD_RESET : 0), __ATOMIC_RELEASE);
+        }
+        return;
+    }
+    // The whole volume may have changed
+    bool notified = false;
+    for (uint8_t i = 0; i < VD_LUN_COUNT; i++) {
+        if (lun == VD_LUN_ALL || lun == i) {
+            notified |= vd_virtual_disk_lun_range_changed(i, 0, MSC_TOTAL_BLOCKS);
+        }
+    }
 
     // Drop the USB connection to notify the host
     // that the disk contents have changed.
@@ -93,7 +316,16 @@ void vd_virtual_disk_contents_changed(bool hard_reset) {
     // and we need to ensure it sees the new contents.
     // This is a workaround for the fact that the host may not
     // automatically re-read the disk contents when they change.
+    // Not needed if the host has read nothing yet, e.g. before the mount.
     if (hard_reset) {
+      if (!notified) {
+        vd_notify_stats.hard_resets_avoided++;
+        return;
+      }
+      vd_notify_stats.hard_resets++;
+      for (uint8_t i = 0; i < VD_LUN_COUNT; i++) {
+        vd_read_extents_clear(i);
+      }
       tud_disconnect();      // remove D+ pull-up
       sleep_ms(3);          // host will see device vanish
       tud_connect();         // re-enumerate as a brand-new device
@@ -118,17 +350,26 @@ void vd_virtual_disk_contents_changed(bool hard_reset) {
 
  #if CFG_TUD_MSC
 
+// Number of LUNs: two exFAT volumes with PICOVD_MULTI_LUN_ENABLED, otherwise one
+uint8_t tud_msc_get_maxlun_cb(void)
+{
+    return VD_LUN_COUNT;
+}
+
 // Read10 callback: serve LBA regions defined in the lba_regions table
-int32_t tud_msc_read10_cb(uint8_t lun         __unused,
+int32_t tud_msc_read10_cb(uint8_t lun,
                           uint32_t lba,
                           uint32_t offset,
                           void*    buffer,
                           uint32_t bufsize)
 {
-    // Enforce single LUN, full-sector, offset-zero semantics
-    assert(lun == 0);
+    assert(lun < VD_LUN_COUNT);
+
+    vd_read_extents_mark(lun, lba, lba + (offset + bufsize + MSC_BLOCK_SIZE - 1) / MSC_BLOCK_SIZE);
 
-    return vd_virtual_disk_read(lba, offset, buffer, bufsize);
+    // Returns 0 while a content callback has a read pending (VD_READ_PENDING).
+    // TinyUSB treats that as busy, and calls us again from tud_task().
+    return vd_virtual_disk_read(lun, lba, offset, buffer, bufsize);
 }
 
 #define PICOVD_MSC_PRODUCT_NAME    PICO_PROGRAM_NAME "                "
@@ -162,8 +403,8 @@ bool tud_msc_prevent_allow_medium_removal_cb(uint8_t lun,
                                             uint8_t prevent,
                                             uint8_t control)
 {
-    if (vd_virtual_disk_contents_status &   VD_CHANGED_NEED_MEDIUM_REQUEST_DISALLOW_FAILURE) {
-        vd_virtual_disk_contents_status &= ~VD_CHANGED_NEED_MEDIUM_REQUEST_DISALLOW_FAILURE;
+    if (vd_virtual_disk_contents_status[lun] &   VD_CHANGED_NEED_MEDIUM_REQUEST_DISALLOW_FAILURE) {
+        vd_virtual_disk_contents_status[lun] &= ~VD_CHANGED_NEED_MEDIUM_REQUEST_DISALLOW_FAILURE;
         return false;
     }
     return true;
@@ -221,19 +462,21 @@ int32_t tud_msc_write10_cb(uint8_t lun,
 // that the host should re-read the disk.
 bool tud_msc_test_unit_ready_cb(uint8_t lun)
 {
-    if (vd_virtual_disk_contents_status &   VD_CHANGED_NEED_UA_28H) {
+    if (vd_virtual_disk_contents_status[lun] &   VD_CHANGED_NEED_UA_28H) {
 
         // Rate limit UA requests to prevent excessive refresh requests
-        static uint32_t last_ua_time;
+        static uint32_t last_ua_time[VD_LUN_COUNT];
         uint32_t now = to_ms_since_boot(get_absolute_time());
-        if (now - last_ua_time < PICOVD_PARAM_USB_MSC_UA_MINIMUM_DELAY_MS) {
+        if (now - last_ua_time[lun] < PICOVD_PARAM_USB_MSC_UA_MINIMUM_DELAY_MS) {
             return true;
         }
-        last_ua_time = now;
+        last_ua_time[lun] = now;
 
-        vd_virtual_disk_contents_status &= ~VD_CHANGED_NEED_UA_28H;
+        vd_virtual_disk_contents_status[lun] &= ~VD_CHANGED_NEED_UA_28H;
+        vd_notify_stats.unit_attentions++;
+        vd_read_extents_clear(lun);
 
-        tud_msc_set_sense(0,
+        tud_msc_set_sense(lun,
             SCSI_SENSE_UNIT_ATTENTION,
             SCSI_ASC_MEDIUM_MAY_HAVE_CHANGED,
             0x00);
@@ -242,48 +485,177 @@ bool tud_msc_test_unit_ready_cb(uint8_t lun)
     return true;
 }
 
+/*
+ * Commands not handled by TinyUSB itself, dispatched through a table indexed
+ * by the operation code.  TinyUSB answers READ (10), READ CAPACITY (10),
+ * INQUIRY, MODE SENSE (6), REQUEST SENSE, TEST UNIT READY, START STOP UNIT
+ * and PREVENT ALLOW MEDIUM REMOVAL with the callbacks above.  Linux also
+ * issues the 16-byte variants, REPORT LUNS, PRE-FETCH and SYNCHRONIZE CACHE,
+ * which are answered here rather than failed, to spare the host its retries.
+ *
+ * A handler returns the number of response bytes in the buffer,
+ * 0 for none, or TUD_MSC_RET_ERROR after setting the sense data.
+ */
+
+typedef int32_t (*vd_scsi_handler_t)(uint8_t lun, uint8_t const cdb[16], void *buffer, uint16_t bufsize);
+
+static inline uint32_t scsi_get_be32(uint8_t const *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static inline uint64_t scsi_get_be64(uint8_t const *p) {
+    return ((uint64_t)scsi_get_be32(p) << 32) | scsi_get_be32(p + 4);
+}
+
+static int32_t scsi_fail(uint8_t lun, uint8_t sense_key, uint8_t asc, uint8_t ascq) {
+    tud_msc_set_sense(lun, sense_key, asc, ascq);
+    return TUD_MSC_RET_ERROR;
+}
+
+// Logical block range of a 10-byte (group 1) or 16-byte (group 4) CDB,
+// checked against the capacity.  A count of 0 means up to the last block.
+static bool scsi_get_range(uint8_t lun, uint8_t const cdb[16], uint64_t *lba, uint32_t *count) {
+    if (cdb[0] >= 0x80) {
+        *lba   = scsi_get_be64(&cdb[2]);
+        *count = scsi_get_be32(&cdb[10]);
+    } else {
+        *lba   = scsi_get_be32(&cdb[2]);
+        *count = ((uint32_t)cdb[7] << 8) | cdb[8];
+    }
+    if (*lba >= MSC_TOTAL_BLOCKS || *count > MSC_TOTAL_BLOCKS - *lba) {
+        tud_msc_set_sense(lun, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ASC_LBA_OUT_OF_RANGE, 0x00);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Reject any SCSI commands that would alter the medium on a read-only device.
+ * Always report Data Protect (Write Protected) sense per SPC-4 §6.7.
+ */
+static int32_t scsi_write_protected(uint8_t lun, uint8_t const cdb[16], void *buffer, uint16_t bufsize) {
+    (void)cdb; (void)buffer; (void)bufsize;
+    return scsi_fail(lun, SCSI_SENSE_DATA_PROTECT, SCSI_ASC_WRITE_PROTECTED, SCSI_ASCQ_WRITE_PROTECTED);
+}
+
+/*
+ * Handle MODE SENSE (10) to report a write-protected medium.
+ * This responds with a Mode Parameter Header (SPC-4 §5.5.4) with the Write-Protect bit set,
+ * so the host recognizes the device as read-only. No block descriptors or mode pages are returned.
+ */
+static int32_t scsi_mode_sense10(uint8_t lun, uint8_t const cdb[16], void *buffer, uint16_t bufsize) {
+    (void)lun; (void)cdb; (void)bufsize;
+    scsi_mode_sense10_resp_t* resp = (scsi_mode_sense10_resp_t*)buffer;
+    memset(resp, 0, sizeof(*resp));
+    // Mode Data Length = total bytes following data_len field (sizeof(header)-2)
+    resp->data_len = tu_htons(sizeof(*resp) - 2);
+    // Byte-3 (Device-Specific Parameter): set Write-Protect bit (0x80)
+    resp->dev_spec_params = 0x80;
+    // Block Descriptor Length = 0 (bytes 4-5 already zeroed)
+    return sizeof(*resp);
+}
+
+/*
+ * READ (16), SBC-3 §5.8: through vd_virtual_disk_read(), as READ (10).
+ * TinyUSB returns the response of this callback in one buffer, so a command
+ * may read at most CFG_TUD_MSC_EP_BUFSIZE bytes.  Hosts use READ (16) only
+ * beyond the 32-bit LBAs of READ (10), i.e. not for this disk.
+ */
+static int32_t scsi_read16(uint8_t lun, uint8_t const cdb[16], void *buffer, uint16_t bufsize) {
+    uint64_t lba;
+    uint32_t count;
+    if (!scsi_get_range(lun, cdb, &lba, &count)) {
+        return TUD_MSC_RET_ERROR;
+    }
+    if (count > bufsize / MSC_BLOCK_SIZE) {
+        return scsi_fail(lun, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ASC_INVALID_FIELD_IN_CDB, 0x00);
+    }
+    if (count == 0) {
+        return 0;
+    }
+    vd_read_extents_mark(lun, lba, lba + count);
+    const int32_t rc = vd_virtual_disk_read(lun, lba, 0, buffer, count * MSC_BLOCK_SIZE);
+    if (rc == 0) {
+        // A deferred read (VD_READ_PENDING) cannot be waited for here:
+        // the host retries, and the retry picks up the completed read
+        return scsi_fail(lun, SCSI_SENSE_NOT_READY, SCSI_ASC_NOT_READY, 0x01);
+    }
+    if (rc < 0) {
+        return scsi_fail(lun, SCSI_SENSE_MEDIUM_ERROR, SCSI_ASC_UNRECOVERED_READ_ERROR, 0x00);
+    }
+    return rc;
+}
+
+// SERVICE ACTION IN (16), SBC-3 §5.16: only READ CAPACITY (16)
+static int32_t scsi_service_action_in16(uint8_t lun, uint8_t const cdb[16], void *buffer, uint16_t bufsize) {
+    (void)bufsize;
+    if ((cdb[1] & 0x1F) != SCSI_SA_READ_CAPACITY_16) {
+        return scsi_fail(lun, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ASC_INVALID_FIELD_IN_CDB, 0x00);
+    }
+    scsi_read_capacity16_resp_t *resp = (scsi_read_capacity16_resp_t *)buffer;
+    memset(resp, 0, sizeof(*resp));
+    resp->last_lba_lo = tu_htonl(MSC_TOTAL_BLOCKS - 1);
+    resp->block_size  = tu_htonl(MSC_BLOCK_SIZE);
+    // A 4 KB cluster, one flash page, is the unit the reads are best aligned to
+    resp->exponent    = EXFAT_SECTORS_PER_CLUSTER_SHIFT;
+
+    const uint32_t alloc_len = scsi_get_be32(&cdb[10]);
+    return alloc_len < sizeof(*resp) ? alloc_len : sizeof(*resp);
+}
+
+// REPORT LUNS, SPC-4 §6.33: LUNs 0 to VD_LUN_COUNT - 1, peripheral device addressing
+static int32_t scsi_report_luns(uint8_t lun, uint8_t const cdb[16], void *buffer, uint16_t bufsize) {
+    (void)lun;
+    uint8_t *resp = buffer;
+    const uint32_t size = 8 + 8 * VD_LUN_COUNT;
+    assert(size <= bufsize);
+    memset(resp, 0, size);
+    *(uint32_t *)resp = tu_htonl(8 * VD_LUN_COUNT); // LUN list length
+    for (uint32_t i = 0; i < VD_LUN_COUNT; i++) {
+        resp[8 + 8 * i + 1] = i;
+    }
+    const uint32_t alloc_len = scsi_get_be32(&cdb[6]);
+    return alloc_len < size ? alloc_len : size;
+}
+
+// PRE-FETCH and SYNCHRONIZE CACHE (10/16), SBC-3 §5.4, §5.22: nothing to do
+// for a read-only disk whose contents are generated on demand, beyond
+// checking the range
+static int32_t scsi_check_range(uint8_t lun, uint8_t const cdb[16], void *buffer, uint16_t bufsize) {
+    (void)buffer; (void)bufsize;
+    uint64_t lba;
+    uint32_t count;
+    return scsi_get_range(lun, cdb, &lba, &count) ? 0 : TUD_MSC_RET_ERROR;
+}
+
+static const vd_scsi_handler_t vd_scsi_handlers[256] = {
+    [SCSI_CMD_MODE_SELECT_6]        = scsi_write_protected,
+    [SCSI_CMD_MODE_SELECT_10]       = scsi_write_protected,
+    [SCSI_CMD_UNMAP]                = scsi_write_protected,
+    [SCSI_CMD_FORMAT_UNIT]          = scsi_write_protected,
+    [SCSI_CMD_WRITE12]              = scsi_write_protected,
+    [SCSI_CMD_WRITE16]              = scsi_write_protected,
+    [SCSI_CMD_MODE_SENSE_10]        = scsi_mode_sense10,
+    [SCSI_CMD_READ_16]              = scsi_read16,
+    [SCSI_CMD_SERVICE_ACTION_IN_16] = scsi_service_action_in16,
+    [SCSI_CMD_REPORT_LUNS]          = scsi_report_luns,
+    [SCSI_CMD_PREFETCH_10]          = scsi_check_range,
+    [SCSI_CMD_PREFETCH_16]          = scsi_check_range,
+    [SCSI_CMD_SYNCHRONIZE_CACHE_10] = scsi_check_range,
+    [SCSI_CMD_SYNCHRONIZE_CACHE_16] = scsi_check_range,
+};
+
 int32_t tud_msc_scsi_cb(uint8_t lun,
                         uint8_t const scsi_cmd[16],
                         void* buffer,
                         uint16_t bufsize)
 {
-    switch (scsi_cmd[0]) {
-    /*
-     * Reject any SCSI commands that would alter the medium on a read-only device.
-     * Always report Data Protect (Write Protected) sense per SPC-4 §6.7.
-     */
-    case SCSI_CMD_MODE_SELECT_6:
-    case SCSI_CMD_MODE_SELECT_10:
-    case SCSI_CMD_UNMAP:
-    case SCSI_CMD_FORMAT_UNIT:
-    case SCSI_CMD_WRITE12:
-    case SCSI_CMD_WRITE16:
-        tud_msc_set_sense(lun,
-                    SCSI_SENSE_DATA_PROTECT,
-                    SCSI_ASC_WRITE_PROTECTED,
-                    SCSI_ASCQ_WRITE_PROTECTED);
-        return TUD_MSC_RET_ERROR;
-
-    /*
-     * Handle MODE SENSE (10) to report a write-protected medium.
-     * This responds with a Mode Parameter Header (SPC-4 §5.5.4) with the Write-Protect bit set,
-     * so the host recognizes the device as read-only. No block descriptors or mode pages are returned.
-     */
-    case SCSI_CMD_MODE_SENSE_10:
-    {
-        scsi_mode_sense10_resp_t* resp = (scsi_mode_sense10_resp_t*)buffer;
-        memset(resp, 0, sizeof(*resp));
-        // Mode Data Length = total bytes following data_len field (sizeof(header)-2)
-        resp->data_len = tu_htons(sizeof(*resp) - 2);
-        // Byte-3 (Device-Specific Parameter): set Write-Protect bit (0x80)
-        resp->dev_spec_params = 0x80;
-        // Block Descriptor Length = 0 (bytes 4-5 already zeroed)
-        return sizeof(*resp);
-    }
-    default:
-        // For all other commands, fallback to default (unrecognized command)
-        return -1;
+    const vd_scsi_handler_t handler = vd_scsi_handlers[scsi_cmd[0]];
+    if (handler == NULL) {
+        // Unknown command: Illegal Request, Invalid Command Operation Code
+        return scsi_fail(lun, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ASC_INVALID_COMMAND, 0x00);
     }
+    return handler(lun, scsi_cmd, buffer, bufsize);
 }
 
 bool tud_msc_is_writable_cb(uint8_t lun) {
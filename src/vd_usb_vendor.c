@@ -0,0 +1,272 @@
+/**
+ * @file src/vd_usb_vendor.c
+ * @brief Vendor bulk fast path for raw memory and file reads, see vd_usb_vendor.h
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <assert.h>
+#include <string.h>
+
+#include <tusb.h>
+
+#include <picovd_config.h>
+#include "vd_virtual_disk.h"
+#include "vd_exfat.h"
+#include "vd_exfat_params.h"
+#include "vd_exfat_dirs.h"
+#include "vd_files_rp2350.h"
+#include "vd_usb_vendor.h"
+
+#if PICOVD_VENDOR_BULK_ENABLED
+
+// The memory regions, as in PICOVD_MEMORY_REGIONS, with their sector readers
+#define VD_MEMORY_REGION_VENDOR_INFO(id, CFG) {        \
+    .base_address  = PICOVD_ ## CFG ## _BASE_ADDRESS,  \
+    .size_bytes    = PICOVD_ ## CFG ## _SIZE_BYTES,    \
+    .first_cluster = PICOVD_ ## CFG ## _START_CLUSTER, \
+    .name          = PICOVD_ ## CFG ## _FILE_NAME,     \
+},
+static const vd_vendor_region_t region_info[] = {
+    PICOVD_MEMORY_REGIONS(VD_MEMORY_REGION_VENDOR_INFO)
+};
+#undef VD_MEMORY_REGION_VENDOR_INFO
+
+#define VD_MEMORY_REGION_VENDOR_READER(id, CFG) \
+    { vd_file_sector_get_ ## id, PICOVD_ ## CFG ## _START_LBA },
+static const struct {
+    usb_msc_lba_read10_fn_t reader;
+    uint32_t                start_lba;
+} region_reader[] = {
+    PICOVD_MEMORY_REGIONS(VD_MEMORY_REGION_VENDOR_READER)
+};
+#undef VD_MEMORY_REGION_VENDOR_READER
+
+#define REGION_COUNT (sizeof(region_info) / sizeof(region_info[0]))
+
+// The request being answered.  Its data is produced in chunks, as far as the
+// IN FIFO has room, so that a long read does not hold up the USB service loop.
+static struct {
+    bool                 active;
+    vd_vendor_request_t  request;
+    vd_vendor_response_t header;
+    uint32_t             header_sent;  // Header bytes written to the FIFO
+    uint32_t             pos;          // Data bytes written to the FIFO
+    uint32_t             padding;      // Padding bytes still to write after the data
+    uint32_t             busy_size;    // Size of the chunk a deferred read is pending for, or 0
+    uint32_t             region_idx;   // VD_VENDOR_OP_READ_MEM: region of the address
+} current;
+
+static uint8_t chunk_buf[CFG_TUD_VENDOR_TX_BUFSIZE];
+
+// Return the region containing [address, address + length), or REGION_COUNT
+static uint32_t find_region(uint32_t address, uint32_t length) {
+    for (uint32_t i = 0; i < REGION_COUNT; i++) {
+        const uint64_t offset = (uint64_t)address - region_info[i].base_address;
+        if (address >= region_info[i].base_address &&
+            offset + length <= region_info[i].size_bytes) {
+            return i;
+        }
+    }
+    return REGION_COUNT;
+}
+
+static inline uint32_t file_record_size(const vd_dynamic_file_t *file) {
+    return sizeof(vd_vendor_file_t) + file->name_length * sizeof(char16_t);
+}
+
+// Fill the response header for a new request
+static void start_response(void) {
+    const vd_vendor_request_t *req = &current.request;
+
+    current.header = (vd_vendor_response_t){
+        .opcode = req->opcode,
+        .status = VD_VENDOR_STATUS_OK,
+        .tag    = req->tag,
+        .length = 0,
+    };
+    current.header_sent = 0;
+    current.pos         = 0;
+    current.busy_size   = 0;
+
+    switch (req->opcode) {
+    case VD_VENDOR_OP_READ_MEM:
+        current.region_idx = find_region(req->arg0, req->length);
+        if (current.region_idx == REGION_COUNT) {
+            current.header.status = VD_VENDOR_STATUS_OUT_OF_RANGE;
+            break;
+        }
+        current.header.length = req->length;
+        break;
+    case VD_VENDOR_OP_LIST_REGIONS:
+        current.header.length = sizeof(region_info);
+        break;
+    case VD_VENDOR_OP_LIST_FILES: {
+        const vd_dynamic_file_t *file;
+        for (size_t i = 0; (file = vd_exfat_dir_get_file(i)) != NULL; i++) {
+            current.header.length += file_record_size(file);
+        }
+        break;
+    }
+    case VD_VENDOR_OP_READ_FILE: {
+        const vd_dynamic_file_t *file = vd_exfat_dir_get_file(req->arg0);
+        if (file == NULL) {
+            current.header.status = VD_VENDOR_STATUS_NO_FILE;
+            break;
+        }
+        // Clamp to the end of the file, as a read() would
+        if (req->arg1 < file->size_bytes) {
+            const uint32_t left = file->size_bytes - req->arg1;
+            current.header.length = req->length < left ? req->length : left;
+        }
+        break;
+    }
+    default:
+        current.header.status = VD_VENDOR_STATUS_BAD_REQUEST;
+        break;
+    }
+    if (current.header.status != VD_VENDOR_STATUS_OK) {
+        current.header.length = 0;
+    }
+    const uint32_t total = sizeof(current.header) + current.header.length;
+    current.padding = (VD_VENDOR_PACKET_SIZE - total % VD_VENDOR_PACKET_SIZE) % VD_VENDOR_PACKET_SIZE;
+}
+
+// Produce the file list bytes [pos, pos + size)
+static int32_t list_files_data(uint32_t pos, uint8_t *buf, uint32_t size) {
+    const vd_dynamic_file_t *file;
+    uint32_t done = 0;
+    uint32_t record_start = 0;
+
+    for (size_t i = 0; (file = vd_exfat_dir_get_file(i)) != NULL && done < size; i++) {
+        const uint32_t record_size = file_record_size(file);
+        if (pos + done >= record_start + record_size) {
+            record_start += record_size;
+            continue; // Requested slice starts after this record
+        }
+        const vd_vendor_file_t record = {
+            .size_bytes  = file->size_bytes,
+            .lun         = file->lun,
+            .name_length = file->name_length,
+        };
+        for (uint32_t p = pos + done - record_start; p < record_size && done < size; p++) {
+            buf[done++] = p < sizeof(record)
+                        ? ((const uint8_t *)&record)[p]
+                        : ((const uint8_t *)file->name)[p - sizeof(record)];
+        }
+        record_start += record_size;
+    }
+    return done;
+}
+
+// Produce the response data bytes [pos, pos + size).  Returns the number of
+// bytes produced, 0 if a deferred read is still pending, or negative on error.
+static int32_t response_data(uint32_t pos, uint8_t *buf, uint32_t size) {
+    const vd_vendor_request_t *req = &current.request;
+
+    switch (req->opcode) {
+    case VD_VENDOR_OP_READ_MEM: {
+        // The same readers as the memory region files, at the file offset of the address
+        const uint32_t offset = req->arg0 - region_info[current.region_idx].base_address + pos;
+        return region_reader[current.region_idx].reader(
+            region_reader[current.region_idx].start_lba + offset / MSC_BLOCK_SIZE,
+            offset % MSC_BLOCK_SIZE, buf, size);
+    }
+    case VD_VENDOR_OP_LIST_REGIONS:
+        memcpy(buf, (const uint8_t *)region_info + pos, size);
+        return size;
+    case VD_VENDOR_OP_LIST_FILES:
+        return list_files_data(pos, buf, size);
+    case VD_VENDOR_OP_READ_FILE: {
+        // Through the virtual disk, at the file's clusters, so that the
+        // deferred reads (VD_READ_PENDING) work as they do for the MSC
+        const vd_dynamic_file_t *file = vd_exfat_dir_get_file(req->arg0);
+        if (file == NULL) {
+            return -1; // Removed while being read
+        }
+        const uint32_t offset = req->arg1 + pos;
+        return vd_virtual_disk_read_by(VD_READ_OWNER_VENDOR, file->lun,
+                                       EXFAT_CLUSTER_TO_LBA(file->first_cluster) + offset / MSC_BLOCK_SIZE,
+                                       offset % MSC_BLOCK_SIZE, buf, size);
+    }
+    default:
+        return -1;
+    }
+}
+
+// Write as much of the current response as the FIFO has room for.
+// Returns true once the response is complete.
+static bool continue_response(void) {
+    if (current.header_sent < sizeof(current.header)) {
+        current.header_sent += tud_vendor_write((const uint8_t *)&current.header + current.header_sent,
+                                                sizeof(current.header) - current.header_sent);
+        if (current.header_sent < sizeof(current.header)) {
+            return false;
+        }
+    }
+
+    while (current.pos < current.header.length) {
+        uint32_t size = current.header.length - current.pos;
+        if (size > sizeof(chunk_buf)) {
+            size = sizeof(chunk_buf);
+        }
+        if (current.busy_size) {
+            size = current.busy_size; // Retry the deferred read with the same arguments
+        } else if (size > tud_vendor_write_available()) {
+            size = tud_vendor_write_available();
+        }
+        if (size == 0 || size > tud_vendor_write_available()) {
+            return false; // FIFO full
+        }
+
+        int32_t rc = response_data(current.pos, chunk_buf, size);
+        if (rc == 0) {
+            current.busy_size = size;
+            return false; // Deferred read pending, retry at the next task
+        }
+        current.busy_size = 0;
+        if (rc < 0) {
+            // The header is already out: send zeros, as the length promised
+            memset(chunk_buf, 0, size);
+            rc = size;
+        }
+        current.pos += tud_vendor_write(chunk_buf, rc);
+    }
+
+    static const uint8_t zeros[VD_VENDOR_PACKET_SIZE];
+    current.padding -= tud_vendor_write(zeros, current.padding);
+    return current.padding == 0;
+}
+
+void vd_usb_vendor_task(void) {
+    if (!tud_vendor_mounted()) {
+        if (current.active) {
+            // Drop the response in progress, and its deferred read, if any
+            vd_virtual_disk_read_abort(VD_READ_OWNER_VENDOR);
+            current.active    = false;
+            current.busy_size = 0;
+        }
+        return;
+    }
+    while (true) {
+        if (!current.active) {
+            if (tud_vendor_available() < sizeof(current.request)) {
+                break;
+            }
+            tud_vendor_read(&current.request, sizeof(current.request));
+            start_response();
+            current.active = true;
+        }
+        if (!continue_response()) {
+            break;
+        }
+        current.active = false;
+    }
+    tud_vendor_write_flush();
+}
+
+#else
+
+void vd_usb_vendor_task(void) {}
+
+#endif // PICOVD_VENDOR_BULK_ENABLED
@@ -0,0 +1,80 @@
+#ifndef VD_USB_VENDOR_H
+#define VD_USB_VENDOR_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Vendor bulk protocol, on a vendor-specific interface with one bulk OUT and
+// one bulk IN endpoint, see PICOVD_VENDOR_BULK_ENABLED.
+//
+// The host writes requests to the OUT endpoint, any number back to back.
+// The device answers each one, in order, on the IN endpoint: a response
+// header, followed by exactly `length` bytes of data, zero padded to a
+// multiple of VD_VENDOR_PACKET_SIZE.  The padding lets the host read each
+// response as whole packets, without a transfer running into the next one.
+// The host may keep several requests in flight to keep the IN endpoint busy;
+// the device buffers up to CFG_TUD_VENDOR_RX_BUFSIZE bytes of requests.
+// All fields are little endian.
+//
+// The reads bypass the SCSI layer, the exFAT layout and the host page cache:
+// the memory regions are read with the same readers as FLASH.BIN and friends,
+// and the dynamic files through the same content callbacks.
+
+#define VD_VENDOR_PACKET_SIZE 64 // Bulk endpoint max packet size, full speed
+
+typedef enum {
+    VD_VENDOR_OP_READ_MEM     = 0x01, // arg0: address, length: bytes to read
+    VD_VENDOR_OP_LIST_REGIONS = 0x02, // Data: vd_vendor_region_t for each memory region
+    VD_VENDOR_OP_LIST_FILES   = 0x03, // Data: vd_vendor_file_t and name for each dynamic file
+    VD_VENDOR_OP_READ_FILE    = 0x04, // arg0: file index, arg1: offset, length: bytes to read
+} vd_vendor_op_t;
+
+typedef enum {
+    VD_VENDOR_STATUS_OK           = 0x00,
+    VD_VENDOR_STATUS_BAD_REQUEST  = 0x01, // Unknown opcode
+    VD_VENDOR_STATUS_OUT_OF_RANGE = 0x02, // Address range not within one memory region
+    VD_VENDOR_STATUS_NO_FILE      = 0x03, // No such file index
+} vd_vendor_status_t;
+
+typedef struct __attribute__((packed)) {
+    uint8_t  opcode;       // vd_vendor_op_t
+    uint8_t  reserved;
+    uint16_t tag;          // Echoed in the response
+    uint32_t arg0;
+    uint32_t arg1;
+    uint32_t length;       // Bytes requested, for the reads
+} vd_vendor_request_t;
+
+typedef struct __attribute__((packed)) {
+    uint8_t  opcode;       // As in the request
+    uint8_t  status;       // vd_vendor_status_t; no data unless VD_VENDOR_STATUS_OK
+    uint16_t tag;          // As in the request
+    uint32_t length;       // Data bytes following the header, without the padding
+} vd_vendor_response_t;
+
+typedef struct __attribute__((packed)) {
+    uint32_t base_address; // Address of the first byte, for VD_VENDOR_OP_READ_MEM
+    uint32_t size_bytes;
+    uint32_t first_cluster;// Where the region is on the exFAT volume
+    char     name[16];     // File name, e.g. "FLASH.BIN", NUL padded
+} vd_vendor_region_t;
+
+typedef struct __attribute__((packed)) {
+    uint32_t size_bytes;   // Current file size
+    uint8_t  lun;          // Volume the file is on
+    uint8_t  name_length;  // Name length, in UTF-16 code units, following this record
+    uint16_t reserved;
+} vd_vendor_file_t;        // The index for VD_VENDOR_OP_READ_FILE is the position in the list
+
+// Serve the pending vendor requests, as far as the IN endpoint has room.
+// Call regularly from the USB service loop, e.g. next to tud_task().
+void vd_usb_vendor_task(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // VD_USB_VENDOR_H
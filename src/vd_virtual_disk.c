@@ -15,7 +15,11 @@
 #include "vd_exfat_params.h"
 #include "vd_exfat.h"
 #include "vd_exfat_dirs.h"
+#include "vd_files_rp2350.h"
+#include "vd_handoff.h"
 
+#include <pico/platform.h>
+#include <pico/time.h>
 #include <pico/unique_id.h>
 
 /**
@@ -37,6 +41,9 @@ typedef struct {
     uint32_t first_cluster;
     size_t   max_file_size_bytes;
     vd_file_sector_get_fn_t handler;
+    const vd_dynamic_file_t *directory; // A subdirectory, generated instead of calling the handler
+    uint8_t  read_ahead;  // Clusters to generate ahead, see vd_dynamic_file_t
+    uint32_t next_offset; // File offset after the last read, for detecting sequential reads
 } dynamic_cluster_map_entry_t;
 
 #ifndef PICOVD_PARAM_MAX_DYNAMIC_FILES
@@ -45,8 +52,8 @@ typedef struct {
 
 static dynamic_cluster_map_entry_t dynamic_cluster_map[PICOVD_PARAM_MAX_DYNAMIC_FILES];
 
-// Allocates clusters for a dynamic file and registers its handler
-static uint32_t vd_dynamic_cluster_alloc(size_t region_size_bytes, vd_file_sector_get_fn_t handler) {
+// Allocates clusters for a dynamic file or subdirectory and registers its handler
+static uint32_t vd_dynamic_cluster_alloc(const vd_dynamic_file_t *file, size_t region_size_bytes) {
     const size_t cluster_size_bytes = EXFAT_BYTES_PER_SECTOR * EXFAT_SECTORS_PER_CLUSTER;
     size_t clusters_needed = (region_size_bytes + cluster_size_bytes - 1) / cluster_size_bytes;
 
@@ -63,11 +70,21 @@ static uint32_t vd_dynamic_cluster_alloc(size_t region_size_bytes, vd_file_secto
     dynamic_cluster_map[dynamic_cluster_map_count++] = (dynamic_cluster_map_entry_t){
         .first_cluster = allocated_cluster,
         .max_file_size_bytes = region_size_bytes,
-        .handler = handler,
+        .handler = file->get_content,
+        .directory = (file->file_attributes & FAT_FILE_ATTR_DIRECTORY) ? file : NULL,
+        .read_ahead = file->read_ahead,
     };
     return allocated_cluster;
 }
 
+// Undo the last vd_dynamic_cluster_alloc(), for a file that could not be added
+static void vd_dynamic_cluster_free_last(uint32_t first_cluster) {
+    assert(dynamic_cluster_map_count > 0);
+    assert(dynamic_cluster_map[dynamic_cluster_map_count - 1].first_cluster == first_cluster);
+    dynamic_cluster_map_count--;
+    dynamic_cluster_map_next_cluster = first_cluster;
+}
+
 // Reallocate clusters for a dynamic file if its size increases
 static int vd_dynamic_cluster_realloc(vd_dynamic_file_t *file, size_t size_bytes) {
     // Find the file's entry in the dynamic_cluster_map
@@ -101,17 +118,27 @@ static int vd_dynamic_cluster_realloc(vd_dynamic_file_t *file, size_t size_bytes
 
 // Table entry: start_lba marks the first sector of a region,
 // handler is invoked for any LBA in that region.
+// span_sectors limits how many sectors the handler is given in one call:
+// by default one, as the sector generators assume; see vd_virtual_disk_read().
 typedef struct {
     usb_msc_lba_read10_fn_t handler;
-    uint32_t        next_lba; // Next LBA after this region
+    uint32_t        next_lba;     // Next LBA after this region
+    uint32_t        span_sectors; // LBA_SPAN_SECTOR, _CLUSTER or _REGION
 } lba_region_t;
 
+#define LBA_SPAN_SECTOR   0                         // Up to the end of the sector
+#define LBA_SPAN_CLUSTER  EXFAT_SECTORS_PER_CLUSTER // Up to the next cluster boundary
+#define LBA_SPAN_REGION   UINT32_MAX                // Up to the end of the region
+
+_Static_assert(EXFAT_CLUSTER_HEAP_START_LBA % EXFAT_SECTORS_PER_CLUSTER == 0,
+               "Cluster boundaries must be aligned for LBA_SPAN_CLUSTER");
+_Static_assert(CFG_TUD_MSC_EP_BUFSIZE % MSC_BLOCK_SIZE == 0,
+               "MSC transfer buffer must hold whole sectors");
+
 static int32_t gen_boot_sector(uint32_t lba, uint32_t offset, void* buf, uint32_t bufsize);
 static int32_t gen_extb_sector(uint32_t lba, uint32_t offset, void* buf, uint32_t bufsize);
 static int32_t gen_zero_sector(uint32_t lba, uint32_t offset, void* buf, uint32_t bufsize);
 static int32_t gen_cksm_sector(uint32_t lba, uint32_t offset, void* buf, uint32_t bufsize);
-static int32_t gen_fat0_sector(uint32_t lba, uint32_t offset, void* buf, uint32_t bufsize);
-static int32_t gen_ones_sector(uint32_t lba, uint32_t offset, void* buf, uint32_t bufsize);
 static int32_t gen_upcs_sector(uint32_t lba, uint32_t offset, void* buf, uint32_t bufsize);
 static int32_t gen_dirs_sector(uint32_t lba, uint32_t offset, void* buf, uint32_t bufsize);
 
@@ -123,78 +150,112 @@ static const lba_region_t lba_regions[] = {
     // §2 Volume Structure
     { gen_boot_sector, 1 },  // LBA 0, §3.1 Boot Sector
     { gen_extb_sector, 9 },  // §3.2 Extended Boot Sectors
-    { gen_zero_sector, 11 }, // §3.3 Main and Backup OEM Parameters
+    { gen_zero_sector, 11, LBA_SPAN_REGION }, // §3.3 Main and Backup OEM Parameters
     { gen_cksm_sector, 12 }, // §3.4 Main Boot Checksum Sub-region
     { gen_boot_sector, 13 }, // §3.1 Backup Boot Sector
     { gen_extb_sector, 21 }, // §3.2 Extended Boot Sectors (backup)
-    { gen_zero_sector, 23 }, // §3.3 Main and Backup OEM Parameters (backup)
+    { gen_zero_sector, 23, LBA_SPAN_REGION }, // §3.3 Main and Backup OEM Parameters (backup)
     { gen_cksm_sector, 24 }, // §3.4 Backup Boot Checksum Sub-region
 #if EXFAT_FAT_REGION_START_LBA > 24
     // Space between Backup Boot Checksum Sub-region and FAT region, if any
     // This is not used in our exFAT, but we reserve it for future use.
     // It is zero-filled.
-   { gen_zero_sector, EXFAT_FAT_REGION_START_LBA },
+   { gen_zero_sector, EXFAT_FAT_REGION_START_LBA, LBA_SPAN_REGION },
 #endif
 
-    // §4   FAT region, first sector
-    { gen_fat0_sector, EXFAT_FAT_REGION_START_LBA + 1 },
-    // §4 Rest of FAT region and unused sectors
-    { gen_zero_sector, EXFAT_CLUSTER_HEAP_START_LBA, },
+    // §4 FAT region, with a cluster chain for each file, from vd_exfat_extents.c
+    { exfat_generate_fat_sector, EXFAT_FAT_REGION_START_LBA + EXFAT_FAT_REGION_LENGTH, LBA_SPAN_REGION },
+    // Unused sectors before the cluster heap, see EXFAT_CLUSTER_HEAP_GAP_CLUSTERS
+    { gen_zero_sector, EXFAT_CLUSTER_HEAP_START_LBA, LBA_SPAN_REGION },
 #if EXFAT_ALLOCATION_BITMAP_START_LBA > EXFAT_CLUSTER_HEAP_START_LBA
     // Space between FAT and Allocation Bitmap regions, if any
-    { gen_zero_sector,  EXFAT_ALLOCATION_BITMAP_START_LBA, },
+    { gen_zero_sector,  EXFAT_ALLOCATION_BITMAP_START_LBA, LBA_SPAN_REGION },
 #endif
 
-    // §7.1 Allocation Bitmap region (not used in our exFAT)
-    { gen_ones_sector, EXFAT_ALLOCATION_BITMAP_START_LBA + EXFAT_ALLOCATION_BITMAP_LENGTH_SECTORS, },
+    // §7.1 Allocation Bitmap region, from vd_exfat_extents.c
+    { exfat_generate_bitmap_sector, EXFAT_ALLOCATION_BITMAP_START_LBA + EXFAT_ALLOCATION_BITMAP_LENGTH_SECTORS, LBA_SPAN_REGION },
     // §7.2 Up-case Table first sector
-    { gen_upcs_sector, EXFAT_UPCASE_TABLE_START_LBA + EXFAT_UPCASE_TABLE_LENGTH_SECTORS, },
+    { gen_upcs_sector, EXFAT_UPCASE_TABLE_START_LBA + EXFAT_UPCASE_TABLE_LENGTH_SECTORS, LBA_SPAN_REGION },
     // §7.2 Zero sectors before the root directory
-    { gen_zero_sector, EXFAT_ROOT_DIR_START_LBA, },
+    { gen_zero_sector, EXFAT_ROOT_DIR_START_LBA, LBA_SPAN_REGION },
     // §7.4 Root Directory sectors, from vd_exfat_directory.c
-    { exfat_generate_root_dir_fixed_sector,   EXFAT_ROOT_DIR_START_LBA + 1, },
-    { exfat_generate_root_dir_dynamic_sector, EXFAT_ROOT_DIR_START_LBA + EXFAT_ROOT_DIR_LENGTH_SECTORS },
+    { exfat_generate_root_dir_sector, EXFAT_ROOT_DIR_START_LBA + EXFAT_ROOT_DIR_LENGTH_SECTORS, LBA_SPAN_REGION },
 
     // Add dynamic area handler for the dynamic cluster region
-    { vd_dynamic_area_handler, PICOVD_DYNAMIC_AREA_END_LBA },
+    // One cluster at a time, as a cluster belongs to at most one file
+    { vd_dynamic_area_handler, PICOVD_DYNAMIC_AREA_END_LBA, LBA_SPAN_CLUSTER },
 
-#if PICOVD_BOOTROM_ENABLED
-    // BOOTROM.BIN file, from vd_rp2350.c
-    { gen_zero_sector, PICOVD_BOOTROM_START_LBA, },
-    { vd_file_sector_get_bootrom, PICOVD_BOOTROM_START_LBA + PICOVD_BOOTROM_SIZE_BYTES / EXFAT_BYTES_PER_SECTOR, },
-#endif
+    // Memory region files (BOOTROM.BIN, FLASH.BIN, ...), from vd_files_rp2350.c
+    // Zero sectors before each region, then the region itself
+#define VD_MEMORY_REGION_LBA_REGIONS(id, CFG) \
+    { gen_zero_sector, PICOVD_ ## CFG ## _START_LBA, LBA_SPAN_REGION, }, \
+    { vd_file_sector_get_ ## id, PICOVD_ ## CFG ## _START_LBA + PICOVD_ ## CFG ## _SIZE_BYTES / EXFAT_BYTES_PER_SECTOR, LBA_SPAN_REGION, },
+    PICOVD_MEMORY_REGIONS(VD_MEMORY_REGION_LBA_REGIONS)
+#undef VD_MEMORY_REGION_LBA_REGIONS
 
-#if PICOVD_FLASH_ENABLED
-    // FLASH.BIN file, from vd_rp2350.c
-    { gen_zero_sector, PICOVD_FLASH_START_LBA, },
-    { vd_file_sector_get_flash, PICOVD_FLASH_START_LBA + PICOVD_FLASH_SIZE_BYTES / EXFAT_BYTES_PER_SECTOR, },
-#endif
+};
 
-#if PICOVD_SRAM_ENABLED
-    // SRAM.BIN file, from vd_rp2350.c
-    { gen_zero_sector, PICOVD_SRAM_START_LBA, },
-    { vd_file_sector_get_sram, PICOVD_SRAM_START_LBA + PICOVD_SRAM_SIZE_BYTES / EXFAT_BYTES_PER_SECTOR, },
+// The volatile volume has no memory region files: its table ends before them
+#define VD_MEMORY_REGION_LBA_REGION_COUNT(id, CFG) + 2
+static const size_t lba_regions_count[VD_LUN_COUNT] = {
+    [VD_LUN_STATIC]   = sizeof(lba_regions) / sizeof(lba_region_t),
+#if VD_LUN_VOLATILE != VD_LUN_STATIC
+    [VD_LUN_VOLATILE] = sizeof(lba_regions) / sizeof(lba_region_t)
+                      - (0 PICOVD_MEMORY_REGIONS(VD_MEMORY_REGION_LBA_REGION_COUNT)),
 #endif
-
 };
+#undef VD_MEMORY_REGION_LBA_REGION_COUNT
+
+// LUN of the READ10 being served; the region handlers are shared by the volumes
+static uint8_t current_lun = VD_LUN_STATIC;
 
-// Helper functions
-static inline uint32_t get_volume_serial_number(void) {
+uint8_t vd_virtual_disk_current_lun(void) {
+    return current_lun;
+}
+
+// Volume identity: the VolumeSerialNumber and the Volume GUID of each volume are
+// derived from the unique board ID, so that the host sees the same volumes again
+// after a reset or a replug, e.g. for its automounter and caches, and each board
+// and each volume its own ones.
+static const uint8_t *get_board_id(void) {
     static bool inited = false;
-    static uint32_t volume_serial_number = 0;
+    static pico_unique_board_id_t board_id;
 
     if (!inited) {
-        pico_unique_board_id_t board_id;
         pico_get_unique_board_id(&board_id);
-        // Use the first 4 bytes of the 8-byte board ID as the 32-bit serial
-        volume_serial_number =
-                        ((uint32_t)board_id.id[0]      ) |
-                        ((uint32_t)board_id.id[1] <<  8) |
-                        ((uint32_t)board_id.id[2] << 16) |
-                        ((uint32_t)board_id.id[3] << 24);
         inited = true;
     }
-    return volume_serial_number;
+    return board_id.id;
+}
+
+static inline uint32_t get_volume_serial_number(uint8_t lun) {
+    const uint8_t *id = get_board_id();
+    // Fold the 8-byte board ID into the 32-bit serial
+    uint32_t serial = 0;
+    for (uint32_t i = 0; i < PICO_UNIQUE_BOARD_ID_SIZE_BYTES; i++) {
+        serial ^= (uint32_t)id[i] << (8 * (i % 4));
+    }
+    // Each volume needs its own serial, for the host to tell them apart
+    return serial + lun;
+}
+
+void vd_virtual_disk_volume_guid(uint8_t lun, uint8_t guid[EXFAT_VOLUME_GUID_LENGTH]) {
+    const uint8_t *id = get_board_id();
+    // A name-based, version 8 (RFC 9562) GUID: "PiVD", the board ID and the LUN,
+    // with the version and variant bits in between.  In the Microsoft byte order,
+    // Data3, bytes 6-7, is little-endian: the version is the high nibble of byte 7.
+    // Never the null GUID, §7.5.3.
+    static const uint8_t tag[4] = { 'P', 'i', 'V', 'D' };
+    memcpy(&guid[0], tag, sizeof(tag));
+    guid[4]  = id[0];
+    guid[5]  = id[1];
+    guid[6]  = id[2];
+    guid[7]  = 0x80 | (lun & 0x0F); // Version 8
+    guid[8]  = 0x80;                // Variant 10
+    memcpy(&guid[9], &id[3], 5);
+    // The last two bytes fold the board ID and the LUN, so that none is constant
+    guid[14] = id[0] ^ id[2] ^ id[4] ^ id[6] ^ lun;
+    guid[15] = id[1] ^ id[3] ^ id[5] ^ id[7];
 }
 
 // Sector generators
@@ -203,29 +264,30 @@ static int32_t gen_zero_sector(uint32_t lba __unused, uint32_t offset __unused,
     return bufsize;
 }
 
-static int32_t gen_ones_sector(uint32_t lba __unused, uint32_t offset __unused, void* buf, uint32_t bufsize) {
-    memset(buf, 0xff, bufsize);
-    return bufsize;
-}
-static int32_t gen_extb_sector_signature(uint32_t offset, uint8_t *buffer, uint32_t bufsize) {
-    // Generate an extended boot sector with the signature bytes 0x55 and 0xAA
-    // at the end of the sector, if they fall within the requested offset and size.
+// Place the signature bytes 0x55 and 0xAA at pos55 and pos55 + 1 of the sector,
+// if they fall within the requested offset and size.
+static int32_t gen_sector_signature(uint32_t pos55, uint32_t offset, uint8_t *buffer, uint32_t bufsize) {
     assert(offset < MSC_BLOCK_SIZE);
     assert(offset + bufsize <= MSC_BLOCK_SIZE);
 
-    const uint32_t pos55 = MSC_BLOCK_SIZE - 2;  // 510
-    const uint32_t posAA = MSC_BLOCK_SIZE - 1;  // 511
+    const uint32_t posAA = pos55 + 1;
     // For each signature byte, see if it falls inside [offset, offset+bufsize).
     // The compiler will optimize this a lot.
-    if (offset + bufsize > pos55 && offset < pos55) {
+    if (offset + bufsize > pos55 && offset <= pos55) {
         buffer[pos55 - offset] = 0x55;
     }
-    if (offset + bufsize > posAA && offset < posAA) {
+    if (offset + bufsize > posAA && offset <= posAA) {
         buffer[posAA - offset] = 0xAA;
     }
     return bufsize;
 }
 
+// The ExtendedBootSignature is in the last four bytes of the sector, §3.2.2,
+// whereas the BootSignature is at bytes 510-511 whatever the sector size, §3.1.22.
+static inline int32_t gen_extb_sector_signature(uint32_t offset, uint8_t *buffer, uint32_t bufsize) {
+    return gen_sector_signature(MSC_BLOCK_SIZE - 2, offset, buffer, bufsize);
+}
+
 static int32_t gen_extb_sector(uint32_t lba, uint32_t offset, void* buf, uint32_t bufsize) {
     int32_t rc = gen_zero_sector(lba, offset, buf, bufsize);
     assert(rc == bufsize);
@@ -254,7 +316,7 @@ static int32_t gen_boot_sector(uint32_t lba __unused, uint32_t offset, void* buf
     // 2) Insert VolumeSerialNumber bytes at offsets 100-103 if they fall in this slice
     const uint32_t serial_pos = 100; // byte offset for serial start
     if (offset <= serial_pos && offset + bufsize > serial_pos) {
-        uint32_t serial = get_volume_serial_number();
+        uint32_t serial = get_volume_serial_number(current_lun);
         for (uint32_t i = 0; i < sizeof(uint32_t); i++) {
             uint32_t abs_pos = serial_pos + i;
             if (abs_pos >= offset && abs_pos < offset + bufsize) {
@@ -268,93 +330,51 @@ static int32_t gen_boot_sector(uint32_t lba __unused, uint32_t offset, void* buf
         memset(out, 0, remaining);
     }
 
-    // 4) Fill the sector signature bytes at the end of the buffer
-    return gen_extb_sector_signature(offset, buf, bufsize);
+    // 4) Fill the boot signature bytes; with 4Kn the rest of the sector stays zero
+    return gen_sector_signature(510, offset, buf, bufsize);
 }
 
-/**
- * Compute the VBR checksum at runtime over sectors 0–10.
- * Skips offsets 106, 107 and 112 in sector 0.
- */
-static uint32_t compute_vbr_checksum_runtime_simple(void) {
-    uint32_t sum = 0;
-    uint8_t sector[MSC_BLOCK_SIZE];
-    // Iterate each sector
-    for (uint32_t lba = 0; lba < 11; ++lba) {
-        // Generate sector data into 'sector' buffer via the MSC callback
-        tud_msc_read10_cb(0, lba, 0, sector, MSC_BLOCK_SIZE);
-
-        // Walk bytes
-        for (uint32_t off = 0; off < MSC_BLOCK_SIZE; ++off) {
-            if (lba == 0 && (off == 106 || off == 107 || off == 112)) {
-                continue;
-            }
-            // Rotate right by one: ROR32(sum)
-            sum = (sum >> 1) | (sum << 31);
-            sum = (sum + sector[off]) & 0xFFFFFFFFu;
-        }
-    }
-    return sum;
+static inline uint32_t ror32_n(uint32_t x, uint32_t n) {
+    n &= 31;
+    return n ? (x >> n) | (x << (32 - n)) : x;
 }
 
-// Compute the VBR checksum at runtime using an optimized algorithm.
-// This is a more efficient version that avoids the need to read sectors
-// and instead computes the checksum directly from the volume serial number.
-// It uses a compile-time prefix checksum and a suffix checksum, and rotates
-// the checksum value based on the serial number bytes.
-// This is based on the C++ implementation in vd_exfat.cpp.
-
-// XXX FIXME: this function is not yet used in the code, as it does not
-// pass the tests yet. It is a work in progress to replace the simple version
-// of the checksum computation with a more efficient one that does not require
-// reading the sectors at runtime. The goal is to optimize the VBR checksum
-// computation to avoid unnecessary reads and improve performance.
-static uint32_t compute_vbr_checksum_runtime_optimised(void) {
-    // Phase 1: start from compile-time prefix checksum
+// Compute the VBR checksum of sectors 0-10 from the volume serial number,
+// without generating the sectors: start from the compile-time checksum of the
+// bytes before VolumeSerialNumber, add its four bytes, and run the compile-time
+// steps of the non-zero bytes after it.  Some 25 steps in all.
+// For the math, see the C++ source file vd_exfat_consts.cpp.
+static uint32_t compute_vbr_checksum_runtime(void) {
     uint32_t sum = EXFAT_VBR_CHECKSUM_PREFIX;
 
-    uint32_t serial = get_volume_serial_number();
-
-    // Phase 2: rotate and add each byte of the serial number
-    // Let the compiler optimize this loop
-    for (int i = 0; i < 4; i++) {
-        // Rotate right 32-bit by one bit, then add the next byte of the serial
-        // This is equivalent to: sum = ror32(sum) + ((serial >> (8 * i)) & 0xFF);
-        // but avoids the need for a separate ror32 function.
-        sum = (sum >> 1) | (sum << 31);
-        sum = (sum + ((serial >> (8 * i)) & 0xFF)) & 0xFFFFFFFFu;
+    const uint32_t serial = get_volume_serial_number(current_lun);
+    for (uint32_t i = 0; i < sizeof(serial); i++) {
+        sum = ror32_n(sum, 1) + ((serial >> (8 * i)) & 0xFF);
     }
 
-    // Phase 3: apply suffix rotation and suffix checksum
-    // To understand this, you need to understand the math
-    // Otherwise this will feel like magic.
-    sum = (sum >> EXFAT_VBR_SUFFIX_ROT) | (sum << (32 - EXFAT_VBR_SUFFIX_ROT));
-    sum = (sum + EXFAT_VBR_CHECKSUM_SUFFIX) & 0xFFFFFFFFu;
-}
-
-static uint32_t compute_vbr_checksum_runtime(void) {
-    // This is the main entry point for computing the VBR checksum at runtime.
-    // XXX FIXME: switch over to the optimized version of the checksum computation,
-    // once we have verified that it works correctly.
-    return compute_vbr_checksum_runtime_simple();
+    for (size_t i = 0; i < EXFAT_VBR_CHECKSUM_SUFFIX_STEPS_LEN; i++) {
+        sum = ror32_n(sum, EXFAT_VBR_CHECKSUM_SUFFIX_STEPS[i].rotate) + EXFAT_VBR_CHECKSUM_SUFFIX_STEPS[i].byte;
+    }
+    return ror32_n(sum, EXFAT_VBR_SUFFIX_ROT);
 }
 
 
 static int32_t gen_cksm_sector(uint32_t lba __unused, uint32_t offset, void* buffer, uint32_t bufsize) {
-    // For the math, see the C++ source file vd_exfat.cpp
 
     // Sanity-check slice bounds for checksum sector
     assert(offset < MSC_BLOCK_SIZE);
     assert(bufsize <= MSC_BLOCK_SIZE - offset);
 
-    static bool checksum_cached = false;
-    static uint32_t checksum_value = 0;
+    // One checksum per volume, as the serial numbers differ
+    static bool checksum_cached[VD_LUN_COUNT];
+    static uint32_t checksum_values[VD_LUN_COUNT];
 
-    if (!checksum_cached) {
+    if (!checksum_cached[current_lun]) {
         // Cache the result for future calls
-        checksum_cached = true;
-        checksum_value = compute_vbr_checksum_runtime();
+        checksum_cached[current_lun] = true;
+        checksum_values[current_lun] = compute_vbr_checksum_runtime();
     }
+    const uint32_t checksum_value = checksum_values[current_lun];
 
     // Fill requested slice of sector 11 with the 32-bit checksum pattern
     uint8_t  *base8  = ((uint8_t *)buffer);
@@ -367,24 +387,6 @@ static int32_t gen_cksm_sector(uint32_t lba __unused, uint32_t offset, void* buf
     return bufsize;
 }
 
-static int32_t gen_fat0_sector(uint32_t lba __unused,
-                            uint32_t offset,
-                            void*    buffer,
-                            uint32_t bufsize)
-{
-    // Zero-fill the buffer
-    memset(buffer, 0, bufsize);
-    const uint8_t* data = (const uint8_t*)exfat_fat0_sector_data;
-
-    // Copy the precomputed FAT0 beginning entries
-    if (offset < exfat_fat0_sector_data_len) {
-        size_t copy_len = exfat_fat0_sector_data_len - offset;
-        if (copy_len > bufsize) copy_len = bufsize;
-        memcpy(buffer, data + offset, copy_len);
-    }
-    return bufsize;
-}
-
 static int32_t gen_upcs_sector(uint32_t lba, uint32_t offset, void* buf, uint32_t bufsize)
 {
     // Ensure buffer and offsets are 16-bit aligned
@@ -420,6 +422,184 @@ static int32_t gen_upcs_sector(uint32_t lba, uint32_t offset, void* buf, uint32_
     return bufsize;
 }
 
+/**
+ * --------------------------------------------------------------------------
+ * Read-ahead
+ *
+ * Hosts read files sequentially, in bursts of 64 KB or more, which TinyUSB
+ * hands to us one CFG_TUD_MSC_EP_BUFSIZE buffer at a time.  For a file with
+ * .read_ahead set, a read continuing where the previous one ended queues the
+ * next clusters of the file; vd_virtual_disk_read_ahead_task() generates them
+ * between the READ10 calls, while the USB transfer of the previous buffer is
+ * in progress, and the next read is served from the cache.  A cluster is
+ * dropped once read to its end, or when it gets older than
+ * PICOVD_READ_AHEAD_MAX_AGE_MS, or when the file is updated.
+ * --------------------------------------------------------------------------
+ */
+
+#if PICOVD_READ_AHEAD_ENABLED
+
+enum {
+    VD_READ_AHEAD_EMPTY = 0,
+    VD_READ_AHEAD_WANTED,  // Queued for vd_virtual_disk_read_ahead_task()
+    VD_READ_AHEAD_VALID,   // Generated, not read to its end yet
+};
+
+typedef struct {
+    uint8_t  state;
+    uint8_t  entry;        // Index in dynamic_cluster_map
+    uint16_t cluster;      // Cluster within the file
+    int32_t  size;         // Bytes generated
+    uint32_t time_ms;      // When generated
+    uint8_t  data[EXFAT_BYTES_PER_CLUSTER];
+} vd_read_ahead_slot_t;
+
+static vd_read_ahead_slot_t  read_ahead_slots[PICOVD_READ_AHEAD_CACHE_CLUSTERS];
+static vd_read_ahead_stats_t read_ahead_stats;
+
+static inline uint32_t read_ahead_now_ms(void) {
+    return to_ms_since_boot(get_absolute_time());
+}
+
+static void read_ahead_drop(vd_read_ahead_slot_t *slot) {
+    if (slot->state == VD_READ_AHEAD_VALID) {
+        read_ahead_stats.wasted++;
+    }
+    slot->state = VD_READ_AHEAD_EMPTY;
+}
+
+static vd_read_ahead_slot_t *read_ahead_find(size_t entry, uint32_t cluster) {
+    for (size_t i = 0; i < PICOVD_READ_AHEAD_CACHE_CLUSTERS; i++) {
+        vd_read_ahead_slot_t *slot = &read_ahead_slots[i];
+        if (slot->state != VD_READ_AHEAD_EMPTY && slot->entry == entry && slot->cluster == cluster) {
+            return slot;
+        }
+    }
+    return NULL;
+}
+
+// Serve [file_offset, file_offset + size) from the cache, if there.
+// Returns the byte count, or -1 on a miss.
+static int32_t read_ahead_lookup(size_t entry, uint32_t file_offset, uint8_t *buf, uint32_t size) {
+    const uint32_t cluster = file_offset / EXFAT_BYTES_PER_CLUSTER;
+    const uint32_t pos     = file_offset % EXFAT_BYTES_PER_CLUSTER;
+    vd_read_ahead_slot_t *slot = read_ahead_find(entry, cluster);
+
+    if (slot == NULL || slot->state != VD_READ_AHEAD_VALID) {
+        if (slot != NULL) {
+            slot->state = VD_READ_AHEAD_EMPTY; // Too late, generated by the read itself
+        }
+        read_ahead_stats.misses++;
+        return -1;
+    }
+    if (read_ahead_now_ms() - slot->time_ms > PICOVD_READ_AHEAD_MAX_AGE_MS) {
+        read_ahead_drop(slot);
+        read_ahead_stats.misses++;
+        return -1;
+    }
+    read_ahead_stats.hits++;
+    const int32_t rc = pos >= slot->size ? 0 : (pos + size <= slot->size ? size : slot->size - pos);
+    memcpy(buf, slot->data + pos, rc);
+    if (pos + size >= EXFAT_BYTES_PER_CLUSTER) {
+        slot->state = VD_READ_AHEAD_EMPTY; // Read to its end: done
+    }
+    return rc;
+}
+
+// Note a read of [file_offset, end); if sequential, queue the next clusters
+static void read_ahead_note(size_t entry_idx, uint32_t file_offset, uint32_t end) {
+    dynamic_cluster_map_entry_t *entry = &dynamic_cluster_map[entry_idx];
+    const bool sequential = file_offset == entry->next_offset;
+    entry->next_offset = end;
+    if (!sequential) {
+        return;
+    }
+    const uint32_t current = (end - 1) / EXFAT_BYTES_PER_CLUSTER;
+    const uint32_t last    = (entry->max_file_size_bytes - 1) / EXFAT_BYTES_PER_CLUSTER;
+    for (uint32_t cluster = current + 1; cluster <= current + entry->read_ahead && cluster <= last; cluster++) {
+        if (read_ahead_find(entry_idx, cluster) != NULL) {
+            continue;
+        }
+        // A free slot, or one the reader has passed, or else the oldest one
+        vd_read_ahead_slot_t *victim = NULL;
+        for (size_t i = 0; i < PICOVD_READ_AHEAD_CACHE_CLUSTERS; i++) {
+            vd_read_ahead_slot_t *slot = &read_ahead_slots[i];
+            if (slot->state == VD_READ_AHEAD_EMPTY ||
+                (slot->entry == entry_idx && slot->cluster < current)) {
+                victim = slot;
+                break;
+            }
+            if (slot->state == VD_READ_AHEAD_VALID && (victim == NULL || slot->time_ms < victim->time_ms) &&
+                read_ahead_now_ms() - slot->time_ms > PICOVD_READ_AHEAD_MAX_AGE_MS) {
+                victim = slot;
+            }
+        }
+        if (victim == NULL) {
+            return; // Cache full of data still wanted
+        }
+        read_ahead_drop(victim);
+        *victim = (vd_read_ahead_slot_t){ .state = VD_READ_AHEAD_WANTED, .entry = entry_idx, .cluster = cluster };
+    }
+}
+
+// Drop the cached clusters of a file, e.g. after it was updated
+static void read_ahead_invalidate(uint32_t first_cluster) {
+    for (size_t i = 0; i < PICOVD_READ_AHEAD_CACHE_CLUSTERS; i++) {
+        vd_read_ahead_slot_t *slot = &read_ahead_slots[i];
+        if (slot->state != VD_READ_AHEAD_EMPTY && dynamic_cluster_map[slot->entry].first_cluster == first_cluster) {
+            read_ahead_drop(slot);
+        }
+    }
+}
+
+void vd_virtual_disk_read_ahead_task(void) {
+    // The lowest wanted cluster first, as the reader needs it first
+    vd_read_ahead_slot_t *next = NULL;
+    for (size_t i = 0; i < PICOVD_READ_AHEAD_CACHE_CLUSTERS; i++) {
+        vd_read_ahead_slot_t *slot = &read_ahead_slots[i];
+        if (slot->state == VD_READ_AHEAD_WANTED && (next == NULL || slot->cluster < next->cluster)) {
+            next = slot;
+        }
+    }
+    if (next == NULL) {
+        return;
+    }
+    dynamic_cluster_map_entry_t *entry = &dynamic_cluster_map[next->entry];
+    const uint32_t file_offset = next->cluster * EXFAT_BYTES_PER_CLUSTER;
+    uint32_t size = entry->max_file_size_bytes - file_offset;
+    if (size > EXFAT_BYTES_PER_CLUSTER) {
+        size = EXFAT_BYTES_PER_CLUSTER;
+    }
+    const int32_t rc = entry->handler(file_offset, next->data, size);
+    if (rc < 0) {
+        // Includes VD_READ_PENDING, which cannot be waited for here:
+        // such a file is not read ahead any more
+        if (rc == VD_READ_PENDING) {
+            entry->read_ahead = 0;
+        }
+        next->state = VD_READ_AHEAD_EMPTY;
+        return;
+    }
+    next->size    = rc;
+    next->time_ms = read_ahead_now_ms();
+    next->state   = VD_READ_AHEAD_VALID;
+    read_ahead_stats.prefetched++;
+}
+
+void vd_virtual_disk_get_read_ahead_stats(vd_read_ahead_stats_t *stats) {
+    *stats = read_ahead_stats;
+}
+
+#else
+
+void vd_virtual_disk_read_ahead_task(void) {}
+
+void vd_virtual_disk_get_read_ahead_stats(vd_read_ahead_stats_t *stats) {
+    memset(stats, 0, sizeof(*stats));
+}
+
+#endif // PICOVD_READ_AHEAD_ENABLED
+
 // Handler for the dynamic area: looks up the cluster map and calls the file handler
 static int32_t vd_dynamic_area_handler(uint32_t lba, uint32_t offset, void* buf, uint32_t bufsize) {
     // Compute cluster number from LBA
@@ -437,6 +617,19 @@ static int32_t vd_dynamic_area_handler(uint32_t lba, uint32_t offset, void* buf,
                 if (file_offset + to_copy > entry->max_file_size_bytes) {
                     to_copy = entry->max_file_size_bytes - file_offset;
                 }
+                if (entry->directory != NULL) {
+                    return exfat_generate_subdir(entry->directory, file_offset, buf, to_copy);
+                }
+#if PICOVD_READ_AHEAD_ENABLED
+                if (entry->read_ahead) {
+                    // Queue the next clusters first, for the task to start on them
+                    read_ahead_note(i, file_offset, file_offset + to_copy);
+                    const int32_t rc = read_ahead_lookup(i, file_offset, buf, to_copy);
+                    if (rc >= 0) {
+                        return rc;
+                    }
+                }
+#endif
                 return entry->handler(file_offset, buf, to_copy);
             } else {
                 // Out of file bounds
@@ -448,55 +641,345 @@ static int32_t vd_dynamic_area_handler(uint32_t lba, uint32_t offset, void* buf,
     return 0;
 }
 
-// Read10 callback: serve LBA regions defined in the lba_regions table
-// Called from the TinyUSB MSC stack when a READ10 command is issued.
-int32_t vd_virtual_disk_read(uint32_t lba,
-                             uint32_t offset,
-                             void*    buffer,
-                             uint32_t bufsize)
+/**
+ * --------------------------------------------------------------------------
+ * Deferred reads
+ *
+ * A content callback may return VD_READ_PENDING and complete the read later,
+ * from an IRQ or the other core, with vd_read_complete().  Meanwhile we report
+ * the READ10 as busy (0), and TinyUSB retries the same call, with the same
+ * LBA, offset and buffer, from tud_task().
+ *
+ * The slot is tagged with the interface, MSC or vendor, whose read started
+ * it.  Only that interface picks up the result; the reads of the other one
+ * go on, except where they need a content callback too, as only one read may
+ * be pending.  A slot left for PICOVD_READ_PENDING_TIMEOUT_MS is dropped.
+ * --------------------------------------------------------------------------
+ */
+
+enum {
+    VD_READ_IDLE = 0,  // No read pending
+    VD_READ_STARTED,   // Content callback being called
+    VD_READ_WAITING,   // Callback returned VD_READ_PENDING, not completed yet
+    VD_READ_FILLING,   // Claimed with vd_read_claim(), the buffer being written
+    VD_READ_DONE,      // vd_read_complete() called, result not yet returned
+};
+
+// The state word holds the state in its low bits and the ticket of the read
+// above them, so that a late vd_read_complete() with the ticket of a dropped
+// read never matches the read that has taken the slot since
+#define PENDING_STATE_BITS          3
+#define PENDING_STATE_MASK          ((1u << PENDING_STATE_BITS) - 1)
+#define PENDING_WORD(ticket, state) (((uint32_t)(ticket) << PENDING_STATE_BITS) | (state))
+
+static struct {
+    uint32_t word;     // PENDING_WORD(), written by both sides, with atomic accesses
+    uint8_t  owner;    // vd_read_owner_t of the call the pending piece belongs to
+    uint8_t  lun;      // READ10 call the pending piece belongs to
+    uint32_t lba;
+    uint32_t offset;
+    uint32_t pos;      // Pending piece within that call's buffer
+    uint32_t size;
+    uint32_t start_ms; // When the callback was called, for the timeout
+    int32_t  result;
+} pending_read = { .word = PENDING_WORD(0, VD_READ_IDLE) };
+
+static inline uint32_t pending_read_now_ms(void) {
+    return to_ms_since_boot(get_absolute_time());
+}
+
+static inline uint32_t pending_read_word(void) {
+    return __atomic_load_n(&pending_read.word, __ATOMIC_ACQUIRE);
+}
+
+static inline uint32_t pending_read_state(uint32_t word) {
+    return word & PENDING_STATE_MASK;
+}
+
+// Move the read of word to the given state, unless the slot has changed since
+static inline bool pending_read_move(uint32_t word, uint32_t state) {
+    return __atomic_compare_exchange_n(&pending_read.word, &word, (word & ~PENDING_STATE_MASK) | state,
+                                       false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+// Drop the read in the slot.  One whose buffer is being written is waited
+// for: its callback completes it right after, see vd_read_claim().
+static void pending_read_drop(void) {
+    uint32_t word = pending_read_word();
+    while (pending_read_state(word) != VD_READ_IDLE) {
+        if (pending_read_state(word) == VD_READ_FILLING) {
+            tight_loop_contents();
+        } else if (pending_read_move(word, VD_READ_IDLE)) {
+            return;
+        }
+        word = pending_read_word();
+    }
+}
+
+vd_read_ticket_t vd_read_ticket(void) {
+    return pending_read_word() >> PENDING_STATE_BITS;
+}
+
+bool vd_read_is_current(vd_read_ticket_t ticket) {
+    const uint32_t word = pending_read_word();
+    const uint32_t state = pending_read_state(word);
+    return (word >> PENDING_STATE_BITS) == ticket
+        && (state == VD_READ_STARTED || state == VD_READ_WAITING || state == VD_READ_FILLING);
+}
+
+bool vd_read_claim(vd_read_ticket_t ticket) {
+    uint32_t word = pending_read_word();
+    while ((word >> PENDING_STATE_BITS) == ticket) {
+        switch (pending_read_state(word)) {
+        case VD_READ_FILLING:
+            return true; // Claimed already
+        case VD_READ_STARTED:
+        case VD_READ_WAITING:
+            if (pending_read_move(word, VD_READ_FILLING)) {
+                return true;
+            }
+            word = pending_read_word();
+            break;
+        default:
+            return false; // Dropped, or completed already
+        }
+    }
+    return false; // Another read has taken the slot
+}
+
+void vd_read_complete(vd_read_ticket_t ticket, int32_t result) {
+    if (!vd_read_claim(ticket)) {
+        return; // Dropped after the timeout or an abort: not ours to complete
+    }
+    pending_read.result = result;
+    __atomic_store_n(&pending_read.word, PENDING_WORD(ticket, VD_READ_DONE), __ATOMIC_RELEASE);
+}
+
+void vd_virtual_disk_read_abort(vd_read_owner_t owner) {
+    if (pending_read_state(pending_read_word()) != VD_READ_IDLE && pending_read.owner == owner) {
+        pending_read_drop();
+    }
+}
+
+// Zero-fill the part of the piece the handler did not provide
+static inline int32_t vd_virtual_disk_pad(uint8_t* piece, uint32_t size, int32_t rc) {
+    if (rc < 0) {
+        return rc;
+    }
+    assert(rc <= size);
+    if (rc < size) {
+        memset(piece + rc, 0, size - rc);
+    }
+    return size;
+}
+
+// End of the piece a region handler may be given in one call, starting at lba
+static inline uint32_t lba_region_span_end(const lba_region_t *region, uint32_t lba) {
+    if (region->span_sectors == LBA_SPAN_REGION) {
+        return region->next_lba;
+    }
+    const uint32_t span = region->span_sectors ? region->span_sectors : 1;
+    const uint32_t end  = (lba / span + 1) * span;
+    return end < region->next_lba ? end : region->next_lba;
+}
+
+// Serve bytes [pos, bufsize) of a READ10 call, one region piece at a time
+static int32_t vd_virtual_disk_read_from(vd_read_owner_t owner, uint32_t lba, uint32_t offset,
+                                         uint8_t* buffer, uint32_t bufsize, uint32_t pos)
 {
-    // Check LBA against the region table
-    for (size_t i = 0; i < sizeof(lba_regions) / sizeof(lba_region_t); i++) {
-        if (lba < lba_regions[i].next_lba) {
-            int32_t rc = lba_regions[i].handler(lba, offset, buffer, bufsize);
-            if (rc < 0) {
-                return rc;
+    const size_t region_count = lba_regions_count[current_lun];
+    size_t i = 0;
+    while (pos < bufsize) {
+        const uint32_t piece_lba    = lba + (offset + pos) / MSC_BLOCK_SIZE;
+        const uint32_t piece_offset = (offset + pos) % MSC_BLOCK_SIZE;
+        uint32_t       piece_size   = bufsize - pos;
+
+        // Regions are in LBA order, and so are the pieces
+        while (i < region_count && piece_lba >= lba_regions[i].next_lba) {
+            i++;
+        }
+        if (i == region_count) {
+            // Fallback for other LBAs: zero-filled
+            memset(buffer + pos, 0, piece_size);
+            break;
+        }
+        const uint32_t span_bytes = (lba_region_span_end(&lba_regions[i], piece_lba) - piece_lba)
+                                  * MSC_BLOCK_SIZE - piece_offset;
+        if (piece_size > span_bytes) {
+            piece_size = span_bytes;
+        }
+
+        // Only the content callbacks of the dynamic files may defer their reads
+        const bool may_defer = lba_regions[i].handler == vd_dynamic_area_handler;
+        uint32_t ticket = 0;
+        if (may_defer) {
+            const uint32_t word = pending_read_word();
+            if (pending_read_state(word) != VD_READ_IDLE) {
+                return 0; // The other interface has a read pending, retry later
             }
-            assert(rc <= bufsize);
-            if (rc < bufsize) {
-                memset(buffer + rc, 0, bufsize - rc);
-                return bufsize; // Return full requested size
+            ticket = (word >> PENDING_STATE_BITS) + 1;
+            pending_read.owner    = owner;
+            pending_read.lun      = current_lun;
+            pending_read.lba      = lba;
+            pending_read.offset   = offset;
+            pending_read.pos      = pos;
+            pending_read.size     = piece_size;
+            pending_read.start_ms = pending_read_now_ms();
+            __atomic_store_n(&pending_read.word, PENDING_WORD(ticket, VD_READ_STARTED), __ATOMIC_RELEASE);
+        }
+        const int32_t rc = lba_regions[i].handler(piece_lba, piece_offset, buffer + pos, piece_size);
+        if (may_defer) {
+            if (rc == VD_READ_PENDING) {
+                // The callback may have claimed or completed it already, from an IRQ
+                (void)pending_read_move(PENDING_WORD(ticket, VD_READ_STARTED), VD_READ_WAITING);
+                return 0; // Busy, TinyUSB retries later
             }
+            __atomic_store_n(&pending_read.word, PENDING_WORD(ticket, VD_READ_IDLE), __ATOMIC_RELEASE);
+        }
+        if (vd_virtual_disk_pad(buffer + pos, piece_size, rc) < 0) {
             return rc;
         }
+        pos += piece_size;
     }
-    // Fallback for other LBAs: zero-filled
-    memset(buffer, 0, bufsize);
     return bufsize;
 }
 
+int32_t vd_virtual_disk_read_by(vd_read_owner_t owner,
+                                uint8_t  lun,
+                                uint32_t lba,
+                                uint32_t offset,
+                                void*    buffer,
+                                uint32_t bufsize)
+{
+    assert(lun < VD_LUN_COUNT);
+    current_lun = lun;
+
+    uint32_t word = pending_read_word();
+    if ((pending_read_state(word) == VD_READ_WAITING || pending_read_state(word) == VD_READ_DONE) &&
+        pending_read_now_ms() - pending_read.start_ms > PICOVD_READ_PENDING_TIMEOUT_MS) {
+        // Never completed, or never picked up by its caller.  Its callback
+        // may still run: its ticket no longer matches, see vd_read_claim().
+        const bool waiting = pending_read.owner == owner && pending_read_state(word) == VD_READ_WAITING;
+        if (pending_read_move(word, VD_READ_IDLE) && waiting) {
+            return -1; // Fail the read that is still waiting
+        }
+        word = pending_read_word();
+    }
+    if (pending_read_state(word) != VD_READ_IDLE && pending_read.owner == owner) {
+        if (pending_read_state(word) != VD_READ_DONE) {
+            return 0; // Busy, TinyUSB retries later
+        }
+        __atomic_store_n(&pending_read.word, word & ~PENDING_STATE_MASK, __ATOMIC_RELEASE);
+        if (lun == pending_read.lun && lba == pending_read.lba && offset == pending_read.offset) {
+            // Finish the completed piece, then go on with the rest of the buffer
+            uint8_t *const buf = (uint8_t *)buffer;
+            const int32_t rc = vd_virtual_disk_pad(buf + pending_read.pos, pending_read.size, pending_read.result);
+            if (rc < 0) {
+                return rc;
+            }
+            return vd_virtual_disk_read_from(owner, lba, offset, buf, bufsize, pending_read.pos + pending_read.size);
+        }
+        // Result of an abandoned command, e.g. after a bus reset
+    }
+
+    return vd_virtual_disk_read_from(owner, lba, offset, (uint8_t *)buffer, bufsize, 0);
+}
+
+// Read10 callback: serve LBA regions defined in the lba_regions table
+// Called from the TinyUSB MSC stack when a READ10 command is issued.
+// The buffer may span several sectors, and several regions; each region
+// handler is called for the part within its region, and its span limit.
+int32_t vd_virtual_disk_read(uint8_t  lun,
+                             uint32_t lba,
+                             uint32_t offset,
+                             void*    buffer,
+                             uint32_t bufsize)
+{
+    return vd_virtual_disk_read_by(VD_READ_OWNER_MSC, lun, lba, offset, buffer, bufsize);
+}
+
 int vd_add_file(vd_dynamic_file_t* file, size_t max_size_bytes) {
     // If the file has no first cluster defined, allocate cluster chain
+    bool allocated = false;
     if (file->first_cluster == 0) {
-        file->first_cluster = vd_dynamic_cluster_alloc(max_size_bytes, file->get_content);
+        file->first_cluster = vd_dynamic_cluster_alloc(file, max_size_bytes);
         if (file->first_cluster == 0) {
             return -1;
         }
+        allocated = true;
+    }
+    if (vd_exfat_dir_add_file(file) < 0) {
+        // E.g. the directory is full: give the clusters and the map slot back
+        if (allocated) {
+            vd_dynamic_cluster_free_last(file->first_cluster);
+            file->first_cluster = 0;
+        }
+        return -1;
     }
-    vd_exfat_dir_add_file(file);
     return 0;
 }
 
+int vd_add_directory(vd_dynamic_file_t* dir) {
+    assert(dir->file_attributes & FAT_FILE_ATTR_DIRECTORY);
+    return vd_add_file(dir, dir->size_bytes);
+}
+
+// Notify the Allocation Bitmap and FAT sectors describing clusters [first, end) of a volume,
+// and the FAT entry before them, the end of chain of a file shrunk to end at first
+static void vd_clusters_changed(uint8_t lun, uint32_t first, uint32_t end) {
+    const uint32_t bits_per_sector = 8 * EXFAT_BYTES_PER_SECTOR;
+    const uint32_t bitmap_first    = (first - EXFAT_CLUSTER_HEAP_START_CLUSTER) / bits_per_sector;
+    const uint32_t bitmap_end      = (end - EXFAT_CLUSTER_HEAP_START_CLUSTER + bits_per_sector - 1) / bits_per_sector;
+    (void)vd_virtual_disk_lun_range_changed(lun, EXFAT_ALLOCATION_BITMAP_START_LBA + bitmap_first,
+                                            bitmap_end - bitmap_first);
+
+    const uint32_t fat_first = (first - 1) * sizeof(uint32_t) / EXFAT_BYTES_PER_SECTOR;
+    const uint32_t fat_end   = (end * sizeof(uint32_t) + EXFAT_BYTES_PER_SECTOR - 1) / EXFAT_BYTES_PER_SECTOR;
+    (void)vd_virtual_disk_lun_range_changed(lun, EXFAT_FAT_REGION_START_LBA + fat_first, fat_end - fat_first);
+}
+
+static void vd_update_file_handoff(void *file, uint32_t size_bytes) {
+    (void)vd_update_file(file, size_bytes);
+}
+
 int vd_update_file(vd_dynamic_file_t *file, size_t size_bytes) {
+    if (!vd_handoff_on_usb_core()) {
+        // Called from the application core: the USB core owns the directory
+        return vd_handoff_call(vd_update_file_handoff, file, size_bytes) ? 0 : -1;
+    }
     if (size_bytes > file->size_bytes) {
         int rc = vd_dynamic_cluster_realloc(file, size_bytes);
         if (rc < 0) {
             return rc;
         }
     }
-    file->size_bytes = size_bytes;
-    vd_exfat_dir_update_file(file);
-    vd_virtual_disk_contents_changed(false);
+#if PICOVD_READ_AHEAD_ENABLED
+    if (file->read_ahead) {
+        read_ahead_invalidate(file->first_cluster);
+    }
+#endif
+    if (size_bytes != file->size_bytes) {
+        // New size: the directory entry changes, and the host must re-read
+        // the directory listing the file, if it has read it at all
+        const uint32_t old_clusters = (file->size_bytes + EXFAT_BYTES_PER_CLUSTER - 1) / EXFAT_BYTES_PER_CLUSTER;
+        const uint32_t new_clusters = (size_bytes + EXFAT_BYTES_PER_CLUSTER - 1) / EXFAT_BYTES_PER_CLUSTER;
+        file->size_bytes = size_bytes;
+        vd_exfat_dir_update_file(file);
+        uint32_t dir_sectors;
+        const uint32_t dir_lba = vd_exfat_dir_file_changed(file, &dir_sectors);
+        (void)vd_virtual_disk_lun_range_changed(file->lun, dir_lba, dir_sectors);
+        // So do the bitmap and the FAT, for the clusters gained or freed
+        if (old_clusters != new_clusters) {
+            vd_clusters_changed(file->lun,
+                                file->first_cluster + (old_clusters < new_clusters ? old_clusters : new_clusters),
+                                file->first_cluster + (old_clusters < new_clusters ? new_clusters : old_clusters));
+        }
+    } else if (vd_virtual_disk_lun_range_changed(file->lun, EXFAT_CLUSTER_TO_LBA(file->first_cluster),
+                                                 (size_bytes + MSC_BLOCK_SIZE - 1) / MSC_BLOCK_SIZE)) {
+        // Same size, but the host may have cached the old data: it sees
+        // the new modification time once it re-reads the directory
+        vd_exfat_dir_update_file(file);
+    }
 
     return 0;
 }
@@ -9,6 +9,8 @@
 
 #include <wchar.h>
 
+#include "picovd_config.h"
+
 #ifdef __cplusplus
   // C++11 and later: char16_t is a built-in type
 #else
@@ -21,15 +23,59 @@ typedef enum  {
     FAT_FILE_ATTR_READ_ONLY  = 0x0001,  ///< read-only file
     FAT_FILE_ATTR_HIDDEN     = 0x0002,  ///< hidden file
     FAT_FILE_ATTR_SYSTEM     = 0x0004,  ///< system file
+    FAT_FILE_ATTR_DIRECTORY  = 0x0010,  ///< directory
     FAT_FILE_ATTR_ARCHIVE    = 0x0020,  ///< archive bit
     FAT_FILE_ATTR_MAX        = 0xFFFF,  ///< force 2 byte value
 } fat_file_attr_t;
 
+// ---------------------------------------------------------------
+// Logical units
+// ---------------------------------------------------------------
+
+// With PICOVD_MULTI_LUN_ENABLED, the virtual disk is two exFAT volumes, on two LUNs:
+// the memory images and other rarely changing files on VD_LUN_STATIC, and the
+// frequently changing files, such as STDOUT.TXT, on VD_LUN_VOLATILE.
+// A change is reported only on the LUN of the changed file, so that the host
+// keeps its cache of the other volume.  Otherwise both names refer to LUN 0.
+#define VD_LUN_STATIC   0
+#if PICOVD_MULTI_LUN_ENABLED
+#define VD_LUN_VOLATILE 1
+#define VD_LUN_COUNT    2
+#else
+#define VD_LUN_VOLATILE VD_LUN_STATIC
+#define VD_LUN_COUNT    1
+#endif
+#define VD_LUN_ALL      0xFF  ///< All LUNs, for vd_virtual_disk_lun_contents_changed()
+
 // Function pointer type for LBA region handlers: fetch or generate bufsize number of bytes
 // at the given LBA + offset into the provided buffer.
+// A file content callback gets a contiguous part of the file, up to one cluster (4 KB)
+// per call, depending on CFG_TUD_MSC_EP_BUFSIZE and the alignment of the host's read.
 typedef int32_t (*usb_msc_lba_read10_fn_t)(uint32_t lba, uint32_t offset, void* buf, uint32_t bufsize);
 typedef int32_t (*vd_file_sector_get_fn_t)(uint32_t offset, void* buf, uint32_t bufsize);
 
+/**
+ * @brief Return value of a vd_file_sector_get_fn_t callback that provides the data later.
+ *
+ * A content callback that cannot produce its data quickly, e.g. because it waits
+ * for a sensor or for another core, may take the ticket of the read with
+ * vd_read_ticket(), start the work, return VD_READ_PENDING, and later call
+ * vd_read_complete() with the ticket and the number of bytes written to buf.
+ * Until then, the READ10 command is reported busy to TinyUSB, which retries it
+ * from tud_task(). The rest of the USB stack, including CDC, keeps running.
+ *
+ * Only one read may be pending at a time: meanwhile, the reads of the other
+ * interface, MSC or vendor, are served unless they, too, need a content callback.
+ * A read not completed within PICOVD_READ_PENDING_TIMEOUT_MS fails, and one
+ * whose interface goes away is aborted.  The buffer may then be reused: write
+ * to it only after vd_read_claim() has returned true.
+ *
+ * @see vd_read_ticket
+ * @see vd_read_claim
+ * @see vd_read_complete
+ */
+#define VD_READ_PENDING (-0x7FFF)
+
 // ---------------------------------------------------------------
 // Virtual Disk File Structures
 // ---------------------------------------------------------------
@@ -39,14 +85,19 @@ typedef int32_t (*vd_file_sector_get_fn_t)(uint32_t offset, void* buf, uint32_t
 #endif
 
 // Dynamic file structure: may be changed at runtime
-typedef struct __packed {
+typedef struct __packed vd_dynamic_file_s {
     const char16_t *   name;            // Pointer to UTF-16LE file name
     uint8_t            name_length;     // Name length, in UTF-16 code units
     fat_file_attr_t    file_attributes; // FAT/exFAT file attributes
+    uint8_t            lun;             // Volume the file is on, VD_LUN_STATIC or VD_LUN_VOLATILE
+    uint8_t            read_ahead;      // Clusters to generate ahead of a sequential reader, see PICOVD_READ_AHEAD_ENABLED
+    const struct vd_dynamic_file_s *parent; // Subdirectory the file is in, or NULL for the root directory
     uint16_t           first_cluster;   // First cluster number
     size_t             size_bytes;      // File size in bytes
-    time_t             creat_time_sec;  // Creation time in seconds, Unix epoch (since 1.1.1970)
+    time_t             creat_time_sec;  // Creation time in seconds, Unix epoch (since 1.1.1970); 0 for when added
     time_t             mod_time_sec;    // Modification time in seconds
+    uint8_t            creat_time_10ms; // Hundredths of a second past creat_time_sec
+    uint8_t            mod_time_10ms;   // Hundredths of a second past mod_time_sec
     vd_file_sector_get_fn_t get_content;
 } vd_dynamic_file_t;
 
@@ -66,6 +117,10 @@ typedef struct __packed {
  *
  * @note The file name is automatically converted to UTF-16LE as required by exFAT.
  * @note The file is initially read-only. Other attributes can be set after creation if needed.
+ * @note The file is on VD_LUN_STATIC. Set .lun to VD_LUN_VOLATILE before vd_add_file()
+ *       for a file that changes often.
+ * @note For a file with a slow content callback, set .read_ahead before vd_add_file(),
+ *       see PICOVD_READ_AHEAD_ENABLED.
  * @note The struct must remain valid (not go out of scope) while the file is registered.
  *
  * @see vd_add_file()
@@ -77,67 +132,86 @@ typedef struct __packed {
         .name = STR_UTF16_EXPAND(file_name_str), \
         .name_length = PICOVD_UTF16_STRING_LEN(STR_UTF16_EXPAND(file_name_str)), \
         .file_attributes = FAT_FILE_ATTR_READ_ONLY, \
+        .lun = VD_LUN_STATIC, \
+        .read_ahead = 0, \
+        .parent = NULL, \
         .first_cluster = 0, \
         .size_bytes = file_size_bytes, \
         .creat_time_sec = 0, \
         .mod_time_sec = 0, \
+        .creat_time_10ms = 0, \
+        .mod_time_10ms = 0, \
         .get_content = get_content_cb, \
     }
 
-// Static file structure: fixed at compile time
-typedef struct vd_static_file_s vd_static_file_t; // Opaque, see vd_exfat_dirs.h
+/**
+ * @brief Define a subdirectory, for dynamic files.
+ *
+ * The directory is generated on the fly, like the root directory, from the
+ * dynamic files whose .parent points to it, in clusters of its own in the
+ * dynamic area.  A change to its files notifies the host only if it has read
+ * the directory itself, not the root directory.
+ *
+ * @param struct_name  Name of the variable to define (vd_dynamic_file_t)
+ * @param dir_name_str Directory name (as a string literal, e.g., "LOGS")
+ *
+ * @note The directory holds PICOVD_PARAM_SUBDIRECTORY_SIZE_BYTES / 32 entries,
+ *       3 for each file with a name of up to 15 characters.
+ * @note Register it with vd_add_directory() before adding its files.
+ *       Its files are on its volume; set .lun on the directory only.
+ *
+ * @see vd_add_directory()
+ */
+#define PICOVD_DEFINE_DIRECTORY_RUNTIME(struct_name, dir_name_str) \
+    vd_dynamic_file_t struct_name = { \
+        .name = STR_UTF16_EXPAND(dir_name_str), \
+        .name_length = PICOVD_UTF16_STRING_LEN(STR_UTF16_EXPAND(dir_name_str)), \
+        .file_attributes = FAT_FILE_ATTR_DIRECTORY | FAT_FILE_ATTR_READ_ONLY, \
+        .lun = VD_LUN_STATIC, \
+        .read_ahead = 0, \
+        .parent = NULL, \
+        .first_cluster = 0, \
+        .size_bytes = PICOVD_PARAM_SUBDIRECTORY_SIZE_BYTES, \
+        .creat_time_sec = 0, \
+        .mod_time_sec = 0, \
+        .creat_time_10ms = 0, \
+        .mod_time_10ms = 0, \
+        .get_content = NULL, \
+    }
 
 /**
  * @brief Define a static (compile-time) virtual file for the PicoVD virtual disk.
  *
- * This macro creates and initializes a vd_static_file_t structure
+ * This macro creates and initializes the exFAT directory entry set
  * for a file whose contents are fixed at compile time.
  * Static files are suitable for exposing firmware images, documentation,
  * or other data that does not change at runtime.
  *
- * @param struct_name      Name of the variable to define (vd_static_file_t)
- * @param file_name_str    File name (as a string literal, e.g., "README.TXT")
- * @param file_size_bytes  File size in bytes
+ * @param struct_name        Name of the variable to define
+ * @param file_name_str      File name (as a string literal, e.g., "README.TXT"), up to 255 characters
+ * @param file_first_cluster First cluster of the file contents
+ * @param file_size_bytes    File size in bytes
  *
  * @note The file name must be a string literal and
  *       is automatically encoded as UTF-16LE as required by exFAT.
- * @note The struct is placed in a special linker section, in the flash, and auto-collected at link time.
+ *       The entry set has one File Name entry per 15 characters; its name hash
+ *       and SetChecksum are computed by the compiler.
+ * @note The entry set is placed in a special linker section, in the flash, and auto-collected at link time.
  *       The default root directory handler automatically provides the generated directory entries.
  * @note The file is initially read-only. Other attributes are currently not supported.
+ * @note C++ only, as the size of the entry set depends on the name length.
  *
- * @see vd_static_file_t
+ * @see vd_static_file_entries
  * @see PICOVD_DEFINE_FILE_RUNTIME
  *
  * For usage examples, see the README.
  */
 #define PICOVD_DEFINE_FILE_STATIC(struct_name, file_name_str, file_first_cluster, file_size_bytes) \
-    static const uint32_t struct_name ## _creation_time = vd_exfat_dirs_make_timestamp(PICOVD_PARAM_STATIC_FILE_CREATION_TIME); \
-    const vd_static_file_t struct_name \
-    __attribute__((section("flashdata_picovd_static_directory_entries"), used, aligned(4))) = { \
-        .file_dir_entry = { \
-            .entry_type = exfat_entry_type_file_directory, \
-            .secondary_count = 2u, \
-            .set_checksum = 0u, /* Computed lazily at runtime */ \
-            .file_attributes = FAT_FILE_ATTR_READ_ONLY, \
-            .creat_time = struct_name ## _creation_time, \
-            .last_mod_time = struct_name ## _creation_time, \
-            .last_acc_time = struct_name ## _creation_time, \
-        }, \
-        .stream_extension_entry = { \
-            .entry_type = exfat_entry_type_stream_extension, \
-            .secondary_flags = 0x03, /* XXX */ \
-            .name_length = PICOVD_UTF16_STRING_LEN(STR_UTF16_EXPAND(file_name_str)), \
-            .name_hash = vd_exfat_dirs_compute_name_hash(STR_UTF16_EXPAND(file_name_str), \
-                            PICOVD_UTF16_STRING_LEN(STR_UTF16_EXPAND(file_name_str))), \
-            .valid_data_length = file_size_bytes, \
-            .first_cluster = file_first_cluster, \
-            .data_length = file_size_bytes, \
-        }, \
-        .file_name_entry = { \
-            .entry_type = exfat_entry_type_file_name, \
-            .file_name = STR_UTF16_EXPAND(file_name_str), \
-        }, \
-    }
+    constexpr auto struct_name \
+    __attribute__((section("flashdata_picovd_static_directory_entries"), used, aligned(4))) = \
+        vd_exfat_dirs_make_static_file(STR_UTF16_EXPAND(file_name_str), \
+            file_first_cluster, file_size_bytes, \
+            vd_exfat_dirs_make_timestamp(PICOVD_PARAM_STATIC_FILE_CREATION_TIME))
 
 // ---------------------------------------------------------------
 // API to handle files on the virtual disk during runtime
@@ -171,10 +245,13 @@ typedef struct vd_static_file_s vd_static_file_t; // Opaque, see vd_exfat_dirs.h
  * @param max_size_bytes Maximum file size (in bytes) that may be allocated for this file at runtime.
  *                      The file's cluster chain space is allocated to cover this size.
  *
- * @return 0 on success, negative value on error (e.g., if the requested space cannot be allocated).
+ * @return 0 on success, negative value on error (e.g., if the requested space cannot be allocated,
+ *         or the directory of the file is full or not registered).
  *
  * @note The file is initially read-only. For other attributes, you have to set them manually.
- * @note The number of dynamic files is limited by PICOVD_PARAM_MAX_DYNAMIC_FILES.
+ * @note The number of dynamic files is limited by PICOVD_PARAM_MAX_DYNAMIC_FILES,
+ *       and by the root directory, 384 entries: 3 for a name of up to 15 characters,
+ *       one more for each further 15.  Set .parent to place the file in a subdirectory.
  * @note The vd_dynamic_file_t struct must remain valid while the file is registered.
  * @note vd_add_file() does not call vd_virtual_disk_contents_changed() automatically.
  *       You should call it after adding all your files.
@@ -185,6 +262,21 @@ typedef struct vd_static_file_s vd_static_file_t; // Opaque, see vd_exfat_dirs.h
  */
 int vd_add_file(vd_dynamic_file_t* file, size_t max_size_bytes);
 
+/**
+ * @brief Register a subdirectory defined with PICOVD_DEFINE_DIRECTORY_RUNTIME.
+ *
+ * The directory gets its clusters in the dynamic area, and is listed in its
+ * parent, the root directory unless .parent is set.  Files are then added to it
+ * with vd_add_file(), with their .parent pointing to the directory.
+ *
+ * @return 0 on success, negative value on error (e.g., if the dynamic area or
+ *         PICOVD_PARAM_MAX_SUBDIRECTORIES is exhausted).
+ *
+ * @note Remove the files of a directory before the directory itself.
+ * @see PICOVD_DEFINE_DIRECTORY_RUNTIME
+ */
+int vd_add_directory(vd_dynamic_file_t* dir);
+
 /**
  * @brief Update the size and modification time of a dynamic
  *       (runtime) file on the PicoVD virtual disk.
@@ -194,6 +286,13 @@ int vd_add_file(vd_dynamic_file_t* file, size_t max_size_bytes);
  * It updates the file's size and modification timestamp,
  * and notifies the host that the file has changed.
  *
+ * The notification is targeted: a new size changes the directory entry, which
+ * the host has read at the mount, and raises a Unit Attention; a new cluster
+ * count changes the Allocation Bitmap and FAT sectors of the clusters, too.  If the size
+ * stays the same, only the file's own sectors have changed: the host is
+ * notified, and the modification time updated, only if it has read them since
+ * its last remount.  Otherwise the directory entry is left as it was.
+ *
  * @param file Pointer to the vd_dynamic_file_t structure for the file to update.
  * @param size_bytes New file size in bytes.
  *
@@ -224,26 +323,161 @@ int vd_update_file(vd_dynamic_file_t* file, size_t size_bytes);
  * @note Use this function after modifying files, directories, or metadata that must be
  *       immediately visible to the host. Frequent use may cause the host to remount the disk,
  *       which can interrupt ongoing file operations.
- * @note vd_update_file calls this function automatically with hard_reset=false.
+ * @note vd_update_file notifies the host automatically, with vd_virtual_disk_lun_range_changed().
+ * @note The host is not notified if it has read nothing on the volume since its last
+ *       remount; a hard reset is then skipped, too.
  * @see vd_update_file
+ * @see vd_virtual_disk_lun_contents_changed
  */
 extern void vd_virtual_disk_contents_changed(bool hard_reset);
 
+/**
+ * @brief Notify the host that the contents of one volume have changed.
+ *
+ * As vd_virtual_disk_contents_changed(), but the Unit Attention is raised
+ * only on the given LUN, so that the host keeps its cache of the other volume.
+ *
+ * @param lun        VD_LUN_STATIC, VD_LUN_VOLATILE or VD_LUN_ALL.
+ * @param hard_reset If true, forces a full USB disconnect/reconnect, affecting all LUNs.
+ */
+extern void vd_virtual_disk_lun_contents_changed(uint8_t lun, bool hard_reset);
+
+/**
+ * @brief Replay the change notifications the application core could not hand over.
+ *
+ * A vd_virtual_disk_contents_changed() on the application core, when the
+ * handoff queue is full, is remembered and sent by this task instead.
+ * Call regularly from the USB service loop, after vd_handoff_task().
+ */
+extern void vd_virtual_disk_notify_task(void);
+
+/**
+ * @brief Notify the host, if needed, that the sectors [lba, lba + count) of one volume have changed.
+ *
+ * The USB MSC layer keeps, for each LUN, the set of LBA extents the host has
+ * read since its last Unit Attention or reconnect, i.e. what it may hold in its
+ * cache.  A change outside of those extents needs no notification: the host
+ * reads the new contents at its first access.  Otherwise a Unit Attention is
+ * raised, unless one is already pending for the LUN.
+ *
+ * Must be called on the USB core, see vd_handoff_on_usb_core().
+ *
+ * @return true if the host will be notified, false if it has not read the range.
+ */
+extern bool vd_virtual_disk_lun_range_changed(uint8_t lun, uint32_t lba, uint32_t count);
+
+/// Change notification counters, see vd_virtual_disk_get_notify_stats()
+typedef struct {
+    uint32_t changes;             ///< Changes reported with vd_virtual_disk_lun_range_changed()
+    uint32_t changes_uncached;    ///< ...not notified, as the host had not read the range
+    uint32_t changes_coalesced;   ///< ...covered by a Unit Attention already pending
+    uint32_t unit_attentions;     ///< Unit Attentions delivered, each one a remount
+    uint32_t hard_resets;         ///< USB reconnects
+    uint32_t hard_resets_avoided; ///< Reconnects skipped, as the host had read nothing
+} vd_notify_stats_t;
+
+/**
+ * @brief Get the change notification counters, over all LUNs, since boot.
+ *
+ * The remounts avoided are changes_uncached + changes_coalesced + hard_resets_avoided.
+ */
+extern void vd_virtual_disk_get_notify_stats(vd_notify_stats_t *stats);
+
 
 
 // ---------------------------------------------------------------
 // Virtual Disk Read Callback for USB MSC layer
 // ---------------------------------------------------------------
 
-extern int32_t vd_virtual_disk_read(uint32_t lba, uint32_t offset, void* buf, uint32_t bufsize);
+extern int32_t vd_virtual_disk_read(uint8_t lun, uint32_t lba, uint32_t offset, void* buf, uint32_t bufsize);
 
-// ---------------------------------------------------------------
-// Functions to provide RP2350 memory files
-// XXX FIXME: Move to rp2350.h
-// ---------------------------------------------------------------
+/**
+ * @brief The interface a read is for, see vd_virtual_disk_read_by().
+ *
+ * A deferred read belongs to the interface that started it: only its retries
+ * pick up the result, and the other interface is not blocked while it waits.
+ */
+typedef enum {
+    VD_READ_OWNER_MSC = 0,
+    VD_READ_OWNER_VENDOR,
+} vd_read_owner_t;
+
+// As vd_virtual_disk_read(), for the given interface
+extern int32_t vd_virtual_disk_read_by(vd_read_owner_t owner, uint8_t lun, uint32_t lba, uint32_t offset,
+                                       void* buffer, uint32_t bufsize);
+
+// Drop the deferred read of the interface, if any, e.g. when it goes away
+extern void vd_virtual_disk_read_abort(vd_read_owner_t owner);
+
+// The LUN of the READ10 being served, for the region handlers shared by the volumes
+extern uint8_t vd_virtual_disk_current_lun(void);
+
+// The Volume GUID of a volume, §7.5, derived from the board ID like its VolumeSerialNumber
+extern void vd_virtual_disk_volume_guid(uint8_t lun, uint8_t guid[16]);
+
+/// Identifies a deferred read, see VD_READ_PENDING
+typedef uint32_t vd_read_ticket_t;
+
+/**
+ * @brief Return the ticket of the read being served.
+ *
+ * Call from the content callback, before it returns VD_READ_PENDING.
+ */
+extern vd_read_ticket_t vd_read_ticket(void);
+
+/**
+ * @brief Return true if the read is still pending, i.e. neither completed,
+ *        nor dropped after the timeout or an abort.
+ */
+extern bool vd_read_is_current(vd_read_ticket_t ticket);
+
+/**
+ * @brief Claim the buffer of a pending read, before writing to it.
+ *
+ * May be called from any context: the main loop, an IRQ handler, or the other core.
+ * Once claimed, the read is no longer dropped, and vd_read_complete() must
+ * follow without delay.
+ *
+ * @return true if the buffer may be written, false if the read was dropped:
+ *         then the buffer must not be touched, and the read not completed.
+ */
+extern bool vd_read_claim(vd_read_ticket_t ticket);
+
+/**
+ * @brief Complete a read for which a content callback returned VD_READ_PENDING.
+ *
+ * May be called from any context: the main loop, an IRQ handler, or the other core.
+ * The data must have been written to the buffer, after vd_read_claim(), before the call.
+ * A read dropped meanwhile is not completed.
+ *
+ * @param ticket The ticket of the read, from vd_read_ticket().
+ * @param result Number of bytes written to the buffer, or a negative value on error.
+ *               Bytes beyond result, up to the requested size, are zero-filled.
+ *
+ * @see VD_READ_PENDING
+ */
+extern void vd_read_complete(vd_read_ticket_t ticket, int32_t result);
+
+/**
+ * @brief Generate the next cluster wanted by a sequential reader, if any.
+ *
+ * With PICOVD_READ_AHEAD_ENABLED, a sequential read of a dynamic file with
+ * .read_ahead set queues the following clusters; this task generates them,
+ * one per call, with the file's content callback, while the USB transfer
+ * of the previous ones is in progress.  Call regularly from the USB service
+ * loop, next to tud_task().  The content callbacks of such files must not
+ * return VD_READ_PENDING.
+ */
+extern void vd_virtual_disk_read_ahead_task(void);
+
+/// Read-ahead counters, see vd_virtual_disk_get_read_ahead_stats()
+typedef struct {
+    uint32_t hits;       ///< Reads of read-ahead files served from the cache
+    uint32_t misses;     ///< ...generated at the time of the read
+    uint32_t prefetched; ///< Clusters generated ahead of the reader
+    uint32_t wasted;     ///< ...discarded unread: expired, evicted, or the file updated
+} vd_read_ahead_stats_t;
 
-extern int32_t vd_file_sector_get_bootrom(uint32_t lba, uint32_t offset, void* buf, uint32_t bufsize);
-extern int32_t vd_file_sector_get_sram(uint32_t lba, uint32_t offset, void* buf, uint32_t bufsize);
-extern int32_t vd_file_sector_get_flash(uint32_t lba, uint32_t offset, void* buf, uint32_t bufsize);
+extern void vd_virtual_disk_get_read_ahead_stats(vd_read_ahead_stats_t *stats);
 
 #endif // VD_VIRTUAL_DISK_H
@@ -67,7 +67,7 @@ def device(request):
 @pytest.fixture
 def read_raw_sector(device):
     """
-    Fixture: returns a callable to read a single 512-byte sector at the given LBA from:
+    Fixture: returns a callable to read a single sector at the given LBA from:
       - A raw block device via --device or TEST_EXFAT_DEVICE.
     Skips tests if no device is specified or on errors.
     """
@@ -83,7 +83,7 @@ def read_raw_sector(device):
 
 @pytest.fixture
 def bootsector_data(device, read_raw_sector):
-    """Fixture: 512 bytes of exFAT boot sector (LBA 0)."""
+    """Fixture: exFAT boot sector (LBA 0), 512 or 4096 bytes."""
     # Try raw device first
     if device:
         return read_raw_sector(0)
@@ -103,6 +103,12 @@ def bootsector_data(device, read_raw_sector):
     )
 
 
+@pytest.fixture
+def sector_size(bootsector_data):
+    """Fixture: bytes per sector, from BytesPerSectorShift: 512, or 4096 with PICOVD_4KN_ENABLED."""
+    return 1 << bootsector_data[108]
+
+
 @pytest.fixture
 def dir_entry_finder(read_raw_sector, bootsector_data):
     """
@@ -9,6 +9,8 @@ import os
 import re
 
 # XXX TODO: Should bring in CFG_TUD_MSC_BUFSIZE or rethink.
+# Macros defined per geometry, under #if PICOVD_4KN_ENABLED, keep their last,
+# 512-byte definition here; the tests take the geometry from the boot sector.
 
 # === Editable list of exFAT macro names to extract ===
 # These C macro names will be bound directly as Python variables.
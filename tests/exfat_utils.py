@@ -3,24 +3,43 @@
 import os
 import struct
 
-def raw_sector_reader(device_path=None):
+def detect_sector_size(device_path):
+    """
+    Return the sector size of the exFAT volume on device_path, 512 or 4096,
+    from the BytesPerSectorShift field of the boot sector.
+    The boot sector fields all fit in the first 512 bytes, whatever the sector size.
+    """
+    with open(device_path, "rb") as f:
+        data = f.read(512)
+    if len(data) != 512:
+        raise IOError(f"Short read: {len(data)} bytes")
+    shift = data[108]
+    if data[3:11] != b'EXFAT   ' or not 9 <= shift <= 12:
+        raise IOError(f"Not an exFAT boot sector, BytesPerSectorShift {shift}")
+    return 1 << shift
+
+def raw_sector_reader(device_path=None, sector_size=None):
     """
     Returns a function read_sector(lba) that opens device_path or raises IOError.
+    The sector size is detected from the boot sector, unless given.
     """
     def read_sector(lba):
+        nonlocal sector_size
         if not device_path:
             raise IOError("No device specified")
+        if sector_size is None:
+            sector_size = detect_sector_size(device_path)
         with open(device_path, "rb") as f:
-            f.seek(lba * 512)
-            data = f.read(512)
-        if len(data) != 512:
+            f.seek(lba * sector_size)
+            data = f.read(sector_size)
+        if len(data) != sector_size:
             raise IOError(f"Short read: {len(data)} bytes")
         return data
     return read_sector
 
 def _compute_exfat_checksum(sectors, skip_indices_in_sector0=()):
     """
-    Compute the 32-bit checksum over a list of 512-byte sectors using exFAT algorithm.
+    Compute the 32-bit checksum over a list of sectors using exFAT algorithm.
     For sector 0, bytes in skip_indices_in_sector0 will be skipped.
     """
     checksum = 0
@@ -79,8 +98,8 @@ def cluster_chain_reader(read_sector, bootsector_data, start_cluster):
     Assumes clusters are sequential and contiguous. If fragmentation is detected,
     raises an error.
 
-    :param read_sector: callable that takes an LBA and returns 512 bytes
-    :param bootsector_data: 512 bytes of boot sector, to extract layout
+    :param read_sector: callable that takes an LBA and returns one sector
+    :param bootsector_data: the boot sector, to extract layout
     :param start_cluster: first cluster of the chain
     :return: function(data_length) -> bytes
     """
@@ -103,3 +122,52 @@ def cluster_chain_reader(read_sector, bootsector_data, start_cluster):
         return bytes(result[:data_length])
 
     return _read_chain
+
+def read_root_dir_cluster(bootsector_data, read_raw_sector):
+    """Return the complete bytearray for the first root-directory cluster."""
+    # --- 1) Parse key boot-sector fields (all little-endian) ---------------
+    bytes_per_sector_shift    = struct.unpack_from('<B', bootsector_data, 0x6C)[0]
+    sectors_per_cluster_shift = struct.unpack_from('<B', bootsector_data, 0x6D)[0]
+    cluster_heap_offset       = struct.unpack_from('<I', bootsector_data, 0x58)[0]
+    root_dir_cluster          = struct.unpack_from('<I', bootsector_data, 0x60)[0]
+
+    bytes_per_sector    = 1 << bytes_per_sector_shift
+    sectors_per_cluster = 1 << sectors_per_cluster_shift
+
+    # --- 2) Locate first sector of the root directory ----------------------
+    first_dir_lba = cluster_heap_offset \
+                  + (root_dir_cluster - 2) * sectors_per_cluster
+
+    # --- 3) Read the entire first directory cluster ------------------------
+    data = bytearray()
+    for i in range(sectors_per_cluster):
+        sector = read_raw_sector(first_dir_lba + i)
+        assert len(sector) == bytes_per_sector
+        data.extend(sector)
+
+    return data
+
+ATTR_DIRECTORY = 0x10
+
+def entry_sets(data):
+    """Yield (offset, entry count) of each File Directory Entry Set, up to End-of-directory."""
+    offset = 0
+    while offset < len(data) and data[offset] != 0x00:
+        if data[offset] == 0x85:
+            count = data[offset + 1] + 1
+            yield offset, count
+            offset += 32 * count
+        else:
+            offset += 32
+
+def subdirectories(bootsector_data, read_raw_sector):
+    """
+    Yield (offset, GeneralSecondaryFlags, FirstCluster, DataLength) of each
+    subdirectory listed in the root directory.
+    """
+    root = read_root_dir_cluster(bootsector_data, read_raw_sector)
+    for offset, count in entry_sets(root):
+        attributes = struct.unpack_from('<H', root, offset + 4)[0]
+        if attributes & ATTR_DIRECTORY:
+            first_cluster, data_length = struct.unpack_from('<IQ', root, offset + 32 + 20)
+            yield offset, root[offset + 32 + 1], first_cluster, data_length
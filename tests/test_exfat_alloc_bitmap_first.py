@@ -1,18 +1,53 @@
 """
 tests/test_exfat_alloc_bitmap_first.py
 
-Pytest suite for validating the first sector of the exFAT allocation bitmap (LBA = ClusterHeapOffset).
+Pytest suite for validating the exFAT allocation bitmap (first cluster at ClusterHeapOffset).
 
 This test module:
   - Reads the boot sector to extract ClusterHeapOffset.
   - Reads the first allocation bitmap sector at that LBA via the `read_raw_sector` fixture.
-  - Verifies sector size is 512 bytes.
-  - Asserts that every byte in the sector is 0xFF.
+  - Verifies sector size matches BytesPerSectorShift (512 or 4096 bytes).
+  - Asserts that the clusters of the bitmap, the up-case table and the root
+    directory are marked allocated.
+  - Walks the root directory and its subdirectories, and asserts that the
+    bitmap marks exactly the clusters of the files allocated, §7.1.5.
 """
 
 import struct
 
-def test_exfat_alloc_bitmap_first(bootsector_data, read_raw_sector):
+from exfat_utils import (
+    find_directory_entry, cluster_chain_reader, read_root_dir_cluster, entry_sets, subdirectories,
+)
+
+
+def _bit(bitmap, cluster):
+    return (bitmap[(cluster - 2) // 8] >> ((cluster - 2) % 8)) & 1
+
+
+def _clusters(first_cluster, data_length, cluster_size):
+    return range(first_cluster, first_cluster + (data_length + cluster_size - 1) // cluster_size)
+
+
+def _root_dir_clusters(bootsector_data, read_raw_sector):
+    """Follow the FAT chain of the root directory."""
+    sector_size = 1 << bootsector_data[108]
+    fat_offset, _, _, _, root_cluster = struct.unpack_from('<IIIII', bootsector_data, 0x50)
+    clusters, cluster = [], root_cluster
+    while 2 <= cluster < 0xFFFFFFF7 and len(clusters) < 64:
+        clusters.append(cluster)
+        lba, pos = divmod(4 * cluster, sector_size)
+        cluster = struct.unpack_from('<I', read_raw_sector(fat_offset + lba), pos)[0]
+    return clusters
+
+
+def _read_bitmap(bootsector_data, read_raw_sector):
+    entry = find_directory_entry(read_raw_sector, bootsector_data, 0x81)
+    assert entry is not None, "No Allocation Bitmap entry in the root directory"
+    first_cluster, data_length = struct.unpack_from('<IQ', entry, 20)
+    return first_cluster, data_length, cluster_chain_reader(read_raw_sector, bootsector_data, first_cluster)(data_length)
+
+
+def test_exfat_alloc_bitmap_first(bootsector_data, read_raw_sector, sector_size):
     # Extract ClusterHeapOffset (4-byte little-endian) from boot sector at offset 88
     cluster_heap_offset = struct.unpack_from('<I', bootsector_data, 88)[0]
 
@@ -20,8 +55,41 @@ def test_exfat_alloc_bitmap_first(bootsector_data, read_raw_sector):
     data = read_raw_sector(cluster_heap_offset)
 
     # Verify we got exactly one full sector
-    assert len(data) == 512
+    assert len(data) == sector_size
+
+    # The metadata clusters, from the bitmap up to the end of the root directory, are allocated
+    cluster_size = 1 << (bootsector_data[108] + bootsector_data[109])
+    bitmap_cluster, bitmap_length, _ = _read_bitmap(bootsector_data, read_raw_sector)
+    upcase = find_directory_entry(read_raw_sector, bootsector_data, 0x82)
+    upcase_cluster, upcase_length = struct.unpack_from('<IQ', upcase, 20)
+    metadata = list(_clusters(bitmap_cluster, bitmap_length, cluster_size)) \
+             + list(_clusters(upcase_cluster, upcase_length, cluster_size)) \
+             + _root_dir_clusters(bootsector_data, read_raw_sector)
+    for cluster in metadata:
+        assert _bit(data, cluster), f"Metadata cluster {cluster} is not marked allocated"
+
+
+def test_exfat_alloc_bitmap_matches_files(bootsector_data, read_raw_sector):
+    cluster_size = 1 << (bootsector_data[108] + bootsector_data[109])
+    cluster_count = struct.unpack_from('<I', bootsector_data, 0x5C)[0]
+    bitmap_cluster, bitmap_length, bitmap = _read_bitmap(bootsector_data, read_raw_sector)
+    upcase = find_directory_entry(read_raw_sector, bootsector_data, 0x82)
+    upcase_cluster, upcase_length = struct.unpack_from('<IQ', upcase, 20)
+
+    allocated = set(_clusters(bitmap_cluster, bitmap_length, cluster_size))
+    allocated |= set(_clusters(upcase_cluster, upcase_length, cluster_size))
+    allocated |= set(_root_dir_clusters(bootsector_data, read_raw_sector))
+
+    # The files of the root directory, including the subdirectories themselves
+    directories = [read_root_dir_cluster(bootsector_data, read_raw_sector)]
+    for _, _, first_cluster, data_length in subdirectories(bootsector_data, read_raw_sector):
+        directories.append(cluster_chain_reader(read_raw_sector, bootsector_data, first_cluster)(data_length))
+    for data in directories:
+        for offset, _ in entry_sets(data):
+            first_cluster, data_length = struct.unpack_from('<IQ', data, offset + 32 + 20)
+            if data_length:
+                allocated |= set(_clusters(first_cluster, data_length, cluster_size))
 
-    # Every byte in the allocation bitmap should be 0xFF
-    expected = bytes([0xFF] * 512)
-    assert data == expected
+    marked = {cluster for cluster in range(2, cluster_count + 2) if _bit(bitmap, cluster)}
+    assert not marked - allocated, f"Free clusters marked allocated, e.g. {sorted(marked - allocated)[:8]}"
+    assert not allocated - marked, f"File clusters marked free, e.g. {sorted(allocated - marked)[:8]}"
@@ -5,13 +5,15 @@
 #
 # This test module:
 #   - Locates the compiled 512-byte boot sector image (bootsector.bin) in expected build directories.
-#   - Verifies the image is exactly 512 bytes.
+#   - Verifies the image is exactly one sector, 512 or 4096 bytes (PICOVD_4KN_ENABLED).
 #   - Checks the JumpBoot opcode and the "EXFAT   " filesystem name signature.
 #   - Reads and asserts key header fields per the exFAT specification:
 #       • PartitionOffset and VolumeLength
-#       • FATOffset, FATLength, ClusterHeapOffset, and ClusterCount
+#       • FATOffset, FATLength, ClusterHeapOffset, and ClusterCount, as computed
+#         from VolumeLength by vd_exfat_make_layout() (src/vd_exfat_layout.h),
+#         also in the compact layout (PICOVD_COMPACT_LAYOUT_ENABLED)
 #       • RootDirectoryCluster, FileSystemRevision, BytesPerSectorShift, SectorsPerClusterShift, NumberOfFATs, PercentInUse
-#   - Confirms the final boot signature (0xAA55).
+#   - Confirms the boot signature (0xAA55) at bytes 510-511, and zeros after it.
 # """
 # 
 
@@ -19,9 +21,64 @@ import os
 import struct
 import pytest
 
-def test_bootsector_size(bootsector_data):
-    """Boot sector must be exactly 512 bytes."""
-    assert len(bootsector_data) == 512
+# Expected shifts for each geometry, keyed by the sector size.
+GEOMETRY = {
+    512:  dict(bytes_per_sector_shift=9,  sectors_per_cluster_shift=3),
+    4096: dict(bytes_per_sector_shift=12, sectors_per_cluster_shift=0),
+}
+
+CLUSTER_SIZE            = 4096
+HEAP_ALIGNMENT_CLUSTERS = 0x1000  # EXFAT_CLUSTER_HEAP_ALIGNMENT_CLUSTERS
+MAX_DISK_SIZE           = 64 << 30
+
+def is_compact(bootsector_data):
+    """PICOVD_COMPACT_LAYOUT_ENABLED: the cluster heap starts right after the FAT."""
+    cluster_heap_offset = struct.unpack_from('<I', bootsector_data, 88)[0]
+    return cluster_heap_offset * (1 << bootsector_data[108]) < (HEAP_ALIGNMENT_CLUSTERS + 2) * CLUSTER_SIZE
+
+def expected_compact_layout(volume_length, sector_size):
+    """
+    The compact layout: the FAT covers just the heap, and the heap starts
+    at the first cluster after it.  The disk is sized to the heap, so the
+    gap follows from the disk size only through the FAT; find the one that fits.
+    """
+    disk_clusters = volume_length * sector_size // CLUSTER_SIZE
+    for gap in range(1, HEAP_ALIGNMENT_CLUSTERS):
+        fat_length = -(-(disk_clusters - gap) * 4 // sector_size)
+        if -(-(24 + fat_length) * sector_size // CLUSTER_SIZE) == gap:
+            return dict(fat_length=fat_length,
+                        cluster_heap_offset=(gap + 2) * CLUSTER_SIZE // sector_size,
+                        cluster_count=disk_clusters - gap - 2)
+    pytest.fail(f"No compact layout for VolumeLength {volume_length}")
+
+def expected_layout(volume_length, sector_size, compact=False):
+    """
+    The layout for a disk size, as vd_exfat_make_layout() computes it.
+    Cluster N is at byte offset (gap + N) * 4 KB, where the gap is the smallest
+    multiple of 0x1000 clusters after the FAT: 0x1000 with the default 1 GiB disk,
+    see doc/ExFAT-design.md.
+    """
+    if compact:
+        return expected_compact_layout(volume_length, sector_size)
+    disk_size = volume_length * sector_size
+    fat_length = disk_size // CLUSTER_SIZE * 4 // sector_size
+    fat_end_clusters = -(-(24 + fat_length) * sector_size // CLUSTER_SIZE)
+    gap = -(-fat_end_clusters // HEAP_ALIGNMENT_CLUSTERS) * HEAP_ALIGNMENT_CLUSTERS
+    return dict(fat_length=fat_length,
+                cluster_heap_offset=(gap + 2) * CLUSTER_SIZE // sector_size,
+                cluster_count=disk_size // CLUSTER_SIZE - gap - 2)
+
+@pytest.fixture
+def geometry(bootsector_data, sector_size):
+    if sector_size not in GEOMETRY:
+        pytest.fail(f"Unexpected sector size {sector_size}")
+    volume_length = struct.unpack_from('<Q', bootsector_data, 72)[0]
+    return dict(GEOMETRY[sector_size],
+                **expected_layout(volume_length, sector_size, is_compact(bootsector_data)))
+
+def test_bootsector_size(bootsector_data, sector_size):
+    """Boot sector must be exactly one sector."""
+    assert len(bootsector_data) == sector_size
 
 def test_jump_boot_and_fs_name(bootsector_data):
     """Validate JumpBoot instruction and FileSystemName."""
@@ -30,24 +87,29 @@ def test_jump_boot_and_fs_name(bootsector_data):
     # FileSystemName: "EXFAT   "
     assert bootsector_data[3:11] == b'EXFAT   '
 
-def test_partition_and_volume_length(bootsector_data):
+def test_partition_and_volume_length(bootsector_data, geometry):
     """PartitionOffset should be 0; VolumeLength computed per spec."""
     partition_offset = struct.unpack_from('<Q', bootsector_data, 64)[0]
     volume_length    = struct.unpack_from('<Q', bootsector_data, 72)[0]
     assert partition_offset == 0
+    # PICOVD_VIRTUAL_DISK_SIZE_BYTES, 1 GiB by default; the compact layout is sized to its files
+    disk_size = volume_length * (1 << bootsector_data[108])
+    assert 0 < disk_size <= MAX_DISK_SIZE
+    if not is_compact(bootsector_data):
+        assert disk_size % (1 << 20) == 0
     # VolumeLength = ClusterHeapOffset + ClusterCount * SectorsPerCluster
-    expected_volume_length = (256 * 1024) * 8
-    assert volume_length == expected_volume_length
+    assert volume_length == geometry['cluster_heap_offset'] \
+                          + geometry['cluster_count'] * (1 << bootsector_data[109])
 
-def test_fat_and_cluster_fields(bootsector_data):
+def test_fat_and_cluster_fields(bootsector_data, geometry):
     """Check FATOffset, FATLength, ClusterHeapOffset, and ClusterCount."""
     fat_offset, fat_length, cluster_heap_offset, cluster_count = struct.unpack_from('<IIII', bootsector_data, 80)
     assert fat_offset          == 0x18
-    assert fat_length          == 0x800
-    assert cluster_heap_offset == 0x8010
-    assert cluster_count       == 256 * 1024 - (0x8010 / 8)
+    assert fat_length          == geometry['fat_length']
+    assert cluster_heap_offset == geometry['cluster_heap_offset']
+    assert cluster_count       == geometry['cluster_count'] # The same 4 KB clusters in both geometries
 
-def test_filesystem_parameters(bootsector_data):
+def test_filesystem_parameters(bootsector_data, geometry):
     """
     RootDirectoryCluster, FS revision, shifts, number of FATs,
     percent in use, and boot signature.
@@ -60,11 +122,13 @@ def test_filesystem_parameters(bootsector_data):
     boot_signature              = struct.unpack_from('<H', bootsector_data, 510)[0]
 
     assert fs_revision               == 0x0100
-    assert bytes_per_sector_shift    == 9
-    assert sectors_per_cluster_shift == 3
+    assert bytes_per_sector_shift    == geometry['bytes_per_sector_shift']
+    assert sectors_per_cluster_shift == geometry['sectors_per_cluster_shift']
     assert number_of_fats            == 1
     assert percent_in_use            == 0xFF
     assert boot_signature            == 0xAA55
+    # With 4096-byte sectors, the bytes after the boot signature are ExcessSpace, §3.1.23
+    assert bootsector_data[512:] == b'\x00' * (len(bootsector_data) - 512)
 
 def test_root_directory_follows_metadata(
     allocation_bitmap_entry,
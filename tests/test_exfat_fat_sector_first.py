@@ -8,44 +8,93 @@ Pytest suite for validating the first FAT sector (LBA = FATOffset) on the exFAT
 This test module:
   - Reads the boot sector to extract FATOffset.
   - Reads the FAT sector at that LBA via the `read_raw_sector` fixture.
-  - Verifies sector size is 512 bytes.
+  - Verifies sector size matches BytesPerSectorShift (512 or 4096 bytes).
   - Asserts that the first two FAT entries (4 bytes each) are the reserved values:
     - Entry 0 == 0xFFFFFFF8
     - Entry 1 == 0xFFFFFFFF
+  - Asserts that the allocation bitmap, up-case table and root directory have
+    contiguous cluster chains, ending with an end-of-chain mark.
+  - Walks the root directory and its subdirectories, and asserts that each
+    file has a contiguous cluster chain in the FAT, for hosts that ignore NoFatChain.
 """
 
 import struct
 
-def test_fat_sector_reserved_entries(bootsector_data, read_raw_sector):
+from exfat_utils import cluster_chain_reader, read_root_dir_cluster, entry_sets, subdirectories
+
+FAT_END_OF_CHAIN = 0xFFFFFFFF
+
+def _fat_reader(bootsector_data, read_raw_sector, sector_size):
+    """Return a function to read the FAT entry of a cluster, caching the FAT sectors."""
+    fat_offset = struct.unpack_from('<I', bootsector_data, 80)[0]
+    fat_sectors = {}
+
+    def fat_entry(cluster):
+        lba, pos = divmod(4 * cluster, sector_size)
+        if lba not in fat_sectors:
+            fat_sectors[lba] = read_raw_sector(fat_offset + lba)
+        return struct.unpack_from('<I', fat_sectors[lba], pos)[0]
+    return fat_entry
+
+
+def test_fat_sector_reserved_entries(bootsector_data, read_raw_sector, sector_size,
+                                     allocation_bitmap_entry, upcase_table_entry):
     # Extract FATOffset (4-byte little-endian) from boot sector at offset 80
     fat_offset = struct.unpack_from('<I', bootsector_data, 80)[0]
     # Read the FAT sector
     data = read_raw_sector(fat_offset)
-    assert len(data) == 512
+    assert len(data) == sector_size
 
     # Unpack the first two FAT entries
     entry0, entry1 = struct.unpack_from('<II', data, 0)
     assert entry0 == 0xFFFFFFF8  # reserved cluster 0
     assert entry1 == 0xFFFFFFFF  # reserved cluster 1
 
-    # Unpack the first 15 FAT entries (covers clusters 0–14)
-    entries = struct.unpack_from('<15I', data, 0)
-
-    # 2–9: Allocation bitmap chain (clusters 2→3→…→9→EOC)
-    for cluster in range(2, 9):
-        assert entries[cluster] == cluster + 1, \
-            f"Allocation bitmap chain: FAT[{cluster}] == {entries[cluster]:#x}, expected {cluster+1:#x}"
-    assert entries[9] == 0xFFFFFFFF, \
-        f"Allocation bitmap end-of-chain: FAT[9] == {entries[9]:#x}"
-
-    # 10: Up-case table chain (single cluster)
-    assert entries[10] == 0xFFFFFFFF, \
-        f"Up-case table end-of-chain: FAT[10] == {entries[10]:#x}"
-
-    # 11–13: Root directory chain (clusters 11→12→13→EOC)
-    assert entries[11] == 12, \
-        f"Root dir chain: FAT[11] == {entries[11]:#x}, expected 0xc"
-    assert entries[12] == 13, \
-        f"Root dir chain: FAT[12] == {entries[12]:#x}, expected 0xd"
-    assert entries[13] == 0xFFFFFFFF, \
-        f"Root dir end-of-chain: FAT[13] == {entries[13]:#x}"
+    # The metadata chains: 2-9 for the allocation bitmap, 10 for the up-case table
+    # and 11-13 for the root directory with the default 1 GiB disk
+    fat_entry = _fat_reader(bootsector_data, read_raw_sector, sector_size)
+    cluster_size = 1 << (bootsector_data[108] + bootsector_data[109])
+    for name, entry in (("Allocation bitmap", allocation_bitmap_entry), ("Up-case table", upcase_table_entry)):
+        first_cluster, data_length = struct.unpack_from('<IQ', entry, 20)
+        last_cluster = first_cluster + (data_length + cluster_size - 1) // cluster_size - 1
+        for cluster in range(first_cluster, last_cluster):
+            assert fat_entry(cluster) == cluster + 1, \
+                f"{name} chain: FAT[{cluster}] == {fat_entry(cluster):#x}, expected {cluster + 1:#x}"
+        assert fat_entry(last_cluster) == FAT_END_OF_CHAIN, \
+            f"{name} end-of-chain: FAT[{last_cluster}] == {fat_entry(last_cluster):#x}"
+
+    # The root directory is contiguous too, and ends after at most 16 clusters
+    cluster = struct.unpack_from('<I', bootsector_data, 96)[0]
+    for _ in range(16):
+        if fat_entry(cluster) == FAT_END_OF_CHAIN:
+            break
+        assert fat_entry(cluster) == cluster + 1, \
+            f"Root dir chain: FAT[{cluster}] == {fat_entry(cluster):#x}, expected {cluster + 1:#x}"
+        cluster += 1
+    else:
+        assert False, "Root dir chain longer than 16 clusters"
+
+
+
+def test_fat_chains_match_files(bootsector_data, read_raw_sector, sector_size):
+    fat_entry = _fat_reader(bootsector_data, read_raw_sector, sector_size)
+    cluster_size = 1 << (bootsector_data[108] + bootsector_data[109])
+
+    directories = [read_root_dir_cluster(bootsector_data, read_raw_sector)]
+    for _, _, first_cluster, data_length in subdirectories(bootsector_data, read_raw_sector):
+        directories.append(cluster_chain_reader(read_raw_sector, bootsector_data, first_cluster)(data_length))
+    files = 0
+    for data in directories:
+        for offset, _ in entry_sets(data):
+            first_cluster, data_length = struct.unpack_from('<IQ', data, offset + 32 + 20)
+            if data_length == 0:
+                continue
+            last_cluster = first_cluster + (data_length + cluster_size - 1) // cluster_size - 1
+            for cluster in range(first_cluster, last_cluster):
+                assert fat_entry(cluster) == cluster + 1, \
+                    f"File at cluster {first_cluster}: FAT[{cluster}] == {fat_entry(cluster):#x}, expected {cluster + 1:#x}"
+            # Files within other files, e.g. partitions within FLASH.BIN, end within their chain
+            assert fat_entry(last_cluster) in (FAT_END_OF_CHAIN, last_cluster + 1), \
+                f"File at cluster {first_cluster}: FAT[{last_cluster}] == {fat_entry(last_cluster):#x}, expected end of chain"
+            files += 1
+    assert files > 0, "No files in the root directory"
@@ -0,0 +1,76 @@
+"""
+tests/test_exfat_geometry.py
+
+Pytest suite for validating the virtual disk geometry, with 512-byte or
+4096-byte (PICOVD_4KN_ENABLED) sectors.
+
+This test module:
+  - Checks that the cluster is 4 KB, one flash page, whatever the sector size.
+  - Checks that cluster N starts at byte offset (0x1000 + N) * 4 KB, so that
+    memory addresses map directly to LBAs (see doc/ExFAT-design.md), or at
+    a larger multiple of 0x1000 clusters, with disks of 16 GiB and more,
+    or right after the FAT in the compact layout (PICOVD_COMPACT_LAYOUT_ENABLED).
+  - Checks that the FAT region covers all clusters and ends before the cluster heap.
+  - Checks that the block device is as large as VolumeLength sectors.
+  - Over libusb (Linux only), checks that READ CAPACITY(10) reports the
+    block size and count of the boot sector.
+"""
+
+import os
+import struct
+import pytest
+
+CLUSTER_SIZE = 4096
+
+def _fields(bootsector_data):
+    volume_length = struct.unpack_from('<Q', bootsector_data, 72)[0]
+    fat_offset, fat_length, cluster_heap_offset, cluster_count = struct.unpack_from('<IIII', bootsector_data, 80)
+    return volume_length, fat_offset, fat_length, cluster_heap_offset, cluster_count
+
+def test_cluster_is_one_flash_page(bootsector_data, sector_size):
+    sectors_per_cluster = 1 << bootsector_data[109]
+    assert sector_size in (512, 4096)
+    assert sector_size * sectors_per_cluster == CLUSTER_SIZE
+
+def test_cluster_heap_direct_mapping(bootsector_data, sector_size):
+    volume_length, fat_offset, fat_length, cluster_heap_offset, _ = _fields(bootsector_data)
+    # Cluster 2 is the first cluster of the heap
+    gap, rest = divmod(cluster_heap_offset * sector_size - 2 * CLUSTER_SIZE, CLUSTER_SIZE)
+    assert rest == 0
+    if gap < 0x1000:
+        # Compact layout: the heap starts at the first cluster after the FAT
+        assert gap == -(-(fat_offset + fat_length) * sector_size // CLUSTER_SIZE)
+        return
+    assert gap % 0x1000 == 0
+    if volume_length * sector_size < 16 << 30:
+        # The FAT fits before cluster 0x1000
+        assert gap == 0x1000
+
+def test_fat_region_fits(bootsector_data, sector_size):
+    _, fat_offset, fat_length, cluster_heap_offset, cluster_count = _fields(bootsector_data)
+    assert fat_offset == 24  # Main and Backup Boot regions, 12 sectors each
+    assert fat_length * sector_size >= (cluster_count + 2) * 4
+    assert fat_offset + fat_length <= cluster_heap_offset
+
+def test_device_size_matches_volume_length(device, bootsector_data, sector_size):
+    volume_length, *_ = _fields(bootsector_data)
+    fd = os.open(device, os.O_RDONLY)
+    try:
+        device_size = os.lseek(fd, 0, os.SEEK_END)
+    finally:
+        os.close(fd)
+    assert device_size == volume_length * sector_size
+
+def test_read_capacity_matches_bootsector(msc_usb_dev_device):
+    from test_msc_scsi_read_only import read_capacity
+    last_lba, block_size = read_capacity(msc_usb_dev_device)
+    # The boot sector can't be read through the block device here: the kernel
+    # driver is detached.  Its fields fit in the first 512 bytes of the block.
+    from test_msc_scsi_read_only import send_scsi
+    cdb = bytes([0x28, 0, 0, 0, 0, 0, 0, 0, 1, 0] + [0]*6)  # READ(10), LBA 0, 1 block
+    status, _, data = send_scsi(msc_usb_dev_device, lun=0, scsi_cmd=cdb, data_dir=1, data_len=block_size)
+    assert status == 0, "READ(10) of the boot sector should succeed"
+    bootsector = bytes(data)
+    volume_length = struct.unpack_from('<Q', bootsector, 72)[0]
+    assert block_size == 1 << bootsector[108]
+    assert last_lba + 1 == volume_length
@@ -3,10 +3,13 @@ tests/test_exfat_root_dir_metadata_entries.py
 
 Verify that the root‐directory cluster contains each of the required
 exFAT metadata entries — Volume Label (0x83), Allocation Bitmap (0x81)
-and Up-case Table (0x82) — in any order.
+and Up-case Table (0x82) — in any order, and a valid Volume GUID entry (0xA0).
 """
 
 import struct
+import uuid
+
+from test_exfat_root_dir_file_entry_sets import _compute_entry_set_checksum
 
 def test_exfat_root_dir_metadata_entries(bootsector_data, read_raw_sector):
     # --- 1) Parse key boot‐sector fields (all little‐endian) ---
@@ -38,3 +41,16 @@ def test_exfat_root_dir_metadata_entries(bootsector_data, read_raw_sector):
     assert 0x83 in entry_types, "Missing Volume Label entry (0x83)"
     assert 0x81 in entry_types, "Missing Allocation Bitmap entry (0x81)"
     assert 0x82 in entry_types, "Missing Up-case Table entry (0x82)"
+
+    # --- 6) The Volume GUID entry, §7.5: no secondaries, a non-null GUID ---
+    assert 0xA0 in entry_types, "Missing Volume GUID entry (0xA0)"
+    offset = 32 * entry_types.index(0xA0)
+    secondary_count, set_checksum, flags = struct.unpack_from('<BHH', data, offset + 1)
+    assert secondary_count == 0, f"Volume GUID SecondaryCount {secondary_count}, expected 0"
+    assert flags == 0, f"Volume GUID GeneralPrimaryFlags {flags:#06x}, expected 0"
+    assert data[offset + 6:offset + 22] != bytes(16), "Volume GUID is the null GUID"
+    assert _compute_entry_set_checksum(data, offset, 1) == set_checksum, "Volume GUID SetChecksum mismatch"
+    # In the Microsoft byte order, as uuid.UUID(bytes_le=...) reads it
+    guid = uuid.UUID(bytes_le=bytes(data[offset + 6:offset + 22]))
+    assert guid.version == 8, f"Volume GUID version {guid.version}, expected 8"
+    assert guid.variant == uuid.RFC_4122, f"Volume GUID variant {guid.variant}, expected RFC 4122"
@@ -18,34 +18,7 @@ A   File DirectoryEntry (0x85)  **must** be followed immediately by:
 import struct
 import pytest
 
-
-# ---------------------------------------------------------------------------
-# Helpers
-# ---------------------------------------------------------------------------
-
-def _read_root_dir_cluster(bootsector_data, read_raw_sector) -> bytearray:
-    """Return the complete bytearray for the first root-directory cluster."""
-    # --- 1) Parse key boot-sector fields (all little-endian) ---------------
-    bytes_per_sector_shift    = struct.unpack_from('<B', bootsector_data, 0x6C)[0]
-    sectors_per_cluster_shift = struct.unpack_from('<B', bootsector_data, 0x6D)[0]
-    cluster_heap_offset       = struct.unpack_from('<I', bootsector_data, 0x58)[0]
-    root_dir_cluster          = struct.unpack_from('<I', bootsector_data, 0x60)[0]
-
-    bytes_per_sector    = 1 << bytes_per_sector_shift
-    sectors_per_cluster = 1 << sectors_per_cluster_shift
-
-    # --- 2) Locate first sector of the root directory ----------------------
-    first_dir_lba = cluster_heap_offset \
-                  + (root_dir_cluster - 2) * sectors_per_cluster
-
-    # --- 3) Read the entire first directory cluster ------------------------
-    data = bytearray()
-    for i in range(sectors_per_cluster):
-        sector = read_raw_sector(first_dir_lba + i)
-        assert len(sector) == bytes_per_sector
-        data.extend(sector)
-
-    return data
+from exfat_utils import read_root_dir_cluster
 
 
 # ---------------------------------------------------------------------------
@@ -145,7 +118,7 @@ def test_exfat_root_dir_file_entry_sets(bootsector_data, read_raw_sector):
     Iterate over every 32-byte directory entry in the first root-directory
     cluster and validate each *File Directory Entry Set*.
     """
-    data = _read_root_dir_cluster(bootsector_data, read_raw_sector)
+    data = read_root_dir_cluster(bootsector_data, read_raw_sector)
     offset = 0
     cluster_size = len(data)
 
@@ -157,12 +130,12 @@ def test_exfat_root_dir_file_entry_sets(bootsector_data, read_raw_sector):
             offset += 32
             continue
 
-        # 0x80 = End-of-directory entry  → stop (no active entries after this)
-        if entry_type == 0x80:
+        # 0x00 = End-of-directory entry  → stop (no active entries after this)
+        if entry_type == 0x00:
             break
 
         # Skip the well-tested metadata single-entry types
-        if entry_type in (0x81, 0x82, 0x83):     # Allocation Bitmap, Up-case, Volume Label
+        if entry_type in (0x81, 0x82, 0x83, 0xA0):  # Allocation Bitmap, Up-case, Volume Label, Volume GUID
             offset += 32
             continue
 
@@ -236,3 +209,46 @@ def test_exfat_root_dir_file_entry_sets(bootsector_data, read_raw_sector):
         pytest.fail(
             f"Unexpected directory entry type {entry_type:#04x} at offset {offset}"
         )
+
+
+def test_exfat_root_dir_end_of_directory(bootsector_data, read_raw_sector):
+    """
+    The root directory ends with End-of-directory entries, spec §6.3.1.1,
+    within its first cluster, so that the host does not scan the rest:
+    every entry after the first one must be an End-of-directory entry too.
+    """
+    data = read_root_dir_cluster(bootsector_data, read_raw_sector)
+    types = data[::32]
+    assert 0x00 in types, "No End-of-directory entry in the first root-directory cluster"
+    end = types.index(0x00) * 32
+    assert data[end:] == bytes(len(data) - end), (
+        f"Non-zero bytes after the End-of-directory entry at offset {end}"
+    )
+
+
+def _timestamp_fields(timestamp):
+    """(year, month, day, hour, minute, second) of an exFAT timestamp, Table 29 §7.4.8."""
+    return (1980 + (timestamp >> 25), (timestamp >> 21) & 0x0F, (timestamp >> 16) & 0x1F,
+            (timestamp >> 11) & 0x1F, (timestamp >> 5) & 0x3F, 2 * (timestamp & 0x1F))
+
+
+def test_exfat_root_dir_timestamps(bootsector_data, read_raw_sector):
+    """
+    The timestamps of every File Directory Entry are valid dates and times,
+    §7.4.8, and the 10msIncrement fields at most 199, §7.4.9.
+    """
+    import calendar
+
+    data = read_root_dir_cluster(bootsector_data, read_raw_sector)
+    for offset in range(0, len(data), 32):
+        if data[offset] != 0x85:
+            continue
+        creat, mod, acc = struct.unpack_from('<III', data, offset + 8)
+        for name, timestamp in (('Create', creat), ('LastModified', mod), ('LastAccessed', acc)):
+            year, month, day, hour, minute, second = _timestamp_fields(timestamp)
+            assert 1 <= month <= 12 and 1 <= day <= calendar.monthrange(year, month)[1], \
+                f"Entry at {offset}: {name}Timestamp {timestamp:#010x} has no valid date"
+            assert hour < 24 and minute < 60 and second < 60, \
+                f"Entry at {offset}: {name}Timestamp {timestamp:#010x} has no valid time"
+        for name, increment in (('Create', data[offset + 20]), ('LastModified', data[offset + 21])):
+            assert increment <= 199, f"Entry at {offset}: {name}10msIncrement {increment} > 199"
@@ -7,7 +7,8 @@ This test module:
   - Reads sectors 0 through 10 via the `read_raw_sector` fixture.
   - Applies the exFAT VBR checksum algorithm (ROR by 1, add byte) across all 11 sectors,
     zeroing the three ignored bytes in sector 0 (VolumeFlags and PercentInUse) per spec.
-  - Reads sector 11 and verifies it contains 128 copies of the 4-byte checksum (little-endian).
+  - Reads sector 11 and verifies it is filled with copies of the 4-byte checksum (little-endian),
+    128 copies with 512-byte sectors, 1024 with 4096-byte sectors.
 """
 
 import struct
@@ -15,15 +16,15 @@ import pytest
 
 from exfat_utils import compute_vbr_checksum, raw_sector_reader
 
-def test_vbr_checksum_sector(read_raw_sector):
+def test_vbr_checksum_sector(read_raw_sector, sector_size):
     """
-    Sector 11 must contain 128 repetitions of the computed VBR checksum.
+    Sector 11 must be filled with repetitions of the computed VBR checksum.
     """
     sectors = [read_raw_sector(lba) for lba in range(11)]
     checksum = compute_vbr_checksum(sectors)
     sector11 = read_raw_sector(11)
-    assert len(sector11) == 512
-    expected_pattern = struct.pack('<I', checksum) * (512 // 4)
+    assert len(sector11) == sector_size
+    expected_pattern = struct.pack('<I', checksum) * (sector_size // 4)
     assert sector11 == expected_pattern
 
 if __name__ == "__main__":
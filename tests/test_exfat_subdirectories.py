@@ -0,0 +1,44 @@
+"""
+tests/test_exfat_subdirectories.py
+
+Walk every subdirectory listed in the root directory, see
+PICOVD_DEFINE_DIRECTORY_RUNTIME, and check that its generated clusters
+hold valid File Directory Entry Sets, followed by End-of-directory entries
+up to the end of the directory.  Skipped if there are no subdirectories.
+"""
+
+import struct
+import pytest
+
+from exfat_utils import cluster_chain_reader, entry_sets, subdirectories
+from test_exfat_root_dir_file_entry_sets import (
+    _compute_entry_set_checksum, _extract_and_check_filename,
+)
+
+
+def test_exfat_subdirectories(bootsector_data, read_raw_sector):
+    subdirs = list(subdirectories(bootsector_data, read_raw_sector))
+    if not subdirs:
+        pytest.skip("No subdirectories in the root directory")
+
+    cluster_size = 1 << (bootsector_data[108] + bootsector_data[109])
+    for offset, flags, first_cluster, data_length in subdirs:
+        # Generated, contiguous clusters, no FAT chain
+        assert flags & 0x03 == 0x03, f"Subdirectory at {offset}: flags {flags:#04x}, expected NoFatChain"
+        assert data_length > 0 and data_length % cluster_size == 0, \
+            f"Subdirectory at {offset}: DataLength {data_length} is not whole clusters"
+
+        data = cluster_chain_reader(read_raw_sector, bootsector_data, first_cluster)(data_length)
+        end = 0
+        for set_offset, count in entry_sets(data):
+            types = [data[set_offset + 32 * i] for i in range(count)]
+            assert types[1] == 0xC0 and set(types[2:]) == {0xC1}, \
+                f"Subdirectory cluster {first_cluster}, set at {set_offset}: entry types {types}"
+            stored = struct.unpack_from('<H', data, set_offset + 2)[0]
+            assert _compute_entry_set_checksum(data, set_offset, count) == stored, \
+                f"Subdirectory cluster {first_cluster}, set at {set_offset}: EntrySetChecksum mismatch"
+            _extract_and_check_filename(data, set_offset, types, count)
+            end = set_offset + 32 * count
+
+        assert data[end:] == bytes(len(data) - end), \
+            f"Subdirectory cluster {first_cluster}: non-zero bytes after the last entry set at {end}"
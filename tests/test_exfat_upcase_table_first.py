@@ -7,7 +7,7 @@ This test module:
   - Reads the boot sector to extract ClusterHeapOffset and SectorsPerClusterShift.
   - Computes the LBA of the up-case table cluster (cluster 2 + 8).
   - Reads the first up-case table sector via the `read_raw_sector` fixture.
-  - Verifies sector size is 512 bytes.
+  - Verifies sector size matches BytesPerSectorShift (512 or 4096 bytes).
   - Checks that:
       • codepoint 0x0000 maps to 0x0000,
       • lowercase 'a' → 'A',
@@ -16,7 +16,7 @@ This test module:
 
 import struct
 
-def test_exfat_upcase_table_first(bootsector_data, read_raw_sector, upcase_table_entry):
+def test_exfat_upcase_table_first(bootsector_data, read_raw_sector, upcase_table_entry, sector_size):
     # 1) Extract key boot-sector fields
     cluster_heap_offset = struct.unpack_from('<I', bootsector_data, 88)[0]
     sectors_per_cluster_shift = struct.unpack_from('<B', bootsector_data, 109)[0]
@@ -30,7 +30,7 @@ def test_exfat_upcase_table_first(bootsector_data, read_raw_sector, upcase_table
     data = read_raw_sector(upcase_lba)
 
     # 4) Verify we got exactly one full sector
-    assert len(data) == 512
+    assert len(data) == sector_size
 
     # 5) Decompress the RLE-compressed up-case table
     mapping = []
@@ -0,0 +1,132 @@
+# tests/test_msc_scsi_commands.py
+#
+# Conformance and latency of the SCSI commands answered by tud_msc_scsi_cb()
+# rather than by TinyUSB: READ (16), READ CAPACITY (16), REPORT LUNS,
+# PRE-FETCH and SYNCHRONIZE CACHE.  Each one must either succeed or fail
+# with the sense data of SPC-4/SBC-3, never time out.
+
+import struct
+import time
+
+import pytest
+
+from test_msc_scsi_read_only import send_scsi, read_capacity, parse_sense, get_max_lun
+
+SCSI_CMD_REQUEST_SENSE        = 0x03
+SCSI_CMD_READ_10              = 0x28
+SCSI_CMD_PREFETCH_10          = 0x34
+SCSI_CMD_SYNCHRONIZE_CACHE_10 = 0x35
+SCSI_CMD_READ_16              = 0x88
+SCSI_CMD_PREFETCH_16          = 0x90
+SCSI_CMD_SYNCHRONIZE_CACHE_16 = 0x91
+SCSI_CMD_SERVICE_ACTION_IN_16 = 0x9E
+SCSI_CMD_REPORT_LUNS          = 0xA0
+SCSI_SA_READ_CAPACITY_16      = 0x10
+
+SENSE_ILLEGAL_REQUEST = 0x05
+ASC_INVALID_COMMAND   = 0x20
+ASC_LBA_OUT_OF_RANGE  = 0x21
+ASC_INVALID_FIELD     = 0x24
+
+MAX_LATENCY_S = 0.020  # Per command, median; none of these touch the flash
+
+def cdb16(*fields):
+    return bytes(fields).ljust(16, b'\x00')
+
+def read16_cdb(lba, count):
+    return cdb16(SCSI_CMD_READ_16, 0, *struct.pack('>QI', lba, count))
+
+def request_sense(dev, lun=0):
+    status, _, data = send_scsi(dev, lun, cdb16(SCSI_CMD_REQUEST_SENSE, 0, 0, 0, 18), data_dir=1, data_len=18)
+    assert status == 0, "REQUEST SENSE should succeed"
+    return parse_sense(bytes(data))
+
+def assert_fails_with(dev, cdb, asc, data_dir=2, data_len=0):
+    status, _, _ = send_scsi(dev, 0, cdb, data_dir=data_dir, data_len=data_len)
+    assert status != 0, f"Command 0x{cdb[0]:02x} should fail"
+    skey, rasc, _ = request_sense(dev)
+    assert (skey, rasc) == (SENSE_ILLEGAL_REQUEST, asc), \
+        f"Command 0x{cdb[0]:02x}: sense {skey:x}/{rasc:02x}, expected {SENSE_ILLEGAL_REQUEST:x}/{asc:02x}"
+
+def test_read_capacity16_matches_read_capacity10(msc_usb_dev_device):
+    dev = msc_usb_dev_device
+    last_lba, block_size = read_capacity(dev)
+    cdb = cdb16(SCSI_CMD_SERVICE_ACTION_IN_16, SCSI_SA_READ_CAPACITY_16, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 32)
+    status, _, data = send_scsi(dev, 0, cdb, data_dir=1, data_len=32)
+    assert status == 0, "READ CAPACITY (16) should succeed"
+    last_lba16, block_size16, _, exponent = struct.unpack('>QIBB', bytes(data[:14]))
+    assert (last_lba16, block_size16) == (last_lba, block_size)
+    # One 4 KB cluster per physical block
+    assert block_size << exponent == 4096
+
+def test_read16_matches_read10(msc_usb_dev_device):
+    dev = msc_usb_dev_device
+    _, block_size = read_capacity(dev)
+    count = 4096 // block_size
+    status, _, data16 = send_scsi(dev, 0, read16_cdb(0, count), data_dir=1, data_len=4096)
+    assert status == 0, "READ (16) should succeed"
+    cdb10 = cdb16(SCSI_CMD_READ_10, 0, *struct.pack('>IBH', 0, 0, count))
+    status, _, data10 = send_scsi(dev, 0, cdb10, data_dir=1, data_len=4096)
+    assert status == 0, "READ (10) should succeed"
+    assert bytes(data16) == bytes(data10), "READ (16) and READ (10) data differ"
+
+def test_read16_out_of_range(msc_usb_dev_device):
+    dev = msc_usb_dev_device
+    last_lba, block_size = read_capacity(dev)
+    assert_fails_with(dev, read16_cdb(last_lba + 1, 1), ASC_LBA_OUT_OF_RANGE,
+                      data_dir=1, data_len=block_size)
+
+def test_report_luns(msc_usb_dev_device):
+    dev = msc_usb_dev_device
+    luns = get_max_lun(dev) + 1
+    cdb = cdb16(SCSI_CMD_REPORT_LUNS, 0, 0, 0, 0, 0, *struct.pack('>I', 256))
+    status, _, data = send_scsi(dev, 0, cdb, data_dir=1, data_len=256)
+    assert status == 0, "REPORT LUNS should succeed"
+    data = bytes(data)
+    assert struct.unpack('>I', data[:4])[0] == 8 * luns
+    assert [data[8 + 8 * i + 1] for i in range(luns)] == list(range(luns))
+
+@pytest.mark.parametrize("opcode", [SCSI_CMD_PREFETCH_10, SCSI_CMD_SYNCHRONIZE_CACHE_10])
+def test_range_commands_10(msc_usb_dev_device, opcode):
+    dev = msc_usb_dev_device
+    last_lba, _ = read_capacity(dev)
+    status, _, _ = send_scsi(dev, 0, cdb16(opcode, 0, *struct.pack('>IBH', 0, 0, 8)), data_dir=2, data_len=0)
+    assert status == 0, f"Command 0x{opcode:02x} should succeed"
+    assert_fails_with(dev, cdb16(opcode, 0, *struct.pack('>IBH', last_lba + 1, 0, 1)), ASC_LBA_OUT_OF_RANGE)
+
+@pytest.mark.parametrize("opcode", [SCSI_CMD_PREFETCH_16, SCSI_CMD_SYNCHRONIZE_CACHE_16])
+def test_range_commands_16(msc_usb_dev_device, opcode):
+    dev = msc_usb_dev_device
+    last_lba, _ = read_capacity(dev)
+    status, _, _ = send_scsi(dev, 0, cdb16(opcode, 0, *struct.pack('>QI', 0, 8)), data_dir=2, data_len=0)
+    assert status == 0, f"Command 0x{opcode:02x} should succeed"
+    assert_fails_with(dev, cdb16(opcode, 0, *struct.pack('>QI', last_lba + 1, 1)), ASC_LBA_OUT_OF_RANGE)
+
+def test_unknown_command_sense(msc_usb_dev_device):
+    # A vendor-specific operation code
+    assert_fails_with(msc_usb_dev_device, cdb16(0xC0), ASC_INVALID_COMMAND)
+
+def test_unknown_service_action_sense(msc_usb_dev_device):
+    assert_fails_with(msc_usb_dev_device, cdb16(SCSI_CMD_SERVICE_ACTION_IN_16, 0x1F), ASC_INVALID_FIELD,
+                      data_dir=1, data_len=32)
+
+@pytest.mark.parametrize("name, cdb, data_dir, data_len", [
+    ("READ (16)",           read16_cdb(0, 1),                                          1, 512),
+    ("READ CAPACITY (16)",  cdb16(SCSI_CMD_SERVICE_ACTION_IN_16, SCSI_SA_READ_CAPACITY_16,
+                                  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 32),                1, 32),
+    ("REPORT LUNS",         cdb16(SCSI_CMD_REPORT_LUNS, 0, 0, 0, 0, 0, 0, 0, 1, 0),     1, 256),
+    ("SYNCHRONIZE CACHE",   cdb16(SCSI_CMD_SYNCHRONIZE_CACHE_10),                      2, 0),
+], ids=["read16", "read_capacity16", "report_luns", "synchronize_cache"])
+def test_command_latency(msc_usb_dev_device, name, cdb, data_dir, data_len):
+    dev = msc_usb_dev_device
+    _, block_size = read_capacity(dev)
+    if cdb[0] == SCSI_CMD_READ_16:
+        data_len = block_size
+    times = []
+    for _ in range(20):
+        t0 = time.perf_counter()
+        status, _, _ = send_scsi(dev, 0, cdb, data_dir=data_dir, data_len=data_len)
+        times.append(time.perf_counter() - t0)
+        assert status == 0, f"{name} should succeed"
+    median = sorted(times)[len(times) // 2]
+    assert median < MAX_LATENCY_S, f"{name}: median {median * 1000:.1f} ms"
@@ -5,10 +5,14 @@ import usb.util
 import conftest
 
 # SCSI command op‐codes
+SCSI_CMD_READ_CAPACITY_10 = 0x25
 SCSI_CMD_WRITE10       = 0x2A
 SCSI_CMD_MODE_SENSE_6  = 0x1A
 SCSI_CMD_REQUEST_SENSE = 0x03
 
+# USB MSC BOT class request
+MSC_REQ_GET_MAX_LUN = 0xFE
+
 # USB MSC BOT signatures
 CBW_SIGNATURE = 0x43425355
 CSW_SIGNATURE = 0x53425355
@@ -66,6 +70,13 @@ def send_scsi(dev, lun, scsi_cmd, data_dir, data_len, data_out=b''):
     assert sig == CSW_SIGNATURE, f"Bad CSW signature: {hex(sig)}"
     return status, residue, data_in
 
+def read_capacity(dev, lun=0):
+    """READ CAPACITY(10): return (last_lba, block_size)."""
+    cdb = bytes([SCSI_CMD_READ_CAPACITY_10] + [0]*9 + [0]*6)
+    status, residue, data = send_scsi(dev, lun=lun, scsi_cmd=cdb, data_dir=1, data_len=8)
+    assert status == 0, "READ CAPACITY should succeed"
+    return struct.unpack('>II', bytes(data))
+
 def parse_sense(data):
     """Extract (sense_key, asc, ascq) from 18-byte fixed-format sense."""
     sense_key = data[2] & 0x0F
@@ -75,7 +86,8 @@ def parse_sense(data):
 
 def test_write10_fails_with_protect(msc_usb_dev_device):
     dev = msc_usb_dev_device
-    # 1 block (512B) write at LBA 0
+    _, block_size = read_capacity(dev)
+    # 1 block (512B, or 4 KB with 4Kn) write at LBA 0
     cdb = bytearray(16)
     cdb[0] = SCSI_CMD_WRITE10
     # LBA = bytes 2–5 = 0 by default, transfer length = 1 block -> byte 7=0, byte8=1
@@ -86,8 +98,8 @@ def test_write10_fails_with_protect(msc_usb_dev_device):
         dev, lun=0,
         scsi_cmd=cdb,
         data_dir=0,
-        data_len=512,
-        data_out=b'\x00'*512
+        data_len=block_size,
+        data_out=b'\x00'*block_size
     )
     assert status != 0, "WRITE10 should be rejected on read-only medium"
 
@@ -120,3 +132,17 @@ def test_mode_sense_reports_wp(msc_usb_dev_device):
     assert status == 0, "MODE SENSE should succeed"
     # Byte 2 bit7 = Write-Protect
     assert (data[2] & 0x80) != 0, "Write-Protect bit not set in MODE SENSE response"
+
+def get_max_lun(dev):
+    """BOT GET MAX LUN class request: return the highest LUN number."""
+    data = dev.ctrl_transfer(0xA1, MSC_REQ_GET_MAX_LUN, 0, conftest.USB_MSC_IFACE, 1, timeout=1000)
+    return data[0]
+
+def test_all_luns_have_same_geometry(msc_usb_dev_device):
+    # One LUN by default, two with PICOVD_MULTI_LUN_ENABLED
+    dev = msc_usb_dev_device
+    max_lun = get_max_lun(dev)
+    assert max_lun <= 1, f"Unexpected max LUN {max_lun}"
+    geometry = read_capacity(dev, lun=0)
+    for lun in range(1, max_lun + 1):
+        assert read_capacity(dev, lun=lun) == geometry, f"LUN {lun} geometry differs from LUN 0"
@@ -0,0 +1,45 @@
+# tests/test_vendor_bulk.py
+#
+# The vendor bulk fast path (PICOVD_VENDOR_BULK_ENABLED) must return the same
+# bytes as the memory region files on the exFAT volume.
+
+import os
+import sys
+
+import pytest
+
+sys.path.insert(0, os.path.join(os.path.dirname(__file__), '..', 'tools'))
+import picovd_bulk
+
+READ_SIZE = 8192  # Bytes compared per region
+
+@pytest.fixture
+def vendor_bulk():
+    try:
+        return picovd_bulk.PicoVDBulk()
+    except Exception as e:
+        pytest.skip(f"No vendor bulk interface: {e}")
+
+def test_regions_match_msc(vendor_bulk, device):
+    regions = vendor_bulk.regions()
+    assert regions, "LIST_REGIONS returned no regions"
+    with open(device, 'rb') as f:
+        for base, size, cluster, name in regions:
+            n = min(size, READ_SIZE)
+            f.seek(picovd_bulk.cluster_offset(f, cluster))
+            assert vendor_bulk.read_mem(base, n) == f.read(n), f"{name} differs from its file"
+
+def test_read_mem_out_of_range(vendor_bulk):
+    base, size, _, name = vendor_bulk.regions()[0]
+    with pytest.raises(RuntimeError, match="out of range"):
+        vendor_bulk.read_mem(base + size - 4, 8)
+    # The request stream stays in sync after an error
+    assert len(vendor_bulk.read_mem(base, 64)) == 64
+
+def test_files_read_to_size(vendor_bulk):
+    for idx, (name, size, _) in enumerate(vendor_bulk.files()):
+        if size > READ_SIZE:
+            continue
+        # Reading past the end returns the file contents only
+        data = vendor_bulk.read(picovd_bulk.OP_READ_FILE, idx, 0, size + 100)
+        assert len(data) == size, f"{name}: {len(data)} bytes, size {size}"
@@ -0,0 +1,115 @@
+#!/usr/bin/env python3
+"""
+tools/cdc_latency_bench.py
+
+Measure the CDC round-trip latency of a PicoVD device, first idle and then
+while the host reads SLOW.TXT, to show that slow MSC reads do not stall CDC.
+
+Usage:
+    cdc_latency_bench.py <serial port> <mount point> [-n pings]
+
+Requires a build with PICOVD_SLOW_FILE_ENABLED, which adds SLOW.TXT and
+echoes CDC input back.  With PICOVD_SLOW_FILE_ASYNC (the default) the reads
+complete via vd_read_complete() and the latency stays flat; with it set to 0
+each read blocks tud_task() for PICOVD_SLOW_FILE_DELAY_MS, and the latency
+under load grows accordingly.
+
+Requires pyserial (`pip3 install pyserial`).
+"""
+
+import argparse
+import mmap
+import os
+import platform
+import statistics
+import sys
+import threading
+import time
+
+import serial
+
+CHUNK_SIZE = 4096
+PING_SIZE  = 8
+
+
+def read_uncached(path, stop):
+    """Read the file repeatedly, bypassing the page cache, until stop is set."""
+    flags = os.O_RDONLY
+    if platform.system() == 'Linux':
+        flags |= os.O_DIRECT
+    fd = os.open(path, flags)
+    try:
+        if platform.system() == 'Darwin':
+            import fcntl
+            fcntl.fcntl(fd, fcntl.F_NOCACHE, 1)
+        size = os.fstat(fd).st_size
+        buf = mmap.mmap(-1, CHUNK_SIZE)  # Page aligned, as O_DIRECT requires
+        reads = 0
+        while not stop.is_set():
+            for pos in range(0, size, CHUNK_SIZE):
+                if stop.is_set() or os.preadv(fd, [buf], pos) <= 0:
+                    break
+                reads += 1
+        return reads
+    finally:
+        os.close(fd)
+
+
+def ping(port, seq):
+    """Send one ping and return its round-trip time in milliseconds."""
+    token = b'%0*d' % (PING_SIZE - 1, seq % 10 ** (PING_SIZE - 1)) + b'\n'
+    port.reset_input_buffer()
+    t0 = time.perf_counter()
+    port.write(token)
+    received = b''
+    while not received.endswith(token):
+        data = port.read(1)
+        if not data:
+            raise TimeoutError(f"No echo for ping {seq}; is PICOVD_SLOW_FILE_ENABLED set?")
+        received += data
+    return (time.perf_counter() - t0) * 1000
+
+
+def measure(port, count):
+    return [ping(port, i) for i in range(count)]
+
+
+def report(label, samples):
+    samples = sorted(samples)
+    p99 = samples[min(len(samples) - 1, int(len(samples) * 0.99))]
+    print(f"{label:<12} n={len(samples):<5} min {samples[0]:7.2f} ms  "
+          f"median {statistics.median(samples):7.2f} ms  "
+          f"p99 {p99:7.2f} ms  max {samples[-1]:7.2f} ms")
+    return statistics.median(samples), p99
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n\n')[1])
+    parser.add_argument('port', help="CDC serial port, e.g. /dev/ttyACM0 or /dev/cu.usbmodem1101")
+    parser.add_argument('mount', help="PicoVD mount point, e.g. /Volumes/PicoVD")
+    parser.add_argument('-n', '--pings', type=int, default=200, help="Pings per phase")
+    args = parser.parse_args()
+
+    with serial.Serial(args.port, timeout=2) as port:
+        idle_median, idle_p99 = report("idle", measure(port, args.pings))
+
+        stop = threading.Event()
+        result = {}
+        reader = threading.Thread(
+            target=lambda: result.update(reads=read_uncached(os.path.join(args.mount, 'SLOW.TXT'), stop)))
+        reader.start()
+        try:
+            time.sleep(0.1)  # Let the first reads start
+            load_median, load_p99 = report("MSC reading", measure(port, args.pings))
+        finally:
+            stop.set()
+            reader.join()
+
+    print(f"SLOW.TXT reads during the test: {result.get('reads', 0)}")
+    print(f"Median latency under load is {load_median / max(idle_median, 1e-9):.1f}x idle, "
+          f"p99 {load_p99 / max(idle_p99, 1e-9):.1f}x idle")
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,97 @@
+#!/usr/bin/env python3
+"""
+tools/core_mode_bench.py
+
+Measure the MSC read throughput of a PicoVD device, and report the
+application loop jitter the device measured meanwhile.
+
+Usage:
+    core_mode_bench.py <mount point> [-r rounds] [-f file]
+
+Requires a build with PICOVD_APP_LOOP_STATS_ENABLED, which prints
+"app loop: core <n>, <count> iterations, max gap <us> us" lines to
+STDOUT.TXT every PICOVD_APP_LOOP_STATS_PERIOD_MS.  Run it once against
+a build with PICOVD_USB_ON_CORE1 set to 0, and once with it set to 1,
+and compare.  With the USB service on core 1, the max gap of the core 0
+application loop should no longer grow while the host reads the disk.
+
+The files are read bypassing the host page cache (F_NOCACHE on macOS,
+O_DIRECT on Linux), so that repeated rounds measure the USB transfer.
+"""
+
+import argparse
+import mmap
+import os
+import platform
+import re
+import sys
+import time
+
+CHUNK_SIZE = 64 * 1024
+
+APP_LOOP_LINE = re.compile(rb'app loop: core (\d+), (\d+) iterations, max gap (\d+) us')
+
+
+def read_uncached(path):
+    """Read the whole file, bypassing the page cache where possible."""
+    flags = os.O_RDONLY
+    if platform.system() == 'Linux':
+        flags |= os.O_DIRECT
+    fd = os.open(path, flags)
+    try:
+        if platform.system() == 'Darwin':
+            import fcntl
+            fcntl.fcntl(fd, fcntl.F_NOCACHE, 1)
+        size = os.fstat(fd).st_size
+        buf = mmap.mmap(-1, CHUNK_SIZE)  # Page aligned, as O_DIRECT requires
+        data = bytearray()
+        while len(data) < size:
+            n = os.preadv(fd, [buf], len(data))
+            if n <= 0:
+                break
+            data += buf[:n]
+        return bytes(data[:size])
+    finally:
+        os.close(fd)
+
+
+def app_loop_stats(mount):
+    """Return the (core, iterations, max gap) tuples printed so far."""
+    log = read_uncached(os.path.join(mount, 'STDOUT.TXT'))
+    return [tuple(int(g) for g in m.groups()) for m in APP_LOOP_LINE.finditer(log)]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n\n')[1])
+    parser.add_argument('mount', help="PicoVD mount point, e.g. /Volumes/PicoVD")
+    parser.add_argument('-r', '--rounds', type=int, default=3, help="Times to read the file")
+    parser.add_argument('-f', '--file', default='FLASH.BIN', help="File to read")
+    args = parser.parse_args()
+
+    before = len(app_loop_stats(args.mount))
+
+    total_bytes = 0
+    total_time = 0.0
+    for i in range(args.rounds):
+        t0 = time.monotonic()
+        data = read_uncached(os.path.join(args.mount, args.file))
+        t1 = time.monotonic()
+        total_bytes += len(data)
+        total_time += t1 - t0
+        print(f"round {i + 1}: {len(data):>10} bytes in {t1 - t0:7.3f} s, "
+              f"{len(data) / (t1 - t0) / 1e6:6.3f} MB/s")
+    print(f"{args.file}: {total_bytes / max(total_time, 1e-9) / 1e6:6.3f} MB/s average")
+
+    stats = app_loop_stats(args.mount)[before:]
+    if not stats:
+        print("No app loop statistics in STDOUT.TXT; is PICOVD_APP_LOOP_STATS_ENABLED set?",
+              file=sys.stderr)
+        return 1
+    for core, iterations, max_gap_us in stats:
+        print(f"app loop on core {core}: {iterations:>9} iterations, max gap {max_gap_us:>7} us")
+    print(f"worst max gap during the reads: {max(s[2] for s in stats)} us")
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
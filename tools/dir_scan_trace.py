@@ -0,0 +1,121 @@
+#!/usr/bin/env python3
+"""
+tools/dir_scan_trace.py
+
+Count the sectors a host reads to scan the PicoVD root directory, from
+a raw device or an image of it, or by tracing a real mount on Linux.
+
+Usage:
+    dir_scan_trace.py scan <device or image> [<device or image>...]
+    dir_scan_trace.py mount <device> <mount point> [-n runs]
+
+scan reads the root directory sector by sector, as the exFAT drivers do,
+and stops at the first End-of-directory entry (type 0x00).  Without one,
+the whole directory, 3 clusters, is read.  Give several images, e.g.
+before and after a firmware change, to compare them.
+
+mount needs root.  It drops the page cache, mounts the volume read-only,
+lists and stats the root directory, and unmounts it, and reports the
+sectors and read requests of the block device during that, from
+/sys/class/block/<dev>/stat.  Unlike scan, this includes the boot
+region, the FAT and the bitmap, and the host's own read-ahead.
+"""
+
+import argparse
+import os
+import struct
+import subprocess
+import sys
+
+ENTRY_SIZE = 32
+
+
+def read_bytes(f, offset, length):
+    f.seek(offset)
+    data = f.read(length)
+    if len(data) != length:
+        raise RuntimeError(f"Short read at {offset:#x}")
+    return data
+
+
+def scan(path):
+    """Return (sectors read, directory sectors, live entries) for a host scan."""
+    with open(path, 'rb') as f:
+        boot = read_bytes(f, 0, 512)
+        if boot[3:11] != b'EXFAT   ':
+            raise RuntimeError(f"{path}: not an exFAT volume")
+        heap_offset, _, root_cluster = struct.unpack_from('<III', boot, 0x58)
+        sector_size = 1 << boot[0x6C]
+        cluster_sectors = 1 << boot[0x6D]
+
+        # The root directory is contiguous on PicoVD; follow the FAT anyway
+        fat_offset = struct.unpack_from('<I', boot, 0x50)[0] * sector_size
+        clusters, cluster = [], root_cluster
+        while 2 <= cluster < 0xFFFFFFF7 and len(clusters) < 64:
+            clusters.append(cluster)
+            cluster = struct.unpack('<I', read_bytes(f, fat_offset + 4 * cluster, 4))[0]
+
+        sectors = entries = 0
+        for cluster in clusters:
+            lba = heap_offset + (cluster - 2) * cluster_sectors
+            for i in range(cluster_sectors):
+                data = read_bytes(f, (lba + i) * sector_size, sector_size)
+                sectors += 1
+                for pos in range(0, sector_size, ENTRY_SIZE):
+                    entry_type = data[pos]
+                    if entry_type == 0x00:
+                        return sectors, len(clusters) * cluster_sectors, entries
+                    if entry_type & 0x80:
+                        entries += 1
+        return sectors, len(clusters) * cluster_sectors, entries
+
+
+def block_stat(device):
+    """Return (read requests, 512-byte sectors read) of a block device."""
+    name = os.path.basename(os.path.realpath(device))
+    with open(f'/sys/class/block/{name}/stat') as f:
+        fields = f.read().split()
+    return int(fields[0]), int(fields[2])
+
+
+def trace_mount(device, mount_point):
+    subprocess.run(['sync'], check=True)
+    with open('/proc/sys/vm/drop_caches', 'w') as f:
+        f.write('3\n')
+    before = block_stat(device)
+    subprocess.run(['mount', '-t', 'exfat', '-o', 'ro', device, mount_point], check=True)
+    try:
+        for name in os.listdir(mount_point):
+            os.stat(os.path.join(mount_point, name))
+    finally:
+        subprocess.run(['umount', mount_point], check=True)
+    after = block_stat(device)
+    return after[0] - before[0], after[1] - before[1]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n\n')[1])
+    sub = parser.add_subparsers(dest='command', required=True)
+    p = sub.add_parser('scan', help="Simulate a host scan of the root directory")
+    p.add_argument('paths', nargs='+')
+    p = sub.add_parser('mount', help="Trace the reads of a real mount (Linux, root)")
+    p.add_argument('device')
+    p.add_argument('mount_point')
+    p.add_argument('-n', '--runs', type=int, default=3)
+    args = parser.parse_args()
+
+    if args.command == 'scan':
+        for path in args.paths:
+            sectors, total, entries = scan(path)
+            print(f"{path}: {sectors} of {total} root directory sectors read, {entries} live entries")
+    else:
+        if sys.platform != 'linux':
+            parser.error("mount tracing needs Linux")
+        for run in range(args.runs):
+            requests, sectors = trace_mount(args.device, args.mount_point)
+            print(f"mount {run + 1}: {requests} read requests, {sectors} sectors of 512 bytes")
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,118 @@
+#!/usr/bin/env python3
+"""
+tools/flash_sparse_bench.py
+
+Reconstruct a flash image from FLASH.SPARSE and compare the time it takes
+with a raw read of FLASH.BIN, on a mounted PicoVD volume.
+
+Usage:
+    flash_sparse_bench.py <mount point> [-o image.bin] [--no-raw]
+
+FLASH.SPARSE format (little endian), see src/vd_files_flash_map.h:
+    char     magic[8]      "PVSPARSE"
+    uint32_t page_size
+    uint32_t flash_size
+    uint32_t extent_count
+    uint32_t header_size   offset of the first data byte
+    { uint32_t offset; uint32_t length; } extents[extent_count]
+    zero padding up to header_size
+    contents of the extents, back to back
+
+The files are read bypassing the host page cache (F_NOCACHE on macOS,
+O_DIRECT on Linux), so that repeated runs measure the USB transfer.
+"""
+
+import argparse
+import mmap
+import os
+import platform
+import struct
+import sys
+import time
+
+SPARSE_MAGIC  = b'PVSPARSE'
+SPARSE_HEADER = struct.Struct('<8sIIII')
+SPARSE_EXTENT = struct.Struct('<II')
+
+CHUNK_SIZE = 64 * 1024
+
+
+def read_uncached(path):
+    """Read the whole file, bypassing the page cache where possible."""
+    flags = os.O_RDONLY
+    if platform.system() == 'Linux':
+        flags |= os.O_DIRECT
+    fd = os.open(path, flags)
+    try:
+        if platform.system() == 'Darwin':
+            import fcntl
+            fcntl.fcntl(fd, fcntl.F_NOCACHE, 1)
+        size = os.fstat(fd).st_size
+        buf = mmap.mmap(-1, CHUNK_SIZE)  # Page aligned, as O_DIRECT requires
+        data = bytearray()
+        while len(data) < size:
+            n = os.preadv(fd, [buf], len(data))
+            if n <= 0:
+                break
+            data += buf[:n]
+        return bytes(data[:size])
+    finally:
+        os.close(fd)
+
+
+def reconstruct(sparse):
+    """Return the flash image described by the FLASH.SPARSE contents."""
+    magic, page_size, flash_size, extent_count, header_size = SPARSE_HEADER.unpack_from(sparse, 0)
+    if magic != SPARSE_MAGIC:
+        raise ValueError(f"Bad FLASH.SPARSE magic {magic!r}")
+    image = bytearray(b'\xff' * flash_size)
+    data = header_size
+    for i in range(extent_count):
+        offset, length = SPARSE_EXTENT.unpack_from(sparse, SPARSE_HEADER.size + i * SPARSE_EXTENT.size)
+        image[offset:offset + length] = sparse[data:data + length]
+        data += length
+    if data != len(sparse):
+        raise ValueError(f"FLASH.SPARSE has {len(sparse)} bytes, extents cover {data}")
+    return bytes(image), extent_count
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n\n')[1])
+    parser.add_argument('mount', help="PicoVD mount point, e.g. /Volumes/PicoVD")
+    parser.add_argument('-o', '--output', help="Write the reconstructed image to this file")
+    parser.add_argument('--no-raw', action='store_true', help="Skip the FLASH.BIN read and comparison")
+    args = parser.parse_args()
+
+    t0 = time.monotonic()
+    sparse = read_uncached(os.path.join(args.mount, 'FLASH.SPARSE'))
+    t1 = time.monotonic()
+    image, extents = reconstruct(sparse)
+    t2 = time.monotonic()
+    sparse_total = t2 - t0
+    print(f"FLASH.SPARSE: {len(sparse):>10} bytes, {extents} extents, "
+          f"read {t1 - t0:7.3f} s, reconstruct {t2 - t1:7.3f} s, total {sparse_total:7.3f} s")
+
+    if args.output:
+        with open(args.output, 'wb') as f:
+            f.write(image)
+
+    if args.no_raw:
+        return 0
+
+    t0 = time.monotonic()
+    raw = read_uncached(os.path.join(args.mount, 'FLASH.BIN'))
+    t1 = time.monotonic()
+    print(f"FLASH.BIN:    {len(raw):>10} bytes, read {t1 - t0:7.3f} s, "
+          f"speedup {(t1 - t0) / max(sparse_total, 1e-9):5.1f}x")
+
+    if raw != image:
+        first = next(i for i in range(min(len(raw), len(image))) if raw[i] != image[i]) \
+                if len(raw) == len(image) else min(len(raw), len(image))
+        print(f"MISMATCH: images differ, first at offset {first:#x}", file=sys.stderr)
+        return 1
+    print("Images match")
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
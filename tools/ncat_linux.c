@@ -0,0 +1,317 @@
+// ncat_linux.c
+//
+// Non-caching cat for PicoVD files on Linux, the counterpart of ncat.c (macOS).
+// Reads with O_DIRECT into aligned buffers, keeping several reads in flight
+// with Linux native AIO, and writes the data to stdout in order.
+//
+//   cc -O2 -Wall -o ncat_linux tools/ncat_linux.c
+//
+//   ncat_linux [-d depth] [-b bytes] [-s] <file> [<file>...]
+//   ncat_linux -f [-i ms] [-s] /media/$USER/PicoVD/STDOUT-TAIL.TXT
+//
+//   -d depth  Reads in flight (default 4)
+//   -b bytes  Bytes per read, a multiple of 4096 (default 32768)
+//   -s        Print the throughput and the per-read latency to stderr
+//   -f        Follow, as tail -F: after each media change (Unit Attention)
+//             and remount, read the file again from the start.  Meant for
+//             STDOUT-TAIL.TXT, which then holds only the output not read yet.
+//   -i ms     Poll interval for -f (default 500)
+//
+// For testing without a device, build the image on the host, attach it to
+// a loop device with direct I/O, and mount it:
+//   sudo losetup --direct-io=on -f --show picovd.img
+//   sudo mount -o ro /dev/loopN /mnt
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/aio_abi.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#define ALIGNMENT     4096 // O_DIRECT buffer and offset alignment, enough for 4Kn disks
+#define DEFAULT_DEPTH 4
+#define DEFAULT_BUF   32768
+#define MAX_DEPTH     64
+
+// glibc has no wrappers for the native AIO system calls
+static int io_setup(unsigned nr, aio_context_t *ctx) {
+    return syscall(SYS_io_setup, nr, ctx);
+}
+static int io_destroy(aio_context_t ctx) {
+    return syscall(SYS_io_destroy, ctx);
+}
+static int io_submit(aio_context_t ctx, long nr, struct iocb **iocbpp) {
+    return syscall(SYS_io_submit, ctx, nr, iocbpp);
+}
+static int io_getevents(aio_context_t ctx, long min_nr, long nr, struct io_event *events) {
+    return syscall(SYS_io_getevents, ctx, min_nr, nr, events, NULL);
+}
+
+typedef struct {
+    struct iocb     cb;
+    void           *buf;
+    int64_t         result;    // Bytes read, or -errno; valid once done
+    bool            done;
+    struct timespec submitted;
+} slot_t;
+
+static struct {
+    uint64_t bytes;
+    uint64_t reads;
+    double   seconds;
+    double   lat_min_us, lat_max_us, lat_sum_us;
+} stats = { .lat_min_us = 1e30 };
+
+static int    depth    = DEFAULT_DEPTH;
+static size_t buf_size = DEFAULT_BUF;
+static bool   print_stats = false;
+
+static double elapsed_us(const struct timespec *from, const struct timespec *to) {
+    return (to->tv_sec - from->tv_sec) * 1e6 + (to->tv_nsec - from->tv_nsec) / 1e3;
+}
+
+static int write_all(const void *buf, size_t len) {
+    const uint8_t *p = buf;
+    while (len > 0) {
+        ssize_t w = write(STDOUT_FILENO, p, len);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += w;
+        len -= w;
+    }
+    return 0;
+}
+
+// Open without the page cache; fall back to a plain open where O_DIRECT is
+// not supported (e.g. tmpfs), with a warning.
+static int open_direct(const char *path) {
+    int fd = open(path, O_RDONLY | O_DIRECT);
+    if (fd < 0 && errno == EINVAL) {
+        fprintf(stderr, "%s: O_DIRECT not supported, reading through the page cache\n", path);
+        fd = open(path, O_RDONLY);
+    }
+    return fd;
+}
+
+// Copy the file to stdout, with up to depth reads in flight.
+// Returns 0 at EOF, or -errno on a read error, e.g. EIO during a media change.
+static int copy_fd(aio_context_t *ctx, slot_t *slots, int fd, const char *path) {
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        return -errno;
+    }
+    // Reads are aligned; the last one returns short at the end of the file
+    const uint64_t end = ((uint64_t)st.st_size + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+
+    struct timespec t0, now;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    uint64_t next_offset = 0; // Offset of the next read to submit
+    uint64_t submitted = 0, output = 0; // Read sequence numbers
+    bool eof = false;
+    int rc = 0;
+
+    while (output < submitted || (!eof && rc == 0 && next_offset < end)) {
+        // Keep depth reads in flight
+        while (!eof && rc == 0 && next_offset < end && submitted - output < (uint64_t)depth) {
+            slot_t *s = &slots[submitted % depth];
+            memset(&s->cb, 0, sizeof(s->cb));
+            s->cb.aio_data       = (uint64_t)(uintptr_t)s;
+            s->cb.aio_lio_opcode = IOCB_CMD_PREAD;
+            s->cb.aio_fildes     = fd;
+            s->cb.aio_buf        = (uint64_t)(uintptr_t)s->buf;
+            s->cb.aio_nbytes     = buf_size;
+            s->cb.aio_offset     = next_offset;
+            s->done = false;
+            clock_gettime(CLOCK_MONOTONIC, &s->submitted);
+            struct iocb *cbp = &s->cb;
+            if (io_submit(*ctx, 1, &cbp) != 1) {
+                rc = -errno;
+                break;
+            }
+            submitted++;
+            next_offset += buf_size;
+        }
+        if (output == submitted) {
+            break;
+        }
+
+        // Reap at least one completion
+        struct io_event events[MAX_DEPTH];
+        int n = io_getevents(*ctx, 1, depth, events);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            rc = -errno;
+            // io_destroy() waits for the reads in flight; with a new context,
+            // their completions cannot reach the slots of the next copy_fd()
+            io_destroy(*ctx);
+            *ctx = 0;
+            if (io_setup(depth, ctx) < 0) {
+                perror("io_setup");
+                *ctx = 0; // The next io_submit() fails
+            }
+            break;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        for (int i = 0; i < n; i++) {
+            slot_t *s = (slot_t *)(uintptr_t)events[i].data;
+            s->result = events[i].res;
+            s->done   = true;
+            const double us = elapsed_us(&s->submitted, &now);
+            stats.reads++;
+            stats.lat_sum_us += us;
+            if (us < stats.lat_min_us) stats.lat_min_us = us;
+            if (us > stats.lat_max_us) stats.lat_max_us = us;
+        }
+
+        // Write the completed reads, in file order
+        while (output < submitted && slots[output % depth].done) {
+            slot_t *s = &slots[output % depth];
+            output++;
+            if (eof || rc < 0) {
+                continue; // Drain the reads past the end or the error
+            }
+            if (s->result < 0) {
+                rc = (int)s->result;
+                fprintf(stderr, "%s: %s\n", path, strerror(-rc));
+                continue;
+            }
+            if (write_all(s->buf, s->result) < 0) {
+                rc = -errno;
+                continue;
+            }
+            stats.bytes += s->result;
+            if ((size_t)s->result < buf_size) {
+                eof = true;
+            }
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    stats.seconds += elapsed_us(&t0, &now) / 1e6;
+    return rc;
+}
+
+static int cat_file(aio_context_t *ctx, slot_t *slots, const char *path) {
+    int fd = open_direct(path);
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+    int rc = copy_fd(ctx, slots, fd, path);
+    close(fd);
+    return rc;
+}
+
+// Did the file change, or disappear, since it was last read?
+static bool same_file(const struct stat *a, const struct stat *b) {
+    return a->st_dev == b->st_dev && a->st_ino == b->st_ino &&
+           a->st_size == b->st_size &&
+           a->st_mtim.tv_sec == b->st_mtim.tv_sec && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+// tail -F for STDOUT-TAIL.TXT.  After each Unit Attention the host remounts
+// the volume: the file may vanish for a moment, and reappears with only the
+// output not read yet, from offset 0.  Reading it again from the start
+// therefore gives each line once.
+static int follow_file(aio_context_t *ctx, slot_t *slots, const char *path, int interval_ms) {
+    const struct timespec interval = { interval_ms / 1000, (interval_ms % 1000) * 1000000L };
+    struct stat seen;
+    bool have_seen = false;
+
+    for (;;) {
+        struct stat st;
+        if (stat(path, &st) < 0) {
+            have_seen = false; // Unmounted, wait for the remount
+        } else if (!have_seen || !same_file(&st, &seen)) {
+            int fd = open_direct(path);
+            if (fd >= 0) {
+                // A read error means a media change under us: retry after it
+                if (copy_fd(ctx, slots, fd, path) == 0 && fstat(fd, &seen) == 0) {
+                    have_seen = true;
+                }
+                close(fd);
+            }
+            if (print_stats && stats.seconds > 0) {
+                fprintf(stderr, "%" PRIu64 " bytes, %.3f MB/s\n", stats.bytes, stats.bytes / stats.seconds / 1e6);
+            }
+        }
+        nanosleep(&interval, NULL);
+    }
+    return 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-d depth] [-b bytes] [-s] <file> [<file>...]\n"
+                    "       %s -f [-i ms] [-s] <file>\n", prog, prog);
+}
+
+int main(int argc, char *argv[]) {
+    bool follow = false;
+    int interval_ms = 500;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:b:sfi:")) != -1) {
+        switch (opt) {
+        case 'd': depth = atoi(optarg); break;
+        case 'b': buf_size = strtoul(optarg, NULL, 0); break;
+        case 's': print_stats = true; break;
+        case 'f': follow = true; break;
+        case 'i': interval_ms = atoi(optarg); break;
+        default: usage(argv[0]); return 1;
+        }
+    }
+    if (optind >= argc || (follow && argc - optind != 1) ||
+        depth < 1 || depth > MAX_DEPTH || buf_size == 0 || buf_size % ALIGNMENT != 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    aio_context_t ctx = 0;
+    if (io_setup(depth, &ctx) < 0) {
+        perror("io_setup");
+        return 1;
+    }
+    slot_t slots[MAX_DEPTH];
+    for (int i = 0; i < depth; i++) {
+        if (posix_memalign(&slots[i].buf, ALIGNMENT, buf_size) != 0) {
+            fprintf(stderr, "Out of memory\n");
+            return 1;
+        }
+    }
+
+    int status = 0;
+    if (follow) {
+        status = follow_file(&ctx, slots, argv[optind], interval_ms) < 0;
+    } else {
+        for (int i = optind; i < argc; i++) {
+            if (cat_file(&ctx, slots, argv[i]) < 0) {
+                status = 1;
+            }
+        }
+    }
+
+    if (print_stats && stats.reads > 0) {
+        fprintf(stderr, "%" PRIu64 " bytes in %.3f s, %.3f MB/s; %" PRIu64 " reads of %zu bytes, depth %d, "
+                        "latency min %.0f avg %.0f max %.0f us\n",
+                stats.bytes, stats.seconds, stats.seconds > 0 ? stats.bytes / stats.seconds / 1e6 : 0.0,
+                stats.reads, buf_size, depth,
+                stats.lat_min_us, stats.lat_sum_us / stats.reads, stats.lat_max_us);
+    }
+    if (ctx != 0) {
+        io_destroy(ctx);
+    }
+    return status;
+}
@@ -0,0 +1,242 @@
+#!/usr/bin/env python3
+"""
+tools/picovd_bulk.py
+
+Read memory ranges and files from a PicoVD device over its vendor bulk
+interface, bypassing SCSI, the exFAT layout and the host page cache,
+and compare the throughput with dd over the mass storage interface.
+
+Usage:
+    picovd_bulk.py regions
+    picovd_bulk.py files
+    picovd_bulk.py read-mem <address> <length> [-o out.bin]
+    picovd_bulk.py read-file <name> [-o out.bin]
+    picovd_bulk.py bench [--region FLASH.BIN] [--msc /dev/sdX | /Volumes/PicoVD]
+
+Requires a build with PICOVD_VENDOR_BULK_ENABLED, and pyusb (libusb).
+
+Protocol, see src/vd_usb_vendor.h (little endian):
+    request   <BBHIII  opcode, reserved, tag, arg0, arg1, length
+    response  <BBHI    opcode, status, tag, length; then length data bytes,
+                       zero padded to a multiple of 64 bytes, the packet size
+    READ_MEM     (1)  arg0 address
+    LIST_REGIONS (2)  data: <III16s base, size, first cluster, name
+    LIST_FILES   (3)  data: <IBBH size, lun, name length, reserved; UTF-16LE name
+    READ_FILE    (4)  arg0 file index, arg1 offset
+
+The reads are pipelined: up to --depth requests are kept in flight,
+so that the device always has the next one queued.
+"""
+
+import argparse
+import os
+import platform
+import struct
+import subprocess
+import sys
+import time
+
+import usb.core
+import usb.util
+
+USB_VENDOR_ID  = 0x2E8A
+USB_PRODUCT_ID = 0x0009
+
+OP_READ_MEM     = 0x01
+OP_LIST_REGIONS = 0x02
+OP_LIST_FILES   = 0x03
+OP_READ_FILE    = 0x04
+
+STATUS_NAMES = {0: "OK", 1: "bad request", 2: "out of range", 3: "no such file"}
+
+REQUEST  = struct.Struct('<BBHIII')
+RESPONSE = struct.Struct('<BBHI')
+REGION   = struct.Struct('<III16s')
+FILE     = struct.Struct('<IBBH')
+
+PACKET_SIZE   = 64         # VD_VENDOR_PACKET_SIZE
+CHUNK_SIZE    = 64 * 1024  # Bytes per read request
+DEFAULT_DEPTH = 4          # Requests in flight; the device queues up to 16
+TIMEOUT_MS    = 5000
+
+
+class PicoVDBulk:
+    """The vendor bulk interface of a PicoVD device."""
+
+    def __init__(self):
+        dev = usb.core.find(idVendor=USB_VENDOR_ID, idProduct=USB_PRODUCT_ID)
+        if dev is None:
+            raise RuntimeError("PicoVD not plugged in")
+        cfg = dev.get_active_configuration()
+        # The vendor interface with bulk endpoints; the Reset interface has none
+        intf = usb.util.find_descriptor(
+            cfg,
+            custom_match=lambda i: i.bInterfaceClass == 0xFF and i.bNumEndpoints == 2)
+        if intf is None:
+            raise RuntimeError("No vendor bulk interface, build with PICOVD_VENDOR_BULK_ENABLED")
+        if platform.system() == 'Linux' and dev.is_kernel_driver_active(intf.bInterfaceNumber):
+            dev.detach_kernel_driver(intf.bInterfaceNumber)
+        usb.util.claim_interface(dev, intf.bInterfaceNumber)
+        self.ep_out = usb.util.find_descriptor(
+            intf, custom_match=lambda e: usb.util.endpoint_direction(e.bEndpointAddress) == usb.util.ENDPOINT_OUT)
+        self.ep_in = usb.util.find_descriptor(
+            intf, custom_match=lambda e: usb.util.endpoint_direction(e.bEndpointAddress) == usb.util.ENDPOINT_IN)
+        self.tag = 0
+
+    def send(self, opcode, arg0=0, arg1=0, length=0):
+        """Queue a request; return its tag."""
+        self.tag = (self.tag + 1) & 0xFFFF
+        self.ep_out.write(REQUEST.pack(opcode, 0, self.tag, arg0, arg1, length), timeout=TIMEOUT_MS)
+        return self.tag
+
+    def _read_exact(self, n):
+        """Read n bytes, a multiple of the packet size, from the IN endpoint."""
+        data = bytearray()
+        while len(data) < n:
+            data += self.ep_in.read(n - len(data), timeout=TIMEOUT_MS)
+        return data
+
+    def receive(self, tag):
+        """Return the data of the response to the given request."""
+        # Responses are padded to whole packets: the first one holds the header
+        first = self._read_exact(PACKET_SIZE)
+        opcode, status, rtag, length = RESPONSE.unpack_from(first)
+        if rtag != tag:
+            raise RuntimeError(f"Response tag {rtag}, expected {tag}")
+        total = (RESPONSE.size + length + PACKET_SIZE - 1) // PACKET_SIZE * PACKET_SIZE
+        data = first + self._read_exact(total - PACKET_SIZE)
+        if status != 0:
+            raise RuntimeError(f"Request {opcode} failed: {STATUS_NAMES.get(status, status)}")
+        return bytes(data[RESPONSE.size:RESPONSE.size + length])
+
+    def call(self, opcode, arg0=0, arg1=0, length=0):
+        return self.receive(self.send(opcode, arg0, arg1, length))
+
+    def regions(self):
+        data = self.call(OP_LIST_REGIONS)
+        return [(base, size, cluster, name.rstrip(b'\0').decode())
+                for base, size, cluster, name in REGION.iter_unpack(data)]
+
+    def files(self):
+        data = self.call(OP_LIST_FILES)
+        files, pos = [], 0
+        while pos < len(data):
+            size, lun, name_length, _ = FILE.unpack_from(data, pos)
+            pos += FILE.size
+            files.append((data[pos:pos + 2 * name_length].decode('utf-16le'), size, lun))
+            pos += 2 * name_length
+        return files
+
+    def read(self, opcode, arg0, start, length, depth=DEFAULT_DEPTH):
+        """Pipelined read of [start, start + length): of memory at arg0 for READ_MEM, of file arg0 for READ_FILE."""
+        chunks, queued = [], []
+        pos = start
+        while pos < start + length or queued:
+            while pos < start + length and len(queued) < depth:
+                n = min(CHUNK_SIZE, start + length - pos)
+                if opcode == OP_READ_MEM:
+                    queued.append(self.send(opcode, arg0 + (pos - start), 0, n))
+                else:
+                    queued.append(self.send(opcode, arg0, pos, n))
+                pos += n
+            chunks.append(self.receive(queued.pop(0)))
+        return b''.join(chunks)
+
+    def read_mem(self, address, length, depth=DEFAULT_DEPTH):
+        return self.read(OP_READ_MEM, address, 0, length, depth)
+
+    def read_file(self, name, depth=DEFAULT_DEPTH):
+        for idx, (fname, size, _) in enumerate(self.files()):
+            if fname.upper() == name.upper():
+                return self.read(OP_READ_FILE, idx, 0, size, depth)
+        raise RuntimeError(f"No file {name}")
+
+
+def dd_read(path, offset, length):
+    """Read with dd over the mass storage interface; return the seconds taken."""
+    bs = CHUNK_SIZE
+    args = ['dd', f'if={path}', 'of=/dev/null', f'bs={bs}',
+            f'skip={offset // bs}', f'count={(length + bs - 1) // bs}']
+    if platform.system() == 'Linux':
+        args.append('iflag=direct')  # Bypass the page cache; on macOS use /dev/rdiskN
+    t0 = time.monotonic()
+    subprocess.run(args, check=True, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    return time.monotonic() - t0
+
+
+def cluster_offset(f, cluster):
+    """Byte offset of a cluster on the raw device, from the boot sector.  Cluster N is at
+    (0x1000 + N) * 4096 with the default layout, but not e.g. with the compact one."""
+    f.seek(0)
+    boot = f.read(512)
+    heap_offset = struct.unpack_from('<I', boot, 0x58)[0]
+    return (heap_offset << boot[0x6C]) + (cluster - 2) * (1 << (boot[0x6C] + boot[0x6D]))
+
+
+def bench(vd, args):
+    regions = {name: (base, size, cluster) for base, size, cluster, name in vd.regions()}
+    if args.region not in regions:
+        raise RuntimeError(f"No region {args.region}, have {', '.join(regions)}")
+    base, size, cluster = regions[args.region]
+
+    for depth in (1, args.depth):
+        t0 = time.monotonic()
+        data = vd.read_mem(base, size, depth)
+        t = time.monotonic() - t0
+        print(f"vendor bulk, depth {depth}: {len(data):>9} bytes, {t:7.3f} s, {len(data) / t / 1024:8.1f} KiB/s")
+
+    if args.msc:
+        if os.path.isdir(args.msc):
+            path, offset = os.path.join(args.msc, args.region), 0
+        else:
+            # Raw device: the region is at its cluster
+            with open(args.msc, 'rb') as f:
+                path, offset = args.msc, cluster_offset(f, cluster)
+        t = dd_read(path, offset, size)
+        print(f"dd over MSC:           {size:>9} bytes, {t:7.3f} s, {size / t / 1024:8.1f} KiB/s")
+
+
+def write_output(data, output):
+    if output:
+        with open(output, 'wb') as f:
+            f.write(data)
+    else:
+        sys.stdout.buffer.write(data)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n\n')[1])
+    parser.add_argument('--depth', type=int, default=DEFAULT_DEPTH, help="Read requests in flight")
+    sub = parser.add_subparsers(dest='command', required=True)
+    sub.add_parser('regions', help="List the memory regions")
+    sub.add_parser('files', help="List the dynamic files")
+    p = sub.add_parser('read-mem', help="Read a memory range")
+    p.add_argument('address', type=lambda s: int(s, 0))
+    p.add_argument('length', type=lambda s: int(s, 0))
+    p.add_argument('-o', '--output')
+    p = sub.add_parser('read-file', help="Read a dynamic file")
+    p.add_argument('name')
+    p.add_argument('-o', '--output')
+    p = sub.add_parser('bench', help="Compare the throughput with dd over MSC")
+    p.add_argument('--region', default='FLASH.BIN', help="Memory region to read")
+    p.add_argument('--msc', help="Raw MSC device or mount point, for the dd comparison")
+    args = parser.parse_args()
+
+    vd = PicoVDBulk()
+    if args.command == 'regions':
+        for base, size, cluster, name in vd.regions():
+            print(f"{name:<16} 0x{base:08x} 0x{size:08x} cluster 0x{cluster:05x}")
+    elif args.command == 'files':
+        for idx, (name, size, lun) in enumerate(vd.files()):
+            print(f"{idx:3} {name:<24} {size:>10} LUN {lun}")
+    elif args.command == 'read-mem':
+        write_output(vd.read_mem(args.address, args.length, args.depth), args.output)
+    elif args.command == 'read-file':
+        write_output(vd.read_file(args.name, args.depth), args.output)
+    elif args.command == 'bench':
+        bench(vd, args)
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -36,15 +36,22 @@
 #define CFG_TUD_CDC_EP_BUFSIZE  CFG_TUD_CDC_BUFSIZE
 
 // Enable support for vendor-class interfaces (e.g. the “Reset” interface)
-// and pick a buffer size for vendor control transfers (if needed)
+// and pick the FIFO sizes for the PicoVD vendor bulk interface, if enabled.
+// The RX FIFO holds the requests in flight, 16 bytes each; the TX FIFO
+// bounds how much response data is produced per vd_usb_vendor_task() call.
 #ifndef CFG_TUD_VENDOR_RX_BUFSIZE
-#define CFG_TUD_VENDOR_RX_BUFSIZE  64
+#define CFG_TUD_VENDOR_RX_BUFSIZE  256
+#endif
+#ifndef CFG_TUD_VENDOR_TX_BUFSIZE
+#define CFG_TUD_VENDOR_TX_BUFSIZE  2048
 #endif
 
-#define CFG_TUD_MSC_BUFSIZE     (512)
-// MSC USB endpoint max-packet size (full-speed bulk = 64 bytes)
+// MSC transfer buffer size.  Each tud_msc_read10_cb() call covers up to this
+// many bytes, spanning several 512-byte sectors; one cluster (4 KB) lets the
+// memory regions and dynamic files produce a whole cluster in one call.
+// Must be a multiple of the sector size.  See vd_virtual_disk_read().
 #ifndef CFG_TUD_MSC_EP_BUFSIZE
-#define CFG_TUD_MSC_EP_BUFSIZE  (64)
+#define CFG_TUD_MSC_EP_BUFSIZE  (4096)
 #endif
 
 #ifndef CFG_TUD_ENDPOINT0_SIZE
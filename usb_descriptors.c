@@ -31,6 +31,8 @@
 #include <pico/unique_id.h>
 #include <tusb.h>
 
+#include <picovd_config.h>
+
 #ifndef USBD_VID
 #define USBD_VID (0x2E8A) // Raspberry Pi
 #endif
@@ -53,6 +55,7 @@
     + TUD_CDC_DESC_LEN       \
     + (CFG_TUD_VENDOR? TUD_RPI_RESET_DESC_LEN: 0) \
     + (CFG_TUD_MSC   ? TUD_MSC_DESC_LEN : 0) \
+    + (PICOVD_VENDOR_BULK_ENABLED ? TUD_VENDOR_DESC_LEN : 0) \
     + 0) // +0 for the string descriptor length, not included
 
 #if !PICO_STDIO_USB_DEVICE_SELF_POWERED
@@ -68,7 +71,8 @@ enum {
     USBD_ITF_CDC_DATA  = 1,
     USBD_ITF_RPI_RESET = 2,
     USBD_ITF_MSC       = 2 + CFG_TUD_VENDOR,
-    USBD_ITF_MAX       = 2 + CFG_TUD_VENDOR + CFG_TUD_MSC,
+    USBD_ITF_VD_BULK   = 2 + CFG_TUD_VENDOR + CFG_TUD_MSC, // After MSC, not to renumber it
+    USBD_ITF_MAX       = 2 + CFG_TUD_VENDOR + CFG_TUD_MSC + PICOVD_VENDOR_BULK_ENABLED,
 };
 
 #define USBD_CDC_EP_CMD (0x81)
@@ -79,7 +83,11 @@ enum {
 
 #define USBD_MSC_EP_OUT (0x03)
 #define USBD_MSC_EP_IN  (0x83)
-#define USBD_MSC_IN_OUT_MAX_SIZE (CFG_TUD_MSC_EP_BUFSIZE)
+#define USBD_MSC_IN_OUT_MAX_SIZE (64) // Full-speed bulk max packet size
+
+#define USBD_VD_BULK_EP_OUT (0x04)
+#define USBD_VD_BULK_EP_IN  (0x84)
+#define USBD_VD_BULK_IN_OUT_MAX_SIZE (64) // VD_VENDOR_PACKET_SIZE
 
 #define USBD_STR_0         (0x00)
 #define USBD_STR_MANUF     (0x01)
@@ -88,6 +96,7 @@ enum {
 #define USBD_STR_CDC       (0x04)
 #define USBD_STR_RPI_RESET (0x05)
 #define USBD_STR_MSC       (USBD_STR_RPI_RESET + CFG_TUD_VENDOR)
+#define USBD_STR_VD_BULK   (USBD_STR_MSC + CFG_TUD_MSC)
 
 // Note: descriptors returned from callbacks must exist long enough for transfer to complete
 
@@ -134,6 +143,11 @@ static const uint8_t usbd_desc_cfg[USBD_DESC_LEN] = {
 #if CFG_TUD_MSC
     TUD_MSC_DESCRIPTOR(USBD_ITF_MSC, USBD_STR_MSC, USBD_MSC_EP_OUT, USBD_MSC_EP_IN, USBD_MSC_IN_OUT_MAX_SIZE),
 #endif
+
+#if PICOVD_VENDOR_BULK_ENABLED
+    TUD_VENDOR_DESCRIPTOR(USBD_ITF_VD_BULK, USBD_STR_VD_BULK, USBD_VD_BULK_EP_OUT, USBD_VD_BULK_EP_IN,
+        USBD_VD_BULK_IN_OUT_MAX_SIZE),
+#endif
 };
 
 static char usbd_serial_str[PICO_UNIQUE_BOARD_ID_SIZE_BYTES * 2 + 1];
@@ -149,6 +163,9 @@ static const char *const usbd_desc_str[] = {
 #if CFG_TUD_MSC
     [USBD_STR_MSC] = "Mass Storage",
 #endif
+#if PICOVD_VENDOR_BULK_ENABLED
+    [USBD_STR_VD_BULK] = "PicoVD Bulk",
+#endif
 };
 
 const uint8_t *tud_descriptor_device_cb(void) {